@@ -505,6 +505,20 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.hellaswag_tasks = std::stoi(argv[i]);
+        } else if (arg == "--kl-divergence-base") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.logits_file = argv[i];
+        } else if (arg == "--kl-divergence") {
+            params.kl_divergence = true;
+        } else if (arg == "--kl-divergence-top-k") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.kl_divergence_top_k = std::stoi(argv[i]);
         } else if (arg == "--ignore-eos") {
             params.ignore_eos = true;
         } else if (arg == "--no-penalize-nl") {
@@ -687,6 +701,11 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --logits-all          return logits for all tokens in the batch (default: disabled)\n");
     printf("  --hellaswag           compute HellaSwag score over random tasks from datafile supplied with -f\n");
     printf("  --hellaswag-tasks N   number of tasks to use when computing the HellaSwag score (default: %zu)\n", params.hellaswag_tasks);
+    printf("  --kl-divergence-base FNAME\n");
+    printf("                        reference logits file for perplexity: written by a normal run, read back with --kl-divergence\n");
+    printf("  --kl-divergence       compute KL-divergence and top token agreement against the --kl-divergence-base file\n");
+    printf("  --kl-divergence-top-k N\n");
+    printf("                        number of top reference probabilities stored per token (default: %d)\n", params.kl_divergence_top_k);
     printf("  --keep N              number of tokens to keep from the initial prompt (default: %d, -1 = all)\n", params.n_keep);
     printf("  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
     printf("  --chunks N            max number of chunks to process (default: %d, -1 = all)\n", params.n_chunks);
@@ -1265,7 +1284,10 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "interactive: %s # default: false\n", params.interactive ? "true" : "false");
     fprintf(stream, "interactive_first: %s # default: false\n", params.interactive_first ? "true" : "false");
     fprintf(stream, "keep: %d # default: 0\n", params.n_keep);
+    fprintf(stream, "kl_divergence: %s # default: false\n", params.kl_divergence ? "true" : "false");
+    fprintf(stream, "kl_divergence_top_k: %d # default: 32\n", params.kl_divergence_top_k);
     fprintf(stream, "logdir: %s # default: unset (no logging)\n", params.logdir.c_str());
+    fprintf(stream, "logits_file: %s # default: unset\n", params.logits_file.c_str());
 
     fprintf(stream, "logit_bias:\n");
     for (std::pair<llama_token, float> lb : params.logit_bias) {
@@ -96,6 +96,10 @@ struct gpt_params {
     bool hellaswag         = false; // compute HellaSwag score over random tasks from datafile supplied in prompt
     size_t hellaswag_tasks = 400;   // number of tasks to use when computing the HellaSwag score
 
+    std::string logits_file = "";   // reference logits file for KL-divergence: written by a plain run, read with kl_divergence
+    bool kl_divergence     = false; // score the model against the reference logits in logits_file
+    int  kl_divergence_top_k = 32;  // number of top reference probabilities stored per token
+
     bool mul_mat_q         = true;  // if true, use mul_mat_q kernels instead of cuBLAS
     bool memory_f16        = true;  // use f16 instead of f32 for memory kv
     bool random_prompt     = false; // do not randomize prompt if none provided
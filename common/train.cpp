@@ -4,6 +4,23 @@
 #include <random>
 #include <sstream>
 #include <functional>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 struct random_normal_distribution {
     std::mt19937 gen;
@@ -207,10 +224,16 @@ void assert_shape_4d(struct ggml_tensor * tensor, int64_t ne0, int64_t ne1, int6
     GGML_ASSERT(tensor->ne[3] == ne3);
 }
 
-int64_t get_example_targets_batch(
-    struct llama_context * lctx,
-    struct ggml_tensor   * tokens_input,
-    struct ggml_tensor   * target_probs,
+// assemble the token ids of a batch of n_batch rows with n_tokens each.
+// tokens receives the model input, starting with bos, targets the token expected at each position.
+static int64_t get_example_tokens_batch(
+    llama_token            bos,
+    llama_token            eos,
+    int64_t                n_vocab,
+    int64_t                n_tokens,
+    int64_t                n_batch,
+    llama_token          * tokens,
+    llama_token          * targets,
     int64_t                example_id,
     const size_t         * samples_offs,
     const size_t         * samples_begin,
@@ -224,20 +247,9 @@ int64_t get_example_targets_batch(
     bool                   sample_random_offsets
 ) {
     GGML_ASSERT(samples_count > 0);
-    GGML_ASSERT(tokens_input->n_dims  == 2);
-    GGML_ASSERT(target_probs->n_dims  == 3);
-    int64_t n_vocab  = target_probs->ne[0];
-    int64_t n_tokens = tokens_input->ne[0];
-    int64_t n_batch  = tokens_input->ne[1];
-    GGML_ASSERT(n_vocab  == target_probs->ne[0]);
-    GGML_ASSERT(n_tokens == target_probs->ne[1]);
-    GGML_ASSERT(n_batch  == target_probs->ne[2]);
 
     int64_t used_samples = 0;
 
-    ggml_set_f32(target_probs, 0.0f);
-    llama_token bos = llama_token_bos(lctx);
-    llama_token eos = llama_token_eos(lctx);
     // printf("%s: example_id=%d n_batch=%d n_train_samples=%zu\n", __func__, example_id, n_batch, n_train_samples);
     for (int k=0; k<n_batch; ++k) {
         // printf("%s: batch %d\n", __func__, k);
@@ -250,7 +262,9 @@ int64_t get_example_targets_batch(
         // printf("%s: sample_idx=%zu sample=%zu\n", __func__, sample_idx, sample);
         GGML_ASSERT(sample_begin+sample_size-1 < n_train_data);
 
-        ggml_set_i32_nd(tokens_input, 0, k, 0, 0, bos);
+        llama_token * row_tokens  = tokens  + k*n_tokens;
+        llama_token * row_targets = targets + k*n_tokens;
+        row_tokens[0] = bos;
         bool sample_separation_eos = !separate_with_eos;
         bool sample_separation_bos = !separate_with_bos;
         for (int64_t i=0; i<n_tokens; ++i) {
@@ -279,9 +293,9 @@ int64_t get_example_targets_batch(
                 token = clamp(train_data[sample_begin+sample_offs], 0, (llama_token) (n_vocab - 1));
                 ++sample_offs;
             }
-            ggml_set_f32_nd(target_probs,  token, (int) i, (int) k, 0, +1.0f);
+            row_targets[i] = token;
             if (i+1<n_tokens) {
-                ggml_set_i32_nd(tokens_input, (int) (i + 1), (int) k, 0, 0, token);
+                row_tokens[i+1] = token;
             }
         }
     }
@@ -289,6 +303,53 @@ int64_t get_example_targets_batch(
     return used_samples;
 }
 
+int64_t get_example_targets_batch(
+    struct llama_context * lctx,
+    struct ggml_tensor   * tokens_input,
+    struct ggml_tensor   * target_probs,
+    int64_t                example_id,
+    const size_t         * samples_offs,
+    const size_t         * samples_begin,
+    const size_t         * samples_size,
+          size_t           samples_count,
+    const llama_token    * train_data,
+    size_t                 n_train_data,
+    bool                   separate_with_eos,
+    bool                   separate_with_bos,
+    bool                   fill_with_next_samples,
+    bool                   sample_random_offsets
+) {
+    GGML_ASSERT(tokens_input->n_dims  == 2);
+    GGML_ASSERT(target_probs->n_dims  == 3);
+    int64_t n_vocab  = target_probs->ne[0];
+    int64_t n_tokens = tokens_input->ne[0];
+    int64_t n_batch  = tokens_input->ne[1];
+    GGML_ASSERT(n_vocab  == target_probs->ne[0]);
+    GGML_ASSERT(n_tokens == target_probs->ne[1]);
+    GGML_ASSERT(n_batch  == target_probs->ne[2]);
+
+    std::vector<llama_token> tokens(n_tokens*n_batch);
+    std::vector<llama_token> targets(n_tokens*n_batch);
+
+    int64_t used_samples = get_example_tokens_batch(
+        llama_token_bos(lctx), llama_token_eos(lctx),
+        n_vocab, n_tokens, n_batch,
+        tokens.data(), targets.data(),
+        example_id, samples_offs, samples_begin, samples_size, samples_count,
+        train_data, n_train_data,
+        separate_with_eos, separate_with_bos, fill_with_next_samples, sample_random_offsets);
+
+    ggml_set_f32(target_probs, 0.0f);
+    for (int k=0; k<n_batch; ++k) {
+        for (int64_t i=0; i<n_tokens; ++i) {
+            ggml_set_i32_nd(tokens_input, (int) i, k, 0, 0, tokens[k*n_tokens + i]);
+            ggml_set_f32_nd(target_probs, targets[k*n_tokens + i], (int) i, k, 0, +1.0f);
+        }
+    }
+
+    return used_samples;
+}
+
 void mt19937_set_state(std::mt19937& rng, const std::string& rng_state) {
     std::stringstream s_rng_state;
     s_rng_state.imbue(std::locale::classic());
@@ -1021,6 +1082,242 @@ size_t tokenize_file(
     return out_tokens.size();
 }
 
+// read-only mapping of a whole file
+struct train_mmap {
+    void * addr = NULL;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE hmapping = NULL;
+#endif
+
+    bool map(const char * fname) {
+#ifdef _WIN32
+        HANDLE hfile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hfile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(hfile, &file_size)) {
+            CloseHandle(hfile);
+            return false;
+        }
+        size = (size_t) file_size.QuadPart;
+        if (size > 0) {
+            hmapping = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (hmapping != NULL) {
+                addr = MapViewOfFile(hmapping, FILE_MAP_READ, 0, 0, 0);
+            }
+        }
+        CloseHandle(hfile);
+        return size == 0 || addr != NULL;
+#else
+        int fd = open(fname, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        size = (size_t) st.st_size;
+        if (size > 0) {
+            addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                addr = NULL;
+            } else {
+                // the cache and the text are read front to back
+                posix_madvise(addr, size, POSIX_MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        return size == 0 || addr != NULL;
+#endif
+    }
+
+    ~train_mmap() {
+#ifdef _WIN32
+        if (addr) {
+            UnmapViewOfFile(addr);
+        }
+        if (hmapping) {
+            CloseHandle(hmapping);
+        }
+#else
+        if (addr) {
+            munmap(addr, size);
+        }
+#endif
+    }
+};
+
+static const uint32_t TOKEN_CACHE_MAGIC   = 0x746b6361; // 'tkca'
+static const uint32_t TOKEN_CACHE_VERSION = 1;
+
+// followed by n_tokens int32 tokens, padded to 8 bytes, then n_samples uint64 sample begins and n_samples uint64 sample sizes
+struct token_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t text_size;
+    uint64_t text_hash;
+    uint64_t tokenizer_hash;
+    uint64_t options_hash;
+    uint64_t n_tokens;
+    uint64_t n_samples;
+};
+
+static size_t token_cache_tokens_size(uint64_t n_tokens) {
+    return GGML_PAD(n_tokens*sizeof(llama_token), sizeof(uint64_t));
+}
+
+static uint64_t hash_bytes(uint64_t h, const void * data, size_t size) {
+    const uint64_t mul = 0xff51afd7ed558ccdULL;
+    const uint8_t * bytes = (const uint8_t *) data;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, bytes + i, sizeof(w));
+        h = (h ^ w) * mul;
+        h ^= h >> 32;
+    }
+    for (; i < size; ++i) {
+        h = (h ^ bytes[i]) * mul;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static uint64_t hash_tokenizer(struct llama_context * lctx) {
+    const int n_vocab = llama_n_vocab(llama_get_model(lctx));
+    uint64_t h = hash_bytes(0, &n_vocab, sizeof(n_vocab));
+    for (llama_token token = 0; token < n_vocab; ++token) {
+        const char * text = llama_token_get_text(lctx, token);
+        const float score = llama_token_get_score(lctx, token);
+        const int   type  = (int) llama_token_get_type(lctx, token);
+        h = hash_bytes(h, text, strlen(text) + 1);
+        h = hash_bytes(h, &score, sizeof(score));
+        h = hash_bytes(h, &type, sizeof(type));
+    }
+    return h;
+}
+
+static bool write_token_cache(const char * fn_cache, const token_cache_header & header, const struct train_tokenized_data * data) {
+    // write to a temporary file first, so that an interrupted run never leaves a truncated cache behind
+    std::string fn_tmp = std::string(fn_cache) + ".tmp";
+    FILE * fp = std::fopen(fn_tmp.c_str(), "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    const size_t tokens_bytes = data->n_tokens*sizeof(llama_token);
+    const uint8_t padding[sizeof(uint64_t)] = {};
+    bool ok = std::fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && (tokens_bytes == 0 || std::fwrite(data->tokens, tokens_bytes, 1, fp) == 1);
+    ok = ok && (token_cache_tokens_size(data->n_tokens) == tokens_bytes || std::fwrite(padding, token_cache_tokens_size(data->n_tokens) - tokens_bytes, 1, fp) == 1);
+    ok = ok && (data->n_samples == 0 || std::fwrite(data->samples_begin, data->n_samples*sizeof(size_t), 1, fp) == 1);
+    ok = ok && (data->n_samples == 0 || std::fwrite(data->samples_size,  data->n_samples*sizeof(size_t), 1, fp) == 1);
+    ok = (std::fclose(fp) == 0) && ok;
+    if (ok) {
+        std::remove(fn_cache);
+        ok = std::rename(fn_tmp.c_str(), fn_cache) == 0;
+    }
+    if (!ok) {
+        std::remove(fn_tmp.c_str());
+    }
+    return ok;
+}
+
+struct train_tokenized_data * load_tokenized_data(
+        struct llama_context * lctx,
+        const char           * filename,
+        const char           * fn_cache,
+        const std::string    & sample_start,
+        bool                   include_sample_start,
+        bool                   overlapping_samples,
+        unsigned               context_length) {
+    struct train_tokenized_data * data = new struct train_tokenized_data;
+    data->mapping = NULL;
+
+    // the cache stores sample boundaries as uint64
+    const bool use_cache = (fn_cache != NULL) && (fn_cache[0] != 0) && (sizeof(size_t) == sizeof(uint64_t));
+
+    token_cache_header header = {};
+    if (use_cache) {
+        struct train_mmap text;
+        if (text.map(filename) && text.size > 0) {
+            header.magic          = TOKEN_CACHE_MAGIC;
+            header.version        = TOKEN_CACHE_VERSION;
+            header.text_size      = text.size;
+            header.text_hash      = hash_bytes(0, text.addr, text.size);
+            header.tokenizer_hash = hash_tokenizer(lctx);
+
+            uint64_t h = hash_bytes(0, sample_start.data(), sample_start.size());
+            const uint32_t options[4] = { (uint32_t) sample_start.size(), include_sample_start, overlapping_samples, context_length };
+            header.options_hash   = hash_bytes(h, options, sizeof(options));
+        }
+    }
+
+    if (header.magic == TOKEN_CACHE_MAGIC) {
+        struct train_mmap * cache = new struct train_mmap;
+        const token_cache_header * cached = NULL;
+        if (cache->map(fn_cache) && cache->size >= sizeof(token_cache_header)) {
+            cached = (const token_cache_header *) cache->addr;
+        }
+        if (cached != NULL
+                && cached->magic          == header.magic
+                && cached->version        == header.version
+                && cached->text_size      == header.text_size
+                && cached->text_hash      == header.text_hash
+                && cached->tokenizer_hash == header.tokenizer_hash
+                && cached->options_hash   == header.options_hash
+                && cache->size == sizeof(token_cache_header) + token_cache_tokens_size(cached->n_tokens) + 2*cached->n_samples*sizeof(uint64_t)) {
+            const uint8_t * base = (const uint8_t *) cache->addr + sizeof(token_cache_header);
+            data->mapping       = cache;
+            data->n_tokens      = cached->n_tokens;
+            data->n_samples     = cached->n_samples;
+            data->tokens        = (const llama_token *) base;
+            data->samples_begin = (const size_t *) (base + token_cache_tokens_size(cached->n_tokens));
+            data->samples_size  = data->samples_begin + data->n_samples;
+            printf("%s: loaded %zu tokens and %zu samples from token cache '%s'\n",
+                __func__, data->n_tokens, data->n_samples, fn_cache);
+            return data;
+        }
+        delete cache;
+    }
+
+    tokenize_file(lctx,
+        filename,
+        sample_start,
+        include_sample_start,
+        overlapping_samples,
+        context_length,
+        data->tokens_buf,
+        data->samples_begin_buf,
+        data->samples_size_buf);
+
+    data->tokens        = data->tokens_buf.data();
+    data->n_tokens      = data->tokens_buf.size();
+    data->samples_begin = data->samples_begin_buf.data();
+    data->samples_size  = data->samples_size_buf.data();
+    data->n_samples     = data->samples_begin_buf.size();
+
+    if (header.magic == TOKEN_CACHE_MAGIC) {
+        header.n_tokens  = data->n_tokens;
+        header.n_samples = data->n_samples;
+        if (write_token_cache(fn_cache, header, data)) {
+            printf("%s: wrote token cache '%s'\n", __func__, fn_cache);
+        } else {
+            printf("%s: warning: failed to write token cache '%s'\n", __func__, fn_cache);
+        }
+    }
+
+    return data;
+}
+
+void free_tokenized_data(struct train_tokenized_data * data) {
+    delete data->mapping;
+    delete data;
+}
+
 std::string get_train_filename(const char * filename, const char * pattern_it, const char * latest, int64_t iteration) {
     std::string sit = (iteration >= 0) ? std::to_string(iteration) : std::string(latest);
     return replace_str(filename, pattern_it, sit.c_str());
@@ -1061,6 +1358,10 @@ struct train_params_common get_default_train_params_common() {
     params.sample_random_offsets  = false;
     params.force_reshuffle        = false;
 
+    params.use_token_cache        = true;
+    params.fn_token_cache         = "";
+    params.n_prefetch_batches     = 2;
+
     params.opt_past               = 0;
     params.opt_delta              = 1e-5f;
     params.opt_max_no_improvement = 0;
@@ -1110,6 +1411,9 @@ void print_common_train_usage(int /*argc*/, char ** /*argv*/, const struct train
     fprintf(stderr, "  --no-separate-with-bos     When fill-with-next-samples, don't insert begin-of-sequence token between samples.%s\n", !params->separate_with_bos ? " (default)" : "");
     fprintf(stderr, "  --sample-random-offsets    Use samples beginning at random offsets. Together with fill-with-next-samples this may help for training endless text generation.%s\n", params->sample_random_offsets ? " (default)" : "");
     fprintf(stderr, "  --force-reshuffle          Force a reshuffling of data at program start, otherwise the shuffling of loaded checkpoint is resumed.\n");
+    fprintf(stderr, "  --token-cache FNAME        path of the tokenized training data cache (default: train data path + '.tokcache')\n");
+    fprintf(stderr, "  --no-token-cache           Always tokenize the training data, don't read or write the token cache.\n");
+    fprintf(stderr, "  --prefetch N               Number of batches assembled ahead by a background thread. Zero assembles them between optimizer steps. (default %d)\n", params->n_prefetch_batches);
     fprintf(stderr, "  --no-flash                 Don't use flash attention \n");
     fprintf(stderr, "  --use-flash                Use flash attention (default)\n");
     fprintf(stderr, "  --no-checkpointing         Don't use gradient checkpointing\n");
@@ -1238,6 +1542,20 @@ bool consume_common_train_arg(
         params->sample_random_offsets = true;
     } else if (arg == "--force-reshuffle") {
         params->force_reshuffle = true;
+    } else if (arg == "--token-cache") {
+        if (++i >= argc) {
+            *invalid_param = true;
+            return true;
+        }
+        params->fn_token_cache = std::string(argv[i]);
+    } else if (arg == "--no-token-cache") {
+        params->use_token_cache = false;
+    } else if (arg == "--prefetch") {
+        if (++i >= argc) {
+            *invalid_param = true;
+            return true;
+        }
+        params->n_prefetch_batches = std::max(0, std::stoi(argv[i]));
     } else if (arg == "--no-flash") {
         params->use_flash = false;
     } else if (arg == "--use-flash") {
@@ -1365,6 +1683,205 @@ void finish_processing_train_args(struct train_params_common * params) {
     if (params->escape) {
         process_escapes(params->sample_start);
     }
+    if (params->use_token_cache && params->fn_token_cache.empty()) {
+        params->fn_token_cache = std::string(params->fn_train_data) + ".tokcache";
+    }
+}
+
+// token ids of one assembled batch and the shuffle state after it was taken
+struct train_batch {
+    std::vector<llama_token> tokens;
+    std::vector<llama_token> targets;
+    int64_t                  used_samples;
+    size_t                   next_sample;
+    bool                     reshuffled;
+    mt19937_state            rng_state_current;
+    mt19937_state            rng_state_next;
+};
+
+struct train_batch_loader {
+    struct train_opt_callback_data * data;
+
+    llama_token bos;
+    llama_token eos;
+    int64_t     n_vocab;
+    int64_t     n_tokens;
+    int64_t     n_batch;
+
+    // shuffle position of the worker, ahead of train_state by the batches in the queue
+    size_t        next_sample;
+    size_t        sample_count;
+    mt19937_state rng_state_next;
+
+    // ring of prefetched batches, slots[head] is the oldest
+    std::vector<train_batch> slots;
+    size_t                   head;
+    size_t                   count;
+    bool                     stop;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::thread             worker;
+
+    // targets of the previous batch, to clear only those entries of target_probs
+    std::vector<llama_token> last_targets;
+    bool                     target_probs_cleared;
+};
+
+static void fill_train_batch(struct train_batch_loader * loader, struct train_batch * batch) {
+    struct train_opt_callback_data * data   = loader->data;
+    struct train_params_common     * params = data->params;
+
+    batch->used_samples = get_example_tokens_batch(
+        loader->bos, loader->eos,
+        loader->n_vocab, loader->n_tokens, loader->n_batch,
+        batch->tokens.data(), batch->targets.data(),
+        (int64_t) loader->next_sample,
+        data->shuffled_samples_offs,
+        data->shuffled_samples_begin,
+        data->shuffled_samples_size,
+        data->samples_count,
+        data->tokens_data,
+        data->tokens_size,
+        params->separate_with_eos,
+        params->separate_with_bos,
+        params->fill_with_next_samples,
+        params->sample_random_offsets);
+
+    loader->next_sample += batch->used_samples;
+    batch->reshuffled = false;
+    if (loader->next_sample >= loader->sample_count) {
+        // same reshuffling as train_opt_callback does without a loader
+        batch->reshuffled        = true;
+        batch->rng_state_current = loader->rng_state_next;
+        loader->rng_state_next   = shuffle_samples(
+            batch->rng_state_current,
+            data->shuffled_samples_offs,
+            data->shuffled_samples_begin,
+            data->shuffled_samples_size,
+            data->samples_begin,
+            data->samples_size,
+            data->samples_count);
+        batch->rng_state_next    = loader->rng_state_next;
+        loader->next_sample      = 0;
+    }
+    batch->next_sample = loader->next_sample;
+}
+
+static void train_batch_loader_worker(struct train_batch_loader * loader) {
+    const size_t n_slots = loader->slots.size();
+    while (true) {
+        struct train_batch * batch;
+        {
+            std::unique_lock<std::mutex> lock(loader->mutex);
+            loader->cv.wait(lock, [loader, n_slots]{ return loader->stop || loader->count < n_slots; });
+            if (loader->stop) {
+                return;
+            }
+            batch = &loader->slots[(loader->head + loader->count) % n_slots];
+        }
+        // the slot is not visible to the consumer until count is increased
+        fill_train_batch(loader, batch);
+        {
+            std::lock_guard<std::mutex> lock(loader->mutex);
+            ++loader->count;
+        }
+        loader->cv.notify_all();
+    }
+}
+
+struct train_batch_loader * init_train_batch_loader(struct train_opt_callback_data * data, int n_prefetch) {
+    GGML_ASSERT(n_prefetch > 0);
+    GGML_ASSERT(data->samples_count > 0);
+    GGML_ASSERT(data->tokens_input->type == GGML_TYPE_I32 && ggml_is_contiguous(data->tokens_input));
+    GGML_ASSERT(data->target_probs->type == GGML_TYPE_F32 && ggml_is_contiguous(data->target_probs));
+
+    struct train_batch_loader * loader = new struct train_batch_loader;
+    loader->data     = data;
+    loader->bos      = llama_token_bos(data->lctx);
+    loader->eos      = llama_token_eos(data->lctx);
+    loader->n_vocab  = data->target_probs->ne[0];
+    loader->n_tokens = data->tokens_input->ne[0];
+    loader->n_batch  = data->tokens_input->ne[1];
+    GGML_ASSERT(loader->n_tokens == data->target_probs->ne[1]);
+    GGML_ASSERT(loader->n_batch  == data->target_probs->ne[2]);
+
+    loader->next_sample    = data->train->shuffle_next_sample;
+    loader->sample_count   = data->train->shuffle_sample_count;
+    loader->rng_state_next = data->train->shuffle_rng_state_next;
+
+    loader->slots.resize(n_prefetch);
+    for (auto & batch : loader->slots) {
+        batch.tokens.resize(loader->n_tokens*loader->n_batch);
+        batch.targets.resize(loader->n_tokens*loader->n_batch);
+    }
+    loader->head  = 0;
+    loader->count = 0;
+    loader->stop  = false;
+    loader->target_probs_cleared = false;
+
+    loader->worker = std::thread(train_batch_loader_worker, loader);
+    return loader;
+}
+
+void free_train_batch_loader(struct train_batch_loader * loader) {
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->stop = true;
+    }
+    loader->cv.notify_all();
+    loader->worker.join();
+    delete loader;
+}
+
+// wait for the next prefetched batch, copy it into the input tensors and advance the train state like
+// the synchronous path in train_opt_callback. returns the number of used samples.
+static int64_t take_prefetched_batch(struct train_batch_loader * loader, struct train_state * train) {
+    struct train_batch * batch;
+    {
+        std::unique_lock<std::mutex> lock(loader->mutex);
+        loader->cv.wait(lock, [loader]{ return loader->count > 0; });
+        batch = &loader->slots[loader->head];
+    }
+
+    struct ggml_tensor * tokens_input = loader->data->tokens_input;
+    struct ggml_tensor * target_probs = loader->data->target_probs;
+    const size_t n = batch->targets.size();
+
+    memcpy(tokens_input->data, batch->tokens.data(), n*sizeof(llama_token));
+
+    float * probs = (float *) target_probs->data;
+    if (!loader->target_probs_cleared) {
+        ggml_set_f32(target_probs, 0.0f);
+        loader->target_probs_cleared = true;
+    } else {
+        for (size_t j = 0; j < n; ++j) {
+            probs[j*loader->n_vocab + loader->last_targets[j]] = 0.0f;
+        }
+    }
+    for (size_t j = 0; j < n; ++j) {
+        probs[j*loader->n_vocab + batch->targets[j]] = 1.0f;
+    }
+    loader->last_targets = batch->targets;
+
+    const int64_t used_samples = batch->used_samples;
+    train->train_samples += used_samples;
+    if (batch->reshuffled) {
+        ++train->train_epochs;
+        printf("%s: reshuffle samples. completed epochs: %llu\n", __func__, (long long unsigned) train->train_epochs);
+        train->shuffle_rng_state_current = batch->rng_state_current;
+        train->shuffle_rng_state_next    = batch->rng_state_next;
+    }
+    train->shuffle_next_sample = batch->next_sample;
+
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->head = (loader->head + 1) % loader->slots.size();
+        --loader->count;
+    }
+    loader->cv.notify_all();
+
+    return used_samples;
 }
 
 void train_opt_callback(void * vdata, int accum_step, float * sched, bool * cancel) {
@@ -1449,39 +1966,43 @@ void train_opt_callback(void * vdata, int accum_step, float * sched, bool * canc
         printf("\n");
     }
 
-    int64_t used_samples = get_example_targets_batch(
-        data->lctx,
-        data->tokens_input,
-        data->target_probs,
-        train->shuffle_next_sample,
-        data->shuffled_samples_offs,
-        data->shuffled_samples_begin,
-        data->shuffled_samples_size,
-        data->samples_count,
-        data->tokens_data,
-        data->tokens_size,
-        params->separate_with_eos,
-        params->separate_with_bos,
-        params->fill_with_next_samples,
-        params->sample_random_offsets);
-
-    train->train_samples += used_samples;
-    train->shuffle_next_sample += used_samples;
-
-    if (train->shuffle_next_sample >= train->shuffle_sample_count) {
-        ++train->train_epochs;
-        printf("%s: reshuffle samples. completed epochs: %llu\n", __func__, (long long unsigned) train->train_epochs);
-        // note: we may have used some samples from the current shuffling more than once
-        train->shuffle_rng_state_current = train->shuffle_rng_state_next;
-        train->shuffle_rng_state_next = shuffle_samples(
-            train->shuffle_rng_state_current,
+    if (data->loader != NULL) {
+        take_prefetched_batch(data->loader, train);
+    } else {
+        int64_t used_samples = get_example_targets_batch(
+            data->lctx,
+            data->tokens_input,
+            data->target_probs,
+            train->shuffle_next_sample,
             data->shuffled_samples_offs,
             data->shuffled_samples_begin,
             data->shuffled_samples_size,
-            data->samples_begin,
-            data->samples_size,
-            data->samples_count);
-        train->shuffle_next_sample = 0;
+            data->samples_count,
+            data->tokens_data,
+            data->tokens_size,
+            params->separate_with_eos,
+            params->separate_with_bos,
+            params->fill_with_next_samples,
+            params->sample_random_offsets);
+
+        train->train_samples += used_samples;
+        train->shuffle_next_sample += used_samples;
+
+        if (train->shuffle_next_sample >= train->shuffle_sample_count) {
+            ++train->train_epochs;
+            printf("%s: reshuffle samples. completed epochs: %llu\n", __func__, (long long unsigned) train->train_epochs);
+            // note: we may have used some samples from the current shuffling more than once
+            train->shuffle_rng_state_current = train->shuffle_rng_state_next;
+            train->shuffle_rng_state_next = shuffle_samples(
+                train->shuffle_rng_state_current,
+                data->shuffled_samples_offs,
+                data->shuffled_samples_begin,
+                data->shuffled_samples_size,
+                data->samples_begin,
+                data->samples_size,
+                data->samples_count);
+            train->shuffle_next_sample = 0;
+        }
     }
 
     const bool last_epoch_reached = (params->n_epochs > 0 && (int64_t) train->train_epochs - data->first_epoch >= params->n_epochs);
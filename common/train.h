@@ -61,6 +61,10 @@ struct train_params_common {
 
     bool force_reshuffle;
 
+    bool        use_token_cache;
+    std::string fn_token_cache;
+    int         n_prefetch_batches;
+
     int   warmup;
     int   cos_decay_steps;
     float cos_decay_restart;
@@ -84,6 +88,8 @@ struct train_params_common {
 
 typedef void (*save_train_files_callback)(void * data, struct train_state * train);
 
+struct train_batch_loader;
+
 struct train_opt_callback_data {
     struct train_params_common * params;
     struct train_state         * train;
@@ -91,10 +97,10 @@ struct train_opt_callback_data {
     void                       * save_data;
     struct llama_context       * lctx;
     int                          last_save_iter;
-    llama_token                * tokens_data;
+    const llama_token          * tokens_data;
     size_t                       tokens_size;
-    size_t                     * samples_begin;
-    size_t                     * samples_size;
+    const size_t               * samples_begin;
+    const size_t               * samples_size;
     size_t                     * shuffled_samples_offs;
     size_t                     * shuffled_samples_begin;
     size_t                     * shuffled_samples_size;
@@ -106,6 +112,24 @@ struct train_opt_callback_data {
     int                          iter_at_last_epoch;
     int64_t                      last_time;
     double                       millis_per_iter;
+    struct train_batch_loader  * loader; // NULL: assemble batches in train_opt_callback
+};
+
+struct train_mmap;
+
+// tokens and sample boundaries of the training data.
+// the arrays point into a memory mapped token cache, or into the vectors when the cache is not used.
+struct train_tokenized_data {
+    const llama_token * tokens;
+    size_t              n_tokens;
+    const size_t      * samples_begin;
+    const size_t      * samples_size;
+    size_t              n_samples;
+
+    struct train_mmap        * mapping;
+    std::vector<llama_token>   tokens_buf;
+    std::vector<size_t>        samples_begin_buf;
+    std::vector<size_t>        samples_size_buf;
 };
 
 struct train_state * init_train_state();
@@ -153,6 +177,20 @@ size_t tokenize_file(
         std::vector<size_t>      & out_samples_begin,
         std::vector<size_t>      & out_samples_size);
 
+// like tokenize_file, but reuses the tokens stored in fn_cache when the training data, the tokenizer
+// and the sample options did not change. otherwise the data is tokenized and fn_cache is (re)written.
+// fn_cache may be NULL to always tokenize.
+struct train_tokenized_data * load_tokenized_data(
+        struct llama_context * lctx,
+        const char           * filename,
+        const char           * fn_cache,
+        const std::string    & sample_start,
+        bool                   include_sample_start,
+        bool                   overlapping_samples,
+        unsigned               context_length);
+
+void free_tokenized_data(struct train_tokenized_data * data);
+
 int64_t get_example_targets_batch(
         struct llama_context * lctx,
         struct ggml_tensor   * tokens_input,
@@ -227,4 +265,10 @@ void save_train_state_gguf(struct gguf_context * fctx, struct train_state * trai
 
 std::string get_train_filename(const char * filename, const char * pattern_it, const char * latest, int64_t iteration);
 
+// assembles the next n_prefetch batches and does the reshuffling in a background thread.
+// create it after the shuffled samples of data are initialized, from then on only the loader touches them.
+// target_probs is updated sparsely, nothing else may write to it while the loader is in use.
+struct train_batch_loader * init_train_batch_loader(struct train_opt_callback_data * data, int n_prefetch);
+void free_train_batch_loader(struct train_batch_loader * loader);
+
 void train_opt_callback(void * vdata, int accum_step, float * sched, bool * cancel);
@@ -0,0 +1,188 @@
+#include "build-info.h"
+#include "common.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// Quantization throughput benchmark.
+// Every type is quantized from the same synthetic weights and a checksum of the quantized bytes is printed,
+// run it before and after touching a quantizer to check that the output did not change.
+
+struct benchmark_params_struct {
+    int32_t n_iterations = 5;
+    int32_t n_rows       = 1024;
+    int32_t n_cols       = 4096;
+    int32_t seed         = 1234;
+    std::vector<ggml_type> types;
+};
+
+static const ggml_type all_types[] = {
+    GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_Q8_0,
+#ifdef GGML_USE_K_QUANTS
+    GGML_TYPE_Q2_K, GGML_TYPE_Q3_K, GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K,
+#endif
+};
+
+static void print_usage(int /*argc*/, char ** argv, const benchmark_params_struct & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -i N, --iter N        number of timed iterations per type (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "  -r N, --rows N        number of rows to quantize (default: %d)\n", params.n_rows);
+    fprintf(stderr, "  -c N, --cols N        row length, must be a multiple of 256 (default: %d)\n", params.n_cols);
+    fprintf(stderr, "  -s N, --seed N        seed for the synthetic weights (default: %d)\n", params.seed);
+    fprintf(stderr, "  -q T, --type T        only benchmark type T (q4_0, q3_K, ...), can be repeated\n");
+    fprintf(stderr, "\n");
+}
+
+// weights roughly shaped like a real layer: mostly gaussian, a few rows with outliers, some all-zero and constant blocks
+static void fill_weights(std::vector<float> & data, int n_rows, int n_cols, int seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal(0.0f, 0.02f);
+    std::uniform_int_distribution<int> pick(0, 99);
+
+    for (int r = 0; r < n_rows; ++r) {
+        float * row = data.data() + (size_t) r*n_cols;
+        const int kind = pick(rng);
+        for (int c = 0; c < n_cols; ++c) {
+            float v = normal(rng);
+            if (kind < 10 && pick(rng) == 0) {
+                v *= 25.0f;
+            }
+            row[c] = v;
+        }
+        if (kind == 10) {
+            memset(row, 0, 256*sizeof(float));
+        } else if (kind == 11) {
+            for (int c = 0; c < 256; ++c) {
+                row[c] = 0.5f;
+            }
+        }
+    }
+}
+
+static uint64_t fnv1a(const uint8_t * data, size_t size) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int main(int argc, char ** argv) {
+    benchmark_params_struct params;
+
+    bool invalid_param = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-i" || arg == "--iter") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_iterations = std::stoi(argv[i]);
+        } else if (arg == "-r" || arg == "--rows") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_rows = std::stoi(argv[i]);
+        } else if (arg == "-c" || arg == "--cols") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_cols = std::stoi(argv[i]);
+        } else if (arg == "-s" || arg == "--seed") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.seed = std::stoi(argv[i]);
+        } else if (arg == "-q" || arg == "--type") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            bool found = false;
+            for (ggml_type type : all_types) {
+                if (std::string(ggml_type_name(type)) == argv[i]) {
+                    params.types.push_back(type);
+                    found = true;
+                }
+            }
+            if (!found) {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv, params);
+            exit(0);
+        } else {
+            invalid_param = true;
+            break;
+        }
+    }
+    if (!invalid_param && (params.n_rows <= 0 || params.n_cols <= 0 || params.n_cols % 256 != 0 || params.n_iterations <= 0)) {
+        invalid_param = true;
+    }
+    if (invalid_param) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv, params);
+        exit(1);
+    }
+    if (params.types.empty()) {
+        params.types.assign(std::begin(all_types), std::end(all_types));
+    }
+
+    print_build_info();
+
+    // initializes the fp16 tables used by the quantizers
+    struct ggml_init_params ip = { 0, NULL, true };
+    ggml_free(ggml_init(ip));
+
+    const size_t n_elements = (size_t) params.n_rows*params.n_cols;
+    std::vector<float> src(n_elements);
+    fill_weights(src, params.n_rows, params.n_cols, params.seed);
+
+    std::vector<uint8_t> dst(n_elements*sizeof(float));
+    std::vector<int64_t> hist(1 << 4, 0);
+
+    printf("quantizing %d x %d floats, %d iterations per type\n\n", params.n_rows, params.n_cols, params.n_iterations);
+    printf("%6s %12s %12s %12s %18s\n", "type", "best (ms)", "avg (ms)", "MB/s", "checksum");
+    printf("==================================================================\n");
+
+    for (ggml_type type : params.types) {
+        int64_t best_us = INT64_MAX;
+        int64_t total_us = 0;
+        size_t size = 0;
+        for (int it = 0; it < params.n_iterations; ++it) {
+            const int64_t t_start = ggml_time_us();
+            size = ggml_quantize_chunk(type, src.data(), dst.data(), 0, n_elements, hist.data());
+            const int64_t t_us = ggml_time_us() - t_start;
+            best_us = std::min(best_us, t_us);
+            total_us += t_us;
+        }
+        const double mb = n_elements*sizeof(float)/(1024.0*1024.0);
+        printf("%6s %12.2f %12.2f %12.2f   %016" PRIx64 "\n", ggml_type_name(type),
+            best_us/1000.0, total_us/1000.0/params.n_iterations, mb/(best_us/1e6), fnv1a(dst.data(), size));
+    }
+
+    return 0;
+}
@@ -661,9 +661,18 @@ static struct ggml_tensor * llama_build_lora_finetune_graphs(
         }
     };
 
+    // quantized base weights are never dequantized as a whole, the lora update is applied
+    // to the activations instead: W*x + b*(a^T*x)
+    auto mul_mat_lora = [&add_to_f32] (struct ggml_context * ctx, struct ggml_tensor * w, struct ggml_tensor * a, struct ggml_tensor * b, struct ggml_tensor * x) {
+        if (ggml_is_quantized(w->type)) {
+            struct ggml_tensor * ax = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, a)), x);
+            return ggml_add(ctx, ggml_mul_mat(ctx, w, x), ggml_mul_mat(ctx, b, ax));
+        }
+        return ggml_mul_mat(ctx, add_to_f32(ctx, w, ggml_mul_mat(ctx, a, b)), x);
+    };
+
     struct ggml_tensor * tok_embeddings = add_to_f32(ctx, model->tok_embeddings, ggml_mul_mat(ctx, lora->tok_embeddings_a, lora->tok_embeddings_b));
     struct ggml_tensor * norm           = add_to_f32(ctx, model->norm, ggml_mul_mat(ctx, lora->norm_a, lora->norm_b));
-    struct ggml_tensor * output         = add_to_f32(ctx, model->output, ggml_mul_mat(ctx, lora->output_a, lora->output_b));
 
     struct ggml_tensor * t00 = ggml_reshape_1d(ctx, tokens_input, N*n_batch);  set_name(t00, "t00"); assert_shape_1d(t00, N*n_batch);
     struct ggml_tensor * t01 = ggml_get_rows(ctx, tok_embeddings, t00);        set_name(t01, "t01"); assert_shape_2d(t01, n_embd, N*n_batch);
@@ -689,30 +698,24 @@ static struct ggml_tensor * llama_build_lora_finetune_graphs(
 
         struct ggml_tensor * attention_norm = add_to_f32(ctx, layer.attention_norm, ggml_mul_mat(ctx, llayer.attention_norm_a, llayer.attention_norm_b));
         struct ggml_tensor * ffn_norm = add_to_f32(ctx, layer.ffn_norm, ggml_mul_mat(ctx, llayer.ffn_norm_a, llayer.ffn_norm_b));
-        struct ggml_tensor * wq = add_to_f32(ctx, layer.wq, ggml_mul_mat(ctx, llayer.wq_a, llayer.wq_b));
-        struct ggml_tensor * wk = add_to_f32(ctx, layer.wk, ggml_mul_mat(ctx, llayer.wk_a, llayer.wk_b));
-        struct ggml_tensor * wv = add_to_f32(ctx, layer.wv, ggml_mul_mat(ctx, llayer.wv_a, llayer.wv_b));
-        struct ggml_tensor * wo = add_to_f32(ctx, layer.wo, ggml_mul_mat(ctx, llayer.wo_a, llayer.wo_b));
-        struct ggml_tensor * w1 = add_to_f32(ctx, layer.w1, ggml_mul_mat(ctx, llayer.w1_a, llayer.w1_b));
-        struct ggml_tensor * w2 = add_to_f32(ctx, layer.w2, ggml_mul_mat(ctx, llayer.w2_a, llayer.w2_b));
-        struct ggml_tensor * w3 = add_to_f32(ctx, layer.w3, ggml_mul_mat(ctx, llayer.w3_a, llayer.w3_b));
 
         struct ggml_tensor * t02 = ggml_rms_norm     (ctx, cur, rms_norm_eps);                       set_name(t02, "t02");     assert_shape_2d(t02, n_embd, N*n_batch);
         struct ggml_tensor * t03 = ggml_repeat       (ctx, attention_norm, t02);                     set_name(t03, "t03");     assert_shape_2d(t03, n_embd, N*n_batch);
         struct ggml_tensor * t04 = ggml_mul          (ctx, t03, t02);                                set_name(t04, "t04");     assert_shape_2d(t04, n_embd, N*n_batch);
-        struct ggml_tensor * t05 = ggml_mul_mat      (ctx, wq, t04);                                 set_name(t05, "t05");     assert_shape_2d(t05, n_embd, N*n_batch);
+        struct ggml_tensor * t05 = mul_mat_lora      (ctx, layer.wq, llayer.wq_a, llayer.wq_b, t04); set_name(t05, "t05");     assert_shape_2d(t05, n_embd, N*n_batch);
         struct ggml_tensor * t06 = ggml_reshape_4d   (ctx, t05, n_embd_head, n_head, N, n_batch);    set_name(t06, "t06");     assert_shape_4d(t06, n_embd_head, n_head, N, n_batch);
         struct ggml_tensor * t07 = rope              (t06);                                          set_name(t07, "t07");     assert_shape_4d(t07, n_embd_head, n_head, N, n_batch);
-        struct ggml_tensor * t08 = ggml_mul_mat      (ctx, wk, t04);                                 set_name(t08, "t08");     assert_shape_2d(t08, n_embd_gqa, N*n_batch);
+        struct ggml_tensor * t08 = mul_mat_lora      (ctx, layer.wk, llayer.wk_a, llayer.wk_b, t04); set_name(t08, "t08");     assert_shape_2d(t08, n_embd_gqa, N*n_batch);
         struct ggml_tensor * t09 = ggml_reshape_4d   (ctx, t08, n_embd_head, n_head_kv, N, n_batch); set_name(t09, "t09");     assert_shape_4d(t09, n_embd_head, n_head_kv, N, n_batch);
         struct ggml_tensor * t10 = rope              (t09);                                          set_name(t10, "t10");     assert_shape_4d(t10, n_embd_head, n_head_kv, N, n_batch);
 
         struct ggml_tensor * t11;
-        if (ggml_is_quantized(wv->type)) {
-            struct ggml_tensor * t11_1 = ggml_mul_mat  (ctx, wv, t04);                               set_name(t11_1, "t11_1"); assert_shape_2d(t11_1, n_embd_gqa, N*n_batch);
+        if (ggml_is_quantized(layer.wv->type)) {
+            struct ggml_tensor * t11_1 = mul_mat_lora  (ctx, layer.wv, llayer.wv_a, llayer.wv_b, t04); set_name(t11_1, "t11_1"); assert_shape_2d(t11_1, n_embd_gqa, N*n_batch);
             struct ggml_tensor * t11_2 = ggml_transpose(ctx, t11_1);                                 set_name(t11_2, "t11_2"); assert_shape_2d(t11_2, N*n_batch, n_embd_gqa);
                                  t11   = ggml_cont     (ctx, t11_2);                                 set_name(t11, "t11");     assert_shape_2d(t11, N*n_batch, n_embd_gqa);
         } else {
+            struct ggml_tensor * wv    = add_to_f32    (ctx, layer.wv, ggml_mul_mat(ctx, llayer.wv_a, llayer.wv_b));
                                  t11   = ggml_mul_mat  (ctx, t04, wv);                               set_name(t11, "t11");     assert_shape_2d(t11, N*n_batch, n_embd_gqa);
         }
 
@@ -733,16 +736,16 @@ static struct ggml_tensor * llama_build_lora_finetune_graphs(
         struct ggml_tensor * t17 = ggml_permute      (ctx, t16, 0, 2, 1, 3);                         set_name(t17, "t17");     assert_shape_4d(t17, n_embd_head, n_head, N, n_batch);
         struct ggml_tensor * t18 = ggml_cont         (ctx, t17);                                     set_name(t18, "t18");     assert_shape_4d(t18, n_embd_head, n_head, N, n_batch);
         struct ggml_tensor * t19 = ggml_reshape_2d   (ctx, t18, n_embd, N*n_batch);                  set_name(t19, "t19");     assert_shape_2d(t19, n_embd, N*n_batch);
-        struct ggml_tensor * t20 = ggml_mul_mat      (ctx, wo, t19);                                 set_name(t20, "t20");     assert_shape_2d(t20, n_embd, N*n_batch);
+        struct ggml_tensor * t20 = mul_mat_lora      (ctx, layer.wo, llayer.wo_a, llayer.wo_b, t19); set_name(t20, "t20");     assert_shape_2d(t20, n_embd, N*n_batch);
         struct ggml_tensor * t21 = ggml_add          (ctx, t20, cur);                                set_name(t21, "t21");     assert_shape_2d(t21, n_embd, N*n_batch);
         struct ggml_tensor * t22 = ggml_rms_norm     (ctx, t21, rms_norm_eps);                       set_name(t22, "t22");     assert_shape_2d(t22, n_embd, N*n_batch);
         struct ggml_tensor * t23 = ggml_repeat       (ctx, ffn_norm, t22);                           set_name(t23, "t23");     assert_shape_2d(t23, n_embd, N*n_batch);
         struct ggml_tensor * t24 = ggml_mul          (ctx, t23, t22);                                set_name(t24, "t24");     assert_shape_2d(t24, n_embd, N*n_batch);
-        struct ggml_tensor * t25 = ggml_mul_mat      (ctx, w3, t24);                                 set_name(t25, "t25");     assert_shape_2d(t25, n_ff, N*n_batch);
-        struct ggml_tensor * t26 = ggml_mul_mat      (ctx, w1, t24);                                 set_name(t26, "t26");     assert_shape_2d(t26, n_ff, N*n_batch);
+        struct ggml_tensor * t25 = mul_mat_lora      (ctx, layer.w3, llayer.w3_a, llayer.w3_b, t24); set_name(t25, "t25");     assert_shape_2d(t25, n_ff, N*n_batch);
+        struct ggml_tensor * t26 = mul_mat_lora      (ctx, layer.w1, llayer.w1_a, llayer.w1_b, t24); set_name(t26, "t26");     assert_shape_2d(t26, n_ff, N*n_batch);
         struct ggml_tensor * t27 = ggml_silu         (ctx, t26);                                     set_name(t27, "t27");     assert_shape_2d(t27, n_ff, N*n_batch);
         struct ggml_tensor * t28 = ggml_mul          (ctx, t27, t25);                                set_name(t28, "t28");     assert_shape_2d(t28, n_ff, N*n_batch);
-        struct ggml_tensor * t29 = ggml_mul_mat      (ctx, w2, t28);                                 set_name(t29, "t29");     assert_shape_2d(t29, n_embd, N*n_batch);
+        struct ggml_tensor * t29 = mul_mat_lora      (ctx, layer.w2, llayer.w2_a, llayer.w2_b, t28); set_name(t29, "t29");     assert_shape_2d(t29, n_embd, N*n_batch);
         struct ggml_tensor * t30 = ggml_add          (ctx, t29, t21);                                set_name(t30, "t30");     assert_shape_2d(t30, n_embd, N*n_batch);
         cur = t30;
         if (enable_checkpointing) {
@@ -752,7 +755,7 @@ static struct ggml_tensor * llama_build_lora_finetune_graphs(
     struct ggml_tensor * t31   = ggml_rms_norm          (ctx, cur, rms_norm_eps);                    set_name(t31, "t31");     assert_shape_2d(t31, n_embd, N*n_batch);
     struct ggml_tensor * t32   = ggml_repeat            (ctx, norm, t31);                            set_name(t32, "t32");     assert_shape_2d(t32, n_embd, N*n_batch);
     struct ggml_tensor * t33   = ggml_mul               (ctx, t32, t31);                             set_name(t33, "t33");     assert_shape_2d(t33, n_embd, N*n_batch);
-    struct ggml_tensor * t34   = ggml_mul_mat           (ctx, output, t33);                          set_name(t34, "t34");     assert_shape_2d(t34, n_vocab, N*n_batch);
+    struct ggml_tensor * t34   = mul_mat_lora           (ctx, model->output, lora->output_a, lora->output_b, t33); set_name(t34, "t34");     assert_shape_2d(t34, n_vocab, N*n_batch);
     struct ggml_tensor * t35   = ggml_reshape_3d        (ctx, t34, n_vocab, N, n_batch);             set_name(t35, "t35");     assert_shape_3d(t35, n_vocab, N, n_batch);
     struct ggml_tensor * t36   = ggml_cross_entropy_loss(ctx, t35, targets);                         set_name(t36, "t36");     assert_shape_1d(t36, 1);
 
@@ -1806,27 +1809,21 @@ int main(int argc, char ** argv) {
     ggml_allocr_free(alloc);
 
     // tokenize data
-    std::vector<llama_token> train_tokens;
-    std::vector<size_t> train_samples_begin;
-    std::vector<size_t> train_samples_size;
     printf("%s: tokenize training data\n", __func__);
-    tokenize_file(lctx,
+    struct train_tokenized_data * train_data = load_tokenized_data(lctx,
             params.common.fn_train_data,
+            params.common.use_token_cache ? params.common.fn_token_cache.c_str() : NULL,
             params.common.sample_start,
             params.common.include_sample_start,
             params.common.overlapping_samples,
-            n_tokens,
-            train_tokens,
-            train_samples_begin,
-            train_samples_size);
-    GGML_ASSERT(train_samples_begin.size() == train_samples_size.size());
+            n_tokens);
 
-    printf("%s: number of training tokens: %zu\n", __func__, train_tokens.size());
+    printf("%s: number of training tokens: %zu\n", __func__, train_data->n_tokens);
 
     std::vector<size_t> token_noccurs;
     token_noccurs.resize(model.hparams.n_vocab, 0);
-    for (unsigned int i = 0; i < train_tokens.size(); ++i) {
-        ++token_noccurs[train_tokens[i]];
+    for (unsigned int i = 0; i < train_data->n_tokens; ++i) {
+        ++token_noccurs[train_data->tokens[i]];
     }
     int n_unique_tokens = 0;
     for (unsigned int i = 0; i < token_noccurs.size(); ++i) {
@@ -1835,8 +1832,8 @@ int main(int argc, char ** argv) {
     }
     printf("%s: number of unique tokens: %d\n", __func__, n_unique_tokens);
 
-    size_t shuffle_samples_hash = compute_samples_hash(params.common.fn_train_data, train_samples_begin.data(), train_samples_size.data(), train_samples_size.size());
-    const bool changed_train_data = (shuffle_samples_hash != train->shuffle_samples_hash) || (train->shuffle_sample_count != train_samples_size.size());
+    size_t shuffle_samples_hash = compute_samples_hash(params.common.fn_train_data, train_data->samples_begin, train_data->samples_size, train_data->n_samples);
+    const bool changed_train_data = (shuffle_samples_hash != train->shuffle_samples_hash) || (train->shuffle_sample_count != train_data->n_samples);
     if (changed_train_data) {
         printf("%s: train data seems to have changed. restarting shuffled epoch.\n", __func__);
     }
@@ -1845,24 +1842,24 @@ int main(int argc, char ** argv) {
     }
     if ((train->shuffle_rng_state_current == "") || changed_train_data || params.common.force_reshuffle) {
         train->shuffle_rng_state_current = mt19937_seed_to_state(params.common.seed);
-        train->shuffle_sample_count = train_samples_size.size();
+        train->shuffle_sample_count = train_data->n_samples;
         train->shuffle_next_sample = 0;
         train->shuffle_samples_hash = shuffle_samples_hash;
     }
     std::vector<size_t> train_shuffled_samples_offs;
     std::vector<size_t> train_shuffled_samples_begin;
     std::vector<size_t> train_shuffled_samples_size;
-    train_shuffled_samples_offs.resize(train_samples_begin.size());
-    train_shuffled_samples_begin.resize(train_samples_begin.size());
-    train_shuffled_samples_size.resize(train_samples_size.size());
+    train_shuffled_samples_offs.resize(train_data->n_samples);
+    train_shuffled_samples_begin.resize(train_data->n_samples);
+    train_shuffled_samples_size.resize(train_data->n_samples);
     train->shuffle_rng_state_next = shuffle_samples(
         train->shuffle_rng_state_current,
         train_shuffled_samples_offs.data(),
         train_shuffled_samples_begin.data(),
         train_shuffled_samples_size.data(),
-        train_samples_begin.data(),
-        train_samples_size.data(),
-        train_samples_size.size());
+        train_data->samples_begin,
+        train_data->samples_size,
+        train_data->n_samples);
 
     printf("%s: begin training\n", __func__);
 
@@ -1881,14 +1878,14 @@ int main(int argc, char ** argv) {
     opt_cb_data.save_data              = &save_data;
     opt_cb_data.lctx                   = lctx;
     opt_cb_data.last_save_iter         = opt->iter;
-    opt_cb_data.tokens_data            = train_tokens.data();
-    opt_cb_data.tokens_size            = train_tokens.size();
-    opt_cb_data.samples_begin          = train_samples_begin.data();
-    opt_cb_data.samples_size           = train_samples_size.data();
+    opt_cb_data.tokens_data            = train_data->tokens;
+    opt_cb_data.tokens_size            = train_data->n_tokens;
+    opt_cb_data.samples_begin          = train_data->samples_begin;
+    opt_cb_data.samples_size           = train_data->samples_size;
     opt_cb_data.shuffled_samples_offs  = train_shuffled_samples_offs.data();
     opt_cb_data.shuffled_samples_begin = train_shuffled_samples_begin.data();
     opt_cb_data.shuffled_samples_size  = train_shuffled_samples_size.data();
-    opt_cb_data.samples_count          = train_samples_size.size();
+    opt_cb_data.samples_count          = train_data->n_samples;
     opt_cb_data.tokens_input           = tokens_input;
     opt_cb_data.target_probs           = target_probs;
     opt_cb_data.first_iter             = opt->iter;
@@ -1896,6 +1893,10 @@ int main(int argc, char ** argv) {
     opt_cb_data.iter_at_last_epoch     = -1;
     opt_cb_data.last_time              = ggml_time_ms();
     opt_cb_data.millis_per_iter        = 0.0;
+    opt_cb_data.loader                 = NULL;
+    if (params.common.n_prefetch_batches > 0) {
+        opt_cb_data.loader = init_train_batch_loader(&opt_cb_data, params.common.n_prefetch_batches);
+    }
 
     // measure required memory for work buffer
     size_t max_work_size = ggml_graph_plan(gb, params.common.n_threads).work_size + GGML_OBJECT_SIZE;
@@ -1913,6 +1914,10 @@ int main(int argc, char ** argv) {
 
     ggml_opt_resume_g(ctx_work, opt, loss, gf, gb, &train_opt_callback, (void *) &opt_cb_data);
 
+    if (opt_cb_data.loader) {
+        free_train_batch_loader(opt_cb_data.loader);
+    }
+
     ggml_free(ctx_work);
     ggml_free(ctx_compute);
     ggml_free(ctx_input);
@@ -1932,6 +1937,7 @@ int main(int argc, char ** argv) {
     }
 
     ggml_free(opt->ctx);
+    free_tokenized_data(train_data);
     free_train_state(train);
     ggml_free(lora.ctx);
     llama_free(lctx);
@@ -2,15 +2,37 @@
 #include "common.h"
 #include "llama.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <fstream>
+#include <iterator>
 #include <sstream>
 #include <thread>
 #include <mutex>
 #include <vector>
 
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <fcntl.h>
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+        #endif
+    #endif
+#endif
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -144,6 +166,313 @@ static void process_logits(
     }
 }
 
+// Reference logits file, written by a normal perplexity run with --kl-divergence-base and memory-mapped by --kl-divergence:
+//   kl_file_header
+//   llama_token tokens[n_chunk*n_ctx]
+//   one record per scored token: kl_record_head followed by top_k kl_top_entry, most probable first
+struct kl_file_header {
+    char     magic[4];
+    uint32_t version;
+    int32_t  n_vocab;
+    int32_t  n_ctx;
+    int32_t  n_chunk;
+    int32_t  top_k;
+};
+
+struct kl_record_head {
+    float tok_logprob; // log-prob the reference gave to the actual next token
+    float rest_prob;   // probability mass outside the stored top-k
+};
+
+struct kl_top_entry {
+    int32_t id;
+    float   logprob;
+};
+
+static const char     KL_FILE_MAGIC[4] = {'k', 'l', 'd', 'b'};
+static const uint32_t KL_FILE_VERSION  = 1;
+
+static size_t kl_record_size(int top_k) {
+    return sizeof(kl_record_head) + top_k*sizeof(kl_top_entry);
+}
+
+// read-only mapping of the reference file, falls back to reading it into memory where mmap is not available
+struct kl_mapped_file {
+    void * addr = nullptr; // only ever read through const pointers
+    size_t size = 0;
+
+    kl_mapped_file() = default;
+    kl_mapped_file(const kl_mapped_file &) = delete;
+
+#ifdef _POSIX_MAPPED_FILES
+    bool open(const std::string & fname) {
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void * ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ptr == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        // records are consumed strictly in order
+        posix_madvise(ptr, size, POSIX_MADV_SEQUENTIAL);
+        addr = ptr;
+        return true;
+    }
+
+    ~kl_mapped_file() {
+        if (addr) {
+            munmap(addr, size);
+        }
+    }
+#elif defined(_WIN32)
+    bool open(const std::string & fname) {
+        HANDLE hFile = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(hFile, &file_size) || file_size.QuadPart == 0) {
+            CloseHandle(hFile);
+            return false;
+        }
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(hFile);
+        if (hMapping == NULL) {
+            return false;
+        }
+        addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+        if (addr == NULL) {
+            return false;
+        }
+        size = file_size.QuadPart;
+        return true;
+    }
+
+    ~kl_mapped_file() {
+        if (addr) {
+            UnmapViewOfFile(addr);
+        }
+    }
+#else
+    std::vector<uint8_t> data;
+
+    bool open(const std::string & fname) {
+        std::ifstream f(fname, std::ios::binary);
+        if (!f) {
+            return false;
+        }
+        data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        addr = data.data();
+        size = data.size();
+        return size > 0;
+    }
+#endif
+};
+
+// stores the reference top-k distribution for n_token consecutive positions into records
+static void process_logits_ref(
+    int n_vocab, const float * logits, const int * tokens, int n_token, int top_k, std::vector<std::thread> & workers,
+    uint8_t * records
+) {
+    const size_t record_size = kl_record_size(top_k);
+    std::mutex mutex;
+    int counter = 0;
+    auto compute = [&mutex, &counter, n_vocab, logits, tokens, n_token, top_k, record_size, records] () {
+        std::vector<kl_top_entry> entries(n_vocab);
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            int i = counter++;
+            if (i >= n_token) {
+                break;
+            }
+            lock.unlock();
+            const float * row = logits + (size_t) i*n_vocab;
+            const float max_logit = *std::max_element(row, row + n_vocab);
+            double sum_exp = 0.0;
+            for (int j = 0; j < n_vocab; ++j) {
+                sum_exp += expf(row[j] - max_logit);
+            }
+            const float log_sum = max_logit + log(sum_exp);
+            for (int j = 0; j < n_vocab; ++j) {
+                entries[j] = {j, row[j] - log_sum};
+            }
+            std::partial_sort(entries.begin(), entries.begin() + top_k, entries.end(),
+                    [](const kl_top_entry & a, const kl_top_entry & b) { return a.logprob > b.logprob; });
+            double top_mass = 0.0;
+            for (int k = 0; k < top_k; ++k) {
+                top_mass += expf(entries[k].logprob);
+            }
+            const kl_record_head head = {row[tokens[i+1]] - log_sum, (float) std::max(0.0, 1.0 - top_mass)};
+            uint8_t * record = records + i*record_size;
+            memcpy(record, &head, sizeof(head));
+            memcpy(record + sizeof(head), entries.data(), top_k*sizeof(kl_top_entry));
+        }
+    };
+    for (auto & w : workers) {
+        w = std::thread(compute);
+    }
+    compute();
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+struct kl_divergence_stats {
+    double  sum_kld      = 0.0;
+    double  sum_kld2     = 0.0;
+    double  max_kld      = 0.0;
+    double  nll          = 0.0;
+    double  nll2         = 0.0;
+    double  nll_base     = 0.0;
+    int64_t n_same_top   = 0;
+    int64_t count        = 0;
+};
+
+// KL(reference || model) per position, with the reference tail past top-k folded into one bucket
+static void process_logits_kl(
+    int n_vocab, const float * logits, const int * tokens, int n_token, int top_k, std::vector<std::thread> & workers,
+    const uint8_t * records, kl_divergence_stats & stats
+) {
+    const size_t record_size = kl_record_size(top_k);
+    std::mutex mutex;
+    int counter = 0;
+    auto compute = [&mutex, &counter, &stats, n_vocab, logits, tokens, n_token, top_k, record_size, records] () {
+        kl_divergence_stats local;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            int i = counter++;
+            if (i >= n_token) {
+                stats.sum_kld    += local.sum_kld;
+                stats.sum_kld2   += local.sum_kld2;
+                stats.max_kld     = std::max(stats.max_kld, local.max_kld);
+                stats.nll        += local.nll;
+                stats.nll2       += local.nll2;
+                stats.nll_base   += local.nll_base;
+                stats.n_same_top += local.n_same_top;
+                stats.count      += local.count;
+                break;
+            }
+            lock.unlock();
+            const float * row = logits + (size_t) i*n_vocab;
+            const uint8_t * record = records + i*record_size;
+            kl_record_head head;
+            memcpy(&head, record, sizeof(head));
+            const kl_top_entry * top = (const kl_top_entry *) (record + sizeof(head));
+
+            int   best_id   = 0;
+            float max_logit = row[0];
+            for (int j = 1; j < n_vocab; ++j) {
+                if (row[j] > max_logit) {
+                    max_logit = row[j];
+                    best_id   = j;
+                }
+            }
+            double sum_exp = 0.0;
+            for (int j = 0; j < n_vocab; ++j) {
+                sum_exp += expf(row[j] - max_logit);
+            }
+            const float log_sum = max_logit + log(sum_exp);
+
+            double kld   = 0.0;
+            double q_top = 0.0;
+            for (int k = 0; k < top_k; ++k) {
+                const float lq = row[top[k].id] - log_sum;
+                kld   += expf(top[k].logprob) * (top[k].logprob - lq);
+                q_top += expf(lq);
+            }
+            if (head.rest_prob > 0.0f) {
+                const double q_rest = std::max(1e-30, 1.0 - q_top);
+                kld += head.rest_prob * (log(head.rest_prob) - log(q_rest));
+            }
+
+            const double v = -(row[tokens[i+1]] - log_sum);
+            local.sum_kld    += kld;
+            local.sum_kld2   += kld*kld;
+            local.max_kld     = std::max(local.max_kld, kld);
+            local.nll        += v;
+            local.nll2       += v*v;
+            local.nll_base   += -head.tok_logprob;
+            local.n_same_top += best_id == top[0].id;
+            local.count      += 1;
+        }
+    };
+    for (auto & w : workers) {
+        w = std::thread(compute);
+    }
+    compute();
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+// Evaluates n_seq consecutive chunks of n_ctx tokens. Several chunks only fit in one decode when n_batch >= n_seq*n_ctx,
+// in that case they go into a single batch as parallel sequences. Otherwise n_seq must be 1 and the chunk is split
+// over several decodes. On return logits holds n_ctx rows per chunk, chunk by chunk.
+static bool evaluate_chunks(
+    llama_context * ctx, llama_batch & batch, const llama_token * tokens, int n_seq, int n_ctx, int n_batch, bool add_bos,
+    std::vector<float> & logits
+) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    const int num_batches = (n_ctx + n_batch - 1) / n_batch;
+
+    GGML_ASSERT(n_seq == 1 || num_batches == 1);
+
+    logits.clear();
+
+    // clear the KV cache
+    llama_kv_cache_tokens_rm(ctx, -1, -1);
+
+    for (int j = 0; j < num_batches; ++j) {
+        const int batch_start = j * n_batch;
+        const int batch_size  = std::min(n_ctx - batch_start, n_batch);
+
+        batch.n_tokens = 0;
+        for (int seq = 0; seq < n_seq; ++seq) {
+            for (int k = 0; k < batch_size; ++k) {
+                const int idx = batch.n_tokens++;
+                batch.token [idx] = tokens[seq*n_ctx + batch_start + k];
+                batch.pos   [idx] = batch_start + k;
+                batch.seq_id[idx] = seq;
+                batch.logits[idx] = true;
+            }
+
+            // add BOS token for the first batch of each chunk
+            if (add_bos && j == 0) {
+                batch.token[seq*batch_size] = llama_token_bos(ctx);
+            }
+        }
+
+        if (llama_decode(ctx, batch)) {
+            return false;
+        }
+
+        const auto * batch_logits = llama_get_logits(ctx);
+        logits.insert(logits.end(), batch_logits, batch_logits + (size_t) batch.n_tokens * n_vocab);
+    }
+
+    return true;
+}
+
+static void print_eta(float t_total, int n_pass) {
+    fprintf(stderr, "%.2f seconds per pass - ETA ", t_total);
+    int total_seconds = (int)(t_total * n_pass);
+    if (total_seconds >= 60*60) {
+        fprintf(stderr, "%d hours ", total_seconds / (60*60));
+        total_seconds = total_seconds % (60*60);
+    }
+    fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
+}
+
 static results_perplexity perplexity_v2(llama_context * ctx, const gpt_params & params) {
     // Download: https://s3.amazonaws.com/research.metamind.io/wikitext/wikitext-2-raw-v1.zip?ref=salesforce-research
     // Run `./perplexity -m models/7B/ggml-model-q4_0.bin -f wiki.test.raw`
@@ -291,7 +620,10 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 
     const bool is_spm = llama_vocab_type(llama_get_model(ctx)) == LLAMA_VOCAB_TYPE_SPM;
     const bool add_bos = is_spm;
-    const int n_ctx = llama_n_ctx(ctx);
+
+    // the context holds n_seq chunks side by side, see main
+    const int n_seq = std::max(1, params.n_parallel);
+    const int n_ctx = llama_n_ctx(ctx) / n_seq;
 
     auto tim1 = std::chrono::high_resolution_clock::now();
     fprintf(stderr, "%s: tokenizing the input ..\n", __func__);
@@ -319,63 +651,63 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     const int n_chunk = params.n_chunks < 0 ? n_chunk_max : std::min(params.n_chunks, n_chunk_max);
     const int n_vocab = llama_n_vocab(llama_get_model(ctx));
     const int n_batch = params.n_batch;
+    const int first   = n_ctx/2;
+    const int top_k   = std::max(1, std::min(params.kl_divergence_top_k, n_vocab));
+
+    // optionally keep the reference distributions of every scored token for later --kl-divergence runs
+    FILE * ref_file = nullptr;
+    std::vector<uint8_t> ref_records;
+    if (!params.logits_file.empty()) {
+        ref_file = fopen(params.logits_file.c_str(), "wb");
+        if (ref_file == NULL) {
+            fprintf(stderr, "%s: failed to open %s for writing\n", __func__, params.logits_file.c_str());
+            return {tokens, -1, logit_history, prob_history};
+        }
+        kl_file_header header;
+        memcpy(header.magic, KL_FILE_MAGIC, sizeof(header.magic));
+        header.version = KL_FILE_VERSION;
+        header.n_vocab = n_vocab;
+        header.n_ctx   = n_ctx;
+        header.n_chunk = n_chunk;
+        header.top_k   = top_k;
+        fwrite(&header, sizeof(header), 1, ref_file);
+        fwrite(tokens.data(), sizeof(llama_token), (size_t) n_chunk*n_ctx, ref_file);
+        ref_records.resize((n_ctx - 1 - first) * kl_record_size(top_k));
+        fprintf(stderr, "%s: saving top-%d reference logits to %s\n", __func__, top_k, params.logits_file.c_str());
+    }
 
     int count = 0;
     double nll = 0.0;
     double nll2 = 0.0;
 
-    fprintf(stderr, "%s: calculating perplexity over %d chunks, batch_size=%d\n", __func__, n_chunk, n_batch);
+    fprintf(stderr, "%s: calculating perplexity over %d chunks, batch_size=%d, n_seq=%d\n", __func__, n_chunk, n_batch, n_seq);
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
-    for (int i = 0; i < n_chunk; ++i) {
-        const int start =     i * n_ctx;
-        const int end   = start + n_ctx;
-
-        const int num_batches = (n_ctx + n_batch - 1) / n_batch;
+    llama_batch batch = llama_batch_init(n_seq * std::min(n_ctx, n_batch), 0);
+    std::vector<float> logits;
 
-        std::vector<float> logits;
+    for (int i = 0; i < n_chunk; i += n_seq) {
+        const int start = i * n_ctx;
+        const int n_seq_batch = std::min(n_seq, n_chunk - i);
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
-        // clear the KV cache
-        llama_kv_cache_tokens_rm(ctx, -1, -1);
-
-        for (int j = 0; j < num_batches; ++j) {
-            const int batch_start = start + j * n_batch;
-            const int batch_size  = std::min(end - batch_start, n_batch);
-
-            // save original token and restore it after eval
-            const auto token_org = tokens[batch_start];
-
-            // add BOS token for the first batch of each chunk
-            if (add_bos && j == 0) {
-                tokens[batch_start] = llama_token_bos(ctx);
-            }
-
-            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0))) {
-                fprintf(stderr, "%s : failed to eval\n", __func__);
-                return {tokens, -1, logit_history, prob_history};
+        if (!evaluate_chunks(ctx, batch, tokens.data() + start, n_seq_batch, n_ctx, n_batch, add_bos, logits)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            llama_batch_free(batch);
+            if (ref_file) {
+                fclose(ref_file);
             }
-
-            // restore the original token in case it was set to BOS
-            tokens[batch_start] = token_org;
-
-            const auto * batch_logits = llama_get_logits(ctx);
-            logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+            return {tokens, -1, logit_history, prob_history};
         }
 
         const auto t_end = std::chrono::high_resolution_clock::now();
 
         if (i == 0) {
             const float t_total = std::chrono::duration<float>(t_end - t_start).count();
-            fprintf(stderr, "%s: %.2f seconds per pass - ETA ", __func__, t_total);
-            int total_seconds = (int)(t_total * n_chunk);
-            if (total_seconds >= 60*60) {
-                fprintf(stderr, "%d hours ", total_seconds / (60*60));
-                total_seconds = total_seconds % (60*60);
-            }
-            fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
+            fprintf(stderr, "%s: ", __func__);
+            print_eta(t_total, (n_chunk + n_seq - 1) / n_seq);
         }
 
         // We get the logits for all the tokens in the context window (params.n_ctx)
@@ -390,24 +722,39 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
         // Example, we have a context window of 512, we will compute perplexity for each of the
         // last 256 tokens.  Then, we split the input up into context window size chunks to
         // process the entire prompt.
-        const int first = n_ctx/2;
-        process_logits(n_vocab, logits.data() + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                       workers, nll, nll2, logit_history.data() + start + first, prob_history.data() + start + first);
-        count += n_ctx - first - 1;
+        for (int seq = 0; seq < n_seq_batch; ++seq) {
+            const float * chunk_logits = logits.data() + (size_t) seq*n_ctx*n_vocab;
+            const int chunk_start = start + seq*n_ctx;
+
+            process_logits(n_vocab, chunk_logits + first*n_vocab, tokens.data() + chunk_start + first, n_ctx - 1 - first,
+                           workers, nll, nll2, logit_history.data() + chunk_start + first, prob_history.data() + chunk_start + first);
+            count += n_ctx - first - 1;
+
+            if (ref_file) {
+                process_logits_ref(n_vocab, chunk_logits + first*n_vocab, tokens.data() + chunk_start + first, n_ctx - 1 - first,
+                                   top_k, workers, ref_records.data());
+                fwrite(ref_records.data(), 1, ref_records.size(), ref_file);
+            }
 
-        // perplexity is e^(average negative log-likelihood)
-        if (params.ppl_output_type == 0) {
-            printf("[%d]%.4lf,", i + 1, std::exp(nll / count));
-        } else {
-            double av = nll/count;
-            double av2 = nll2/count - av*av;
-            if (av2 > 0) av2 = sqrt(av2/(count-1));
-            printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(nll / count), av, av2);
+            // perplexity is e^(average negative log-likelihood)
+            if (params.ppl_output_type == 0) {
+                printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
+            } else {
+                double av = nll/count;
+                double av2 = nll2/count - av*av;
+                if (av2 > 0) av2 = sqrt(av2/(count-1));
+                printf("%8d  %.4lf  %4lf  %4lf\n", (i + seq)*n_ctx, std::exp(nll / count), av, av2);
+            }
         }
         fflush(stdout);
     }
     printf("\n");
 
+    llama_batch_free(batch);
+    if (ref_file) {
+        fclose(ref_file);
+    }
+
     nll2 /= count;
     nll /= count;
     const double ppl = exp(nll);
@@ -422,6 +769,137 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     return {tokens, ppl, logit_history, prob_history};
 }
 
+static results_perplexity kl_divergence(llama_context * ctx, const gpt_params & params) {
+    // Compares the model against reference logits saved by an earlier run of
+    // `./perplexity -m models/7B/ggml-model-f16.gguf -f wiki.test.raw --kl-divergence-base wiki.kld`
+    // with `./perplexity -m models/7B/ggml-model-q4_0.gguf --kl-divergence-base wiki.kld --kl-divergence`
+    // The evaluated tokens come from the reference file, so no -f is needed.
+
+    const bool is_spm = llama_vocab_type(llama_get_model(ctx)) == LLAMA_VOCAB_TYPE_SPM;
+    const bool add_bos = is_spm;
+
+    const int n_seq   = std::max(1, params.n_parallel);
+    const int n_ctx   = llama_n_ctx(ctx) / n_seq;
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    const int n_batch = params.n_batch;
+
+    if (params.logits_file.empty()) {
+        fprintf(stderr, "%s: --kl-divergence needs the reference file given with --kl-divergence-base\n", __func__);
+        return {{}, -1, {}, {}};
+    }
+
+    kl_mapped_file file;
+    if (!file.open(params.logits_file)) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, params.logits_file.c_str());
+        return {{}, -1, {}, {}};
+    }
+
+    kl_file_header header;
+    if (file.size < sizeof(header)) {
+        fprintf(stderr, "%s: %s is too small to be a reference logits file\n", __func__, params.logits_file.c_str());
+        return {{}, -1, {}, {}};
+    }
+    const uint8_t * base = (const uint8_t *) file.addr;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, KL_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != KL_FILE_VERSION) {
+        fprintf(stderr, "%s: %s is not a reference logits file (or has an unsupported version)\n", __func__, params.logits_file.c_str());
+        return {{}, -1, {}, {}};
+    }
+    if (header.n_vocab != n_vocab) {
+        fprintf(stderr, "%s: reference vocab size %d does not match the model (%d)\n", __func__, header.n_vocab, n_vocab);
+        return {{}, -1, {}, {}};
+    }
+    if (header.n_ctx != n_ctx) {
+        fprintf(stderr, "%s: reference was computed with a context of %d, run with -c %d\n", __func__, header.n_ctx, header.n_ctx);
+        return {{}, -1, {}, {}};
+    }
+
+    const int first  = n_ctx/2;
+    const int top_k  = header.top_k;
+    const size_t chunk_records = (size_t) (n_ctx - 1 - first) * kl_record_size(top_k);
+    const size_t tokens_offset = sizeof(header);
+    const size_t record_offset = tokens_offset + (size_t) header.n_chunk*n_ctx*sizeof(llama_token);
+    if (file.size < record_offset + header.n_chunk*chunk_records) {
+        fprintf(stderr, "%s: %s is truncated\n", __func__, params.logits_file.c_str());
+        return {{}, -1, {}, {}};
+    }
+
+    const llama_token * tokens  = (const llama_token *) (base + tokens_offset);
+    const uint8_t     * records = base + record_offset;
+
+    const int n_chunk = params.n_chunks < 0 ? header.n_chunk : std::min(params.n_chunks, header.n_chunk);
+
+    fprintf(stderr, "%s: computing KL-divergence against top-%d reference logits over %d chunks, batch_size=%d, n_seq=%d\n",
+            __func__, top_k, n_chunk, n_batch, n_seq);
+
+    std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
+
+    llama_batch batch = llama_batch_init(n_seq * std::min(n_ctx, n_batch), 0);
+    std::vector<float> logits;
+    kl_divergence_stats stats;
+
+    printf("\nchunk        PPL      ln(PPL(Q)/PPL(base))    KL-divergence       same top\n");
+
+    for (int i = 0; i < n_chunk; i += n_seq) {
+        const int start = i * n_ctx;
+        const int n_seq_batch = std::min(n_seq, n_chunk - i);
+
+        const auto t_start = std::chrono::high_resolution_clock::now();
+
+        if (!evaluate_chunks(ctx, batch, tokens + start, n_seq_batch, n_ctx, n_batch, add_bos, logits)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            llama_batch_free(batch);
+            return {{}, -1, {}, {}};
+        }
+
+        const auto t_end = std::chrono::high_resolution_clock::now();
+
+        if (i == 0) {
+            const float t_total = std::chrono::duration<float>(t_end - t_start).count();
+            fprintf(stderr, "%s: ", __func__);
+            print_eta(t_total, (n_chunk + n_seq - 1) / n_seq);
+        }
+
+        for (int seq = 0; seq < n_seq_batch; ++seq) {
+            const float * chunk_logits = logits.data() + (size_t) seq*n_ctx*n_vocab;
+            const int chunk_start = start + seq*n_ctx;
+
+            process_logits_kl(n_vocab, chunk_logits + first*n_vocab, tokens + chunk_start + first, n_ctx - 1 - first,
+                              top_k, workers, records + (size_t) (i + seq)*chunk_records, stats);
+
+            const double count = stats.count;
+            printf("%5d  %10.4lf  %20.6lf  %20.6lf  %12.3lf%%\n", i + seq + 1, exp(stats.nll/count),
+                    (stats.nll - stats.nll_base)/count, stats.sum_kld/count, 100.0*stats.n_same_top/count);
+        }
+        fflush(stdout);
+    }
+    printf("\n");
+
+    llama_batch_free(batch);
+
+    const double count = stats.count;
+    const double nll      = stats.nll/count;
+    const double nll_base = stats.nll_base/count;
+    const double ppl      = exp(nll);
+    double nll_err = stats.nll2/count - nll*nll;
+    nll_err = nll_err > 0 ? sqrt(nll_err/(count - 1)) : 0.0;
+    const double kld = stats.sum_kld/count;
+    double kld_err = stats.sum_kld2/count - kld*kld;
+    kld_err = kld_err > 0 ? sqrt(kld_err/(count - 1)) : 0.0;
+    const double p_same = stats.n_same_top/count;
+
+    printf("====== Perplexity statistics ======\n");
+    printf("PPL(Q)                : %.4lf +/- %.5lf\n", ppl, nll_err*ppl);
+    printf("PPL(base)             : %.4lf\n", exp(nll_base));
+    printf("ln(PPL(Q)/PPL(base))  : %.6lf\n", nll - nll_base);
+    printf("====== KL divergence statistics ======\n");
+    printf("Mean    KLD           : %.6lf +/- %.6lf\n", kld, kld_err);
+    printf("Maximum KLD           : %.6lf\n", stats.max_kld);
+    printf("Same top token        : %.3lf +/- %.3lf %%\n", 100.0*p_same, 100.0*sqrt(p_same*(1.0 - p_same)/count));
+
+    return {{}, ppl, {}, {}};
+}
+
 static std::vector<float> hellaswag_evaluate_tokens(
     llama_context * ctx, std::vector<int> & tokens, int n_past, int n_batch, int n_vocab
 ) {
@@ -687,6 +1165,13 @@ int main(int argc, char ** argv) {
     }
 
     params.logits_all = true;
+
+    // when the batch can hold several contexts, evaluate that many chunks at once as parallel sequences
+    params.n_parallel = 1;
+    if (!params.hellaswag && params.ppl_stride <= 0) {
+        params.n_parallel = std::max(1, params.n_batch / params.n_ctx);
+        params.n_ctx *= params.n_parallel;
+    }
     params.n_batch = std::min(params.n_batch, params.n_ctx);
 
     if (params.ppl_stride > 0) {
@@ -721,9 +1206,9 @@ int main(int argc, char ** argv) {
     }
 
     const int n_ctx_train = llama_n_ctx_train(model);
-    if (params.n_ctx > n_ctx_train) {
+    if (params.n_ctx / params.n_parallel > n_ctx_train) {
         fprintf(stderr, "%s: warning: model was trained on only %d context tokens (%d specified)\n",
-                __func__, n_ctx_train, params.n_ctx);
+                __func__, n_ctx_train, params.n_ctx / params.n_parallel);
     }
 
     // print system information
@@ -735,6 +1220,8 @@ int main(int argc, char ** argv) {
     struct results_perplexity results;
     if (params.hellaswag) {
         hellaswag_score(ctx, params);
+    } else if (params.kl_divergence) {
+        results = kl_divergence(ctx, params);
     } else {
         results = perplexity(ctx, params);
     }
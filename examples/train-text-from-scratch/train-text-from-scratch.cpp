@@ -1185,25 +1185,19 @@ int main(int argc, char ** argv) {
     );
     ggml_allocr_free(alloc);
 
-    std::vector<llama_token> train_tokens;
-    std::vector<size_t> train_samples_begin;
-    std::vector<size_t> train_samples_size;
     printf("%s: tokenize training data\n", __func__);
-    tokenize_file(lctx,
+    struct train_tokenized_data * train_data = load_tokenized_data(lctx,
             params.common.fn_train_data,
+            params.common.use_token_cache ? params.common.fn_token_cache.c_str() : NULL,
             params.common.sample_start,
             params.common.include_sample_start,
             params.common.overlapping_samples,
-            n_tokens,
-            train_tokens,
-            train_samples_begin,
-            train_samples_size);
-    GGML_ASSERT(train_samples_begin.size() == train_samples_size.size());
+            n_tokens);
 
-    printf("%s: number of training tokens: %zu\n", __func__, train_tokens.size());
+    printf("%s: number of training tokens: %zu\n", __func__, train_data->n_tokens);
 
-    size_t shuffle_samples_hash = compute_samples_hash(params.common.fn_train_data, train_samples_begin.data(), train_samples_size.data(), train_samples_size.size());
-    const bool changed_train_data = (shuffle_samples_hash != train->shuffle_samples_hash) || (train->shuffle_sample_count != train_samples_size.size());
+    size_t shuffle_samples_hash = compute_samples_hash(params.common.fn_train_data, train_data->samples_begin, train_data->samples_size, train_data->n_samples);
+    const bool changed_train_data = (shuffle_samples_hash != train->shuffle_samples_hash) || (train->shuffle_sample_count != train_data->n_samples);
     if (changed_train_data) {
         printf("%s: train data seems to have changed. restarting shuffled epoch.\n", __func__);
     }
@@ -1212,24 +1206,24 @@ int main(int argc, char ** argv) {
     }
     if ((train->shuffle_rng_state_current == "") || changed_train_data || params.common.force_reshuffle) {
         train->shuffle_rng_state_current = mt19937_seed_to_state(params.common.seed);
-        train->shuffle_sample_count = train_samples_size.size();
+        train->shuffle_sample_count = train_data->n_samples;
         train->shuffle_next_sample = 0;
         train->shuffle_samples_hash = shuffle_samples_hash;
     }
     std::vector<size_t> train_shuffled_samples_offs;
     std::vector<size_t> train_shuffled_samples_begin;
     std::vector<size_t> train_shuffled_samples_size;
-    train_shuffled_samples_offs.resize(train_samples_begin.size());
-    train_shuffled_samples_begin.resize(train_samples_begin.size());
-    train_shuffled_samples_size.resize(train_samples_size.size());
+    train_shuffled_samples_offs.resize(train_data->n_samples);
+    train_shuffled_samples_begin.resize(train_data->n_samples);
+    train_shuffled_samples_size.resize(train_data->n_samples);
     train->shuffle_rng_state_next = shuffle_samples(
         train->shuffle_rng_state_current,
         train_shuffled_samples_offs.data(),
         train_shuffled_samples_begin.data(),
         train_shuffled_samples_size.data(),
-        train_samples_begin.data(),
-        train_samples_size.data(),
-        train_samples_size.size());
+        train_data->samples_begin,
+        train_data->samples_size,
+        train_data->n_samples);
     printf("%s: begin training\n", __func__);
 
     save_train_files_data save_data;
@@ -1247,14 +1241,14 @@ int main(int argc, char ** argv) {
     opt_cb_data.save_data              = &save_data;
     opt_cb_data.lctx                   = lctx;
     opt_cb_data.last_save_iter         = opt->iter;
-    opt_cb_data.tokens_data            = train_tokens.data();
-    opt_cb_data.tokens_size            = train_tokens.size();
-    opt_cb_data.samples_begin          = train_samples_begin.data();
-    opt_cb_data.samples_size           = train_samples_size.data();
+    opt_cb_data.tokens_data            = train_data->tokens;
+    opt_cb_data.tokens_size            = train_data->n_tokens;
+    opt_cb_data.samples_begin          = train_data->samples_begin;
+    opt_cb_data.samples_size           = train_data->samples_size;
     opt_cb_data.shuffled_samples_offs  = train_shuffled_samples_offs.data();
     opt_cb_data.shuffled_samples_begin = train_shuffled_samples_begin.data();
     opt_cb_data.shuffled_samples_size  = train_shuffled_samples_size.data();
-    opt_cb_data.samples_count          = train_samples_size.size();
+    opt_cb_data.samples_count          = train_data->n_samples;
     opt_cb_data.tokens_input           = tokens_input;
     opt_cb_data.target_probs           = target_probs;
     opt_cb_data.first_iter             = opt->iter;
@@ -1262,6 +1256,10 @@ int main(int argc, char ** argv) {
     opt_cb_data.iter_at_last_epoch     = -1;
     opt_cb_data.last_time              = ggml_time_ms();
     opt_cb_data.millis_per_iter        = 0.0;
+    opt_cb_data.loader                 = NULL;
+    if (params.common.n_prefetch_batches > 0) {
+        opt_cb_data.loader = init_train_batch_loader(&opt_cb_data, params.common.n_prefetch_batches);
+    }
 
     // measure required memory for work buffer
     size_t max_work_size = ggml_graph_plan(gb, params.common.n_threads).work_size + GGML_OBJECT_SIZE;
@@ -1279,6 +1277,10 @@ int main(int argc, char ** argv) {
 
     ggml_opt_resume_g(ctx_work, opt, loss, gf, gb, &train_opt_callback, (void *) &opt_cb_data);
 
+    if (opt_cb_data.loader) {
+        free_train_batch_loader(opt_cb_data.loader);
+    }
+
     ggml_free(ctx_work);
     ggml_free(ctx_compute);
     ggml_free(ctx_input);
@@ -1302,6 +1304,7 @@ int main(int argc, char ** argv) {
     }
 
     ggml_free(opt->ctx);
+    free_tokenized_data(train_data);
     free_train_state(train);
     ggml_free(model.ctx);
     llama_free(lctx);
@@ -31,6 +31,9 @@ extern "C"
 
     bool load_model(const load_model_inputs inputs)
     {
+        //adapter output is queued, make sure it is all on screen before python continues
+        struct log_flush_guard { ~log_flush_guard() { kcpp_log_flush(); } } flush_guard;
+
         std::string model = inputs.model_filename;
         lora_filename = inputs.lora_filename;
         lora_base = inputs.lora_base;
@@ -41,7 +44,7 @@ extern "C"
 
         if(forceversion!=0)
         {
-            printf("\nWARNING: FILE FORMAT FORCED TO VER %d\nIf incorrect, loading may fail or crash.\n",forceversion);
+            kcpp_log(KCPP_LOG_ALWAYS, "\nWARNING: FILE FORMAT FORCED TO VER %d\nIf incorrect, loading may fail or crash.\n",forceversion);
             file_format = (FileFormat)forceversion;
         }
 
@@ -62,7 +65,7 @@ extern "C"
 
         if(file_format==FileFormat::GPTJ_1 || file_format==FileFormat::GPTJ_2 || file_format==FileFormat::GPTJ_3 || file_format==FileFormat::GPTJ_4  || file_format==FileFormat::GPTJ_5)
         {
-            printf("\n---\nIdentified as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+            kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
             ModelLoadResult lr = gpttype_load_model(inputs, file_format, file_format_meta);
             if (lr == ModelLoadResult::RETRY_LOAD)
             {
@@ -71,14 +74,14 @@ extern "C"
                     //if we tried 1 first, then try 3 and lastly 2
                     //otherwise if we tried 3 first, then try 2
                     file_format = FileFormat::GPTJ_4;
-                    printf("\n---\nRetrying as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                    kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                     lr = gpttype_load_model(inputs, file_format, file_format_meta);
                 }
 
                 if (lr == ModelLoadResult::RETRY_LOAD)
                 {
                     file_format = FileFormat::GPTJ_3;
-                    printf("\n---\nRetrying as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                    kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                     lr = gpttype_load_model(inputs, file_format, file_format_meta);
                 }
 
@@ -86,7 +89,7 @@ extern "C"
                 if (lr == ModelLoadResult::RETRY_LOAD)
                 {
                     file_format = FileFormat::GPTJ_2;
-                    printf("\n---\nRetrying as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                    kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-J model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                     lr = gpttype_load_model(inputs, file_format, file_format_meta);
                 }
             }
@@ -102,18 +105,18 @@ extern "C"
         }
         else if(file_format==FileFormat::GPT2_1||file_format==FileFormat::GPT2_2||file_format==FileFormat::GPT2_3||file_format==FileFormat::GPT2_4)
         {
-            printf("\n---\nIdentified as GPT-2 model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+            kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as GPT-2 model: (ver %d)\nAttempting to Load...\n---\n", file_format);
             ModelLoadResult lr = gpttype_load_model(inputs, file_format, file_format_meta);
             if (lr == ModelLoadResult::RETRY_LOAD)
             {
                 file_format = FileFormat::GPT2_3;
-                printf("\n---\nRetrying as GPT-2 model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-2 model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                 lr = gpttype_load_model(inputs, file_format, file_format_meta);
             }
             if (lr == ModelLoadResult::RETRY_LOAD)
             {
                 file_format = FileFormat::GPT2_2;
-                printf("\n---\nRetrying as GPT-2 model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-2 model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                 lr = gpttype_load_model(inputs, file_format, file_format_meta);
             }
             if (lr == ModelLoadResult::FAIL || lr == ModelLoadResult::RETRY_LOAD)
@@ -127,27 +130,27 @@ extern "C"
         }
         else if(file_format==FileFormat::NEOX_1 || file_format==FileFormat::NEOX_2 || file_format==FileFormat::NEOX_3 || file_format==FileFormat::NEOX_4 || file_format==FileFormat::NEOX_5 || file_format==FileFormat::NEOX_6 || file_format==FileFormat::NEOX_7)
         {
-            printf("\n---\nIdentified as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+            kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
             ModelLoadResult lr = gpttype_load_model(inputs, file_format, file_format_meta);
             if (lr == ModelLoadResult::RETRY_LOAD)
             {
                 if(file_format==FileFormat::NEOX_2)
                 {
                     file_format = FileFormat::NEOX_3;
-                    printf("\n---\nRetrying as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                    kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                     lr = gpttype_load_model(inputs, file_format, file_format_meta);
                 }
                 else
                 {
                     file_format = FileFormat::NEOX_5;
-                    printf("\n---\nRetrying as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                    kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                     lr = gpttype_load_model(inputs, file_format, file_format_meta);
                 }
             }
             if (lr == ModelLoadResult::RETRY_LOAD)
             {
                 file_format = FileFormat::NEOX_1;
-                printf("\n---\nRetrying as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nRetrying as GPT-NEO-X model: (ver %d)\nAttempting to Load...\n---\n", file_format);
                 lr = gpttype_load_model(inputs, file_format, file_format_meta);
             }
             if (lr == ModelLoadResult::FAIL || lr == ModelLoadResult::RETRY_LOAD)
@@ -163,19 +166,23 @@ extern "C"
         {
             if(file_format==FileFormat::MPT_1)
             {
-                printf("\n---\nIdentified as MPT model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as MPT model: (ver %d)\nAttempting to Load...\n---\n", file_format);
             }
             else if(file_format==FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
             {
-                printf("\n---\nIdentified as RWKV model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as RWKV model: (ver %d)\nAttempting to Load...\n---\n", file_format);
             }
             else if(file_format==FileFormat::GGUF_FALCON)
             {
-                printf("\n---\nIdentified as FALCON model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as FALCON model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+            }
+            else if(file_format==FileFormat::GGUF_GENERIC)
+            {
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as GGUF model: (ver %d)\nAttempting to Load...\n---\n", file_format);
             }
             else
             {
-                printf("\n---\nIdentified as LLAMA model: (ver %d)\nAttempting to Load...\n---\n", file_format);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n---\nIdentified as LLAMA model: (ver %d)\nAttempting to Load...\n---\n", file_format);
             }
             ModelLoadResult lr = gpttype_load_model(inputs, file_format, file_format_meta);
             if (lr == ModelLoadResult::FAIL || lr == ModelLoadResult::RETRY_LOAD)
@@ -194,6 +201,40 @@ extern "C"
         return gpttype_generate(inputs, output);
     }
 
+    //same as generate, but the result stays in core memory, read it with get_output_view
+    int generate_buffered(const generation_inputs inputs)
+    {
+        return gpttype_generate_buffered(inputs);
+    }
+
+    //false while a generation is still running, the buffer is only handed out once nothing writes to it anymore
+    bool get_output_view(generation_output_view * view)
+    {
+        if(view==nullptr)
+        {
+            return false;
+        }
+        kcpp_output_buffer * buf = gpttype_acquire_output();
+        if(buf==nullptr)
+        {
+            return false;
+        }
+        view->status = buf->status;
+        view->text = buf->text.data();
+        view->text_len = buf->text.size();
+        view->token_meta = buf->token_meta.data();
+        view->token_meta_count = buf->token_meta.size();
+        view->top_logprobs = buf->top_logprobs.data();
+        view->n_probs = buf->n_probs;
+        view->handle = buf;
+        return true;
+    }
+
+    void release_output(void * handle)
+    {
+        gpttype_release_output((kcpp_output_buffer *)handle);
+    }
+
     const char* new_token(int idx) {
         if (generated_tokens.size() <= idx || idx < 0) return nullptr;
 
@@ -225,10 +266,19 @@ extern "C"
        return gpttype_get_pending_output().c_str();
     }
 
+    void set_log_level(int level) {
+        kcpp_log_set_level(level);
+    }
+
     bool abort_generate() {
         return gpttype_generate_abort();
     }
 
+    const char * token_to_text(int id)
+    {
+        return gpttype_token_to_text(id).c_str();
+    }
+
     int token_count(const char * input)
     {
         std::string inputstr = input;
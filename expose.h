@@ -3,6 +3,8 @@
 const int stop_token_max = 16;
 const int ban_token_max = 16;
 const int tensor_split_max = 16;
+const int logprobs_max = 20;
+const int beam_width_max = 8;
 // match kobold's sampler list and order
 enum samplers
 {
@@ -74,12 +76,40 @@ struct generation_inputs
     const bool stream_sse;
     const char * grammar;
     const bool grammar_retain_state;
+    const int n_probs = 0; //top alternatives with logprobs to record per token, 0 = off
+    const int beam_width = 0; //beams for deterministic beam search (gguf only), 0 or 1 = sample normally
 };
 struct generation_outputs
 {
     int status = -1;
     char text[24576]; //24kb should be enough for any response
 };
+//one record per generated token, offsets index into the output text
+struct generation_token_meta
+{
+    int token_id;
+    int text_offset;
+    int text_len;
+    float logprob; //of the chosen token, taken after the samplers and temperature (beam search: from the raw logits)
+};
+//n_probs of these follow each generated token, unused slots have token_id -1. same distribution as the chosen logprob
+struct generation_logprob
+{
+    int token_id;
+    float logprob;
+};
+//borrowed view of a finished generation, owned by the core until release_output(handle)
+struct generation_output_view
+{
+    int status = -1;
+    const char * text = nullptr;
+    int text_len = 0;
+    const generation_token_meta * token_meta = nullptr;
+    int token_meta_count = 0;
+    const generation_logprob * top_logprobs = nullptr; //token_meta_count * n_probs entries
+    int n_probs = 0;
+    void * handle = nullptr;
+};
 
 extern std::string executable_path;
 extern std::string lora_filename;
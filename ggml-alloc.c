@@ -28,7 +28,6 @@
 
 #define UNUSED(x) (void)(x)
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define GGML_MAX_CONCUR (2*GGML_MAX_NODES)
 
 //#define GGML_ALLOCATOR_DEBUG
 
@@ -39,6 +38,7 @@ struct hash_node {
     struct ggml_tensor * t;
     int n_children;
     int n_views;
+    int plan_buf; // planner buffer of the tensor (1-based), 0 if none
 };
 
 static size_t hash(void * p) {
@@ -78,6 +78,23 @@ struct free_block {
 };
 
 #define MAX_FREE_BLOCKS 256
+#define MAX_PLANS 8
+
+// a buffer of the planner: the memory of a tensor and of the tensors computed inplace on it
+struct plan_buffer {
+    size_t size;
+    size_t offset;
+    int start; // first and last step in which the buffer is live
+    int end;
+};
+
+struct ggml_allocr_plan {
+    uint64_t hash; // hash of the order in which the buffers are created and freed
+    size_t base;   // the buffers are placed after the tensors allocated before the graph
+    size_t size;
+    int n_buffers;
+    struct plan_buffer buffers[];
+};
 
 struct ggml_allocr {
     void * data;
@@ -90,6 +107,10 @@ struct ggml_allocr {
     bool measure;
     int parse_seq[GGML_MAX_CONCUR];
     int parse_seq_len;
+    bool use_planner;
+    size_t plan_peak;
+    struct ggml_allocr_plan * plans[MAX_PLANS];
+    int n_plans;
 
 #ifdef GGML_ALLOCATOR_DEBUG
     struct ggml_tensor * allocated_tensors[1024];
@@ -302,6 +323,10 @@ struct ggml_allocr * ggml_allocr_new(void * data, size_t size, size_t alignment)
         /*.measure       = */ false,
         /*.parse_seq     = */ {0},
         /*.parse_seq_len = */ 0,
+        /*.use_planner   = */ false,
+        /*.plan_peak     = */ 0,
+        /*.plans         = */ {NULL},
+        /*.n_plans       = */ 0,
 #ifdef GGML_ALLOCATOR_DEBUG
         /*.allocated_tensors = */ {0},
 #endif
@@ -382,6 +407,10 @@ struct ggml_allocr * ggml_allocr_new_measure(size_t alignment) {
         /*.measure       = */ true,
         /*.parse_seq     = */ {0},
         /*.parse_seq_len = */ 0,
+        /*.use_planner   = */ false,
+        /*.plan_peak     = */ 0,
+        /*.plans         = */ {NULL},
+        /*.n_plans       = */ 0,
 #ifdef GGML_ALLOCATOR_DEBUG
         /*.allocated_tensors = */ {0},
 #endif
@@ -396,6 +425,9 @@ void ggml_allocr_free(struct ggml_allocr * alloc) {
     if (alloc->measure) {
         free_measure_vmem(alloc->data, alloc->size);
     }
+    for (int i = 0; i < MAX_PLANS; i++) {
+        free(alloc->plans[i]);
+    }
     free(alloc);
 }
 
@@ -437,6 +469,7 @@ static bool ggml_op_can_inplace(enum ggml_op op) {
         case GGML_OP_ROPE:
         case GGML_OP_RMS_NORM:
         case GGML_OP_SOFT_MAX:
+        case GGML_OP_SOFT_MAX_EXT:
         case GGML_OP_CONT:
             return true;
 
@@ -630,7 +663,430 @@ static size_t ggml_allocr_alloc_graph_tensors_n(
     return alloc->max_size;
 }
 
+//////////// offline planner
+
+// with the planner enabled, ggml_allocr_alloc_graph first walks the whole graph to find the steps in which every buffer
+// is live, following the same rules as above for inplace ops, views and parse_seq barriers
+// then the buffers are placed by decreasing size, each one in the smallest gap left by the buffers that are live at the same time
+// the result only depends on the order in which the buffers are created and freed, so the plans are cached and reused for
+// graphs with the same structure as long as all the buffers still fit in their slots
+
+struct plan_state {
+    struct plan_buffer * buffers;
+    int n_buffers;
+    uint64_t hash;
+};
+
+static void plan_hash(struct plan_state * st, int a, int b, int c) {
+    // FNV-1a
+    const int v[3] = { a, b, c };
+    const uint8_t * p = (const uint8_t *)v;
+    for (size_t i = 0; i < sizeof(v); i++) {
+        st->hash ^= p[i];
+        st->hash *= 0x100000001b3ULL;
+    }
+}
+
+static void plan_node(struct ggml_allocr * alloc, struct plan_state * st, struct ggml_tensor * node, int step, int ind, int slot) {
+    struct hash_node * ht = alloc->hash_table;
+    struct hash_node * hn = hash_get(ht, node);
+    if (node->data != NULL || hn->plan_buf != 0 || ggml_is_view(node)) {
+        // already allocated, or a view that will get its data from view_src
+        return;
+    }
+    // see if we can reuse a parent's buffer (inplace)
+    if (ggml_op_can_inplace(node->op)) {
+        for (int i = 0; i < GGML_MAX_SRC; i++) {
+            struct ggml_tensor * parent = node->src[i];
+            if (parent == NULL) {
+                break;
+            }
+            struct hash_node * p_hn = hash_get(ht, parent);
+            if (p_hn->n_children != 1 || p_hn->n_views != 0 || !ggml_are_same_layout(node, parent)) {
+                continue;
+            }
+            int buf = p_hn->plan_buf;
+            if (ggml_is_view(parent)) {
+                struct hash_node * view_src_hn = hash_get(ht, parent->view_src);
+                buf = view_src_hn->n_views == 1 && view_src_hn->n_children == 0 && parent->view_offs == 0 ? view_src_hn->plan_buf : 0;
+            }
+            // buffers allocated before the graph are not reused
+            if (buf != 0) {
+                hn->plan_buf = buf;
+                plan_hash(st, 2, ind, buf);
+                return;
+            }
+        }
+    }
+    struct plan_buffer * b = &st->buffers[st->n_buffers++];
+    b->size   = aligned_offset(NULL, ggml_allocr_get_alloc_size(alloc, node), alloc->alignment);
+    b->offset = 0;
+    b->start  = step;
+    b->end    = -1;
+    hn->plan_buf = st->n_buffers;
+    plan_hash(st, 1, ind, slot);
+}
+
+static void plan_free(struct ggml_allocr * alloc, struct plan_state * st, struct ggml_tensor * tensor, int step, int ind) {
+    int buf = hash_get(alloc->hash_table, tensor)->plan_buf;
+    if (buf == 0) {
+        // not allocated by the planner
+        return;
+    }
+    st->buffers[buf - 1].end = step;
+    plan_hash(st, 3, ind, buf);
+}
+
+// returns the number of steps of the graph
+static int ggml_allocr_plan_lifetimes(struct ggml_allocr * alloc, struct ggml_cgraph * gf, struct plan_state * st) {
+    struct hash_node * ht = alloc->hash_table;
+    memset(ht, 0, sizeof(struct hash_node) * GGML_GRAPH_HASHTABLE_SIZE);
+
+    // count number of children and views
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        if (ggml_is_view(node)) {
+            hash_get(ht, node->view_src)->n_views += 1;
+        }
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            struct ggml_tensor * parent = node->src[j];
+            if (parent == NULL) {
+                break;
+            }
+            hash_get(ht, parent)->n_children += 1;
+        }
+    }
+
+    st->n_buffers = 0;
+    st->hash = 0xcbf29ce484222325ULL;
+    plan_hash(st, 0, gf->n_nodes, alloc->parse_seq_len);
+
+    // without parse_seq every node is a step, with parse_seq the steps are delimited by the barriers
+    int step = 0;
+    int last_barrier_pos = 0;
+    int n_nodes = alloc->parse_seq_len ? alloc->parse_seq_len : gf->n_nodes;
+
+    for (int ind = 0; ind < n_nodes; ind++) {
+        if ((alloc->parse_seq_len == 0) || alloc->parse_seq[ind] != -1) {
+            int i = alloc->parse_seq_len ? alloc->parse_seq[ind] : ind;
+            struct ggml_tensor * node = gf->nodes[i];
+
+            for (int j = 0; j < GGML_MAX_SRC; j++) {
+                struct ggml_tensor * parent = node->src[j];
+                if (parent == NULL) {
+                    break;
+                }
+                plan_node(alloc, st, parent, step, ind, j);
+            }
+            plan_node(alloc, st, node, step, ind, -1);
+        }
+
+        if ((alloc->parse_seq_len == 0) || alloc->parse_seq[ind] == -1) {
+            int update_start = alloc->parse_seq_len ? last_barrier_pos : ind;
+            int update_end   = alloc->parse_seq_len ? ind              : ind + 1;
+            for (int i = update_start; i < update_end; i++) {
+                int node_i = alloc->parse_seq_len ? alloc->parse_seq[i] : i;
+                struct ggml_tensor * node = gf->nodes[node_i];
+                int node_buf = hash_get(ht, node)->plan_buf;
+
+                for (int j = 0; j < GGML_MAX_SRC; j++) {
+                    struct ggml_tensor * parent = node->src[j];
+                    if (parent == NULL) {
+                        break;
+                    }
+                    struct hash_node * p_hn = hash_get(ht, parent);
+                    p_hn->n_children -= 1;
+
+                    if (p_hn->n_children == 0 && p_hn->n_views == 0) {
+                        if (ggml_is_view(parent)) {
+                            struct ggml_tensor * view_src = parent->view_src;
+                            struct hash_node * view_src_hn = hash_get(ht, view_src);
+                            view_src_hn->n_views -= 1;
+                            if (view_src_hn->n_views == 0 && view_src_hn->n_children == 0 && view_src_hn->plan_buf != node_buf) {
+                                plan_free(alloc, st, view_src, step, ind);
+                            }
+                        }
+                        else if (p_hn->plan_buf != node_buf) {
+                            plan_free(alloc, st, parent, step, ind);
+                        }
+                    }
+                }
+            }
+            if (alloc->parse_seq_len) {
+                last_barrier_pos = ind + 1;
+                plan_hash(st, 4, ind, 0);
+            }
+            step++;
+        }
+    }
+
+    // buffers that are never freed stay live until the end of the graph
+    int n_steps = MAX(step, 1);
+    for (int i = 0; i < st->n_buffers; i++) {
+        if (st->buffers[i].end < 0) {
+            st->buffers[i].end = n_steps - 1;
+        }
+    }
+
+    return n_steps;
+}
+
+static int plan_buffer_cmp(const void * a, const void * b) {
+    const struct plan_buffer * ba = *(struct plan_buffer * const *)a;
+    const struct plan_buffer * bb = *(struct plan_buffer * const *)b;
+    if (ba->size != bb->size) {
+        return ba->size > bb->size ? -1 : 1;
+    }
+    if (ba->start != bb->start) {
+        return ba->start < bb->start ? -1 : 1;
+    }
+    return ba < bb ? -1 : (ba > bb);
+}
+
+// best-fit-decreasing placement of the buffers after base, returns the end of the highest buffer
+static size_t ggml_allocr_plan_place(struct plan_buffer * buffers, int n_buffers, size_t base) {
+    struct plan_buffer ** order = malloc(sizeof(struct plan_buffer *) * 2 * MAX(n_buffers, 1));
+    struct plan_buffer ** live  = order + n_buffers;
+
+    for (int i = 0; i < n_buffers; i++) {
+        order[i] = &buffers[i];
+    }
+    qsort(order, n_buffers, sizeof(struct plan_buffer *), plan_buffer_cmp);
+
+    size_t end = base;
+    for (int i = 0; i < n_buffers; i++) {
+        struct plan_buffer * b = order[i];
+
+        // the buffers placed so far that are live at the same time as b, sorted by offset
+        int n_live = 0;
+        for (int j = 0; j < i; j++) {
+            struct plan_buffer * p = order[j];
+            if (p->start <= b->end && b->start <= p->end) {
+                int k = n_live++;
+                while (k > 0 && live[k - 1]->offset > p->offset) {
+                    live[k] = live[k - 1];
+                    k--;
+                }
+                live[k] = p;
+            }
+        }
+
+        // smallest gap that fits, or on top of the live buffers
+        size_t best_offset = SIZE_MAX;
+        size_t best_gap    = SIZE_MAX;
+        size_t cur         = base;
+        for (int k = 0; k < n_live; k++) {
+            if (live[k]->offset >= cur) {
+                size_t gap = live[k]->offset - cur;
+                if (gap >= b->size && gap < best_gap) {
+                    best_gap    = gap;
+                    best_offset = cur;
+                }
+            }
+            cur = MAX(cur, live[k]->offset + live[k]->size);
+        }
+        b->offset = best_offset != SIZE_MAX ? best_offset : cur;
+        end = MAX(end, b->offset + b->size);
+    }
+
+    free(order);
+
+    return end;
+}
+
+// total size of the buffers that are live at the same time, at the busiest step
+static size_t ggml_allocr_plan_peak_size(const struct plan_buffer * buffers, int n_buffers, int n_steps) {
+    size_t * live = calloc(2 * (size_t)n_steps, sizeof(size_t));
+    for (int i = 0; i < n_buffers; i++) {
+        live[buffers[i].start]          += buffers[i].size;
+        live[n_steps + buffers[i].end]  += buffers[i].size;
+    }
+    size_t cur  = 0;
+    size_t peak = 0;
+    for (int s = 0; s < n_steps; s++) {
+        cur += live[s];
+        peak = MAX(peak, cur);
+        cur -= live[n_steps + s];
+    }
+    free(live);
+    return peak;
+}
+
+static size_t round_up_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+static struct ggml_allocr_plan * ggml_allocr_plan_new(const struct plan_state * st, size_t fixed_end, bool round_up, struct ggml_allocr * alloc) {
+    struct ggml_allocr_plan * plan = malloc(sizeof(struct ggml_allocr_plan) + sizeof(struct plan_buffer) * st->n_buffers);
+    plan->hash      = st->hash;
+    plan->n_buffers = st->n_buffers;
+    memcpy(plan->buffers, st->buffers, sizeof(struct plan_buffer) * st->n_buffers);
+    if (round_up) {
+        // leave room for the buffers to grow, so that the plan can be reused while the graph grows (eg. with the KV cache)
+        fixed_end = round_up_pow2(fixed_end);
+        for (int i = 0; i < plan->n_buffers; i++) {
+            plan->buffers[i].size = round_up_pow2(plan->buffers[i].size);
+        }
+    }
+    plan->base = aligned_offset(alloc->data, fixed_end, alloc->alignment);
+    plan->size = ggml_allocr_plan_place(plan->buffers, plan->n_buffers, plan->base);
+    return plan;
+}
+
+static bool ggml_allocr_plan_fits(const struct ggml_allocr_plan * plan, const struct plan_state * st, size_t base) {
+    if (plan->hash != st->hash || plan->n_buffers != st->n_buffers || plan->base < base) {
+        return false;
+    }
+    for (int i = 0; i < plan->n_buffers; i++) {
+        if (plan->buffers[i].size < st->buffers[i].size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ggml_allocr_plan_apply(struct ggml_allocr * alloc, const struct ggml_allocr_plan * plan, struct ggml_tensor * tensor) {
+    if (tensor->data != NULL) {
+        return;
+    }
+    if (ggml_is_view(tensor)) {
+        assert(tensor->view_src->data != NULL);
+        tensor->data = (char *)tensor->view_src->data + tensor->view_offs;
+    } else {
+        int buf = hash_get(alloc->hash_table, tensor)->plan_buf;
+        GGML_ASSERT(buf != 0);
+        tensor->data = (char *)alloc->data + plan->buffers[buf - 1].offset;
+    }
+}
+
+// returns false if the graph does not fit in the buffer, in which case nothing is allocated
+static bool ggml_allocr_plan_graph(struct ggml_allocr * alloc, struct ggml_cgraph * gf) {
+    // the tensors allocated with ggml_allocr_alloc since the last reset are kept where they are
+    size_t fixed_end = alloc->size;
+    if (alloc->n_free_blocks > 0) {
+        fixed_end = (char *)alloc->free_blocks[alloc->n_free_blocks - 1].addr - (char *)alloc->data;
+    }
+    size_t base = aligned_offset(alloc->data, fixed_end, alloc->alignment);
+
+    struct plan_state st;
+    st.buffers = malloc(sizeof(struct plan_buffer) * MAX(gf->n_nodes + gf->n_leafs, 1));
+    int n_steps = ggml_allocr_plan_lifetimes(alloc, gf, &st);
+
+    alloc->plan_peak = base + ggml_allocr_plan_peak_size(st.buffers, st.n_buffers, n_steps);
+
+    struct ggml_allocr_plan * plan = NULL;
+    int slot = -1;
+    for (int i = 0; i < MAX_PLANS; i++) {
+        if (alloc->plans[i] != NULL && alloc->plans[i]->hash == st.hash) {
+            slot = i;
+            if (ggml_allocr_plan_fits(alloc->plans[i], &st, base)) {
+                plan = alloc->plans[i];
+            }
+            break;
+        }
+    }
+
+    if (plan == NULL) {
+        // the measure buffer is sized for the exact plan, otherwise try first with some room to grow
+        plan = ggml_allocr_plan_new(&st, fixed_end, !alloc->measure, alloc);
+        if (plan->size > alloc->size) {
+            free(plan);
+            plan = ggml_allocr_plan_new(&st, fixed_end, false, alloc);
+        }
+        if (plan->size > alloc->size) {
+            AT_PRINTF("%s: planned %zu bytes, but the buffer only has %zu\n", __func__, plan->size, alloc->size);
+            free(plan);
+            free(st.buffers);
+            return false;
+        }
+        if (slot < 0) {
+            slot = alloc->n_plans;
+            alloc->n_plans = (alloc->n_plans + 1) % MAX_PLANS;
+        }
+        free(alloc->plans[slot]);
+        alloc->plans[slot] = plan;
+        AT_PRINTF("%s: new plan with %d buffers: %zu bytes, peak %zu bytes\n", __func__, st.n_buffers, plan->size, alloc->plan_peak);
+    }
+
+    int n_nodes = alloc->parse_seq_len ? alloc->parse_seq_len : gf->n_nodes;
+    for (int ind = 0; ind < n_nodes; ind++) {
+        int i = alloc->parse_seq_len ? alloc->parse_seq[ind] : ind;
+        if (i < 0) {
+            continue;
+        }
+        struct ggml_tensor * node = gf->nodes[i];
+        for (int j = 0; j < GGML_MAX_SRC && node->src[j] != NULL; j++) {
+            ggml_allocr_plan_apply(alloc, plan, node->src[j]);
+        }
+        ggml_allocr_plan_apply(alloc, plan, node);
+    }
+
+    // the memory of the graph is in use until the next reset
+    alloc->n_free_blocks = 1;
+    alloc->free_blocks[0].addr = (char *)alloc->data + plan->size;
+    alloc->free_blocks[0].size = alloc->size - plan->size;
+    alloc->max_size = MAX(alloc->max_size, plan->size);
+
+    free(st.buffers);
+
+    return true;
+}
+
+void ggml_allocr_set_planner(struct ggml_allocr * alloc, bool enable) {
+    alloc->use_planner = enable;
+}
+
+size_t ggml_allocr_plan_peak(struct ggml_allocr * alloc) {
+    return alloc->plan_peak;
+}
+
+// runs the greedy allocator on the graph only to measure it, and leaves the tensors unallocated
+static void ggml_allocr_measure_greedy(struct ggml_allocr * alloc, struct ggml_cgraph * gf) {
+    GGML_ASSERT(alloc->measure);
+
+    struct ggml_tensor ** unallocated = malloc(sizeof(struct ggml_tensor *) * MAX(gf->n_nodes + gf->n_leafs, 1));
+    int n_unallocated = 0;
+    for (int i = 0; i < gf->n_nodes; i++) {
+        if (gf->nodes[i]->data == NULL) {
+            unallocated[n_unallocated++] = gf->nodes[i];
+        }
+    }
+    for (int i = 0; i < gf->n_leafs; i++) {
+        if (gf->leafs[i]->data == NULL) {
+            unallocated[n_unallocated++] = gf->leafs[i];
+        }
+    }
+
+    int n_free_blocks = alloc->n_free_blocks;
+    struct free_block free_blocks[MAX_FREE_BLOCKS];
+    memcpy(free_blocks, alloc->free_blocks, sizeof(struct free_block) * n_free_blocks);
+
+    ggml_allocr_alloc_graph_tensors_n(alloc, &gf, 1, NULL, NULL);
+
+    for (int i = 0; i < n_unallocated; i++) {
+        unallocated[i]->data = NULL;
+    }
+    alloc->n_free_blocks = n_free_blocks;
+    memcpy(alloc->free_blocks, free_blocks, sizeof(struct free_block) * n_free_blocks);
+
+    free(unallocated);
+}
+
 size_t ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * graph) {
+    if (alloc->use_planner && alloc->measure) {
+        // best-fit-decreasing is not monotonic, a smaller graph can need more than the measured plan and fall back to
+        // the greedy allocator, so the measured size also covers the greedy allocation
+        ggml_allocr_measure_greedy(alloc, graph);
+    }
+    if (alloc->use_planner && ggml_allocr_plan_graph(alloc, graph)) {
+        return alloc->max_size;
+    }
     return ggml_allocr_alloc_graph_tensors_n(alloc, &graph, 1, NULL, NULL);
 }
 
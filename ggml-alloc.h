@@ -14,6 +14,14 @@ GGML_API struct ggml_allocr * ggml_allocr_new_measure(size_t alignment);
 // you should call this if your graph are optimized to execute out-of-order
 GGML_API void   ggml_allocr_set_parse_seq(struct ggml_allocr * alloc, const int * list, int n);
 
+// plan the memory of the whole graph from the lifetimes of its tensors before allocating it, instead of allocating the
+// tensors one by one as the graph is parsed. plans are cached and reused for graphs with the same structure
+// the tensors allocated with ggml_allocr_alloc after the last reset must be the graph inputs
+// graphs that do not fit their plan are allocated greedily, so a measure allocator measures both and returns the larger
+GGML_API void   ggml_allocr_set_planner(struct ggml_allocr * alloc, bool enable);
+// total size of the tensors that are live at the same time in the last planned graph, a lower bound for its buffer size
+GGML_API size_t ggml_allocr_plan_peak(struct ggml_allocr * alloc);
+
 GGML_API void   ggml_allocr_free(struct ggml_allocr * alloc);
 GGML_API bool   ggml_allocr_is_measure(struct ggml_allocr * alloc);
 GGML_API void   ggml_allocr_reset(struct ggml_allocr * alloc);
@@ -23,8 +23,6 @@
 
 #define UNUSED(x) (void)(x)
 
-#define GGML_MAX_CONCUR (2*GGML_MAX_NODES)
-
 struct ggml_metal_buffer {
     const char * name;
 
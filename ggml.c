@@ -135,6 +135,7 @@ typedef void * thread_ret_t;
 // #define GGML_FLASH_ATTN_EXP_FP16
 
 #define GGML_SOFT_MAX_UNROLL 4
+#define GGML_SOFT_MAX_BLOCK  (16*1024) // mask elements kept in the cache by soft_max_ext
 #define GGML_VEC_DOT_UNROLL  2
 #define GGML_VEC_MAD_UNROLL  32
 
@@ -509,7 +510,15 @@ ggml_fp16_t ggml_fp32_to_fp16(float x) {
 }
 
 void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, int n) {
-    for (int i = 0; i < n; i++) {
+    int i = 0;
+#if defined(__F16C__)
+    for (; i + 7 < n; i += 8) {
+        __m128i x_vec = _mm_loadu_si128((const __m128i *)(x + i));
+        __m256 y_vec = _mm256_cvtph_ps(x_vec);
+        _mm256_storeu_ps(y + i, y_vec);
+    }
+#endif
+    for (; i < n; i++) {
         y[i] = GGML_FP16_TO_FP32(x[i]);
     }
 }
@@ -3973,6 +3982,159 @@ inline static void ggml_vec_argmax_f32(const int n, int * s, const float * x) {
     *s = idx;
 }
 
+// exp(x) for soft_max: x = n*ln2 + b, exp(b) is a polynomial and 2^n goes straight into the exponent
+// the relative error is below 3e-7, the fp16 table_exp_f16 lookup is off by up to 2.5e-3 for x > -8
+// -INFINITY gives 0, as expected for the masked scores
+
+#if defined(__AVX512F__)
+
+inline static __m512 ggml_v_expf(__m512 x) {
+    const __m512 r = _mm512_set1_ps(0x1.8p23f);
+    const __m512 z = _mm512_fmadd_ps(x, _mm512_set1_ps(0x1.715476p+0f), r);
+    const __m512 n = _mm512_sub_ps(z, r);
+    const __m512 b = _mm512_fnmadd_ps(n, _mm512_set1_ps(0x1.7f7d1cp-20f),
+                     _mm512_fnmadd_ps(n, _mm512_set1_ps(0x1.62e4p-1f), x));
+    const __mmask16 d = _mm512_cmp_ps_mask(_mm512_abs_ps(n), _mm512_set1_ps(192), _CMP_GT_OQ);
+    const __m512 u = _mm512_mul_ps(b, b);
+    const __m512 j = _mm512_fmadd_ps(
+            _mm512_fmadd_ps(_mm512_fmadd_ps(_mm512_set1_ps(0x1.0e4020p-7f), b, _mm512_set1_ps(0x1.573e2ep-5f)), u,
+                            _mm512_fmadd_ps(_mm512_set1_ps(0x1.555e66p-3f), b, _mm512_set1_ps(0x1.fffdb6p-2f))), u,
+            _mm512_fmadd_ps(_mm512_set1_ps(0x1.ffffecp-1f), b, _mm512_set1_ps(1.0f)));
+    const __m512 res = _mm512_scalef_ps(j, n);
+    if (_mm512_kortestz(d, d)) {
+        return res;
+    }
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 alt  = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(n, zero, _CMP_LE_OQ), _mm512_set1_ps(INFINITY), zero);
+    return _mm512_mask_blend_ps(d, res, alt);
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+inline static __m256 ggml_v_expf(__m256 x) {
+    const __m256 r = _mm256_set1_ps(0x1.8p23f);
+    const __m256 z = _mm256_fmadd_ps(x, _mm256_set1_ps(0x1.715476p+0f), r);
+    const __m256 n = _mm256_sub_ps(z, r);
+    const __m256 b = _mm256_fnmadd_ps(n, _mm256_set1_ps(0x1.7f7d1cp-20f),
+                     _mm256_fnmadd_ps(n, _mm256_set1_ps(0x1.62e4p-1f), x));
+    const __m256i e = _mm256_slli_epi32(_mm256_castps_si256(z), 23);
+    const __m256  k = _mm256_castsi256_ps(_mm256_add_epi32(e, _mm256_castps_si256(_mm256_set1_ps(1))));
+    const __m256i c = _mm256_castps_si256(_mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), n), _mm256_set1_ps(126), _CMP_GT_OQ));
+    const __m256 u = _mm256_mul_ps(b, b);
+    const __m256 j = _mm256_fmadd_ps(
+            _mm256_fmadd_ps(_mm256_fmadd_ps(_mm256_set1_ps(0x1.0e4020p-7f), b, _mm256_set1_ps(0x1.573e2ep-5f)), u,
+                            _mm256_fmadd_ps(_mm256_set1_ps(0x1.555e66p-3f), b, _mm256_set1_ps(0x1.fffdb6p-2f))), u,
+            _mm256_mul_ps(_mm256_set1_ps(0x1.ffffecp-1f), b));
+    if (!_mm256_movemask_ps(_mm256_castsi256_ps(c))) {
+        return _mm256_fmadd_ps(j, k, k);
+    }
+    // |n| > 126: scale in two steps to avoid overflowing the exponent, |n| > 192: 0 or inf
+    const __m256i g  = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(n, _mm256_setzero_ps(), _CMP_LE_OQ)), _mm256_set1_epi32(0x82000000u));
+    const __m256  s1 = _mm256_castsi256_ps(_mm256_add_epi32(g, _mm256_set1_epi32(0x7f000000u)));
+    const __m256  s2 = _mm256_castsi256_ps(_mm256_sub_epi32(e, g));
+    const __m256i d  = _mm256_castps_si256(_mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), n), _mm256_set1_ps(192), _CMP_GT_OQ));
+    return _mm256_or_ps(
+            _mm256_and_ps(_mm256_castsi256_ps(d), _mm256_mul_ps(s1, s1)),
+            _mm256_andnot_ps(_mm256_castsi256_ps(d),
+                _mm256_or_ps(
+                    _mm256_and_ps(_mm256_castsi256_ps(c), _mm256_mul_ps(_mm256_fmadd_ps(s2, j, s2), s1)),
+                    _mm256_andnot_ps(_mm256_castsi256_ps(c), _mm256_fmadd_ps(k, j, k)))));
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+inline static float32x4_t ggml_v_expf(float32x4_t x) {
+    const float32x4_t r = vdupq_n_f32(0x1.8p23f);
+    const float32x4_t z = vfmaq_f32(r, x, vdupq_n_f32(0x1.715476p+0f));
+    const float32x4_t n = vsubq_f32(z, r);
+    const float32x4_t b = vfmsq_f32(vfmsq_f32(x, n, vdupq_n_f32(0x1.62e4p-1f)), n, vdupq_n_f32(0x1.7f7d1cp-20f));
+    const uint32x4_t  e = vshlq_n_u32(vreinterpretq_u32_f32(z), 23);
+    const float32x4_t k = vreinterpretq_f32_u32(vaddq_u32(e, vreinterpretq_u32_f32(vdupq_n_f32(1))));
+    const uint32x4_t  c = vcagtq_f32(n, vdupq_n_f32(126));
+    const float32x4_t u = vmulq_f32(b, b);
+    const float32x4_t j = vfmaq_f32(
+            vmulq_f32(vdupq_n_f32(0x1.ffffecp-1f), b),
+            vfmaq_f32(vfmaq_f32(vdupq_n_f32(0x1.fffdb6p-2f), vdupq_n_f32(0x1.555e66p-3f), b),
+                      vfmaq_f32(vdupq_n_f32(0x1.573e2ep-5f), vdupq_n_f32(0x1.0e4020p-7f), b), u), u);
+    if (!vpaddd_u64(vreinterpretq_u64_u32(c))) {
+        return vfmaq_f32(k, j, k);
+    }
+    // |n| > 126: scale in two steps to avoid overflowing the exponent, |n| > 192: 0 or inf
+    const uint32x4_t  d  = vandq_u32(vclezq_f32(n), vdupq_n_u32(0x82000000));
+    const float32x4_t s1 = vreinterpretq_f32_u32(vaddq_u32(d, vdupq_n_u32(0x7f000000)));
+    const float32x4_t s2 = vreinterpretq_f32_u32(vsubq_u32(e, d));
+    return vbslq_f32(vcagtq_f32(n, vdupq_n_f32(192)), vmulq_f32(s1, s1),
+                     vbslq_f32(c, vmulq_f32(vfmaq_f32(s2, s2, j), s1), vfmaq_f32(k, k, j)));
+}
+
+#endif
+
+// y[i] = exp(x[i] - max), returns the sum of y
+// values below 2^-24 are flushed to 0 like with the fp16 table: since max gives exp(0) = 1, they are below float
+// precision relative to the sum, and the ops that read y skip the zeros (and would be slowed down by subnormals)
+inline static ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max) {
+    int i = 0;
+    ggml_float sum = 0.0;
+    // the sum is accumulated in double precision, in vectors to keep it off the critical path
+#if defined(__AVX512F__)
+    __m512d sum0 = _mm512_setzero_pd();
+    __m512d sum1 = _mm512_setzero_pd();
+    for (; i + 15 < n; i += 16) {
+        __m512 val = ggml_v_expf(_mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_set1_ps(max)));
+        val = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(val, _mm512_set1_ps(0x1p-24f), _CMP_GE_OQ), val);
+        _mm512_storeu_ps(y + i, val);
+        sum0 = _mm512_add_pd(sum0, _mm512_cvtps_pd(_mm512_castps512_ps256(val)));
+        sum1 = _mm512_add_pd(sum1, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(val), 1))));
+    }
+    sum += _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    for (; i + 7 < n; i += 8) {
+        __m256 val = ggml_v_expf(_mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(max)));
+        val = _mm256_and_ps(val, _mm256_cmp_ps(val, _mm256_set1_ps(0x1p-24f), _CMP_GE_OQ));
+        _mm256_storeu_ps(y + i, val);
+        sum0 = _mm256_add_pd(sum0, _mm256_cvtps_pd(_mm256_castps256_ps128(val)));
+        sum1 = _mm256_add_pd(sum1, _mm256_cvtps_pd(_mm256_extractf128_ps(val, 1)));
+    }
+    sum0 = _mm256_add_pd(sum0, sum1);
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum0), _mm256_extractf128_pd(sum0, 1));
+    sum += _mm_cvtsd_f64(_mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2)));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float64x2_t sum0 = vdupq_n_f64(0.0);
+    float64x2_t sum1 = vdupq_n_f64(0.0);
+    for (; i + 3 < n; i += 4) {
+        float32x4_t val = ggml_v_expf(vsubq_f32(vld1q_f32(x + i), vdupq_n_f32(max)));
+        val = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(val), vcgeq_f32(val, vdupq_n_f32(0x1p-24f))));
+        vst1q_f32(y + i, val);
+        sum0 = vaddq_f64(sum0, vcvt_f64_f32(vget_low_f32(val)));
+        sum1 = vaddq_f64(sum1, vcvt_high_f64_f32(val));
+    }
+    sum += vaddvq_f64(vaddq_f64(sum0, sum1));
+#else
+    // without a vector exp the fp16 table lookup is still much faster than expf per element
+    uint16_t scvt;
+    for (; i < n; ++i) {
+        if (x[i] == -INFINITY) {
+            y[i] = 0.0f;
+            continue;
+        }
+        ggml_fp16_t s = GGML_FP32_TO_FP16(x[i] - max);
+        memcpy(&scvt, &s, sizeof(scvt));
+        const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+        sum += (ggml_float)val;
+        y[i] = val;
+    }
+#endif
+    for (; i < n; ++i) {
+        float val = expf(x[i] - max);
+        val = val < 0x1p-24f ? 0.0f : val;
+        sum += (ggml_float)val;
+        y[i] = val;
+    }
+    return sum;
+}
+
 //
 // data types
 //
@@ -4020,6 +4182,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
     "SOFT_MAX",
+    "SOFT_MAX_EXT",
     "SOFT_MAX_BACK",
     "ROPE",
     "ROPE_BACK",
@@ -4035,6 +4198,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "FLASH_ATTN",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
+    "ATTN_V",
     "WIN_PART",
     "WIN_UNPART",
     "GET_REL_POS",
@@ -4057,7 +4221,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 70, "GGML_OP_COUNT != 70");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -4102,6 +4266,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
     "soft_max(x)",
+    "soft_max_ext(x)",
     "soft_max_back(x)",
     "rope(x)",
     "rope_back(x)",
@@ -4117,6 +4282,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "flash_attn(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
+    "attn_v(x,y)",
     "win_part(x)",
     "win_unpart(x)",
     "get_rel_pos(x)",
@@ -4139,7 +4305,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 70, "GGML_OP_COUNT != 70");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -7210,6 +7376,67 @@ struct ggml_tensor * ggml_soft_max_inplace(
     return ggml_soft_max_impl(ctx, a, true);
 }
 
+// ggml_soft_max_ext
+
+struct ggml_tensor * ggml_soft_max_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * mask,
+        struct ggml_tensor  * slopes,
+        struct ggml_tensor  * pos,
+        float                 scale,
+        int                   n_past) {
+    GGML_ASSERT(ggml_is_contiguous(a));
+    GGML_ASSERT(a->type == GGML_TYPE_F32);
+    if (mask) {
+        GGML_ASSERT(ggml_is_contiguous(mask));
+        GGML_ASSERT(mask->type == GGML_TYPE_F32);
+        GGML_ASSERT(mask->ne[0] == a->ne[0]);
+        GGML_ASSERT(mask->ne[1] >= a->ne[1]);
+    }
+    if (slopes) {
+        GGML_ASSERT(slopes->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_nelements(slopes) >= a->ne[2]);
+    }
+    if (pos) {
+        GGML_ASSERT(pos->type == GGML_TYPE_I32);
+        GGML_ASSERT(ggml_nelements(pos) >= a->ne[0]);
+    }
+
+    bool is_node = false;
+
+    if (a->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    float params[] = { scale, 0.0f };
+    memcpy(params + 1, &n_past, sizeof(int32_t));
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op     = GGML_OP_SOFT_MAX_EXT;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = mask;
+    result->src[2] = slopes;
+    result->src[3] = pos;
+
+    return result;
+}
+
+void ggml_alibi_slopes(int n_head, float max_bias, float * slopes) {
+    const int n_heads_log2_floor = 1 << (int) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias) / n_heads_log2_floor);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_heads_log2_floor);
+
+    for (int k = 0; k < n_head; k++) {
+        slopes[k] = k < n_heads_log2_floor ? powf(m0, k + 1) : powf(m1, 2*(k - n_heads_log2_floor) + 1);
+    }
+}
+
 
 // ggml_soft_max_back
 
@@ -7841,6 +8068,33 @@ struct ggml_tensor * ggml_flash_attn_back(
     return result;
 }
 
+// ggml_attn_v
+
+struct ggml_tensor * ggml_attn_v(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * kq) {
+    GGML_ASSERT(v->type == GGML_TYPE_F16 || v->type == GGML_TYPE_F32);
+    GGML_ASSERT(kq->type == GGML_TYPE_F32);
+    GGML_ASSERT(v->ne[1] == kq->ne[0]);
+    GGML_ASSERT(kq->ne[2] % v->ne[2] == 0);
+    GGML_ASSERT(kq->ne[3] % v->ne[3] == 0);
+
+    if (v->grad || kq->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    const int64_t ne[4] = { v->ne[0], kq->ne[1], kq->ne[2], kq->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, MAX(v->n_dims, kq->n_dims), ne);
+
+    result->op     = GGML_OP_ATTN_V;
+    result->grad   = NULL;
+    result->src[0] = v;
+    result->src[1] = kq;
+
+    return result;
+}
+
 // ggml_win_part
 
 struct ggml_tensor * ggml_win_part(
@@ -11927,6 +12181,10 @@ static void ggml_compute_forward_out_prod_f32(
     //}
 }
 
+// src0 tile dequantized at once by ggml_compute_forward_out_prod_q_f32
+#define GGML_OUT_PROD_Q_TILE_ROWS 16
+#define GGML_OUT_PROD_Q_TILE_COLS 512
+
 static void ggml_compute_forward_out_prod_q_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -11977,18 +12235,6 @@ static void ggml_compute_forward_out_prod_q_f32(
         return;
     }
 
-    // parallelize by last three dimensions
-
-    // total rows in dst
-    const int64_t nr = ne1*ne2*ne3;
-
-    // rows per thread
-    const int64_t dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int64_t ir0 = dr*ith;
-    const int64_t ir1 = MIN(ir0 + dr, nr);
-
     // dst[:,:,:,:] = 0
     // for i2,i3:
     //   for i1:
@@ -11996,30 +12242,56 @@ static void ggml_compute_forward_out_prod_q_f32(
     //       for i0:
     //         dst[i0,i1,i2,i3] += src0[i0,i01,i2,i3] * src1[i1,i01,i2,i3]
 
-    float * wdata = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32) * ith;
+    // parallelize by dst columns, in whole quant blocks.
+    // every thread dequantizes only its columns of src0, one tile at a time, and applies each tile to all dst rows.
+    // this way src0 is dequantized once per op instead of once per dst row, and never as a whole.
 
-    for (int64_t ir = ir0; ir < ir1; ++ir) {
-        // dst indices
-        const int64_t i3 = ir/(ne2*ne1);
-        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
-        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+    const int64_t blck = ggml_blck_size(type);
+    GGML_ASSERT(ne00 % blck == 0);
+
+    // quant blocks per row and per thread
+    const int64_t nblck = ne00/blck;
+    const int64_t dblck = (nblck + nth - 1)/nth;
+
+    // column range for this thread
+    const int64_t ic0 = MIN(nblck, dblck*ith)*blck;
+    const int64_t ic1 = MIN(nblck, dblck*ith + dblck)*blck;
 
-        const int64_t i02 = i2;
-        const int64_t i03 = i3;
+    // at least one block wide
+    const int64_t tile_cols = MAX(blck, GGML_OUT_PROD_Q_TILE_COLS - GGML_OUT_PROD_Q_TILE_COLS % blck);
 
-        //const int64_t i10 = i1;
-        const int64_t i12 = i2;
-        const int64_t i13 = i3;
+    float * wdata = (float *) params->wdata + (GGML_OUT_PROD_Q_TILE_ROWS*tile_cols + CACHE_LINE_SIZE_F32) * ith;
 
-        for (int64_t i01 = 0; i01 < ne01; ++i01) {
-            const int64_t i11 = i01;
+    for (int64_t i3 = 0; i3 < ne3; ++i3) {
+        for (int64_t i2 = 0; i2 < ne2; ++i2) {
+            const int64_t i02 = i2;
+            const int64_t i03 = i3;
+            const int64_t i12 = i2;
+            const int64_t i13 = i3;
 
-            float * s0 = (float *) ((char *) src0->data + (          i01*nb01 + i02*nb02 + i03*nb03));
-            float * s1 = (float *) ((char *) src1->data + (i1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
-            float * d  = (float *) ((char *)  dst->data + (          i1*nb1 + i2*nb2 + i3*nb3));
+            for (int64_t bc0 = ic0; bc0 < ic1; bc0 += tile_cols) {
+                const int64_t nc = MIN(tile_cols, ic1 - bc0);
 
-            dequantize_row_q(s0, wdata, ne0);
-            ggml_vec_mad_f32(ne0, d, wdata, *s1);
+                for (int64_t bi01 = 0; bi01 < ne01; bi01 += GGML_OUT_PROD_Q_TILE_ROWS) {
+                    const int64_t nr01 = MIN(GGML_OUT_PROD_Q_TILE_ROWS, ne01 - bi01);
+
+                    // dequantize the tile src0[bc0:bc0+nc, bi01:bi01+nr01]
+                    for (int64_t r = 0; r < nr01; ++r) {
+                        const char * s0 = (const char *) src0->data + ((bi01 + r)*nb01 + i02*nb02 + i03*nb03) + (bc0/blck)*nb00;
+                        dequantize_row_q(s0, wdata + r*tile_cols, nc);
+                    }
+
+                    for (int64_t i1 = 0; i1 < ne1; ++i1) {
+                        float * d = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3)) + bc0;
+                        const char * s1 = (const char *) src1->data + (i1*nb10 + i12*nb12 + i13*nb13);
+
+                        for (int64_t r = 0; r < nr01; ++r) {
+                            const float v = *(const float *) (s1 + (bi01 + r)*nb11);
+                            ggml_vec_mad_f32(nc, d, wdata + r*tile_cols, v);
+                        }
+                    }
+                }
+            }
         }
     }
 
@@ -12731,21 +13003,7 @@ static void ggml_compute_forward_soft_max_f32(
         float max = -INFINITY;
         ggml_vec_max_f32(nc, &max, sp);
 
-        ggml_float sum = 0.0;
-
-        uint16_t scvt;
-        for (int i = 0; i < nc; i++) {
-            if (sp[i] == -INFINITY) {
-                dp[i] = 0.0f;
-            } else {
-                // const float val = (sp[i] == -INFINITY) ? 0.0 : exp(sp[i] - max);
-                ggml_fp16_t s = GGML_FP32_TO_FP16(sp[i] - max);
-                memcpy(&scvt, &s, sizeof(scvt));
-                const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
-                sum += (ggml_float)val;
-                dp[i] = val;
-            }
-        }
+        ggml_float sum = ggml_vec_soft_max_f32(nc, dp, sp, max);
 
         assert(sum > 0.0);
 
@@ -12777,6 +13035,122 @@ static void ggml_compute_forward_soft_max(
     }
 }
 
+// ggml_compute_forward_soft_max_ext
+
+static void ggml_compute_forward_soft_max_ext_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * mask,
+        const struct ggml_tensor * slopes,
+        const struct ggml_tensor * pos,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    float   scale  = 1.0f;
+    int32_t n_past = -1;
+    memcpy(&scale,  (float *)   dst->op_params + 0, sizeof(float));
+    memcpy(&n_past, (int32_t *) dst->op_params + 1, sizeof(int32_t));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc  = src0->ne[0];
+    const int ne1 = src0->ne[1];
+    const int ne2 = src0->ne[2];
+    const int nr  = ggml_nrows(src0);
+
+    const int32_t * kp = pos ? (const int32_t *) pos->data : NULL;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    // the rows of all heads for a block of queries are processed together, so that the mask rows of the block
+    // are still in the cache when the next head reads them
+    const int nq = mask ? MAX(1, GGML_SOFT_MAX_BLOCK/nc) : ne1;
+
+    const int ih0 = ir0/ne1;
+    const int ih1 = ir1 > ir0 ? (ir1 - 1)/ne1 + 1 : ih0;
+
+    for (int jq = 0; jq < ne1; jq += nq) {
+        for (int ih = ih0; ih < ih1; ih++) {
+            for (int j = jq; j < MIN(jq + nq, ne1); j++) {
+                const int i1 = ih*ne1 + j;
+                if (i1 < ir0 || i1 >= ir1) {
+                    continue;
+                }
+
+                const int h = ih % ne2; // head
+
+                const float * sp = (float *)((char *) src0->data + i1*src0->nb[1]);
+                float       * dp = (float *)((char *)  dst->data + i1*dst->nb[1]);
+
+                const float * mp    = mask   ? (const float *)((const char *) mask->data + j*mask->nb[1]) : NULL;
+                const float   slope = slopes ? ((const float *) slopes->data)[h] : 0.0f;
+
+                // without a mask tensor the columns past n_past + j are masked, they are not even read
+                const int nv = !mask && n_past >= 0 ? MIN(nc, n_past + j + 1) : nc;
+
+                if (mp) {
+                    for (int i = 0; i < nv; ++i) {
+                        dp[i] = sp[i]*scale + mp[i];
+                    }
+                } else {
+                    for (int i = 0; i < nv; ++i) {
+                        dp[i] = sp[i]*scale;
+                    }
+                }
+                if (slopes) {
+                    for (int i = 0; i < nv; ++i) {
+                        dp[i] += slope*(kp ? kp[i] : i);
+                    }
+                }
+
+                float max = -INFINITY;
+                ggml_vec_max_f32(nv, &max, dp);
+
+                ggml_float sum = ggml_vec_soft_max_f32(nv, dp, dp, max);
+
+                for (int i = nv; i < nc; i++) {
+                    dp[i] = 0.0f;
+                }
+
+                assert(sum > 0.0);
+
+                sum = 1.0/sum;
+                ggml_vec_scale_f32(nv, dp, sum);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_soft_max_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * mask,
+        const struct ggml_tensor * slopes,
+        const struct ggml_tensor * pos,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_soft_max_ext_f32(params, src0, mask, slopes, pos, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_soft_max_back
 
 static void ggml_compute_forward_soft_max_back_f32(
@@ -13202,7 +13576,17 @@ static void ggml_compute_forward_rope_f32(
                         dst_data[n_dims/2*3] = x2*sin_block_theta + x3*cos_block_theta;
                     }
                 } else if (!is_neox) {
+                    // only the first n_dims dimensions are rotated (gpt-j rotary_dim), the rest is copied
                     for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
+                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                        if (i0 >= n_dims) {
+                            dst_data[0] = src[0];
+                            dst_data[1] = src[1];
+                            continue;
+                        }
+
                         const float cos_theta = cosf(theta);
                         const float sin_theta = sinf(theta);
                         // zeta scaling for xPos only:
@@ -13211,9 +13595,6 @@ static void ggml_compute_forward_rope_f32(
 
                         theta *= theta_scale;
 
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
                         const float x0 = src[0];
                         const float x1 = src[1];
 
@@ -13221,26 +13602,30 @@ static void ggml_compute_forward_rope_f32(
                         dst_data[1] = x0*sin_theta*zeta + x1*cos_theta*zeta;
                     }
                 } else {
-                    // TODO: this might be wrong for ne0 != n_dims - need double check
+                    // the first n_dims dimensions are rotated in two halves, the rest is copied (gpt-neox rotary_pct)
                     // ref:  https://github.com/huggingface/transformers/blob/main/src/transformers/models/gpt_neox/modeling_gpt_neox.py#LL251C1-L294C28
-                    for (int64_t ib = 0; ib < ne0/n_dims; ++ib) {
-                        for (int64_t ic = 0; ic < n_dims; ic += 2) {
-                            const float cos_theta = cosf(theta);
-                            const float sin_theta = sinf(theta);
+                    for (int64_t ic = 0; ic < n_dims; ic += 2) {
+                        const float cos_theta = cosf(theta);
+                        const float sin_theta = sinf(theta);
 
-                            theta *= theta_scale;
+                        theta *= theta_scale;
 
-                            const int64_t i0 = ib*n_dims + ic/2;
+                        const int64_t i0 = ic/2;
 
-                            const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                                  float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
 
-                            const float x0 = src[0];
-                            const float x1 = src[n_dims/2];
+                        const float x0 = src[0];
+                        const float x1 = src[n_dims/2];
 
-                            dst_data[0]        = x0*cos_theta - x1*sin_theta;
-                            dst_data[n_dims/2] = x0*sin_theta + x1*cos_theta;
-                        }
+                        dst_data[0]        = x0*cos_theta - x1*sin_theta;
+                        dst_data[n_dims/2] = x0*sin_theta + x1*cos_theta;
+                    }
+                    for (int64_t i0 = n_dims; i0 < ne0; ++i0) {
+                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                        dst_data[0] = src[0];
                     }
                 }
             }
@@ -13334,15 +13719,22 @@ static void ggml_compute_forward_rope_f16(
                         dst_data[n_dims/2*3] = GGML_FP32_TO_FP16(x2*sin_block_theta + x3*cos_block_theta);
                     }
                 } if (!is_neox) {
+                    // only the first n_dims dimensions are rotated (gpt-j rotary_dim), the rest is copied
                     for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
+                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                        if (i0 >= n_dims) {
+                            dst_data[0] = src[0];
+                            dst_data[1] = src[1];
+                            continue;
+                        }
+
                         const float cos_theta = cosf(theta);
                         const float sin_theta = sinf(theta);
 
                         theta *= theta_scale;
 
-                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
                         const float x0 = GGML_FP16_TO_FP32(src[0]);
                         const float x1 = GGML_FP16_TO_FP32(src[1]);
 
@@ -13350,26 +13742,30 @@ static void ggml_compute_forward_rope_f16(
                         dst_data[1] = GGML_FP32_TO_FP16(x0*sin_theta + x1*cos_theta);
                     }
                 } else {
-                    // TODO: this might be wrong for ne0 != n_dims - need double check
+                    // the first n_dims dimensions are rotated in two halves, the rest is copied (gpt-neox rotary_pct)
                     // ref:  https://github.com/huggingface/transformers/blob/main/src/transformers/models/gpt_neox/modeling_gpt_neox.py#LL251C1-L294C28
-                    for (int64_t ib = 0; ib < ne0/n_dims; ++ib) {
-                        for (int64_t ic = 0; ic < n_dims; ic += 2) {
-                            const float cos_theta = cosf(theta);
-                            const float sin_theta = sinf(theta);
+                    for (int64_t ic = 0; ic < n_dims; ic += 2) {
+                        const float cos_theta = cosf(theta);
+                        const float sin_theta = sinf(theta);
 
-                            theta *= theta_scale;
+                        theta *= theta_scale;
+
+                        const int64_t i0 = ic/2;
 
-                            const int64_t i0 = ib*n_dims + ic/2;
+                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
 
-                            const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                                  ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+                        const float x0 = GGML_FP16_TO_FP32(src[0]);
+                        const float x1 = GGML_FP16_TO_FP32(src[n_dims/2]);
 
-                            const float x0 = GGML_FP16_TO_FP32(src[0]);
-                            const float x1 = GGML_FP16_TO_FP32(src[n_dims/2]);
+                        dst_data[0]        = GGML_FP32_TO_FP16(x0*cos_theta - x1*sin_theta);
+                        dst_data[n_dims/2] = GGML_FP32_TO_FP16(x0*sin_theta + x1*cos_theta);
+                    }
+                    for (int64_t i0 = n_dims; i0 < ne0; ++i0) {
+                        const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              ggml_fp16_t * dst_data  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
 
-                            dst_data[0]        = GGML_FP32_TO_FP16(x0*cos_theta - x1*sin_theta);
-                            dst_data[n_dims/2] = GGML_FP32_TO_FP16(x0*sin_theta + x1*cos_theta);
-                        }
+                        dst_data[0] = src[0];
                     }
                 }
             }
@@ -13468,7 +13864,17 @@ static void ggml_compute_forward_rope_back_f32(
                 float theta = freq_scale * (float)p;
 
                 if (!is_neox) {
+                    // as in the forward pass, the dimensions past n_dims were copied, so their gradient passes through
                     for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
+                        const float * const dy  = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              float *       dx  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                        if (i0 >= n_dims) {
+                            dx[0] = dy[0];
+                            dx[1] = dy[1];
+                            continue;
+                        }
+
                         const float cos_theta = cosf(theta);
                         const float sin_theta = sinf(theta);
                         // zeta scaling for xPos only:
@@ -13477,9 +13883,6 @@ static void ggml_compute_forward_rope_back_f32(
 
                         theta *= theta_scale;
 
-                        const float * const dy  = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float *       dx  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
                         const float dy0 = dy[0];
                         const float dy1 = dy[1];
 
@@ -13487,24 +13890,28 @@ static void ggml_compute_forward_rope_back_f32(
                         dx[1] = - dy0*sin_theta*zeta + dy1*cos_theta*zeta;
                     }
                 } else {
-                    for (int64_t ib = 0; ib < ne0/n_dims; ++ib) {
-                        for (int64_t ic = 0; ic < n_dims; ic += 2) {
-                            const float cos_theta = cosf(theta);
-                            const float sin_theta = sinf(theta);
+                    for (int64_t ic = 0; ic < n_dims; ic += 2) {
+                        const float cos_theta = cosf(theta);
+                        const float sin_theta = sinf(theta);
 
-                            theta *= theta_scale;
+                        theta *= theta_scale;
 
-                            const int64_t i0 = ib*n_dims + ic/2;
+                        const int64_t i0 = ic/2;
 
-                            const float * const dy  = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                                  float *       dx  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+                        const float * const dy  = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              float *       dx  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
 
-                            const float dy0 = dy[0];
-                            const float dy1 = dy[n_dims/2];
+                        const float dy0 = dy[0];
+                        const float dy1 = dy[n_dims/2];
 
-                            dx[0]        =   dy0*cos_theta + dy1*sin_theta;
-                            dx[n_dims/2] = - dy0*sin_theta + dy1*cos_theta;
-                        }
+                        dx[0]        =   dy0*cos_theta + dy1*sin_theta;
+                        dx[n_dims/2] = - dy0*sin_theta + dy1*cos_theta;
+                    }
+                    for (int64_t i0 = n_dims; i0 < ne0; ++i0) {
+                        const float * const dy  = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              float *       dx  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                        dx[0] = dy[0];
                     }
                 }
             }
@@ -13569,14 +13976,20 @@ static void ggml_compute_forward_rope_back_f16(
 
                 if (!is_neox) {
                     for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
+                        const ggml_fp16_t * const dy  = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              ggml_fp16_t *       dx  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                        if (i0 >= n_dims) {
+                            dx[0] = dy[0];
+                            dx[1] = dy[1];
+                            continue;
+                        }
+
                         const float cos_theta = cosf(theta);
                         const float sin_theta = sinf(theta);
 
                         theta *= theta_scale;
 
-                        const ggml_fp16_t * const dy  = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              ggml_fp16_t *       dx  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
                         const float dy0 = GGML_FP16_TO_FP32(dy[0]);
                         const float dy1 = GGML_FP16_TO_FP32(dy[1]);
 
@@ -13584,24 +13997,28 @@ static void ggml_compute_forward_rope_back_f16(
                         dx[1] = GGML_FP32_TO_FP16(-dy0*sin_theta + dy1*cos_theta);
                     }
                 } else {
-                    for (int64_t ib = 0; ib < ne0/n_dims; ++ib) {
-                        for (int64_t ic = 0; ic < n_dims; ic += 2) {
-                            const float cos_theta = cosf(theta);
-                            const float sin_theta = sinf(theta);
+                    for (int64_t ic = 0; ic < n_dims; ic += 2) {
+                        const float cos_theta = cosf(theta);
+                        const float sin_theta = sinf(theta);
 
-                            theta *= theta_scale;
+                        theta *= theta_scale;
 
-                            const int64_t i0 = ib*n_dims + ic/2;
+                        const int64_t i0 = ic/2;
 
-                            const ggml_fp16_t * const dy  = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                                  ggml_fp16_t *       dx  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+                        const ggml_fp16_t * const dy  = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              ggml_fp16_t *       dx  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
 
-                            const float dy0 = GGML_FP16_TO_FP32(dy[0]);
-                            const float dy1 = GGML_FP16_TO_FP32(dy[n_dims/2]);
+                        const float dy0 = GGML_FP16_TO_FP32(dy[0]);
+                        const float dy1 = GGML_FP16_TO_FP32(dy[n_dims/2]);
 
-                            dx[0]        = GGML_FP32_TO_FP16( dy0*cos_theta + dy1*sin_theta);
-                            dx[n_dims/2] = GGML_FP32_TO_FP16(-dy0*sin_theta + dy1*cos_theta);
-                        }
+                        dx[0]        = GGML_FP32_TO_FP16( dy0*cos_theta + dy1*sin_theta);
+                        dx[n_dims/2] = GGML_FP32_TO_FP16(-dy0*sin_theta + dy1*cos_theta);
+                    }
+                    for (int64_t i0 = n_dims; i0 < ne0; ++i0) {
+                        const ggml_fp16_t * const dy  = (ggml_fp16_t *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                              ggml_fp16_t *       dx  = (ggml_fp16_t *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                        dx[0] = dy[0];
                     }
                 }
             }
@@ -15467,18 +15884,119 @@ static void ggml_compute_forward_flash_attn_back(
     }
 }
 
-// ggml_compute_forward_win_part
+// ggml_compute_forward_attn_v
 
-static void ggml_compute_forward_win_part_f32(
+// cells per block, f16 rows are converted to f32 one block at a time
+#define GGML_ATTN_V_BLCK_C 32
+// tokens that share a converted block
+#define GGML_ATTN_V_BLCK_T 16
+
+static void ggml_compute_forward_attn_v(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
-        struct ggml_tensor * dst) {
-    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    GGML_TENSOR_BINARY_OP_LOCALS
 
-    GGML_TENSOR_LOCALS(int64_t, ne0, src0, ne)
-    GGML_TENSOR_LOCALS(int64_t, ne,  dst,  ne)
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_ASSERT(nb00 == ggml_type_size(src0->type));
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    GGML_ASSERT(ne0 == ne00);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(ne2 == ne12);
+    GGML_ASSERT(ne3 == ne13);
+    GGML_ASSERT(ne10 == ne01);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // dst[:,j,h] = sum_c src1[c,j,h] * src0[:,c,h/r2]
+    // accumulated one src0 row at a time, cells with zero weight (masked) are skipped
+
+    // broadcast factors
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
+
+    const bool is_f16 = src0->type == GGML_TYPE_F16;
+
+    float * wdata = (float *) params->wdata + (GGML_ATTN_V_BLCK_C*ne00 + CACHE_LINE_SIZE_F32)*ith;
+
+    // parallelize over heads and blocks of tokens
+    const int64_t nbt = (ne1 + GGML_ATTN_V_BLCK_T - 1)/GGML_ATTN_V_BLCK_T;
+    const int64_t nr  = nbt*ne2*ne3;
+
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*nbt);
+        const int64_t i2 = (ir - i3*ne2*nbt)/nbt;
+        const int64_t j0 = (ir - i3*ne2*nbt - i2*nbt)*GGML_ATTN_V_BLCK_T;
+        const int64_t j1 = MIN(j0 + GGML_ATTN_V_BLCK_T, ne1);
+
+        const char * v = (const char *) src0->data + (i2/r2)*nb02 + (i3/r3)*nb03;
+
+        for (int64_t j = j0; j < j1; ++j) {
+            ggml_vec_set_f32(ne0, (float *) ((char *) dst->data + j*nb1 + i2*nb2 + i3*nb3), 0.0f);
+        }
+
+        for (int64_t c0 = 0; c0 < ne01; c0 += GGML_ATTN_V_BLCK_C) {
+            const int64_t c1 = MIN(c0 + GGML_ATTN_V_BLCK_C, ne01);
+
+            bool any = false;
+            for (int64_t j = j0; j < j1 && !any; ++j) {
+                const float * p = (const float *) ((const char *) src1->data + j*nb11 + i2*nb12 + i3*nb13);
+                for (int64_t c = c0; c < c1; ++c) {
+                    if (p[c] != 0.0f) {
+                        any = true;
+                        break;
+                    }
+                }
+            }
+            if (!any) {
+                continue;
+            }
+
+            if (is_f16) {
+                for (int64_t c = c0; c < c1; ++c) {
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *) (v + c*nb01), wdata + (c - c0)*ne00, ne00);
+                }
+            }
+
+            for (int64_t j = j0; j < j1; ++j) {
+                const float * p = (const float *) ((const char *) src1->data + j*nb11 + i2*nb12 + i3*nb13);
+                float       * d = (float *) ((char *) dst->data + j*nb1 + i2*nb2 + i3*nb3);
+
+                for (int64_t c = c0; c < c1; ++c) {
+                    if (p[c] == 0.0f) {
+                        continue;
+                    }
+                    const float * row = is_f16 ? wdata + (c - c0)*ne00 : (const float *) (v + c*nb01);
+                    ggml_vec_mad_f32(ne0, d, row, p[c]);
+                }
+            }
+        }
+    }
+}
+
+// ggml_compute_forward_win_part
+
+static void ggml_compute_forward_win_part_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_LOCALS(int64_t, ne0, src0, ne)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst,  ne)
 
     const int32_t nep0 = ((const int32_t *)(dst->op_params))[0];
     const int32_t nep1 = ((const int32_t *)(dst->op_params))[1];
@@ -16373,6 +16891,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_soft_max(params, tensor->src[0], tensor);
             } break;
+        case GGML_OP_SOFT_MAX_EXT:
+            {
+                ggml_compute_forward_soft_max_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
         case GGML_OP_SOFT_MAX_BACK:
             {
                 ggml_compute_forward_soft_max_back(params, tensor->src[0], tensor->src[1], tensor);
@@ -16435,6 +16957,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 bool masked = t != 0;
                 ggml_compute_forward_flash_attn_back(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], masked, tensor);
             } break;
+        case GGML_OP_ATTN_V:
+            {
+                ggml_compute_forward_attn_v(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
         case GGML_OP_WIN_PART:
             {
                 ggml_compute_forward_win_part(params, tensor->src[0], tensor);
@@ -17242,6 +17768,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                 }
 
             } break;
+        case GGML_OP_SOFT_MAX_EXT:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_SOFT_MAX_BACK:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -17404,6 +17934,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // not supported
             } break;
+        case GGML_OP_ATTN_V:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_WIN_PART:
         case GGML_OP_WIN_UNPART:
         case GGML_OP_UNARY:
@@ -17816,6 +18350,238 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(threa
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+// how far back the scheduler looks for the nodes a node depends on or shares memory with
+#define GGML_CONCUR_SEARCH_DEPTH 16
+// nodes only run at the same time if the work buffer slices of all of them fit in this size
+#define GGML_CONCUR_MAX_WORK (16*1024*1024)
+
+// nodes that compute nothing
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// nodes that must not run at the same time as other nodes:
+// user callbacks, and nodes that are computed by a BLAS or GPU library
+static bool ggml_graph_node_is_barrier(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            return true;
+        default:
+            break;
+    }
+
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
+    if (node->backend != GGML_BACKEND_CPU) {
+        return true;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (node->src[i] && node->src[i]->backend != GGML_BACKEND_CPU) {
+            return true;
+        }
+    }
+#endif
+
+    if (node->op == GGML_OP_MUL_MAT) {
+#if defined(GGML_USE_CUBLAS)
+        if (ggml_cuda_can_mul_mat(node->src[0], node->src[1], node)) {
+            return true;
+        }
+#elif defined(GGML_USE_CLBLAST)
+        if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
+            return true;
+        }
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
+            return true;
+        }
+#endif
+    }
+
+    return false;
+}
+
+static bool ggml_graph_ranges_overlap(const char * a0, const char * a1, const char * b0, const char * b1) {
+    return a0 < b1 && b0 < a1;
+}
+
+// whether node b, which comes after node a in the graph, must run after it because one of them
+// writes memory that the other one reads or writes
+static bool ggml_graph_nodes_conflict(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const char * a0 = (const char *) a->data;
+    const char * a1 = a0 + ggml_nbytes(a);
+    const char * b0 = (const char *) b->data;
+    const char * b1 = b0 + ggml_nbytes(b);
+
+    if (ggml_graph_ranges_overlap(a0, a1, b0, b1)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        const struct ggml_tensor * src = b->src[i];
+        if (src && ggml_graph_ranges_overlap(a0, a1, (const char *) src->data, (const char *) src->data + ggml_nbytes(src))) {
+            return true;
+        }
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        const struct ggml_tensor * src = a->src[i];
+        if (src && ggml_graph_ranges_overlap((const char *) src->data, (const char *) src->data + ggml_nbytes(src), b0, b1)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// size of the schedule built by ggml_graph_compute and of the memory used to build it
+static size_t ggml_graph_concur_schedule_size(int n_nodes) {
+    return 6*sizeof(int)*n_nodes;
+}
+
+// Splits the graph into steps of up to n_concur nodes that can run at the same time, and writes them to sched
+// like the parse_seq of ggml-alloc and the concur_list of ggml-metal: the nodes of each step followed by -1.
+// The nodes are taken in the order of seq, a list in the same format, or in the order of the graph.
+//
+// Every node goes to the first step after the steps of the nodes it depends on. With check_mem the graph
+// is allocated: a node also waits for the nodes before it that use memory it writes or write memory it uses,
+// and nodes that compute nothing are left out. Only the last GGML_CONCUR_SEARCH_DEPTH nodes are looked at,
+// the nodes before them are taken as done.
+static int ggml_graph_concur_schedule(
+        const struct ggml_cgraph * cgraph,
+        const int * seq, int seq_len,
+        int n_concur, bool check_mem,
+        int * sched, int * wdata) {
+    const int n_nodes = cgraph->n_nodes;
+
+    int * order   = wdata;             // nodes in the order of seq
+    int * step    = wdata +   n_nodes; // step of each node, for nodes that compute nothing the step of their input
+    int * max_pre = wdata + 2*n_nodes; // last step of the nodes up to each node
+    int * n_step  = wdata + 3*n_nodes; // number of nodes that compute something in each step
+
+    int n = 0;
+    for (int i = 0; i < (seq ? seq_len : n_nodes); ++i) {
+        if (!seq || seq[i] != -1) {
+            order[n++] = seq ? seq[i] : i;
+        }
+    }
+
+    memset(n_step, 0, n_nodes*sizeof(int));
+
+    int n_steps = 0;
+
+    for (int p = 0; p < n; ++p) {
+        const struct ggml_tensor * node = cgraph->nodes[order[p]];
+
+        const bool noop = ggml_graph_node_is_noop(node);
+        const int  p0   = MAX(0, p - GGML_CONCUR_SEARCH_DEPTH);
+
+        // the nodes before the search window are done
+        int s = p0 > 0 ? max_pre[p0 - 1] + (noop ? 0 : 1) : (noop ? -1 : 0);
+
+        if (!noop && ggml_graph_node_is_barrier(node)) {
+            s = p > 0 ? max_pre[p - 1] + 1 : 0;
+        }
+
+        for (int q = p0; q < p; ++q) {
+            const struct ggml_tensor * prev = cgraph->nodes[order[q]];
+
+            bool dep = false;
+            for (int k = 0; k < GGML_MAX_SRC; ++k) {
+                if (node->src[k] == prev) {
+                    dep = true;
+                    break;
+                }
+            }
+
+            if (dep) {
+                s = MAX(s, step[q] + (noop ? 0 : 1));
+            } else if (!noop && !ggml_graph_node_is_noop(prev)) {
+                if (ggml_graph_node_is_barrier(prev) || (check_mem && ggml_graph_nodes_conflict(prev, node))) {
+                    s = MAX(s, step[q] + 1);
+                }
+            }
+        }
+
+        if (!noop) {
+            while (n_step[s] == n_concur) {
+                s++;
+            }
+            n_step[s]++;
+        }
+
+        step[p]    = s;
+        max_pre[p] = p > 0 ? MAX(max_pre[p - 1], s) : s;
+        n_steps    = MAX(n_steps, s + 1);
+    }
+
+    // nodes that compute nothing are only listed for the allocator, next to the node they view
+    if (!check_mem) {
+        for (int p = 0; p < n; ++p) {
+            if (ggml_graph_node_is_noop(cgraph->nodes[order[p]])) {
+                step[p] = MAX(step[p], 0);
+                n_step[step[p]]++;
+            }
+        }
+    }
+
+    // start of each step in the schedule, each step is followed by a -1
+    int * pos = max_pre;
+    int len = 0;
+    for (int s = 0; s < n_steps; ++s) {
+        pos[s] = len;
+        if (n_step[s] > 0) {
+            len += n_step[s];
+            sched[len++] = -1;
+        }
+    }
+
+    for (int p = 0; p < n; ++p) {
+        if (!check_mem || !ggml_graph_node_is_noop(cgraph->nodes[order[p]])) {
+            sched[pos[step[p]]++] = order[p];
+        }
+    }
+
+    GGML_ASSERT(len <= GGML_MAX_CONCUR);
+
+    return len;
+}
+
+int ggml_graph_find_concurrency(const struct ggml_cgraph * cgraph, int n_concur, int * list) {
+    int * wdata = malloc(4*sizeof(int)*MAX(1, cgraph->n_nodes));
+
+    const int len = ggml_graph_concur_schedule(cgraph, NULL, 0, MAX(1, n_concur), false, list, wdata);
+
+    free(wdata);
+
+    return len;
+}
+
+// rough number of operations of a node, to share out the threads between nodes that run at the same time
+static double ggml_graph_node_cost(const struct ggml_tensor * node) {
+    double cost = (double) ggml_nelements(node);
+    if (node->op == GGML_OP_MUL_MAT) {
+        cost *= node->src[0]->ne[0];
+    }
+    return cost;
+}
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
@@ -17825,9 +18591,23 @@ struct ggml_compute_state_shared {
 
     const int n_threads;
 
+    // steps of independent nodes (see ggml_graph_concur_schedule)
+    // without concur the nodes run one at a time, in the order of sched or of the graph when it is NULL
+    bool        concur;
+    const int * sched;
+    int         sched_len;
+
+    // the nodes of the current step, the threads that compute them and their slices of the work buffer
+    int    step_n_nodes;
+    int    step_end;
+    int    step_node[GGML_MAX_CONCUR_NODES];
+    int    step_ith0[GGML_MAX_CONCUR_NODES];
+    int    step_nth [GGML_MAX_CONCUR_NODES];
+    size_t step_wsize;
+
     // synchronization primitives
     atomic_int n_active; // num active threads
-    atomic_int node_n;   // active graph node
+    atomic_int node_n;   // active graph node, or step of the schedule
 
     bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
     void * abort_callback_data;
@@ -17848,14 +18628,85 @@ static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const
     node->perf_time_us += time_us_cur;
 }
 
+// moves to the step after the one at pos and shares out the threads between its nodes
+// returns the position of the new step, sched_len when the graph is done
+static int ggml_graph_compute_next_step(struct ggml_compute_state_shared * st, int pos) {
+    const int * n_tasks = st->cplan->n_tasks;
+
+    if (!st->concur) {
+        // one node at a time, in the order of the schedule if there is one
+        do {
+            pos++;
+        } while (st->sched && pos < st->sched_len && st->sched[pos] == -1);
+
+        if (pos < st->sched_len) {
+            st->step_n_nodes = 1;
+            st->step_node[0] = st->sched ? st->sched[pos] : pos;
+            st->step_ith0[0] = 0;
+            st->step_nth [0] = n_tasks[st->step_node[0]];
+        }
+        return pos;
+    }
+
+    pos = pos < 0 ? 0 : st->step_end + 1;
+    if (pos >= st->sched_len) {
+        return st->sched_len;
+    }
+
+    int n = 0;
+    for (; st->sched[pos + n] != -1; ++n) {
+        st->step_node[n] = st->sched[pos + n];
+        st->step_nth [n] = 1;
+    }
+    st->step_n_nodes = n;
+    st->step_end     = pos + n;
+
+    if (n == 1) {
+        st->step_nth[0] = n_tasks[st->step_node[0]];
+    } else {
+        // one thread per node, the others go one by one to the node with the most work per thread
+        double cost[GGML_MAX_CONCUR_NODES];
+        for (int k = 0; k < n; ++k) {
+            cost[k] = ggml_graph_node_cost(st->cgraph->nodes[st->step_node[k]]);
+        }
+
+        for (int t = n; t < st->n_threads; ++t) {
+            int best = -1;
+            for (int k = 0; k < n; ++k) {
+                if (st->step_nth[k] < n_tasks[st->step_node[k]] &&
+                    (best < 0 || cost[k]*st->step_nth[best] > cost[best]*st->step_nth[k])) {
+                    best = k;
+                }
+            }
+            if (best < 0) {
+                break;
+            }
+            st->step_nth[best]++;
+        }
+    }
+
+    for (int k = 0, ith0 = 0; k < n; ++k) {
+        st->step_ith0[k] = ith0;
+        ith0 += st->step_nth[k];
+    }
+
+    return pos;
+}
+
+static void ggml_graph_compute_step_params(const struct ggml_compute_state_shared * st, int k, struct ggml_compute_params * params) {
+    params->nth   = st->step_nth[k];
+    params->wsize = st->step_wsize;
+    params->wdata = st->cplan->work_data ? (char *) st->cplan->work_data + k*st->step_wsize : NULL;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
 
     const struct ggml_cgraph * cgraph = state->shared->cgraph;
     const struct ggml_cplan  * cplan  = state->shared->cplan;
 
-    const int * n_tasks_arr = cplan->n_tasks;
     const int   n_threads   = state->shared->n_threads;
+    const int   n_steps     = state->shared->sched_len;
 
     set_numa_thread_affinity(state->ith, n_threads);
 
@@ -17863,7 +18714,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     while (true) {
         if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-            state->shared->node_n += 1;
+            atomic_store(&state->shared->node_n, n_steps);
             return (thread_ret_t) GGML_EXIT_ABORTED;
         }
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
@@ -17879,35 +18730,41 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
             if (node_n != -1) {
                 /* FINALIZE */
-                struct ggml_tensor * node = state->shared->cgraph->nodes[node_n];
-                if (GGML_OP_HAS_FINALIZE[node->op]) {
-                    params.nth = n_tasks_arr[node_n];
-                    ggml_compute_forward(&params, node);
+                for (int k = 0; k < state->shared->step_n_nodes; ++k) {
+                    struct ggml_tensor * node = cgraph->nodes[state->shared->step_node[k]];
+                    if (GGML_OP_HAS_FINALIZE[node->op]) {
+                        params.type = GGML_TASK_FINALIZE;
+                        ggml_graph_compute_step_params(state->shared, k, &params);
+                        ggml_compute_forward(&params, node);
+                    }
+                    ggml_graph_compute_perf_stats_node(node, state->shared);
                 }
-                ggml_graph_compute_perf_stats_node(node, state->shared);
             }
 
             // distribute new work or execute it direct if 1T
-            while (++node_n < cgraph->n_nodes) {
-                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
-
-                struct ggml_tensor * node = cgraph->nodes[node_n];
-                const int n_tasks = n_tasks_arr[node_n];
+            while ((node_n = ggml_graph_compute_next_step(state->shared, node_n)) < n_steps) {
+                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, n_steps);
 
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
 
-                params.nth = n_tasks;
-
                 /* INIT */
-                if (GGML_OP_HAS_INIT[node->op]) {
-                    params.type = GGML_TASK_INIT;
-                    ggml_compute_forward(&params, node);
+                for (int k = 0; k < state->shared->step_n_nodes; ++k) {
+                    struct ggml_tensor * node = cgraph->nodes[state->shared->step_node[k]];
+                    if (GGML_OP_HAS_INIT[node->op]) {
+                        params.type = GGML_TASK_INIT;
+                        ggml_graph_compute_step_params(state->shared, k, &params);
+                        ggml_compute_forward(&params, node);
+                    }
                 }
 
-                if (n_tasks == 1) {
+                if (state->shared->step_n_nodes == 1 && state->shared->step_nth[0] == 1) {
                     // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
                     // they do something more efficient than spinning (?)
+                    struct ggml_tensor * node = cgraph->nodes[state->shared->step_node[0]];
+
+                    ggml_graph_compute_step_params(state->shared, 0, &params);
+
                     params.type = GGML_TASK_COMPUTE;
                     ggml_compute_forward(&params, node);
 
@@ -17942,22 +18799,25 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         }
 
         // check if we should stop
-        if (node_n >= cgraph->n_nodes) break;
+        if (node_n >= n_steps) break;
 
         /* COMPUTE */
-        struct ggml_tensor * node = cgraph->nodes[node_n];
-        const int n_tasks = n_tasks_arr[node_n];
-
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_COMPUTE,
-            /*.ith   =*/ state->ith,
-            /*.nth   =*/ n_tasks,
-            /*.wsize =*/ cplan->work_size,
-            /*.wdata =*/ cplan->work_data,
-        };
+        for (int k = 0; k < state->shared->step_n_nodes; ++k) {
+            const int ith = state->ith - state->shared->step_ith0[k];
+            if (ith < 0 || ith >= state->shared->step_nth[k]) {
+                continue;
+            }
+
+            struct ggml_compute_params params = {
+                /*.type  =*/ GGML_TASK_COMPUTE,
+                /*.ith   =*/ ith,
+                /*.nth   =*/ 0,
+                /*.wsize =*/ 0,
+                /*.wdata =*/ NULL,
+            };
+            ggml_graph_compute_step_params(state->shared, k, &params);
 
-        if (state->ith < n_tasks) {
-            ggml_compute_forward(&params, node);
+            ggml_compute_forward(&params, cgraph->nodes[state->shared->step_node[k]]);
         }
     }
 
@@ -18001,7 +18861,10 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
                     size_t cur = 0;
 
                     if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                        // one dequantized src0 tile per thread
+                        const int64_t blck = ggml_blck_size(node->src[0]->type);
+                        const int64_t tile_cols = MAX(blck, GGML_OUT_PROD_Q_TILE_COLS - GGML_OUT_PROD_Q_TILE_COLS % blck);
+                        cur = ggml_type_size(GGML_TYPE_F32) * (GGML_OUT_PROD_Q_TILE_ROWS*tile_cols + CACHE_LINE_SIZE_F32) * n_tasks;
                     }
 
                     work_size = MAX(work_size, cur);
@@ -18116,7 +18979,10 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
                     size_t cur = 0;
 
                     if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                        // one dequantized src0 tile per thread
+                        const int64_t blck = ggml_blck_size(node->src[0]->type);
+                        const int64_t tile_cols = MAX(blck, GGML_OUT_PROD_Q_TILE_COLS - GGML_OUT_PROD_Q_TILE_COLS % blck);
+                        cur = ggml_type_size(GGML_TYPE_F32) * (GGML_OUT_PROD_Q_TILE_ROWS*tile_cols + CACHE_LINE_SIZE_F32) * n_tasks;
                     }
 
                     work_size = MAX(work_size, cur);
@@ -18140,6 +19006,7 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
             case GGML_OP_DIAG_MASK_ZERO:
             case GGML_OP_DIAG_MASK_INF:
             case GGML_OP_SOFT_MAX:
+            case GGML_OP_SOFT_MAX_EXT:
             case GGML_OP_SOFT_MAX_BACK:
             case GGML_OP_ROPE:
             case GGML_OP_ROPE_BACK:
@@ -18307,6 +19174,16 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
 
                     work_size = MAX(work_size, cur);
                 } break;
+            case GGML_OP_ATTN_V:
+                {
+                    n_tasks = n_threads;
+
+                    if (node->src[0]->type == GGML_TYPE_F16) {
+                        const size_t cur = sizeof(float)*(GGML_ATTN_V_BLCK_C*node->src[0]->ne[0] + CACHE_LINE_SIZE_F32)*n_tasks;
+
+                        work_size = MAX(work_size, cur);
+                    }
+                } break;
             case GGML_OP_WIN_PART:
             case GGML_OP_WIN_UNPART:
             case GGML_OP_GET_REL_POS:
@@ -18374,9 +19251,26 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
         work_size += CACHE_LINE_SIZE*(n_threads - 1);
     }
 
-    cplan.n_threads = n_threads;
-    cplan.work_size = work_size;
-    cplan.work_data = NULL;
+    // every node that runs at the same time as others gets a slice of the work buffer as large as the
+    // buffer of the sequential case, so fewer of them run at the same time when the slices get large
+    int    n_concur     = MIN(GGML_MAX_CONCUR_NODES, n_threads);
+    size_t concur_wsize = GGML_PAD(work_size, CACHE_LINE_SIZE);
+
+    if (concur_wsize > 0) {
+        n_concur = MIN(n_concur, (int) (GGML_CONCUR_MAX_WORK/concur_wsize));
+    }
+
+    if (n_concur > 1) {
+        work_size = n_concur*concur_wsize + ggml_graph_concur_schedule_size(cgraph->n_nodes);
+    } else {
+        n_concur = 1;
+    }
+
+    cplan.n_threads    = n_threads;
+    cplan.n_concur     = n_concur;
+    cplan.concur_wsize = concur_wsize;
+    cplan.work_size    = work_size;
+    cplan.work_data    = NULL;
 
     return cplan;
 }
@@ -18405,11 +19299,31 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         /*.perf_node_start_cycles  =*/ 0,
         /*.perf_node_start_time_us =*/ 0,
         /*.n_threads               =*/ n_threads,
+        /*.concur                  =*/ false,
+        /*.sched                   =*/ cplan->parse_seq,
+        /*.sched_len               =*/ cplan->parse_seq ? cplan->parse_seq_len : cgraph->n_nodes,
+        /*.step_n_nodes            =*/ 0,
+        /*.step_end                =*/ -1,
+        /*.step_node               =*/ {0},
+        /*.step_ith0               =*/ {0},
+        /*.step_nth                =*/ {0},
+        /*.step_wsize              =*/ cplan->work_size,
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
+
+    if (cplan->n_concur > 1) {
+        // the schedule and the memory used to build it follow the slices of the nodes in the work buffer
+        int * sched = (int *) (cplan->work_data + cplan->n_concur*cplan->concur_wsize);
+
+        state_shared.concur     = true;
+        state_shared.sched      = sched;
+        state_shared.sched_len  = ggml_graph_concur_schedule(cgraph, cplan->parse_seq, cplan->parse_seq_len,
+                cplan->n_concur, true, sched, sched + 2*cgraph->n_nodes);
+        state_shared.step_wsize = cplan->concur_wsize;
+    }
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
     // create thread pool
@@ -19239,6 +20153,206 @@ static void ggml_opt_acc_grad(int np, struct ggml_tensor * const ps[], float * g
 //   ref: https://arxiv.org/pdf/1412.6980.pdf
 //
 
+// the two passes of an Adam iteration that touch every parameter, run on n_threads threads.
+// each thread takes a contiguous range of the concatenated parameter vector, crossing tensor boundaries.
+//
+//  - accumulate: g = grad*scale on the first accumulation step, g += grad*scale on the following ones,
+//                and the sum of squares of g for gradient clipping on the last one
+//  - update:     the AdamW update of the parameters and moments
+//
+// without gradient accumulation g is not used at all, both passes read the gradient tensors in place.
+
+enum ggml_opt_adam_pass {
+    GGML_OPT_ADAM_ACCUMULATE,
+    GGML_OPT_ADAM_UPDATE,
+};
+
+struct ggml_opt_adam_shared {
+    enum ggml_opt_adam_pass pass;
+
+    int np;
+    struct ggml_tensor * const * ps;
+    int64_t nx;
+    int n_threads;
+    int n_workers;
+
+    float * g;
+    float * m;
+    float * v;
+
+    // gradients are read from ps[i]->grad instead of g
+    bool in_place;
+
+    // accumulate
+    float scale;
+    bool  first;
+    bool  compute_sum;
+
+    // update
+    float gnorm;
+    float beta1;
+    float beta2;
+    float beta1h;
+    float beta2h;
+    float eps;
+    float decay;
+    int   decay_min_ndim;
+    float sched;
+};
+
+struct ggml_opt_adam_worker {
+    ggml_thread_t thrd;
+    int ith;
+    struct ggml_opt_adam_shared * shared;
+    ggml_float sum;
+};
+
+static void ggml_opt_adam_accumulate(const struct ggml_opt_adam_shared * s, struct ggml_tensor * grad,
+        int64_t j0, int64_t j1, float * restrict g, ggml_float * sum) {
+    const float scale = s->scale;
+    const int64_t n = j1 - j0;
+    if (s->in_place) {
+        if (s->compute_sum) {
+            const float * restrict src = (const float *) grad->data + j0;
+            ggml_float acc = 0.0;
+            for (int64_t j = 0; j < n; ++j) {
+                const float g_ = src[j]*scale;
+                acc += (ggml_float)(g_*g_);
+            }
+            *sum += acc;
+        }
+        return;
+    }
+    if (grad->type == GGML_TYPE_F32 && ggml_is_contiguous(grad)) {
+        const float * restrict src = (const float *) grad->data + j0;
+        if (s->first) {
+            for (int64_t j = 0; j < n; ++j) {
+                g[j] = src[j]*scale;
+            }
+        } else {
+            for (int64_t j = 0; j < n; ++j) {
+                g[j] += src[j]*scale;
+            }
+        }
+    } else {
+        for (int64_t j = 0; j < n; ++j) {
+            const float g_ = ggml_get_f32_1d(grad, j0 + j)*scale;
+            g[j] = s->first ? g_ : g[j] + g_;
+        }
+    }
+    if (s->compute_sum) {
+        ggml_float acc = 0.0;
+        for (int64_t j = 0; j < n; ++j) {
+            acc += (ggml_float)(g[j]*g[j]);
+        }
+        *sum += acc;
+    }
+}
+
+static void ggml_opt_adam_update(const struct ggml_opt_adam_shared * s, struct ggml_tensor * param,
+        int64_t j0, int64_t j1, const float * restrict g, float * restrict m, float * restrict v) {
+    const float gnorm  = s->in_place ? s->gnorm*s->scale : s->gnorm;
+    const float beta1  = s->beta1;
+    const float beta2  = s->beta2;
+    const float beta1h = s->beta1h;
+    const float beta2h = s->beta2h;
+    const float eps    = s->eps;
+    const float p_decay = ((param->n_dims >= s->decay_min_ndim) ? s->decay : 0.0f) * s->sched;
+    const int64_t n = j1 - j0;
+
+    if (s->in_place) {
+        g = (const float *) param->grad->data + j0;
+    }
+
+    if (param->type == GGML_TYPE_F32 && ggml_is_contiguous(param)) {
+        float * restrict x = (float *) param->data + j0;
+        for (int64_t j = 0; j < n; ++j) {
+            const float g_ = g[j]*gnorm;
+            m[j] = m[j]*beta1 +    g_*(1.0f - beta1);
+            v[j] = v[j]*beta2 + g_*g_*(1.0f - beta2);
+            const float mh = m[j]*beta1h;
+            const float vh = sqrtf(v[j]*beta2h) + eps;
+            x[j] = x[j]*(1.0f - p_decay) - mh/vh;
+        }
+    } else {
+        for (int64_t j = 0; j < n; ++j) {
+            float x = ggml_get_f32_1d(param, j0 + j);
+            const float g_ = g[j]*gnorm;
+            m[j] = m[j]*beta1 +    g_*(1.0f - beta1);
+            v[j] = v[j]*beta2 + g_*g_*(1.0f - beta2);
+            const float mh = m[j]*beta1h;
+            const float vh = sqrtf(v[j]*beta2h) + eps;
+            x = x*(1.0f - p_decay) - mh/vh;
+            ggml_set_f32_1d(param, j0 + j, x);
+        }
+    }
+}
+
+static thread_ret_t ggml_opt_adam_thread(void * data) {
+    struct ggml_opt_adam_worker * worker = (struct ggml_opt_adam_worker *) data;
+    struct ggml_opt_adam_shared * s = worker->shared;
+
+    const int ith = worker->ith;
+    const int nth = s->n_workers;
+
+    // element range of this thread, rounded to cache lines so threads do not share them in g, m and v
+    const int64_t dr = GGML_PAD((s->nx + nth - 1)/nth, 16);
+    const int64_t i0 = MIN(s->nx, dr*ith);
+    const int64_t i1 = MIN(s->nx, i0 + dr);
+
+    ggml_float sum = 0.0;
+
+    int64_t offs = 0;
+    for (int p = 0; p < s->np && offs < i1; ++p) {
+        const int64_t ne = ggml_nelements(s->ps[p]);
+        const int64_t j0 = MAX(i0, offs) - offs;
+        const int64_t j1 = MIN(i1, offs + ne) - offs;
+        if (j0 < j1) {
+            if (s->pass == GGML_OPT_ADAM_ACCUMULATE) {
+                ggml_opt_adam_accumulate(s, s->ps[p]->grad, j0, j1, s->g + offs + j0, &sum);
+            } else {
+                ggml_opt_adam_update(s, s->ps[p], j0, j1, s->g + offs + j0, s->m + offs + j0, s->v + offs + j0);
+            }
+        }
+        offs += ne;
+    }
+
+    worker->sum = sum;
+
+    return 0;
+}
+
+// returns the sum of squares of g after an accumulate pass with compute_sum
+static ggml_float ggml_opt_adam_run(struct ggml_opt_adam_shared * s) {
+    // starting threads costs more than the update of a few small tensors
+    const int n_threads = (int) MAX(1, MIN((int64_t) s->n_threads, s->nx/(64*1024)));
+    s->n_workers = n_threads;
+
+    struct ggml_opt_adam_worker * workers = alloca(sizeof(struct ggml_opt_adam_worker)*n_threads);
+    for (int j = 0; j < n_threads; ++j) {
+        workers[j].ith    = j;
+        workers[j].shared = s;
+    }
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_opt_adam_thread, &workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_opt_adam_thread(&workers[0]);
+
+    ggml_float sum = 0.0;
+    for (int j = 0; j < n_threads; ++j) {
+        if (j > 0) {
+            const int rc = ggml_thread_join(workers[j].thrd, NULL);
+            GGML_ASSERT(rc == 0);
+            UNUSED(rc);
+        }
+        sum += workers[j].sum;
+    }
+    return sum;
+}
+
 static enum ggml_opt_result ggml_opt_adam(
         struct ggml_context * ctx,
         struct ggml_opt_context * opt,
@@ -19290,6 +20404,38 @@ static enum ggml_opt_result ggml_opt_adam(
 
     float * pf = params.past > 0 ? opt->adam.pf->data : NULL; // past function values
 
+    struct ggml_opt_adam_shared shared = {
+        /*.pass           =*/ GGML_OPT_ADAM_ACCUMULATE,
+        /*.np             =*/ np,
+        /*.ps             =*/ ps,
+        /*.nx             =*/ nx,
+        /*.n_threads      =*/ params.n_threads,
+        /*.n_workers      =*/ 1,
+        /*.g              =*/ g,
+        /*.m              =*/ m,
+        /*.v              =*/ v,
+        /*.in_place       =*/ n_accum == 1,
+        /*.scale          =*/ accum_norm,
+        /*.first          =*/ true,
+        /*.compute_sum    =*/ false,
+        /*.gnorm          =*/ 1.0f,
+        /*.beta1          =*/ beta1,
+        /*.beta2          =*/ beta2,
+        /*.beta1h         =*/ 0.0f,
+        /*.beta2h         =*/ 0.0f,
+        /*.eps            =*/ eps,
+        /*.decay          =*/ decay,
+        /*.decay_min_ndim =*/ decay_min_ndim,
+        /*.sched          =*/ sched,
+    };
+    for (int p = 0; p < np; ++p) {
+        if (ps[p]->grad->type != GGML_TYPE_F32 || !ggml_is_contiguous(ps[p]->grad)) {
+            shared.in_place = false;
+        }
+    }
+    // sum of squares of the accumulated gradients, for gradient clipping
+    ggml_float gsum = 0.0;
+
     struct ggml_cplan cplan = ggml_graph_plan(gb, params.n_threads);
     struct ggml_object * obj = ggml_new_object(ctx, GGML_OBJECT_WORK_BUFFER, cplan.work_size);
     cplan.work_data = (uint8_t *)ctx->mem_buffer + obj->offs;
@@ -19298,7 +20444,6 @@ static enum ggml_opt_result ggml_opt_adam(
 
     // compute the function value
     float fx = 0;
-    ggml_set_zero(opt->adam.g);
     for (int accum_step = 0; accum_step < n_accum; ++accum_step) {
         if (callback) {
             callback(callback_data, accum_step, &sched, &cancel);
@@ -19309,7 +20454,12 @@ static enum ggml_opt_result ggml_opt_adam(
         // ggml_graph_reset  (gf);
         ggml_set_f32      (f->grad, 1.0f);
         ggml_graph_compute(gb, &cplan);
-        ggml_opt_acc_grad(np, ps, g, accum_norm);
+        shared.pass        = GGML_OPT_ADAM_ACCUMULATE;
+        shared.first       = accum_step == 0;
+        shared.compute_sum = gclip > 0.0f && accum_step == n_accum - 1;
+        if (!shared.in_place || shared.compute_sum) {
+            gsum = ggml_opt_adam_run(&shared);
+        }
         fx += ggml_get_f32_1d(f, 0);
     }
     if (cancel) {
@@ -19363,39 +20513,21 @@ static enum ggml_opt_result ggml_opt_adam(
         {
             float gnorm = 1.0f;
             if (gclip > 0.0f) {
-                // gradient clipping
-                ggml_float sum = 0.0;
-                for (int64_t i = 0; i < nx; ++i) {
-                    sum += (ggml_float)(g[i]*g[i]);
-                }
-                ggml_float norm = sqrt(sum);
+                // gradient clipping, the norm was computed while accumulating the gradients
+                ggml_float norm = sqrt(gsum);
                 if (norm > (ggml_float) gclip) {
                     gnorm = (float) ((ggml_float) gclip / norm);
                 }
             }
-            const float beta1h = alpha*sched/(1.0f - powf(beta1, opt->iter));
-            const float beta2h =        1.0f/(1.0f - powf(beta2, opt->iter));
-            int64_t i = 0;
-            for (int p = 0; p < np; ++p) {
-                const int64_t ne = ggml_nelements(ps[p]);
-                const float p_decay = ((ps[p]->n_dims >= decay_min_ndim) ? decay : 0.0f) * sched;
-                for (int64_t j = 0; j < ne; ++j) {
-                    float x  = ggml_get_f32_1d(ps[p], j);
-                    float g_ = g[i]*gnorm;
-                    m[i] = m[i]*beta1 +    g_*(1.0f - beta1);
-                    v[i] = v[i]*beta2 + g_*g_*(1.0f - beta2);
-                    float mh = m[i]*beta1h;
-                    float vh = v[i]*beta2h;
-                    vh = sqrtf(vh) + eps;
-                    x  = x*(1.0f - p_decay) - mh/vh;
-                    ggml_set_f32_1d(ps[p], j, x);
-                    ++i;
-                }
-            }
+            shared.pass   = GGML_OPT_ADAM_UPDATE;
+            shared.gnorm  = gnorm;
+            shared.beta1h = alpha*sched/(1.0f - powf(beta1, opt->iter));
+            shared.beta2h =        1.0f/(1.0f - powf(beta2, opt->iter));
+            shared.sched  = sched;
+            ggml_opt_adam_run(&shared);
         }
 
         fx = 0;
-        ggml_set_zero(opt->adam.g);
         for (int accum_step = 0; accum_step < n_accum; ++accum_step) {
             if (callback) {
                 callback(callback_data, accum_step, &sched, &cancel);
@@ -19406,7 +20538,12 @@ static enum ggml_opt_result ggml_opt_adam(
             // ggml_graph_reset  (gf);
             ggml_set_f32      (f->grad, 1.0f);
             ggml_graph_compute(gb, &cplan);
-            ggml_opt_acc_grad(np, ps, g, accum_norm);
+            shared.pass        = GGML_OPT_ADAM_ACCUMULATE;
+            shared.first       = accum_step == 0;
+            shared.compute_sum = gclip > 0.0f && accum_step == n_accum - 1;
+            if (!shared.in_place || shared.compute_sum) {
+                gsum = ggml_opt_adam_run(&shared);
+            }
             fx += ggml_get_f32_1d(f, 0);
         }
         if (cancel) {
@@ -215,6 +215,8 @@
 
 #define GGML_MAX_DIMS          4
 #define GGML_MAX_NODES         16384
+#define GGML_MAX_CONCUR        (2*GGML_MAX_NODES) // node list with -1 barriers between sets of independent nodes
+#define GGML_MAX_CONCUR_NODES  4                  // max number of independent nodes run at the same time
 #define GGML_MAX_PARAMS        1024
 #define GGML_MAX_CONTEXTS      64
 #define GGML_MAX_SRC           6
@@ -394,6 +396,7 @@ extern "C" {
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
         GGML_OP_SOFT_MAX,
+        GGML_OP_SOFT_MAX_EXT,
         GGML_OP_SOFT_MAX_BACK,
         GGML_OP_ROPE,
         GGML_OP_ROPE_BACK,
@@ -410,6 +413,7 @@ extern "C" {
         GGML_OP_FLASH_ATTN,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
+        GGML_OP_ATTN_V,
         GGML_OP_WIN_PART,
         GGML_OP_WIN_UNPART,
         GGML_OP_GET_REL_POS,
@@ -526,6 +530,14 @@ extern "C" {
         // the `n_tasks` of nodes, 1:1 mapping to cgraph nodes
         int n_tasks[GGML_MAX_NODES];
 
+        // independent nodes run at the same time on disjoint sets of threads, each with a slice of the work buffer
+        int    n_concur;     // max number of nodes that run at the same time, 1 runs the nodes one by one
+        size_t concur_wsize; // size of the work buffer slice of each of them
+
+        // order in which the nodes were allocated, as passed to `ggml_allocr_set_parse_seq()`, NULL for the graph order
+        const int * parse_seq;
+        int         parse_seq_len;
+
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
@@ -1273,6 +1285,23 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
 
+    // fused soft_max(a*scale + mask + alibi) over attention scores a [n_kv, n_tokens, n_head]
+    // mask:   [n_kv, n_tokens] F32 added to every head, or NULL to mask causally with n_past like ggml_diag_mask_inf
+    //         (n_past < 0: no mask)
+    // slopes: [n_head] F32 ALiBi slope per head (see ggml_alibi_slopes), or NULL for no ALiBi bias
+    // pos:    [n_kv] I32 position of each key for the ALiBi bias, or NULL to use the column index like ggml_alibi
+    GGML_API struct ggml_tensor * ggml_soft_max_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * mask,
+            struct ggml_tensor  * slopes,
+            struct ggml_tensor  * pos,
+            float                 scale,
+            int                   n_past);
+
+    // the per-head slopes used by ggml_alibi, compute them once per model for ggml_soft_max_ext
+    GGML_API void ggml_alibi_slopes(int n_head, float max_bias, float * slopes);
+
     GGML_API struct ggml_tensor * ggml_soft_max_back(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -1477,6 +1506,15 @@ extern "C" {
            struct ggml_tensor  * d,
            bool                  masked);
 
+    // attention output from V stored one row per cell:
+    // v:   [d, n_kv, n_head_kv] F16 or F32, rows contiguous
+    // kq:  [n_kv, n_tokens, n_head] F32 (softmax), n_head a multiple of n_head_kv
+    // res: [d, n_tokens, n_head] F32, same as ggml_mul_mat(ggml_cont(ggml_transpose(v)), kq)
+    GGML_API struct ggml_tensor * ggml_attn_v(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * kq);
+
     GGML_API struct ggml_tensor * ggml_flash_ff(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -1708,6 +1746,11 @@ extern "C" {
     GGML_API               int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
     GGML_API              void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // lists the nodes in steps of up to n_concur nodes that do not depend on each other, each step followed by -1
+    // (at most GGML_MAX_CONCUR entries). allocating the graph in this order with ggml_allocr_set_parse_seq() and
+    // passing the list in plan.parse_seq lets ggml_graph_compute() run the nodes of a step at the same time
+    GGML_API int ggml_graph_find_concurrency(const struct ggml_cgraph * cgraph, int n_concur, int * list);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
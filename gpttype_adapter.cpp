@@ -42,7 +42,6 @@ int last_token_count = 0;
 stop_reason last_stop_reason = stop_reason::INVALID;
 std::vector<std::string> generated_tokens;
 
-llama_grammar *  grammar = nullptr; //currently used grammar
 grammar_parser::parse_state parsed_grammar;
 static std::string current_grammar = "";
 
@@ -82,7 +81,6 @@ static bool unbanTokens = false;
 static int blasbatchsize = 512;
 static int debugmode = 0; //-1 = hide all, 0 = normal, 1 = showall
 static std::string modelname;
-static std::vector<gpt_vocab::id> last_n_tokens;
 static std::vector<gpt_vocab::id> current_context_tokens;
 static size_t mem_per_token = 0;
 static std::vector<float> logits;
@@ -90,13 +88,43 @@ static std::vector<int> smartcontext;
 static std::vector<std::string> stop_sequence;
 static std::vector<std::string> banned_tokens;
 static std::vector<int> banned_token_ids;
-static std::vector<llama_token_data> top_picks;
+static int logprobs_count = 0; //n_probs requested for the current generation
 static int remaining_tokens = 0;
 static int stopper_unused_tokens = 0;
-static std::mutex concat_output_mtx;
-static std::string concat_output = "";
+static std::mutex concat_output_mtx; //guards current_output swaps and text appends
+static kcpp_output_buffer * current_output = new kcpp_output_buffer();
 static std::string concat_output_reader_copy = "";
 
+//all sampler state of one generation slot. the workspaces are sized once and only reset between requests,
+//so picking a token never allocates, and nothing carries over from one request (or user) to the next
+struct sampler_context
+{
+    std::mt19937 rng;
+    float mirostat_mu = 0;
+    std::vector<gpt_vocab::id> last_n_tokens; //repetition penalty window
+    std::vector<llama_token_data> candidates; //n_vocab entries
+    std::vector<double> cumprobs; //cumulative distribution for the final draw
+    llama_grammar * grammar = nullptr; //kept across requests when grammar_retain_state is set
+
+    //results of the last draw, for logprobs and debug output
+    std::vector<llama_token_data> top_picks;
+    float last_chosen_logprob = 0;
+    generation_logprob last_top_logprobs[logprobs_max];
+
+    void reset(int n_vocab, int last_n_size, unsigned int seed, float mirostat_tau)
+    {
+        rng.seed(seed);
+        mirostat_mu = 2.0f * mirostat_tau;
+        last_n_tokens.assign(last_n_size, 0);
+        candidates.reserve(n_vocab);
+        cumprobs.reserve(n_vocab);
+        top_picks.reserve(5);
+        top_picks.clear();
+        last_chosen_logprob = 0;
+    }
+};
+static sampler_context sampler;
+
 inline bool IsNanCheck(float f)
 {
     const unsigned int u = *(unsigned int*)&f;
@@ -108,7 +136,7 @@ inline bool LogitsDuplicated(std::vector<float> & arr1, std::vector<float> & arr
     int compareQty = 5;
     if(arr1.size() < compareQty || arr2.size() < compareQty || arr1.size()!=arr2.size())
     {
-        printf("\nError: Logit array sizes are bad!\n");
+        kcpp_log(KCPP_LOG_ALWAYS, "\nError: Logit array sizes are bad!\n");
         return false;
     }
     for(int i=0;i<compareQty;++i)
@@ -132,7 +160,7 @@ static std::string FileFormatTokenizeID(int id, FileFormat file_format)
     {
         return std::string(llama_v3_token_to_str(llama_ctx_v3, id));
     }
-    else if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+    else if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
     {
         return std::string(llama_token_to_str(llama_ctx_v4, id));
     }
@@ -144,7 +172,7 @@ static std::string FileFormatTokenizeID(int id, FileFormat file_format)
 
 static void TokenizeString(const std::string & str_to_tokenize, std::vector<int> & output_tokens, FileFormat file_format)
 {
-    if (file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2  || file_format == FileFormat::GGJT_3 || file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+    if (file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2  || file_format == FileFormat::GGJT_3 || file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
     {
         if(file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2 )
         {
@@ -160,7 +188,8 @@ static void TokenizeString(const std::string & str_to_tokenize, std::vector<int>
         }
         else
         {
-            output_tokens = ::llama_tokenize(llama_ctx_v4, str_to_tokenize, true);
+            //gpt-j, gpt-neox, gpt-2 and mpt were trained without a leading bos, same as the legacy gpt_tokenize
+            output_tokens = ::llama_tokenize(llama_ctx_v4, str_to_tokenize, file_format!=FileFormat::GGUF_GENERIC);
         }
     }
     else
@@ -173,9 +202,9 @@ static int GetEosID(FileFormat file_format, int32_t n_vocab)
 {
     unsigned int eosID = 0;
 
-    if(file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2 || file_format == FileFormat::GGJT_3 || file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+    if(file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2 || file_format == FileFormat::GGJT_3 || file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
     {
-        if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+        if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
         {
             eosID = llama_token_eos(llama_ctx_v4);
         }
@@ -249,27 +278,61 @@ static std::string RemoveBell(const std::string & input) //removes the bell char
 }
 
 
-llama_token sample_token(llama_token_data_array * candidates, std::mt19937 & rng)
+//same draw as std::discrete_distribution (one canonical double against the normalized cumulative sums,
+//no rng use for a single candidate), so seeds keep their results, but into a reused buffer
+static int sample_index(sampler_context & ctx, const llama_token_data_array * candidates)
 {
-    llama_sample_softmax(nullptr, candidates);
-    std::vector<float> probs;
-    probs.reserve(candidates->size);
-    top_picks.clear();
+    if (candidates->size < 2)
+    {
+        return 0;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        sum += (double)candidates->data[i].p;
+    }
+    ctx.cumprobs.resize(candidates->size);
+    double acc = 0;
     for (size_t i = 0; i < candidates->size; ++i) {
-        probs.push_back(candidates->data[i].p);
+        acc += (double)candidates->data[i].p / sum;
+        ctx.cumprobs[i] = acc;
     }
+    ctx.cumprobs.back() = 1.0;
+    const double r = std::generate_canonical<double, std::numeric_limits<double>::digits>(ctx.rng);
+    return std::lower_bound(ctx.cumprobs.begin(), ctx.cumprobs.end(), r) - ctx.cumprobs.begin();
+}
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+llama_token sample_token(sampler_context & ctx, llama_token_data_array * candidates)
+{
+    llama_sample_softmax(nullptr, candidates);
+    ctx.top_picks.clear();
+    int idx = sample_index(ctx, candidates);
 
-    if(debugmode==1)
+    //logprobs come from the distribution the token was actually drawn from, i.e. after the samplers and temperature
+    ctx.last_chosen_logprob = logf(candidates->data[idx].p);
+    if(logprobs_count>0)
     {
-        top_picks.push_back(candidates->data[idx]);
+        //softmax leaves the candidates sorted, so the top n are already at the front
+        for (int i = 0; i < logprobs_count; ++i)
+        {
+            if(i < candidates->size)
+            {
+                ctx.last_top_logprobs[i] = {candidates->data[i].id, logf(candidates->data[i].p)};
+            }
+            else
+            {
+                ctx.last_top_logprobs[i] = {-1, -INFINITY};
+            }
+        }
+    }
+
+    if(kcpp_log_enabled(KCPP_LOG_DEBUG))
+    {
+        ctx.top_picks.push_back(candidates->data[idx]);
         for (size_t i = 0; (i < candidates->size && i<4); ++i)
         {
             if(i!=idx)
             {
-                top_picks.push_back(candidates->data[i]);
+                ctx.top_picks.push_back(candidates->data[i]);
             }
         }
     }
@@ -278,7 +341,7 @@ llama_token sample_token(llama_token_data_array * candidates, std::mt19937 & rng
     return result;
 }
 
-llama_token sample_token_mirostat(int n_vocab, llama_token_data_array * candidates, std::mt19937 & rng, float tau, float eta, int m, float * mu)
+llama_token sample_token_mirostat(sampler_context & ctx, int n_vocab, llama_token_data_array * candidates, float tau, float eta, int m)
 {
     float N = float(n_vocab);
     llama_sample_softmax(nullptr, candidates);
@@ -295,26 +358,26 @@ llama_token sample_token_mirostat(int n_vocab, llama_token_data_array * candidat
     s_hat = sum_ti_bi / sum_ti_sq;
     // Compute k from the estimated s_hat and target surprise value
     float epsilon_hat = s_hat - 1;
-    float k = powf((epsilon_hat * powf(2, *mu)) / (1 - powf(N, -epsilon_hat)), 1 / s_hat);
+    float k = powf((epsilon_hat * powf(2, ctx.mirostat_mu)) / (1 - powf(N, -epsilon_hat)), 1 / s_hat);
     // Sample the next word X using top-k sampling
     llama_sample_top_k(nullptr, candidates, int(k),1);
-    llama_token X = sample_token(candidates, rng);    // Compute error as the difference between observed surprise and target surprise value
+    llama_token X = sample_token(ctx, candidates);    // Compute error as the difference between observed surprise and target surprise value
     size_t X_idx = std::distance(candidates->data, std::find_if(candidates->data, candidates->data + candidates->size, [&](const llama_token_data & candidate) {
         return candidate.id == X;
     }));
     float observed_surprise = -log2f(candidates->data[X_idx].p);
     float e = observed_surprise - tau;
     // Update mu using the learning rate and error
-    *mu = *mu - eta * e;
+    ctx.mirostat_mu = ctx.mirostat_mu - eta * e;
     return X;
 }
 
-llama_token sample_token_mirostat_v2(llama_token_data_array * candidates, std::mt19937 & rng, float tau, float eta, float * mu)
+llama_token sample_token_mirostat_v2(sampler_context & ctx, llama_token_data_array * candidates, float tau, float eta)
 {
     llama_sample_softmax(nullptr, candidates);
     // Truncate the words with surprise values greater than mu
     candidates->size = std::distance(candidates->data, std::find_if(candidates->data, candidates->data + candidates->size, [&](const llama_token_data & candidate) {
-        return -log2f(candidate.p) > *mu;
+        return -log2f(candidate.p) > ctx.mirostat_mu;
     }));
 
     if (candidates->size == 0) {
@@ -324,7 +387,7 @@ llama_token sample_token_mirostat_v2(llama_token_data_array * candidates, std::m
     // Normalize the probabilities of the remaining words
     llama_sample_softmax(nullptr, candidates);
     // Sample the next word X from the remaining words
-    llama_token X = sample_token(candidates,rng);
+    llama_token X = sample_token(ctx, candidates);
 
     // Compute error as the difference between observed surprise and target surprise value
     size_t X_idx = std::distance(candidates->data, std::find_if(candidates->data, candidates->data + candidates->size, [&](const llama_token_data & candidate) {
@@ -333,7 +396,7 @@ llama_token sample_token_mirostat_v2(llama_token_data_array * candidates, std::m
     float observed_surprise = -log2f(candidates->data[X_idx].p);
     float e = observed_surprise - tau;
     // Update mu using the learning rate and error
-    *mu = *mu - eta * e;
+    ctx.mirostat_mu = ctx.mirostat_mu - eta * e;
     return X;
 }
 
@@ -367,7 +430,7 @@ void sample_top_a(llama_token_data_array * candidates, float a, size_t min_keep)
     candidates->size = last_idx;
 }
 
-void sample_rep_pen(int n_ctx, int rep_pen_range, float rep_pen, llama_token_data_array * candidates_p)
+void sample_rep_pen(const std::vector<gpt_vocab::id> & last_n_tokens, int n_ctx, int rep_pen_range, float rep_pen, llama_token_data_array * candidates_p)
 {
     auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), rep_pen_range), n_ctx);
     llama_sample_repetition_penalty(nullptr, candidates_p,
@@ -429,35 +492,34 @@ void sample_grammar(FileFormat file_format, int32_t n_vocab, llama_token_data_ar
 
 }
 
-int SampleLogits(const float * logits, int n_ctx, int n_vocab, int rep_pen_range, float rep_pen, float top_k, float top_a, float top_p, float typical_p, float tfs, float temp, std::mt19937 & rng,
-int mirostat, float mirostat_tau, float mirostat_eta, const std::vector<samplers> & sampler_order, llama_grammar * grammar)
+int SampleLogits(sampler_context & ctx, const float * logits, int n_ctx, int n_vocab, int rep_pen_range, float rep_pen, float top_k, float top_a, float top_p, float typical_p, float tfs, float temp,
+int mirostat, float mirostat_tau, float mirostat_eta, const std::vector<samplers> & sampler_order)
 {
     int id = 0;
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(n_vocab);
+    std::vector<llama_token_data> & candidates = ctx.candidates;
+    candidates.resize(n_vocab);
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        candidates[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
     }
 
     llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
 
-    if (grammar != nullptr) {
-        sample_grammar(file_format, n_vocab, &candidates_p, grammar);
+    if (ctx.grammar != nullptr) {
+        sample_grammar(file_format, n_vocab, &candidates_p, ctx.grammar);
     }
 
     if (mirostat == 1 || mirostat == 2)
     {
-        static float mirostat_mu = 2.0f * mirostat_tau;
         const int mirostat_m = 100;
-        sample_rep_pen(n_ctx, rep_pen_range, rep_pen, &candidates_p);
+        sample_rep_pen(ctx.last_n_tokens, n_ctx, rep_pen_range, rep_pen, &candidates_p);
         sample_temperature(&candidates_p, temp);
         if (mirostat == 1)
         {
-            id = sample_token_mirostat(n_vocab, &candidates_p, rng, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
+            id = sample_token_mirostat(ctx, n_vocab, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m);
         }
         else
         {
-            id = sample_token_mirostat_v2(&candidates_p, rng, mirostat_tau, mirostat_eta, &mirostat_mu);
+            id = sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta);
         }
     }
     else
@@ -485,14 +547,14 @@ int mirostat, float mirostat_tau, float mirostat_eta, const std::vector<samplers
                     sample_temperature(&candidates_p, temp);
                     break;
                 case KCPP_SAMPLER_REP_PEN:
-                    sample_rep_pen(n_ctx, rep_pen_range, rep_pen, &candidates_p);
+                    sample_rep_pen(ctx.last_n_tokens, n_ctx, rep_pen_range, rep_pen, &candidates_p);
                     break;
                 default:
-                    printf("\nSampleLogits: Unknown Sampler : %d",sampler_order[i]);
+                    kcpp_log(KCPP_LOG_ALWAYS, "\nSampleLogits: Unknown Sampler : %d",sampler_order[i]);
                     break;
             }
         }
-        id = sample_token(&candidates_p, rng);
+        id = sample_token(ctx, &candidates_p);
     }
 
     return id;
@@ -521,19 +583,19 @@ static void grammar_accept_token(FileFormat file_format, int32_t n_vocab, struct
     GGML_ASSERT(!grammar->stacks.empty());
 }
 
-static void load_grammar(const std::string & gammarstr)
+static void load_grammar(sampler_context & ctx, const std::string & gammarstr)
 {
-    if(grammar!=nullptr) //on demand free when next grammar is loaded
+    if(ctx.grammar!=nullptr) //on demand free when next grammar is loaded
     {
-        llama_grammar_free(grammar);
-        grammar = nullptr;
+        llama_grammar_free(ctx.grammar);
+        ctx.grammar = nullptr;
     }
 
     if (!gammarstr.empty()) {
         parsed_grammar = grammar_parser::parse(gammarstr.c_str());
         // will be empty (default) if there are parse errors
         if (parsed_grammar.rules.empty()) {
-            printf("\nIgnored invalid grammar sampler.");
+            kcpp_log(KCPP_LOG_ALWAYS, "\nIgnored invalid grammar sampler.");
             return;
         }
         if(debugmode==1)
@@ -541,7 +603,7 @@ static void load_grammar(const std::string & gammarstr)
             grammar_parser::print_grammar(stderr, parsed_grammar);
         }
         std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
-        grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+        ctx.grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
     }
 }
 
@@ -556,6 +618,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
     modelname = params.model = inputs.model_filename;
     useSmartContext = inputs.use_smartcontext;
     debugmode = inputs.debugmode;
+    kcpp_log_set_level(debugmode);
     unbanTokens = inputs.unban_tokens;
     blasbatchsize = inputs.blasbatchsize;
     if(blasbatchsize<=0)
@@ -567,9 +630,9 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
     auto clamped_max_context_length = inputs.max_context_length;
 
     if(clamped_max_context_length>16384 &&
-    file_format != FileFormat::GGUF_LLAMA && file_format!=FileFormat::GGUF_FALCON)
+    file_format != FileFormat::GGUF_LLAMA && file_format!=FileFormat::GGUF_FALCON && file_format!=FileFormat::GGUF_GENERIC)
     {
-        printf("Warning: Only GGUF models can use max context above 16k. Max context lowered to 16k.\n");
+        kcpp_log(KCPP_LOG_ALWAYS, "Warning: Only GGUF models can use max context above 16k. Max context lowered to 16k.\n");
         clamped_max_context_length = 16384;
     }
 
@@ -587,7 +650,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
     {
         rope_freq_scale = inputs.rope_freq_scale;
         rope_freq_base = inputs.rope_freq_base;
-        printf("Using Custom RoPE scaling (scale:%.3f, base:%.1f).\n",rope_freq_scale,rope_freq_base);
+        kcpp_log(KCPP_LOG_ALWAYS, "Using Custom RoPE scaling (scale:%.3f, base:%.1f).\n",rope_freq_scale,rope_freq_base);
     }
     else
     {
@@ -600,7 +663,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         {
             //approximate NTK aware ctx
             auto effectivenctx = params.n_ctx;
-            if((file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON) && file_format_meta.n_ctx_train > 2048)
+            if((file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC) && file_format_meta.n_ctx_train > 2048)
             {
                 float factor = file_format_meta.n_ctx_train/2048;
                 effectivenctx = effectivenctx/factor;
@@ -610,7 +673,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
         }
 
-        printf("Using automatic RoPE scaling (scale:%.3f, base:%.1f)\n",rope_freq_scale,rope_freq_base);
+        kcpp_log(KCPP_LOG_ALWAYS, "Using automatic RoPE scaling (scale:%.3f, base:%.1f)\n",rope_freq_scale,rope_freq_base);
     }
     gptj_ctx_v3.hparams.rope_freq_scale = neox_ctx_v3.hparams.rope_freq_scale = rope_freq_scale;
     gptj_ctx_v3.hparams.rope_freq_base = neox_ctx_v3.hparams.rope_freq_base = rope_freq_base;
@@ -631,14 +694,51 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
     int cu_parseinfo_maindevice = inputs.cublas_info<=0?0:inputs.cublas_info;
 
-    printf("System Info: %s\n", llama_print_system_info());
+    kcpp_log(KCPP_LOG_ALWAYS, "System Info: %s\n", llama_print_system_info());
     #if defined(GGML_USE_CUBLAS)
     if(ggml_cpu_has_gpublas() && cu_parseinfo_maindevice>0)
     {
-        printf("CUBLAS: Set main device to %d\n",cu_parseinfo_maindevice);
+        kcpp_log(KCPP_LOG_ALWAYS, "CUBLAS: Set main device to %d\n",cu_parseinfo_maindevice);
         ggml_cuda_set_main_device(cu_parseinfo_maindevice);
     }
     #endif
+
+    //measurements from an earlier load of the same model with the same settings let us skip the dry runs below
+    const std::string load_cache_file = executable_path + "koboldcpp_loadcache.txt";
+    std::string load_cache_key = "";
+    {
+        std::string settings = std::to_string(file_format) + "," + std::to_string(clamped_max_context_length)
+        + "," + std::to_string(blasbatchsize) + "," + std::to_string(inputs.gpulayers)
+        + "," + std::to_string(inputs.f16_kv) + "," + std::to_string(inputs.low_vram) + "," + std::to_string(inputs.use_mmq)
+        + "," + std::to_string(use_scratch) + "," + std::to_string(cu_parseinfo_maindevice)
+        + "," + lora_filename + "," + lora_base;
+        //a rebuild can change the graphs and their sizes, this file is the one compiled together with them
+        settings += std::string(",") + __DATE__ + " " + __TIME__;
+        for(int i=0;i<tensor_split_max;++i)
+        {
+            settings += "," + std::to_string(inputs.tensor_split[i]);
+        }
+        load_cache_key = kcpp_load_cache_key(modelname, settings);
+    }
+    kcpp_load_cache_entry load_cache;
+    const bool load_cache_hit = load_cache_key!="" && kcpp_load_cache_get(load_cache_file, load_cache_key, load_cache);
+    if(load_cache_hit)
+    {
+        kcpp_log(KCPP_LOG_INFO, "Using cached load measurements, skipping warm-up eval.\n");
+        mem_per_token = load_cache.mem_per_token;
+    }
+    //only called once a load has fully succeeded, so a cached entry also means the format checks passed
+    auto save_load_cache = [&](size_t alloc_size)
+    {
+        if(!load_cache_hit && load_cache_key!="")
+        {
+            kcpp_load_cache_entry entry;
+            entry.mem_per_token = mem_per_token;
+            entry.alloc_size = alloc_size;
+            kcpp_load_cache_put(load_cache_file, load_cache_key, entry);
+        }
+    };
+
     SetQuantsUnshuffled(false);
     if(file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2)
     {
@@ -658,19 +758,19 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
         if (llama_ctx_v2 == NULL)
         {
-            fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, modelname.c_str());
+            kcpp_log_err("%s: error: failed to load model '%s'\n", __func__, modelname.c_str());
             return ModelLoadResult::FAIL;
         }
 
-        printf("\n---\nWarning: Your model may be an OUTDATED format (ver %d). Please reconvert it for better results!\n---\n", file_format);
+        kcpp_log(KCPP_LOG_ALWAYS, "\n---\nWarning: Your model may be an OUTDATED format (ver %d). Please reconvert it for better results!\n---\n", file_format);
 
         if (lora_filename != "")
         {
-            printf("\nAttempting to apply LORA adapter: %s\n", lora_filename.c_str());
+            kcpp_log(KCPP_LOG_ALWAYS, "\nAttempting to apply LORA adapter: %s\n", lora_filename.c_str());
 
             const char * lora_base_arg = NULL;
             if (lora_base != "") {
-                printf("Using LORA base model: %s\n", lora_base.c_str());
+                kcpp_log(KCPP_LOG_ALWAYS, "Using LORA base model: %s\n", lora_base.c_str());
                 lora_base_arg = lora_base.c_str();
             }
 
@@ -680,7 +780,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
                                                  n_threads);
             if (err != 0)
             {
-                fprintf(stderr, "%s: error: failed to apply lora adapter\n", __func__);
+                kcpp_log_err("%s: error: failed to apply lora adapter\n", __func__);
                 return ModelLoadResult::FAIL;
             }
         }
@@ -688,8 +788,12 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         n_vocab = llama_v2_n_vocab(llama_ctx_v2);
 
         //determine mem per token
-        const std::vector<int> tmp = {1, 2, 3, 4};
-        llama_v2_eval(llama_ctx_v2, tmp.data(), tmp.size(), 0, params.n_threads);
+        if(!load_cache_hit)
+        {
+            const std::vector<int> tmp = {1, 2, 3, 4};
+            llama_v2_eval(llama_ctx_v2, tmp.data(), tmp.size(), 0, params.n_threads);
+        }
+        save_load_cache(0);
         return ModelLoadResult::SUCCESS;
     }
     else if(file_format == FileFormat::GGJT_3)
@@ -728,16 +832,16 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
         if (llama_ctx_v3 == NULL)
         {
-            fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, modelname.c_str());
+            kcpp_log_err("%s: error: failed to load model '%s'\n", __func__, modelname.c_str());
             return ModelLoadResult::FAIL;
         }
         if (lora_filename != "")
         {
-            printf("\nAttempting to apply LORA adapter: %s\n", lora_filename.c_str());
+            kcpp_log(KCPP_LOG_ALWAYS, "\nAttempting to apply LORA adapter: %s\n", lora_filename.c_str());
 
             const char * lora_base_arg = NULL;
             if (lora_base != "") {
-                printf("Using LORA base model: %s\n", lora_base.c_str());
+                kcpp_log(KCPP_LOG_ALWAYS, "Using LORA base model: %s\n", lora_base.c_str());
                 lora_base_arg = lora_base.c_str();
             }
 
@@ -747,7 +851,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
                                                  n_threads);
             if (err != 0)
             {
-                fprintf(stderr, "%s: error: failed to apply lora adapter\n", __func__);
+                kcpp_log_err("%s: error: failed to apply lora adapter\n", __func__);
                 return ModelLoadResult::FAIL;
             }
         }
@@ -755,15 +859,19 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         n_vocab = llama_v3_n_vocab(llama_ctx_v3);
 
         //determine mem per token
-        const std::vector<int> tmp = {1, 2, 3, 4};
-        auto er = llama_v3_eval(llama_ctx_v3, tmp.data(), tmp.size(), 0, params.n_threads);
-        if(er!=0)
+        if(!load_cache_hit)
         {
-            printf("\nLLAMA EVAL returned nonzero!\n");
+            const std::vector<int> tmp = {1, 2, 3, 4};
+            auto er = llama_v3_eval(llama_ctx_v3, tmp.data(), tmp.size(), 0, params.n_threads);
+            if(er!=0)
+            {
+                kcpp_log(KCPP_LOG_ALWAYS, "\nLLAMA EVAL returned nonzero!\n");
+            }
         }
+        save_load_cache(0);
         return ModelLoadResult::SUCCESS;
     }
-    else if(file_format==FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+    else if(file_format==FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
     {
         llama_model_params model_params = llama_model_default_params();
         llama_context_params llama_ctx_params = llama_context_default_params();
@@ -780,7 +888,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         #if defined(GGML_USE_CLBLAST)
         if(file_format==FileFormat::GGUF_FALCON && model_params.n_gpu_layers>0)
         {
-            printf("\nGPU layer offload for GGUF FALCON on OpenCL is known to have issues, it has been set to 0.\n");
+            kcpp_log(KCPP_LOG_ALWAYS, "\nGPU layer offload for GGUF FALCON on OpenCL is known to have issues, it has been set to 0.\n");
             model_params.n_gpu_layers = 0;
         }
         #endif
@@ -790,6 +898,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         llama_ctx_params.n_batch = blasbatchsize;
         llama_ctx_params.n_threads = n_threads;
         llama_ctx_params.n_threads_batch = n_blasthreads;
+        llama_ctx_params.alloc_size = load_cache.alloc_size;
 
         #if defined(GGML_USE_CUBLAS)
         bool ts_all_zero = true;
@@ -810,16 +919,16 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
         if (llama_ctx_v4 == NULL)
         {
-            fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, modelname.c_str());
+            kcpp_log_err("%s: error: failed to load model '%s'\n", __func__, modelname.c_str());
             return ModelLoadResult::FAIL;
         }
         if (lora_filename != "")
         {
-            printf("\nAttempting to apply LORA adapter: %s\n", lora_filename.c_str());
+            kcpp_log(KCPP_LOG_ALWAYS, "\nAttempting to apply LORA adapter: %s\n", lora_filename.c_str());
 
             const char * lora_base_arg = NULL;
             if (lora_base != "") {
-                printf("Using LORA base model: %s\n", lora_base.c_str());
+                kcpp_log(KCPP_LOG_ALWAYS, "Using LORA base model: %s\n", lora_base.c_str());
                 lora_base_arg = lora_base.c_str();
             }
 
@@ -830,7 +939,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
                                                  n_threads);
             if (err != 0)
             {
-                fprintf(stderr, "%s: error: failed to apply lora adapter\n", __func__);
+                kcpp_log_err("%s: error: failed to apply lora adapter\n", __func__);
                 return ModelLoadResult::FAIL;
             }
         }
@@ -838,12 +947,16 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         n_vocab = llama_n_vocab(llamamodel);
 
         //determine mem per token
-        std::vector<int> tmp = {1, 2, 3, 4};
-        auto er = llama_eval(llama_ctx_v4, tmp.data(), tmp.size(), 0);
-        if(er!=0)
+        if(!load_cache_hit)
         {
-            printf("\nLLAMA EVAL returned nonzero!\n");
+            std::vector<int> tmp = {1, 2, 3, 4};
+            auto er = llama_eval(llama_ctx_v4, tmp.data(), tmp.size(), 0);
+            if(er!=0)
+            {
+                kcpp_log(KCPP_LOG_ALWAYS, "\nLLAMA EVAL returned nonzero!\n");
+            }
         }
+        save_load_cache(llama_get_alloc_size(llama_ctx_v4));
         return ModelLoadResult::SUCCESS;
     }
     else if (file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
@@ -865,10 +978,10 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
             const struct rwkv_file_header & header = rwkv_ctx_v3->instance->model.header;
             const size_t n_vocab = header.n_vocab;
-            printf("\nDetected Vocab: %zu",n_vocab);
+            kcpp_log(KCPP_LOG_ALWAYS, "\nDetected Vocab: %zu",n_vocab);
             if(n_vocab>60000)
             {
-                printf("\nUsing WORLD TOKENIZER");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nUsing WORLD TOKENIZER");
                 useWorldTokenizer = true;
             }
         }
@@ -891,7 +1004,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             vocab.token_to_id[word] = i;
             vocab.id_to_token[i] = word;
         }
-        printf("\nRWKV Vocab: %u\n", vocabsiz);
+        kcpp_log(KCPP_LOG_ALWAYS, "\nRWKV Vocab: %u\n", vocabsiz);
         logits.resize(vocabsiz);
 
         n_vocab = vocab.id_to_token.size(); //handled seperately
@@ -905,7 +1018,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             auto statebufsiz = rwkv_v2_get_state_buffer_element_count(rwkv_ctx_v2) * sizeof(float) + padding;
             auto logitbufsiz = rwkv_v2_get_logits_buffer_element_count(rwkv_ctx_v2) * sizeof(float) + padding;
 
-            printf("\nRWKV old Init: State Buffer:%lu, Logit Buffer:%lu\n", statebufsiz, logitbufsiz);
+            kcpp_log(KCPP_LOG_ALWAYS, "\nRWKV old Init: State Buffer:%lu, Logit Buffer:%lu\n", statebufsiz, logitbufsiz);
             rwkv_ctx_v2->state_out = (float *)malloc(statebufsiz);
             rwkv_ctx_v2->logits_out = (float *)malloc(logitbufsiz);
             rwkv_ctx_v2->state_in = nullptr;
@@ -913,7 +1026,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             bool testeval = rwkv_v2_eval(rwkv_ctx_v2, 0, rwkv_ctx_v2->state_in, rwkv_ctx_v2->state_out, rwkv_ctx_v2->logits_out);
             if (!testeval)
             {
-                printf("\nError: RWKV old Init Eval Failed!\n");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nError: RWKV old Init Eval Failed!\n");
             }
 
             memcpy(logits.data(), rwkv_ctx_v2->logits_out, sizeof(float) * vocabsiz);
@@ -933,7 +1046,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             auto statebufsiz = rwkv_get_state_buffer_element_count(rwkv_ctx_v3) * sizeof(float) + padding;
             auto logitbufsiz = rwkv_get_logits_buffer_element_count(rwkv_ctx_v3) * sizeof(float) + padding;
 
-            printf("\nRWKV Init: State Buffer:%lu, Logit Buffer:%lu\n", statebufsiz, logitbufsiz);
+            kcpp_log(KCPP_LOG_ALWAYS, "\nRWKV Init: State Buffer:%lu, Logit Buffer:%lu\n", statebufsiz, logitbufsiz);
             rwkv_ctx_v3->state_out = (float *)malloc(statebufsiz);
             rwkv_ctx_v3->logits_out = (float *)malloc(logitbufsiz);
             rwkv_ctx_v3->state_in = nullptr;
@@ -941,7 +1054,7 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             bool testeval = rwkv_eval(rwkv_ctx_v3, params.n_threads, 0, rwkv_ctx_v3->state_in, rwkv_ctx_v3->state_out, rwkv_ctx_v3->logits_out);
             if (!testeval)
             {
-                printf("\nError: RWKV Init Eval Failed!\n");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nError: RWKV Init Eval Failed!\n");
             }
 
             memcpy(logits.data(), rwkv_ctx_v3->logits_out, sizeof(float) * vocabsiz);
@@ -958,19 +1071,23 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         ModelLoadResult res = legacy_gpt2_model_load(params.model, gpt2_ctx_v1, vocab, file_format);
         if(res==ModelLoadResult::FAIL)
         {
-            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
             return res;
         }
         else if(res==ModelLoadResult::RETRY_LOAD)
         {
-            printf("\nTensor Transposition Detected! Retrying GPT-2 model loading...");
+            kcpp_log(KCPP_LOG_ALWAYS, "\nTensor Transposition Detected! Retrying GPT-2 model loading...");
             return res;
         }
 
         n_vocab = gpt2_ctx_v1.hparams.n_vocab;
 
-         // determine the required inference memory per token:
-        legacy_gpt2_eval(gpt2_ctx_v1, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, file_format);
+        // determine the required inference memory per token:
+        if(!load_cache_hit)
+        {
+            legacy_gpt2_eval(gpt2_ctx_v1, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, file_format);
+        }
+        save_load_cache(0);
         return ModelLoadResult::SUCCESS;
     }
     else if (file_format == FileFormat::GPT2_2 || file_format==FileFormat::GPT2_3 || file_format==FileFormat::GPT2_4)
@@ -980,19 +1097,23 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             ModelLoadResult res = gpt2_model_load(params.model, gpt2_ctx_v3, vocab, file_format, inputs.gpulayers);
             if(res==ModelLoadResult::FAIL)
             {
-                fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+                kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
                 return res;
             }
             else if(res==ModelLoadResult::RETRY_LOAD)
             {
-                printf("\nTensor Transposition Detected! Retrying GPT-2 model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nTensor Transposition Detected! Retrying GPT-2 model loading...");
                 return res;
             }
 
             n_vocab = gpt2_ctx_v3.hparams.n_vocab;
 
             // determine the required inference memory per token:
-            gpt2_eval(gpt2_ctx_v3, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, use_scratch);
+            if(!load_cache_hit)
+            {
+                gpt2_eval(gpt2_ctx_v3, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, use_scratch);
+            }
+            save_load_cache(0);
             return ModelLoadResult::SUCCESS;
         }
         else
@@ -1003,19 +1124,23 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             ModelLoadResult res = gpt2_v2_model_load(params.model, gpt2_ctx_v2, vocab, file_format, inputs.gpulayers);
             if(res==ModelLoadResult::FAIL)
             {
-                fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+                kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
                 return res;
             }
             else if(res==ModelLoadResult::RETRY_LOAD)
             {
-                printf("\nTensor Transposition Detected! Retrying GPT-2 model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nTensor Transposition Detected! Retrying GPT-2 model loading...");
                 return res;
             }
 
             n_vocab = gpt2_ctx_v2.hparams.n_vocab;
 
             // determine the required inference memory per token:
-            gpt2_v2_eval(gpt2_ctx_v2, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, file_format);
+            if(!load_cache_hit)
+            {
+                gpt2_v2_eval(gpt2_ctx_v2, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, file_format);
+            }
+            save_load_cache(0);
             return ModelLoadResult::SUCCESS;
         }
     }
@@ -1024,28 +1149,34 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         ModelLoadResult res = legacy_gptj_model_load(params.model, gptj_ctx_v1, vocab, file_format);
         if(res==ModelLoadResult::FAIL)
         {
-            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
             return res;
         }
         else if(res==ModelLoadResult::RETRY_LOAD)
         {
-            printf("\nTensor Transposition Detected! Retrying GPT-J model loading...");
+            kcpp_log(KCPP_LOG_ALWAYS, "\nTensor Transposition Detected! Retrying GPT-J model loading...");
             return res;
         }
 
         n_vocab = gptj_ctx_v1.hparams.n_vocab;
 
+        if(load_cache_hit)
+        {
+            return ModelLoadResult::SUCCESS; //the checks below already passed when the entry was saved
+        }
+
          // determine the required inference memory per token:
         legacy_gptj_eval(gptj_ctx_v1, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, file_format);
 
         //if the logits are NAN or duplicated, it means the model is incompatible
         if(logits.size()>0 && IsNanCheck(logits[0]))
         {
-            printf("\nBad Logits detected! Retrying GPT-J model loading...");
+            kcpp_log(KCPP_LOG_ALWAYS, "\nBad Logits detected! Retrying GPT-J model loading...");
             ggml_v1_free(gptj_ctx_v1.ctx);
             return ModelLoadResult::RETRY_LOAD;
         }
 
+        save_load_cache(0);
         return ModelLoadResult::SUCCESS;
     }
     else if(file_format == FileFormat::GPTJ_3 || file_format == FileFormat::GPTJ_4 || file_format == FileFormat::GPTJ_5)
@@ -1055,17 +1186,22 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             ModelLoadResult loadresult = gptj_model_load(params.model, gptj_ctx_v3, vocab, inputs.gpulayers);
             if (loadresult == ModelLoadResult::FAIL)
             {
-                fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+                kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
                 return loadresult;
             }
             else if (loadresult == ModelLoadResult::RETRY_LOAD)
             {
-                printf("\nTensor Transposition Detected! Retrying GPT-J model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nTensor Transposition Detected! Retrying GPT-J model loading...");
                 return loadresult;
             }
 
             n_vocab = gptj_ctx_v3.hparams.n_vocab;
 
+            if(load_cache_hit)
+            {
+                return ModelLoadResult::SUCCESS; //the checks below already passed when the entry was saved
+            }
+
             // determine the required inference memory per token:
             gptj_eval(gptj_ctx_v3, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, use_scratch);
 
@@ -1078,11 +1214,12 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
             if(logits.size()>0 && (IsNanCheck(logits[0]) || LogitsDuplicated(oldlogits,logits)))
             {
-                printf("\nBad Logits detected! Retrying GPT-J model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nBad Logits detected! Retrying GPT-J model loading...");
                 ggml_free(gptj_ctx_v3.ctx);
                 return ModelLoadResult::RETRY_LOAD;
             }
 
+            save_load_cache(0);
             return ModelLoadResult::SUCCESS;
         }
         else
@@ -1093,17 +1230,22 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             ModelLoadResult loadresult = gptj_v2_model_load(params.model, gptj_ctx_v2, vocab, inputs.gpulayers);
             if (loadresult == ModelLoadResult::FAIL)
             {
-                fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+                kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
                 return loadresult;
             }
             else if (loadresult == ModelLoadResult::RETRY_LOAD)
             {
-                printf("\nTensor Transposition Detected! Retrying GPT-J model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nTensor Transposition Detected! Retrying GPT-J model loading...");
                 return loadresult;
             }
 
             n_vocab = gptj_ctx_v2.hparams.n_vocab;
 
+            if(load_cache_hit)
+            {
+                return ModelLoadResult::SUCCESS; //the checks below already passed when the entry was saved
+            }
+
             // determine the required inference memory per token:
             gptj_v2_eval(gptj_ctx_v2, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token);
 
@@ -1116,11 +1258,12 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
             if(logits.size()>0 && (IsNanCheck(logits[0]) || LogitsDuplicated(oldlogits,logits)))
             {
-                printf("\nBad Logits detected! Retrying GPT-J model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nBad Logits detected! Retrying GPT-J model loading...");
                 ggml_v2_free(gptj_ctx_v2.ctx);
                 return ModelLoadResult::RETRY_LOAD;
             }
 
+            save_load_cache(0);
             return ModelLoadResult::SUCCESS;
         }
     }
@@ -1131,20 +1274,23 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             ModelLoadResult res = gpt_neox_model_load(params.model, neox_ctx_v3, vocab, file_format, inputs.gpulayers);
             if(res==ModelLoadResult::FAIL)
             {
-                fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+                kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
                 return res;
             }
             else if(res==ModelLoadResult::RETRY_LOAD)
             {
-                printf("\nIncorrect Tensor Size Detected! Retrying GPT-NeoX model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nIncorrect Tensor Size Detected! Retrying GPT-NeoX model loading...");
                 return res;
             }
 
             n_vocab = neox_ctx_v3.hparams.n_vocab;
 
             // determine the required inference memory per token:
-            gpt_neox_eval(neox_ctx_v3, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, use_scratch);
-
+            if(!load_cache_hit)
+            {
+                gpt_neox_eval(neox_ctx_v3, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token, use_scratch);
+            }
+            save_load_cache(0);
             return ModelLoadResult::SUCCESS;
         }
         else
@@ -1155,17 +1301,22 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
             ModelLoadResult res = gpt_neox_v2_model_load(params.model, neox_ctx_v2, vocab, file_format);
             if(res==ModelLoadResult::FAIL)
             {
-                fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+                kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
                 return res;
             }
             else if(res==ModelLoadResult::RETRY_LOAD)
             {
-                printf("\nIncorrect Tensor Size Detected! Retrying GPT-NeoX model loading...");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nIncorrect Tensor Size Detected! Retrying GPT-NeoX model loading...");
                 return res;
             }
 
             n_vocab = neox_ctx_v2.hparams.n_vocab;
 
+            if(load_cache_hit)
+            {
+                return ModelLoadResult::SUCCESS; //the checks below already passed when the entry was saved
+            }
+
             // determine the required inference memory per token:
             gpt_neox_v2_eval(neox_ctx_v2, params.n_threads, 0, { 0, 1, 2, 3 }, logits, mem_per_token);
 
@@ -1182,12 +1333,13 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
                 auto findresult = predicted.find("8");
                 if(findresult != std::string::npos && findresult<2)
                 {
-                    printf("\n---\nOld RedPajama NeoX Detected! Switching to new format! (use_parallel_residual=False)\n");
+                    kcpp_log(KCPP_LOG_ALWAYS, "\n---\nOld RedPajama NeoX Detected! Switching to new format! (use_parallel_residual=False)\n");
                     ggml_v2_free(neox_ctx_v2.ctx);
                     return ModelLoadResult::RETRY_LOAD;
                 }
             }
 
+            save_load_cache(0);
             return ModelLoadResult::SUCCESS;
         }
 
@@ -1197,19 +1349,23 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         bool res = mpt_model_load(params.model, mpt_ctx_v3, vocab, inputs.gpulayers);
         if(res==false)
         {
-            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            kcpp_log_err("%s: failed to load model from '%s'\n", __func__, params.model.c_str());
             return ModelLoadResult::FAIL;
         }
 
         n_vocab = mpt_ctx_v3.hparams.n_vocab;
 
         // determine the required inference memory per token:
-        mpt_eval(mpt_ctx_v3, params.n_threads, 0, { 0, 1, 2, 3 }, logits, false, mem_per_token, use_scratch);
+        if(!load_cache_hit)
+        {
+            mpt_eval(mpt_ctx_v3, params.n_threads, 0, { 0, 1, 2, 3 }, logits, false, mem_per_token, use_scratch);
+        }
+        save_load_cache(0);
         return ModelLoadResult::SUCCESS;
     }
     else
     {
-        printf("\nUnknown Model, cannot load.\n");
+        kcpp_log(KCPP_LOG_ALWAYS, "\nUnknown Model, cannot load.\n");
         return ModelLoadResult::FAIL;
     }
 
@@ -1224,34 +1380,433 @@ bool gpttype_generate_abort()
 
 int gpttype_token_count(const std::string & input)
 {
-    if(debugmode==1)
-    {
-        printf("\nFileFormat: %d, Tokenizing: %s",file_format ,input.c_str());
-    }
+    kcpp_log(KCPP_LOG_DEBUG, "\nFileFormat: %d, Tokenizing: %s",file_format ,input.c_str());
     std::vector<int> toks;
     TokenizeString(input, toks, file_format);
     int tokcount = toks.size();
-    if(debugmode==1)
-    {
-        printf("\nTokens Counted: %d\n",tokcount);
-    }
+    kcpp_log(KCPP_LOG_DEBUG, "\nTokens Counted: %d\n",tokcount);
     return tokcount;
 }
 
+const std::string & gpttype_token_to_text(int id)
+{
+    static std::string token_text_reader_copy = "";
+    token_text_reader_copy = (id >= 0 && id < n_vocab) ? FileFormatTokenizeID(id, file_format) : "";
+    return token_text_reader_copy;
+}
+
 const std::string & gpttype_get_pending_output()
 {
     concat_output_mtx.lock();
-    concat_output_reader_copy = concat_output;
+    concat_output_reader_copy = current_output->text;
     concat_output_mtx.unlock();
     return concat_output_reader_copy;
 }
 
+kcpp_output_buffer * gpttype_acquire_output()
+{
+    std::lock_guard<std::mutex> lock(concat_output_mtx);
+    if(current_output->status==-1)
+    {
+        return nullptr; //still being written by a generation, or nothing generated yet
+    }
+    current_output->refs.fetch_add(1);
+    return current_output;
+}
+
+void gpttype_release_output(kcpp_output_buffer * buf)
+{
+    if(buf!=nullptr && buf->refs.fetch_sub(1)==1)
+    {
+        delete buf;
+    }
+}
+
+//reuse the previous buffer (and its capacity) unless a reader still holds it
+static void reset_current_output()
+{
+    std::lock_guard<std::mutex> lock(concat_output_mtx);
+    if(current_output->refs.load()==1)
+    {
+        current_output->status = -1;
+        current_output->text.clear();
+        current_output->token_meta.clear();
+        current_output->top_logprobs.clear();
+    }
+    else
+    {
+        gpttype_release_output(current_output);
+        current_output = new kcpp_output_buffer();
+    }
+    concat_output_reader_copy = "";
+}
+
+//the status is written under the lock so gpttype_acquire_output never hands out a buffer that is still growing
+static void finish_current_output(int status)
+{
+    std::lock_guard<std::mutex> lock(concat_output_mtx);
+    current_output->status = status;
+    generation_finished = true;
+}
+
+//incremental detokenizer for the current generation. token bytes go in, and only spans that are complete utf-8
+//and can no longer grow into a stop sequence come out, so a stream never splits a codepoint or shows part of a stopper.
+//pending never holds more than the longest stopper (or one codepoint), so the stop check stays cheap as the text grows.
+struct stream_detokenizer
+{
+    std::string pending;
+    const std::string * stopped = nullptr; //the stop sequence that ended this generation, if any
+
+    void reset()
+    {
+        pending.clear();
+        stopped = nullptr;
+    }
+
+    //length of the prefix of s that does not end inside a multibyte sequence
+    static size_t utf8_complete_len(const std::string & s)
+    {
+        const size_t n = s.size();
+        for (size_t k = 1; k <= 4 && k <= n; ++k)
+        {
+            const unsigned char c = s[n - k];
+            if ((c & 0xC0) == 0x80)
+            {
+                continue;
+            }
+            const size_t need = (c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1);
+            return (need > k ? n - k : n);
+        }
+        return n; //not utf-8, nothing to wait for
+    }
+
+    //start of the longest tail of s that is a proper prefix of stopper, or s.size() if there is none
+    static size_t stop_prefix_start(const std::string & s, const std::string & stopper)
+    {
+        const size_t n = s.size();
+        size_t i = (stopper.size() > n ? 0 : n - stopper.size() + 1);
+        for (; i < n; ++i)
+        {
+            if (s.compare(i, n - i, stopper, 0, n - i) == 0)
+            {
+                return i;
+            }
+        }
+        return n;
+    }
+
+    //appends the bytes of one token and moves whatever became safe to out. returns true once a stop sequence
+    //has been hit, out then ends right before it and the stopper itself is never emitted
+    bool push(const std::string & piece, const std::vector<std::string> & stoppers, std::string & out)
+    {
+        if (stopped != nullptr)
+        {
+            return true;
+        }
+        pending += piece;
+        size_t hit = std::string::npos;
+        for (const auto & stopper : stoppers)
+        {
+            size_t pos = pending.find(stopper);
+            if (pos < hit)
+            {
+                hit = pos;
+                stopped = &stopper;
+            }
+        }
+        if (stopped != nullptr)
+        {
+            out.append(pending, 0, hit);
+            pending.clear();
+            return true;
+        }
+        size_t safe = utf8_complete_len(pending);
+        for (const auto & stopper : stoppers)
+        {
+            safe = std::min(safe, stop_prefix_start(pending, stopper));
+        }
+        out.append(pending, 0, safe);
+        pending.erase(0, safe);
+        return false;
+    }
+
+    //generation is over, whatever was held back for a stopper that never came is safe now.
+    //a codepoint the model never finished is dropped
+    void flush(std::string & out)
+    {
+        if (stopped == nullptr)
+        {
+            out.append(pending, 0, utf8_complete_len(pending));
+        }
+        pending.clear();
+    }
+};
+static stream_detokenizer stream_detok;
+
+//feed one generated token to the detokenizer, publishing the safe span for sse readers. returns true on a stop sequence
+static bool stream_token(const std::string & tokenizedstr, bool stream_sse)
+{
+    std::string span;
+    bool stopped = stream_detok.push(tokenizedstr, stop_sequence, span);
+    if (stream_sse && span != "")
+    {
+        generated_tokens.push_back(span);
+    }
+    return stopped;
+}
+
+static void stream_flush(bool stream_sse)
+{
+    std::string span;
+    stream_detok.flush(span);
+    if (stream_sse && span != "")
+    {
+        generated_tokens.push_back(span);
+    }
+}
+
+//one hypothesis of a beam search. its kv cells are tagged with seq id == its index in the beam list
+struct beam_hypothesis
+{
+    std::vector<int> tokens;
+    std::vector<float> token_logprobs;
+    std::vector<generation_logprob> top_alts; //logprobs_count entries per token
+    std::string text;
+    float score = 0; //sum of token logprobs
+    bool done = false;
+};
+
+//deterministic beam search for gguf models, continuing from a prompt already evaluated into seq 0 up to n_past.
+//all live beams are decoded together as one multi-sequence batch. forking a beam only relabels its kv cells
+//with llama_kv_cache_seq_cp, so no shared prefix is ever evaluated twice.
+static bool BeamSearchGGUF(int n_beams, int nctx, bool allow_eos, bool stream_sse)
+{
+    struct beam_candidate
+    {
+        int parent;
+        int token; //-1 = carry a finished beam over unchanged
+        float logprob;
+        float score;
+    };
+
+    const int eosID = GetEosID(file_format, n_vocab);
+    const int prompt_past = n_past;
+    const int n_top = std::max(n_beams, logprobs_count);
+    const int tmp_seq = n_beams; //seq ids [n_beams, 2*n_beams) are scratch while beams are relabelled
+
+    std::vector<beam_hypothesis> beams(1);
+    std::vector<beam_hypothesis> next_beams;
+    std::vector<std::vector<generation_logprob>> beam_alts(1);
+    std::vector<float *> beam_rows = {llama_get_logits(llama_ctx_v4)};
+    std::vector<beam_candidate> pool;
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    llama_batch batch = llama_batch_init(n_beams, 0);
+    bool ok = true;
+
+    while (remaining_tokens > 0)
+    {
+        //expand every live beam by its best n_beams continuations, finished beams compete as they are
+        pool.clear();
+        for (int b = 0; b < beams.size(); ++b)
+        {
+            if (beams[b].done)
+            {
+                pool.push_back({b, -1, 0.0f, beams[b].score});
+                continue;
+            }
+            float * row = beam_rows[b];
+            float lowest = LowestLogit(row, n_vocab);
+            if (!allow_eos)
+            {
+                row[eosID] = lowest;
+            }
+            for (auto t : banned_token_ids)
+            {
+                row[t] = lowest;
+            }
+            float maxl = *std::max_element(row, row + n_vocab);
+            double sum = 0;
+            candidates.clear();
+            for (int i = 0; i < n_vocab; ++i)
+            {
+                sum += exp(row[i] - maxl);
+                candidates.push_back({i, row[i], 0.0f});
+            }
+            float lse = maxl + log(sum);
+            std::partial_sort(candidates.begin(), candidates.begin() + n_top, candidates.end(),
+            [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; });
+            for (int k = 0; k < n_beams; ++k)
+            {
+                float lp = candidates[k].logit - lse;
+                pool.push_back({b, candidates[k].id, lp, beams[b].score + lp});
+            }
+            beam_alts[b].clear();
+            for (int k = 0; k < logprobs_count; ++k)
+            {
+                beam_alts[b].push_back({candidates[k].id, candidates[k].logit - lse});
+            }
+        }
+
+        int keep = std::min((int)pool.size(), n_beams);
+        std::partial_sort(pool.begin(), pool.begin() + keep, pool.end(),
+        [](const beam_candidate & a, const beam_candidate & b) { return a.score > b.score; });
+
+        //fork: every survivor takes over its parent's cells via a scratch seq, then moves into its own slot
+        for (int j = 0; j < keep; ++j)
+        {
+            llama_kv_cache_seq_cp(llama_ctx_v4, pool[j].parent, tmp_seq + j, 0, nctx);
+        }
+        for (int b = 0; b < beams.size(); ++b)
+        {
+            llama_kv_cache_seq_rm(llama_ctx_v4, b, 0, nctx);
+        }
+        for (int j = 0; j < keep; ++j)
+        {
+            llama_kv_cache_seq_cp(llama_ctx_v4, tmp_seq + j, j, 0, nctx);
+            llama_kv_cache_seq_rm(llama_ctx_v4, tmp_seq + j, 0, nctx);
+        }
+
+        next_beams.clear();
+        batch.n_tokens = 0;
+        std::vector<int> batch_rows(keep, -1);
+        for (int j = 0; j < keep; ++j)
+        {
+            const beam_candidate & c = pool[j];
+            next_beams.push_back(beams[c.parent]);
+            beam_hypothesis & beam = next_beams.back();
+            if (c.token < 0)
+            {
+                continue;
+            }
+            beam.tokens.push_back(c.token);
+            beam.token_logprobs.push_back(c.logprob);
+            beam.top_alts.insert(beam.top_alts.end(), beam_alts[c.parent].begin(), beam_alts[c.parent].end());
+            const size_t oldlen = beam.text.size();
+            beam.text += FileFormatTokenizeID(c.token, file_format);
+            beam.score = c.score;
+            if (allow_eos && c.token == eosID)
+            {
+                beam.done = true;
+            }
+            for (const auto &matched : stop_sequence)
+            {
+                //only a match that ends in the new token can be new
+                size_t from = (oldlen + 1 > matched.size() ? oldlen + 1 - matched.size() : 0);
+                if (beam.text.find(matched, from) != std::string::npos)
+                {
+                    beam.done = true;
+                    break;
+                }
+            }
+            if (!beam.done)
+            {
+                int n = batch.n_tokens++;
+                batch.token[n] = c.token;
+                batch.pos[n] = prompt_past + beam.tokens.size() - 1;
+                batch.seq_id[n] = j;
+                batch.logits[n] = true;
+                batch_rows[j] = n;
+            }
+        }
+        beams.swap(next_beams);
+
+        --remaining_tokens;
+        kcpp_log_progress(KCPP_PROGRESS_GENERATE, (params.n_predict - remaining_tokens), params.n_predict);
+
+        if (batch.n_tokens == 0)
+        {
+            stopper_unused_tokens = remaining_tokens;
+            remaining_tokens = 0;
+        }
+        if (remaining_tokens <= 0)
+        {
+            break;
+        }
+        if (llama_decode(llama_ctx_v4, batch) != 0)
+        {
+            ok = false;
+            break;
+        }
+        beam_rows.assign(beams.size(), nullptr);
+        beam_alts.resize(beams.size());
+        for (int j = 0; j < beams.size(); ++j)
+        {
+            if (batch_rows[j] >= 0)
+            {
+                beam_rows[j] = llama_get_logits_ith(llama_ctx_v4, batch_rows[j]);
+            }
+        }
+    }
+    llama_batch_free(batch);
+
+    //drop every beam from the cache. only the prompt remains, as seq 0 with cell index == pos,
+    //which is what llama_eval expects when the next request fast forwards over it
+    for (int s = 1; s < 2 * n_beams; ++s)
+    {
+        llama_kv_cache_seq_rm(llama_ctx_v4, s, 0, nctx);
+    }
+    llama_kv_cache_tokens_rm(llama_ctx_v4, prompt_past, -1);
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    const beam_hypothesis & best = beams[0];
+    if (kcpp_log_enabled(KCPP_LOG_DEBUG))
+    {
+        std::string beamstr = "\n[Debug: Final beams]\n";
+        for (const auto & beam : beams)
+        {
+            std::string tmp = beam.text;
+            ::utreplace(tmp, "\n", "\\n");
+            beamstr += "(" + std::to_string(beam.score) + ") " + RemoveBell(tmp) + "\n";
+        }
+        kcpp_log(KCPP_LOG_DEBUG, "%s", beamstr.c_str());
+    }
+
+    concat_output_mtx.lock();
+    for (int i = 0; i < best.tokens.size(); ++i)
+    {
+        std::string tokenizedstr = FileFormatTokenizeID(best.tokens[i], file_format);
+        stream_token(tokenizedstr, stream_sse);
+        current_output->token_meta.push_back({best.tokens[i], (int)current_output->text.size(), (int)tokenizedstr.size(), best.token_logprobs[i]});
+        current_output->text += tokenizedstr;
+    }
+    current_output->top_logprobs.insert(current_output->top_logprobs.end(), best.top_alts.begin(), best.top_alts.end());
+    concat_output_mtx.unlock();
+
+    if (best.done)
+    {
+        if (allow_eos && best.tokens.size() > 0 && best.tokens.back() == eosID)
+        {
+            kcpp_log(KCPP_LOG_ALWAYS, "\n(EOS token triggered!)");
+            last_stop_reason = stop_reason::EOS_TOKEN;
+        }
+        else
+        {
+            kcpp_log(KCPP_LOG_INFO, "\n(Stop sequence triggered)");
+            last_stop_reason = stop_reason::CUSTOM_STOPPER;
+        }
+    }
+    return true;
+}
+
 generation_outputs gpttype_generate(const generation_inputs inputs, generation_outputs &output)
 {
+    output.status = gpttype_generate_buffered(inputs);
     concat_output_mtx.lock();
-    concat_output = "";
-    concat_output_reader_copy = "";
+    snprintf(output.text, sizeof(output.text), "%s", (output.status==1 ? current_output->text.c_str() : ""));
     concat_output_mtx.unlock();
+    return output;
+}
+
+int gpttype_generate_buffered(const generation_inputs inputs)
+{
+    reset_current_output();
+    logprobs_count = std::max(0, std::min(inputs.n_probs, logprobs_max));
+    current_output->n_probs = logprobs_count;
     last_stop_reason = stop_reason::OUT_OF_TOKENS;
     stop_sequence.clear();
     for(int x=0;x<stop_token_max;++x)
@@ -1283,6 +1838,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
 
     generation_finished = false; // Set current generation status
     generated_tokens.clear(); // New Generation, new tokens
+    stream_detok.reset();
 
     std::string grammarstr = inputs.grammar;
     bool grammar_retain_state = inputs.grammar_retain_state;
@@ -1290,12 +1846,12 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
     {
         if(grammarstr=="" || current_grammar!=grammarstr) //if grammar is identical, retain state
         {
-            load_grammar(grammarstr);
+            load_grammar(sampler, grammarstr);
         }
     }
     else
     {
-        load_grammar(grammarstr);
+        load_grammar(sampler, grammarstr);
     }
     current_grammar = grammarstr;
 
@@ -1320,9 +1876,24 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
     //truncate to front of the prompt if its too long
     int32_t nctx = params.n_ctx;
 
-    if (embd_inp.size() + params.n_predict > nctx)
+    //beam search keeps up to beam_width diverging continuations in the kv cache at once
+    int beam_width = std::min(inputs.beam_width, std::min(beam_width_max, blasbatchsize));
+    bool beammode = (beam_width > 1 && (file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC));
+    if (beammode && sampler.grammar != nullptr)
     {
-        int offset = embd_inp.size() - nctx + params.n_predict;
+        kcpp_log(KCPP_LOG_ALWAYS, "\nBeam search cannot be combined with a grammar, sampling normally.\n");
+        beammode = false;
+    }
+    while (beammode && beam_width > 1 && beam_width * params.n_predict >= nctx)
+    {
+        --beam_width;
+    }
+    beammode = (beammode && beam_width > 1);
+    int reserved_tokens = params.n_predict * (beammode ? beam_width : 1);
+
+    if (embd_inp.size() + reserved_tokens > nctx)
+    {
+        int offset = embd_inp.size() - nctx + reserved_tokens;
         embd_inp = std::vector<int>(embd_inp.begin() + offset, embd_inp.end());
     }
 
@@ -1330,9 +1901,8 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
     std::vector<gpt_vocab::id> embd;
 
     int last_n_size = params.repeat_last_n;
-    last_n_tokens.resize(last_n_size);
-
-    std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
+    sampler.reset(n_vocab, last_n_size, params.seed, params.mirostat_tau);
+    std::vector<gpt_vocab::id> & last_n_tokens = sampler.last_n_tokens;
     n_past = 0;
 
     if (file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
@@ -1359,7 +1929,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
     {
         //for non llama, limit to 256
         int bbs = blasbatchsize;
-        if (file_format != FileFormat::GGML && file_format != FileFormat::GGHF && file_format != FileFormat::GGJT && file_format != FileFormat::GGJT_2 && file_format != FileFormat::GGJT_3 && file_format != FileFormat::GGUF_LLAMA && file_format!=FileFormat::GGUF_FALCON)
+        if (file_format != FileFormat::GGML && file_format != FileFormat::GGHF && file_format != FileFormat::GGJT && file_format != FileFormat::GGJT_2 && file_format != FileFormat::GGJT_3 && file_format != FileFormat::GGUF_LLAMA && file_format!=FileFormat::GGUF_FALCON && file_format!=FileFormat::GGUF_GENERIC)
         {
             bbs = (blasbatchsize > 256 ? 256 : blasbatchsize);
         }
@@ -1384,7 +1954,6 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
     remaining_tokens = params.n_predict;
     stopper_unused_tokens = 0;
     int input_consumed = 0;
-    std::mt19937 rng(params.seed);
 
     //prepare sampler order
     std::vector<samplers> sampler_order;
@@ -1449,13 +2018,13 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
 
     if(n_vocab<=0)
     {
-        printf("\nWarning! n_vocab is invalid, maybe bad format!");
+        kcpp_log(KCPP_LOG_ALWAYS, "\nWarning! n_vocab is invalid, maybe bad format!");
     }
 
     //prepare banned tokens
     if(banned_token_ids.size()==0 && banned_tokens.size()>0)
     {
-        printf("\n[First Run] Banning %zu token sequences...",banned_tokens.size());
+        kcpp_log(KCPP_LOG_ALWAYS, "\n[First Run] Banning %zu token sequences...",banned_tokens.size());
         for(int v=0;v<n_vocab;++v)
         {
             std::string word = FileFormatTokenizeID(v,file_format);
@@ -1468,18 +2037,15 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
                 }
             }
         }
-        printf("\nBanned a total of %zu tokens.\n",banned_token_ids.size());
+        kcpp_log(KCPP_LOG_ALWAYS, "\nBanned a total of %zu tokens.\n",banned_token_ids.size());
     }
 
-    if(debugmode!=-1)
-    {
-        printf("\n");
-    }
+    kcpp_log(KCPP_LOG_INFO, "\n");
 
-    if (debugmode==1)
+    if (kcpp_log_enabled(KCPP_LOG_DEBUG))
     {
         std::string outstr = "";
-        printf("\n[Debug: Dump Input Tokens, format: %d]\n", file_format);
+        kcpp_log(KCPP_LOG_DEBUG, "\n[Debug: Dump Input Tokens, format: %d]\n", file_format);
 
         std::string tmp = "";
         for (auto id : embd_inp)
@@ -1497,7 +2063,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
         }
         ::utreplace(tmp, "\n", "\\n");
         outstr += tmp;
-        printf("%s\n\n", RemoveBell(outstr).c_str());
+        kcpp_log(KCPP_LOG_DEBUG, "%s\n\n", RemoveBell(outstr).c_str());
     }
 
     while (remaining_tokens > 0)
@@ -1505,12 +2071,11 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
         gpt_vocab::id id = 0;
         // predict
         unsigned int embdsize = embd.size();
-        //print progress
-        if (!startedsampling && debugmode!=-1)
+        //print progress, coalesced by the logger so this never waits on the console
+        if (!startedsampling)
         {
-            printf("\rProcessing Prompt%s (%d / %zu tokens)", (blasmode ? " [BLAS]" : ""), input_consumed, embd_inp.size());
+            kcpp_log_progress((blasmode ? KCPP_PROGRESS_PROMPT_BLAS : KCPP_PROGRESS_PROMPT), input_consumed, embd_inp.size());
         }
-        fflush(stdout);
 
         if (embdsize > 0)
         {
@@ -1525,7 +2090,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
             {
                 evalres = (llama_v3_eval(llama_ctx_v3, embd.data(), embdsize, n_past, params.n_threads)==0);
             }
-            else if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+            else if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
             {
                 evalres = (llama_eval(llama_ctx_v4, embd.data(), embdsize, n_past)==0);
             }
@@ -1591,16 +2156,15 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
             }
             else
             {
-                printf("\nCannot find eval function\n");
+                kcpp_log(KCPP_LOG_ALWAYS, "\nCannot find eval function\n");
             }
 
             if (!evalres)
             {
-                fprintf(stderr, "Failed to predict\n");
-                snprintf(output.text, sizeof(output.text), "%s", "");
-                output.status = 0;
-                generation_finished = true;
-                return output;
+                kcpp_log_err("Failed to predict\n");
+                kcpp_log_flush();
+                finish_current_output(0);
+                return 0;
             }
         }
 
@@ -1624,19 +2188,28 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
                 params.n_threads = original_threads;
                 time1 = timer_check();
                 timer_start();
-                if(debugmode!=-1)
+                kcpp_log(KCPP_LOG_INFO, "\n");
+            }
+
+            if (beammode)
+            {
+                if (!BeamSearchGGUF(beam_width, nctx, (unbanTokens || inputs.unban_tokens_rt), stream_sse))
                 {
-                    printf("\n");
+                    kcpp_log_err("Failed to predict\n");
+                    kcpp_log_flush();
+                    finish_current_output(0);
+                    return 0;
                 }
+                break;
             }
 
             unsigned int eosID = GetEosID(file_format, n_vocab);
             float * logitsPtr;
             float lowestLogit = 0;
             int btsize = banned_token_ids.size();
-            if(file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2 || file_format == FileFormat::GGJT_3 || file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+            if(file_format == FileFormat::GGML || file_format == FileFormat::GGHF || file_format == FileFormat::GGJT || file_format == FileFormat::GGJT_2 || file_format == FileFormat::GGJT_3 || file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
             {
-                if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON)
+                if(file_format == FileFormat::GGUF_LLAMA || file_format==FileFormat::GGUF_FALCON || file_format==FileFormat::GGUF_GENERIC)
                 {
                     logitsPtr = llama_get_logits(llama_ctx_v4);
                 }
@@ -1669,12 +2242,12 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
                 }
             }
 
-            id = SampleLogits(logitsPtr, nctx, n_vocab, last_n_size, repeat_penalty,
-            top_k, top_a, top_p, typical_p, tfs_z, temp, rng,
-            params.mirostat, params.mirostat_tau, params.mirostat_eta, sampler_order, grammar);
+            id = SampleLogits(sampler, logitsPtr, nctx, n_vocab, last_n_size, repeat_penalty,
+            top_k, top_a, top_p, typical_p, tfs_z, temp,
+            params.mirostat, params.mirostat_tau, params.mirostat_eta, sampler_order);
 
-            if (grammar != nullptr) {
-                grammar_accept_token(file_format, n_vocab, grammar, id);
+            if (sampler.grammar != nullptr) {
+                grammar_accept_token(file_format, n_vocab, sampler.grammar, id);
             }
 
             last_n_tokens.erase(last_n_tokens.begin());
@@ -1687,63 +2260,62 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
             // decrement remaining sampling budget
             --remaining_tokens;
 
+            bool stopped = false;
             for (auto id : embd)
             {
                 std::string tokenizedstr = FileFormatTokenizeID(id, file_format);
-                if(stream_sse)
+                stopped = stream_token(tokenizedstr, stream_sse) || stopped;
+                concat_output_mtx.lock();
+                current_output->token_meta.push_back({id, (int)current_output->text.size(), (int)tokenizedstr.size(), sampler.last_chosen_logprob});
+                if(logprobs_count>0)
                 {
-                    generated_tokens.push_back(tokenizedstr);
+                    current_output->top_logprobs.insert(current_output->top_logprobs.end(), sampler.last_top_logprobs, sampler.last_top_logprobs + logprobs_count);
                 }
-                concat_output_mtx.lock();
-                concat_output += tokenizedstr;
+                current_output->text += tokenizedstr;
                 concat_output_mtx.unlock();
             }
 
-            if (startedsampling && debugmode!=-1)
+            if (startedsampling)
             {
-                printf("\rGenerating (%d / %d tokens)", (params.n_predict - remaining_tokens), params.n_predict);
+                kcpp_log_progress(KCPP_PROGRESS_GENERATE, (params.n_predict - remaining_tokens), params.n_predict);
             }
-            if(debugmode==1 && top_picks.size()>0)
+            if(kcpp_log_enabled(KCPP_LOG_DEBUG) && sampler.top_picks.size()>0)
             {
-                printf(" [");
+                //build the whole line first so it is queued as a single message
+                std::string pickstr = " [";
                 bool firstloop = true;
-                for (auto & pick : top_picks)
+                char pickbuf[32];
+                for (auto & pick : sampler.top_picks)
                 {
                     if (!firstloop)
                     {
-                        printf(" ");
+                        pickstr += " ";
                     }
                     firstloop = false;
                     std::string tokenizedstr = FileFormatTokenizeID(pick.id, file_format);
                     ::utreplace(tokenizedstr, "\n", "\\n");
-                    printf("(%s %.2f%%)", RemoveBell(tokenizedstr).c_str(), pick.p*100);
+                    snprintf(pickbuf, sizeof(pickbuf), " %.2f%%)", pick.p*100);
+                    pickstr += "(" + RemoveBell(tokenizedstr) + pickbuf;
                 }
-                printf("]\n");
+                pickstr += "]\n";
+                kcpp_log(KCPP_LOG_DEBUG, "%s", pickstr.c_str());
             }
 
             if((unbanTokens||inputs.unban_tokens_rt) && id==eosID)
             {
                 stopper_unused_tokens = remaining_tokens;
-                printf("\n(EOS token triggered!)");
+                kcpp_log(KCPP_LOG_ALWAYS, "\n(EOS token triggered!)");
                 remaining_tokens = 0;
                 last_stop_reason = stop_reason::EOS_TOKEN;
             }
 
-            for (const auto &matched : stop_sequence)
+            if (stopped)
             {
-                if (concat_output.find(matched) != std::string::npos)
-                {
-                    stopper_unused_tokens = remaining_tokens;
-                    remaining_tokens = 0;
-                    if(debugmode!=-1)
-                    {
-                        printf("\n(Stop sequence triggered: <%s>)", matched.c_str());
-                    }
-                    last_stop_reason = stop_reason::CUSTOM_STOPPER;
-                    break;
-                }
+                stopper_unused_tokens = remaining_tokens;
+                remaining_tokens = 0;
+                kcpp_log(KCPP_LOG_INFO, "\n(Stop sequence triggered: <%s>)", stream_detok.stopped->c_str());
+                last_stop_reason = stop_reason::CUSTOM_STOPPER;
             }
-            fflush(stdout);
         }
         else
         {
@@ -1767,14 +2339,13 @@ generation_outputs gpttype_generate(const generation_inputs inputs, generation_o
     int realnpredict = params.n_predict-stopper_unused_tokens;
     float pt2 = (time2*1000.0/(realnpredict==0?1:realnpredict));
     float tokens_per_second = (realnpredict == 0 ? 0 : realnpredict / (time1 + time2));
-    printf("\nTime Taken - Processing:%.1fs (%.0fms/T), Generation:%.1fs (%.0fms/T), Total:%.1fs (%.1fT/s)", time1, pt1, time2, pt2, (time1 + time2), tokens_per_second);
-    fflush(stdout);
-    output.status = 1;
-    generation_finished = true;
+    kcpp_log(KCPP_LOG_ALWAYS, "\nTime Taken - Processing:%.1fs (%.0fms/T), Generation:%.1fs (%.0fms/T), Total:%.1fs (%.1fT/s)", time1, pt1, time2, pt2, (time1 + time2), tokens_per_second);
+    kcpp_log_flush(); //generation is done, make sure the console is caught up before python prints
+    stream_flush(stream_sse);
+    finish_current_output(1);
     last_eval_time = pt2;
     last_process_time = pt1;
     last_token_count = realnpredict;
-    snprintf(output.text, sizeof(output.text), "%s", concat_output.c_str());
 
-    return output;
+    return 1;
 }
@@ -76,6 +76,90 @@ static inline int nearest_int(float fval) {
     return (i & 0x007fffff) - 0x00400000;
 }
 
+//
+// SIMD helpers for the scale searches below. A lane evaluates either one candidate scale or one
+// block, walking the elements in the same order and with the same operations as the scalar
+// loops, so the vector paths produce exactly the same quants as the scalar ones.
+//
+#if defined(__AVX512F__)
+
+#define QK_LANES 16
+typedef __m512 qk_vf;
+typedef __mmask16 qk_vm;
+
+static inline qk_vf qk_set1(float v)                 { return _mm512_set1_ps(v); }
+static inline qk_vf qk_load(const float * p)          { return _mm512_loadu_ps(p); }
+static inline void  qk_store(float * p, qk_vf v)      { _mm512_storeu_ps(p, v); }
+static inline qk_vf qk_add(qk_vf a, qk_vf b)          { return _mm512_add_ps(a, b); }
+static inline qk_vf qk_sub(qk_vf a, qk_vf b)          { return _mm512_sub_ps(a, b); }
+static inline qk_vf qk_mul(qk_vf a, qk_vf b)          { return _mm512_mul_ps(a, b); }
+static inline qk_vf qk_div(qk_vf a, qk_vf b)          { return _mm512_div_ps(a, b); }
+static inline qk_vf qk_abs(qk_vf a)                   { return _mm512_abs_ps(a); }
+static inline qk_vm qk_gt(qk_vf a, qk_vf b)           { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+static inline qk_vm qk_and(qk_vm a, qk_vm b)          { return a & b; }
+static inline bool  qk_any(qk_vm m)                   { return m != 0; }
+// m ? a : b
+static inline qk_vf qk_blend(qk_vm m, qk_vf a, qk_vf b) { return _mm512_mask_blend_ps(m, b, a); }
+// MAX(lo, MIN(hi, nearest_int(v))) as float
+static inline qk_vf qk_round_clamp(qk_vf v, int lo, int hi) {
+    __m512i i = _mm512_castps_si512(_mm512_add_ps(v, _mm512_set1_ps(12582912.f)));
+    i = _mm512_sub_epi32(_mm512_and_si512(i, _mm512_set1_epi32(0x007fffff)), _mm512_set1_epi32(0x00400000));
+    i = _mm512_max_epi32(_mm512_set1_epi32(lo), _mm512_min_epi32(_mm512_set1_epi32(hi), i));
+    return _mm512_cvtepi32_ps(i);
+}
+
+#elif defined(__AVX2__)
+
+#define QK_LANES 8
+typedef __m256 qk_vf;
+typedef __m256 qk_vm;
+
+static inline qk_vf qk_set1(float v)                 { return _mm256_set1_ps(v); }
+static inline qk_vf qk_load(const float * p)          { return _mm256_loadu_ps(p); }
+static inline void  qk_store(float * p, qk_vf v)      { _mm256_storeu_ps(p, v); }
+static inline qk_vf qk_add(qk_vf a, qk_vf b)          { return _mm256_add_ps(a, b); }
+static inline qk_vf qk_sub(qk_vf a, qk_vf b)          { return _mm256_sub_ps(a, b); }
+static inline qk_vf qk_mul(qk_vf a, qk_vf b)          { return _mm256_mul_ps(a, b); }
+static inline qk_vf qk_div(qk_vf a, qk_vf b)          { return _mm256_div_ps(a, b); }
+static inline qk_vf qk_abs(qk_vf a)                   { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+static inline qk_vm qk_gt(qk_vf a, qk_vf b)           { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline qk_vm qk_and(qk_vm a, qk_vm b)          { return _mm256_and_ps(a, b); }
+static inline bool  qk_any(qk_vm m)                   { return _mm256_movemask_ps(m) != 0; }
+static inline qk_vf qk_blend(qk_vm m, qk_vf a, qk_vf b) { return _mm256_blendv_ps(b, a, m); }
+static inline qk_vf qk_round_clamp(qk_vf v, int lo, int hi) {
+    __m256i i = _mm256_castps_si256(_mm256_add_ps(v, _mm256_set1_ps(12582912.f)));
+    i = _mm256_sub_epi32(_mm256_and_si256(i, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x00400000));
+    i = _mm256_max_epi32(_mm256_set1_epi32(lo), _mm256_min_epi32(_mm256_set1_epi32(hi), i));
+    return _mm256_cvtepi32_ps(i);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+#define QK_LANES 4
+typedef float32x4_t qk_vf;
+typedef uint32x4_t qk_vm;
+
+static inline qk_vf qk_set1(float v)                 { return vdupq_n_f32(v); }
+static inline qk_vf qk_load(const float * p)          { return vld1q_f32(p); }
+static inline void  qk_store(float * p, qk_vf v)      { vst1q_f32(p, v); }
+static inline qk_vf qk_add(qk_vf a, qk_vf b)          { return vaddq_f32(a, b); }
+static inline qk_vf qk_sub(qk_vf a, qk_vf b)          { return vsubq_f32(a, b); }
+static inline qk_vf qk_mul(qk_vf a, qk_vf b)          { return vmulq_f32(a, b); }
+static inline qk_vf qk_div(qk_vf a, qk_vf b)          { return vdivq_f32(a, b); }
+static inline qk_vf qk_abs(qk_vf a)                   { return vabsq_f32(a); }
+static inline qk_vm qk_gt(qk_vf a, qk_vf b)           { return vcgtq_f32(a, b); }
+static inline qk_vm qk_and(qk_vm a, qk_vm b)          { return vandq_u32(a, b); }
+static inline bool  qk_any(qk_vm m)                   { return vmaxvq_u32(m) != 0; }
+static inline qk_vf qk_blend(qk_vm m, qk_vf a, qk_vf b) { return vbslq_f32(m, a, b); }
+static inline qk_vf qk_round_clamp(qk_vf v, int lo, int hi) {
+    int32x4_t i = vreinterpretq_s32_f32(vaddq_f32(v, vdupq_n_f32(12582912.f)));
+    i = vsubq_s32(vandq_s32(i, vdupq_n_s32(0x007fffff)), vdupq_n_s32(0x00400000));
+    i = vmaxq_s32(vdupq_n_s32(lo), vminq_s32(vdupq_n_s32(hi), i));
+    return vcvtq_f32_s32(i);
+}
+
+#endif
+
 static float make_qx_quants(int n, int nmax, const float * restrict x, int8_t * restrict L, int rmse_type) {
     float max = 0;
     float amax = 0;
@@ -116,6 +200,43 @@ static float make_qx_quants(int n, int nmax, const float * restrict x, int8_t *
     float scale = sumlx/suml2;
     if (return_early) return suml2 > 0 ? 0.5f*(scale + 1/iscale) : 1/iscale;
     float best = scale * sumlx;
+#ifdef QK_LANES
+    // the 18 candidate scales go one per lane, the best one is picked in the scalar order afterwards
+    enum { n_cand = 18, n_cand_pad = (n_cand + QK_LANES - 1)/QK_LANES*QK_LANES };
+    float cand_iscale[n_cand_pad], cand_sumlx[n_cand_pad], cand_suml2[n_cand_pad];
+    for (int c = 0; c < n_cand_pad; ++c) {
+        const int is = c < 9 ? c - 9 : c - 8;
+        cand_iscale[c] = c < n_cand ? -(nmax + 0.1f*is) / max : 0.f;
+    }
+    for (int c = 0; c < n_cand_pad; c += QK_LANES) {
+        const qk_vf vscale = qk_load(cand_iscale + c);
+        qk_vf vsumlx = qk_set1(0.f);
+        qk_vf vsuml2 = qk_set1(0.f);
+        for (int i = 0; i < n; ++i) {
+            const qk_vf l = qk_round_clamp(qk_mul(vscale, qk_set1(x[i])), -nmax, nmax-1);
+            float w = weight_type == 1 ? x[i] * x[i] : 1;
+            vsumlx = qk_add(vsumlx, qk_mul(qk_set1(w*x[i]), l));
+            vsuml2 = qk_add(vsuml2, qk_mul(qk_mul(qk_set1(w), l), l));
+        }
+        qk_store(cand_sumlx + c, vsumlx);
+        qk_store(cand_suml2 + c, vsuml2);
+    }
+    int best_c = -1;
+    for (int c = 0; c < n_cand; ++c) {
+        sumlx = cand_sumlx[c]; suml2 = cand_suml2[c];
+        if (suml2 > 0 && sumlx*sumlx > best*suml2) {
+            scale = sumlx/suml2; best = scale*sumlx;
+            best_c = c;
+        }
+    }
+    if (best_c >= 0) {
+        iscale = cand_iscale[best_c];
+        for (int i = 0; i < n; ++i) {
+            int l = nearest_int(iscale * x[i]);
+            L[i] = nmax + MAX(-nmax, MIN(nmax-1, l));
+        }
+    }
+#else
     for (int is = -9; is <= 9; ++is) {
         if (is == 0) {
             continue;
@@ -137,6 +258,7 @@ static float make_qx_quants(int n, int nmax, const float * restrict x, int8_t *
             scale = sumlx/suml2; best = scale*sumlx;
         }
     }
+#endif
     return scale;
 }
 
@@ -242,6 +364,7 @@ static float make_qkx1_quants(int n, int nmax, const float * restrict x, uint8_t
     return scale;
 }
 
+#ifndef QK_LANES
 static float make_qkx2_quants(int n, int nmax, const float * restrict x, const float * restrict weights,
         uint8_t * restrict L, float * restrict the_min, uint8_t * restrict Laux,
         float rmin, float rdelta, int nstep, bool use_mad) {
@@ -317,6 +440,120 @@ static float make_qkx2_quants(int n, int nmax, const float * restrict x, const f
     *the_min = -min;
     return scale;
 }
+#endif
+
+// make_qkx2_quants on nblock consecutive blocks of n values, with the results in L, scales and mins
+static void make_qkx2_quants_multi(int nblock, int n, int nmax, const float * restrict x, const float * restrict weights,
+        uint8_t * restrict L, float * restrict scales, float * restrict mins, float rmin, float rdelta, int nstep, bool use_mad) {
+#ifdef QK_LANES
+    // One block per lane, each lane runs exactly the scalar search for its block. The blocks are
+    // independent, so unlike a lane per candidate scale nothing has to be redone when a lane finds
+    // a better scale.
+    assert(n <= 32);
+    float xt[32*QK_LANES], wt[32*QK_LANES], lt[32*QK_LANES], best_lt[32*QK_LANES];
+    float lane_min[QK_LANES], lane_max[QK_LANES], lane_sum_w[QK_LANES], lane_sum_x[QK_LANES];
+    float lane_scale[QK_LANES], lane_best_mad[QK_LANES];
+    for (int j0 = 0; j0 < nblock; j0 += QK_LANES) {
+        for (int j = 0; j < QK_LANES; ++j) {
+            const float * xb = x + (j0 + j)*n;
+            const float * wb = weights + (j0 + j)*n;
+            lane_best_mad[j] = -1.f; // lanes with nothing left to search never find a better scale
+            lane_scale[j] = lane_min[j] = lane_max[j] = lane_sum_w[j] = lane_sum_x[j] = 0;
+            if (j0 + j >= nblock) {
+                for (int i = 0; i < n; ++i) {
+                    xt[i*QK_LANES + j] = wt[i*QK_LANES + j] = best_lt[i*QK_LANES + j] = 0;
+                }
+                continue;
+            }
+            float min = xb[0];
+            float max = xb[0];
+            float sum_w = wb[0];
+            float sum_x = sum_w * xb[0];
+            for (int i = 1; i < n; ++i) {
+                if (xb[i] < min) min = xb[i];
+                if (xb[i] > max) max = xb[i];
+                float w = wb[i];
+                sum_w += w;
+                sum_x += w * xb[i];
+            }
+            if (min > 0) min = 0;
+            float iscale = max == min ? 0.f : nmax/(max - min);
+            float scale = max == min ? 0.f : 1/iscale;
+            float best_mad = 0;
+            for (int i = 0; i < n; ++i) {
+                int l = max == min ? 0 : MAX(0, MIN(nmax, nearest_int(iscale*(xb[i] - min))));
+                float diff = scale * l + min - xb[i];
+                diff = use_mad ? fabsf(diff) : diff * diff;
+                float w = wb[i];
+                best_mad += w * diff;
+                xt[i*QK_LANES + j] = xb[i];
+                wt[i*QK_LANES + j] = w;
+                best_lt[i*QK_LANES + j] = l;
+            }
+            lane_min[j] = min;
+            lane_max[j] = max;
+            lane_sum_w[j] = sum_w;
+            lane_sum_x[j] = sum_x;
+            lane_scale[j] = scale;
+            if (max != min) {
+                lane_best_mad[j] = best_mad;
+            }
+        }
+        qk_vf vmin = qk_load(lane_min), vscale = qk_load(lane_scale), vbest_mad = qk_load(lane_best_mad);
+        const qk_vf vmax = qk_load(lane_max), vsum_w = qk_load(lane_sum_w), vsum_x = qk_load(lane_sum_x);
+        for (int is = 0; is <= nstep; ++is) {
+            const qk_vf viscale = qk_div(qk_set1(rmin + rdelta*is + nmax), qk_sub(vmax, vmin));
+            qk_vf sum_l = qk_set1(0.f), sum_l2 = qk_set1(0.f), sum_xl = qk_set1(0.f);
+            for (int i = 0; i < n; ++i) {
+                const qk_vf vx = qk_load(xt + i*QK_LANES);
+                const qk_vf l = qk_round_clamp(qk_mul(viscale, qk_sub(vx, vmin)), 0, nmax);
+                const qk_vf wl = qk_mul(qk_load(wt + i*QK_LANES), l);
+                qk_store(lt + i*QK_LANES, l);
+                sum_l  = qk_add(sum_l, wl);
+                sum_l2 = qk_add(sum_l2, qk_mul(wl, l));
+                sum_xl = qk_add(sum_xl, qk_mul(wl, vx));
+            }
+            const qk_vf D = qk_sub(qk_mul(vsum_w, sum_l2), qk_mul(sum_l, sum_l));
+            qk_vf this_scale = qk_div(qk_sub(qk_mul(vsum_w, sum_xl), qk_mul(vsum_x, sum_l)), D);
+            qk_vf this_min   = qk_div(qk_sub(qk_mul(sum_l2, vsum_x), qk_mul(sum_l, sum_xl)), D);
+            const qk_vm min_pos = qk_gt(this_min, qk_set1(0.f));
+            this_scale = qk_blend(min_pos, qk_div(sum_xl, sum_l2), this_scale);
+            this_min   = qk_blend(min_pos, qk_set1(0.f), this_min);
+            qk_vf mad = qk_set1(0.f);
+            for (int i = 0; i < n; ++i) {
+                qk_vf diff = qk_sub(qk_add(qk_mul(this_scale, qk_load(lt + i*QK_LANES)), this_min), qk_load(xt + i*QK_LANES));
+                diff = use_mad ? qk_abs(diff) : qk_mul(diff, diff);
+                mad = qk_add(mad, qk_mul(qk_load(wt + i*QK_LANES), diff));
+            }
+            const qk_vm better = qk_and(qk_gt(D, qk_set1(0.f)), qk_gt(vbest_mad, mad));
+            if (!qk_any(better)) {
+                continue;
+            }
+            for (int i = 0; i < n; ++i) {
+                qk_store(best_lt + i*QK_LANES, qk_blend(better, qk_load(lt + i*QK_LANES), qk_load(best_lt + i*QK_LANES)));
+            }
+            vbest_mad = qk_blend(better, mad, vbest_mad);
+            vscale = qk_blend(better, this_scale, vscale);
+            vmin = qk_blend(better, this_min, vmin);
+        }
+        qk_store(lane_scale, vscale);
+        qk_store(lane_min, vmin);
+        for (int j = 0; j < QK_LANES && j0 + j < nblock; ++j) {
+            for (int i = 0; i < n; ++i) {
+                L[(j0 + j)*n + i] = (uint8_t)best_lt[i*QK_LANES + j];
+            }
+            scales[j0 + j] = lane_scale[j];
+            mins[j0 + j] = -lane_min[j];
+        }
+    }
+#else
+    uint8_t Laux[32];
+    assert(n <= 32);
+    for (int j = 0; j < nblock; ++j) {
+        scales[j] = make_qkx2_quants(n, nmax, x + n*j, weights + n*j, L + n*j, &mins[j], Laux, rmin, rdelta, nstep, use_mad);
+    }
+#endif
+}
 
 #if QK_K == 256
 static inline void get_scale_min_k4(int j, const uint8_t * restrict q, uint8_t * restrict d, uint8_t * restrict m) {
@@ -336,8 +573,7 @@ void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict
     const int nb = k / QK_K;
 
     uint8_t L[QK_K];
-    uint8_t Laux[16];
-    float   weights[16];
+    float   weights[QK_K];
     float mins[QK_K/16];
     float scales[QK_K/16];
 
@@ -347,9 +583,9 @@ void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict
 
         float max_scale = 0; // as we are deducting the min, scales are always positive
         float max_min = 0;
+        for (int l = 0; l < QK_K; ++l) weights[l] = fabsf(x[l]);
+        make_qkx2_quants_multi(QK_K/16, 16, 3, x, weights, L, scales, mins, -0.5f, 0.1f, 15, true);
         for (int j = 0; j < QK_K/16; ++j) {
-            for (int l = 0; l < 16; ++l) weights[l] = fabsf(x[16*j + l]);
-            scales[j] = make_qkx2_quants(16, 3, x + 16*j, weights, L + 16*j, &mins[j], Laux, -0.5f, 0.1f, 15, true);
             float scale = scales[j];
             if (scale > max_scale) {
                 max_scale = scale;
@@ -695,8 +931,7 @@ void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict
     const int nb = k / QK_K;
 
     uint8_t L[QK_K];
-    uint8_t Laux[32];
-    float   weights[32];
+    float   weights[QK_K];
     float mins[QK_K/32];
     float scales[QK_K/32];
 
@@ -709,8 +944,10 @@ void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict
             float sum_x2 = 0;
             for (int l = 0; l < 32; ++l) sum_x2 += x[32*j + l] * x[32*j + l];
             float av_x = sqrtf(sum_x2/32);
-            for (int l = 0; l < 32; ++l) weights[l] = av_x + fabsf(x[32*j + l]);
-            scales[j] = make_qkx2_quants(32, 15, x + 32*j, weights, L + 32*j, &mins[j], Laux, -1.f, 0.1f, 20, false);
+            for (int l = 0; l < 32; ++l) weights[32*j + l] = av_x + fabsf(x[32*j + l]);
+        }
+        make_qkx2_quants_multi(QK_K/32, 32, 15, x, weights, L, scales, mins, -1.f, 0.1f, 20, false);
+        for (int j = 0; j < QK_K/32; ++j) {
             float scale = scales[j];
             if (scale > max_scale) {
                 max_scale = scale;
@@ -863,8 +1100,7 @@ void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict
     uint8_t L[QK_K];
     float mins[QK_K/32];
     float scales[QK_K/32];
-    float weights[32];
-    uint8_t Laux[32];
+    float weights[QK_K];
 #else
     int8_t L[QK_K];
     float scales[QK_K/16];
@@ -881,8 +1117,10 @@ void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict
             float sum_x2 = 0;
             for (int l = 0; l < 32; ++l) sum_x2 += x[32*j + l] * x[32*j + l];
             float av_x = sqrtf(sum_x2/32);
-            for (int l = 0; l < 32; ++l) weights[l] = av_x + fabsf(x[32*j + l]);
-            scales[j] = make_qkx2_quants(32, 31, x + 32*j, weights, L + 32*j, &mins[j], Laux, -0.5f, 0.1f, 15, false);
+            for (int l = 0; l < 32; ++l) weights[32*j + l] = av_x + fabsf(x[32*j + l]);
+        }
+        make_qkx2_quants_multi(QK_K/32, 32, 31, x, weights, L, scales, mins, -0.5f, 0.1f, 15, false);
+        for (int j = 0; j < QK_K/32; ++j) {
             float scale = scales[j];
             if (scale > max_scale) {
                 max_scale = scale;
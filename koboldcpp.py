@@ -68,12 +68,34 @@ class generation_inputs(ctypes.Structure):
                 ("stop_sequence", ctypes.c_char_p * stop_token_max),
                 ("stream_sse", ctypes.c_bool),
                 ("grammar", ctypes.c_char_p),
-                ("grammar_retain_state", ctypes.c_bool)]
+                ("grammar_retain_state", ctypes.c_bool),
+                ("n_probs", ctypes.c_int),
+                ("beam_width", ctypes.c_int)]
 
 class generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
                 ("text", ctypes.c_char * 24576)]
 
+class generation_token_meta(ctypes.Structure):
+    _fields_ = [("token_id", ctypes.c_int),
+                ("text_offset", ctypes.c_int),
+                ("text_len", ctypes.c_int),
+                ("logprob", ctypes.c_float)]
+
+class generation_logprob(ctypes.Structure):
+    _fields_ = [("token_id", ctypes.c_int),
+                ("logprob", ctypes.c_float)]
+
+class generation_output_view(ctypes.Structure):
+    _fields_ = [("status", ctypes.c_int),
+                ("text", ctypes.c_void_p),
+                ("text_len", ctypes.c_int),
+                ("token_meta", ctypes.POINTER(generation_token_meta)),
+                ("token_meta_count", ctypes.c_int),
+                ("top_logprobs", ctypes.POINTER(generation_logprob)),
+                ("n_probs", ctypes.c_int),
+                ("handle", ctypes.c_void_p)]
+
 handle = None
 
 def getdirpath():
@@ -191,6 +213,11 @@ def init_library():
     handle.load_model.restype = ctypes.c_bool
     handle.generate.argtypes = [generation_inputs, ctypes.c_wchar_p] #apparently needed for osx to work. i duno why they need to interpret it that way but whatever
     handle.generate.restype = generation_outputs
+    handle.generate_buffered.argtypes = [generation_inputs]
+    handle.generate_buffered.restype = ctypes.c_int
+    handle.get_output_view.argtypes = [ctypes.POINTER(generation_output_view)]
+    handle.get_output_view.restype = ctypes.c_bool
+    handle.release_output.argtypes = [ctypes.c_void_p]
     handle.new_token.restype = ctypes.c_char_p
     handle.new_token.argtypes = [ctypes.c_int]
     handle.get_stream_count.restype = ctypes.c_int
@@ -200,7 +227,10 @@ def init_library():
     handle.get_last_token_count.restype = ctypes.c_int
     handle.get_last_stop_reason.restype = ctypes.c_int
     handle.abort_generate.restype = ctypes.c_bool
+    handle.set_log_level.argtypes = [ctypes.c_int]
     handle.token_count.restype = ctypes.c_int
+    handle.token_to_text.argtypes = [ctypes.c_int]
+    handle.token_to_text.restype = ctypes.c_char_p
     handle.get_pending_output.restype = ctypes.c_char_p
 
 def load_model(model_filename):
@@ -282,10 +312,9 @@ def load_model(model_filename):
     ret = handle.load_model(inputs)
     return ret
 
-def generate(prompt,max_length=20, max_context_length=512, temperature=0.8, top_k=120, top_a=0.0, top_p=0.85, typical_p=1.0, tfs=1.0, rep_pen=1.1, rep_pen_range=128, mirostat=0, mirostat_tau=5.0, mirostat_eta=0.1, sampler_order=[6,0,1,3,4,2,5], seed=-1, stop_sequence=[], use_default_badwordsids=True, stream_sse=False, grammar='', grammar_retain_state=False, genkey=''):
+def generate(prompt,max_length=20, max_context_length=512, temperature=0.8, top_k=120, top_a=0.0, top_p=0.85, typical_p=1.0, tfs=1.0, rep_pen=1.1, rep_pen_range=128, mirostat=0, mirostat_tau=5.0, mirostat_eta=0.1, sampler_order=[6,0,1,3,4,2,5], seed=-1, stop_sequence=[], use_default_badwordsids=True, stream_sse=False, grammar='', grammar_retain_state=False, genkey='', n_probs=0, logprobs_out=None, beam_width=0):
     global maxctx, args, currentusergenkey, totalgens
     inputs = generation_inputs()
-    outputs = ctypes.create_unicode_buffer(ctypes.sizeof(generation_outputs))
     inputs.prompt = prompt.encode("UTF-8")
     if max_length >= max_context_length:
         max_length = max_context_length-1
@@ -306,6 +335,8 @@ def generate(prompt,max_length=20, max_context_length=512, temperature=0.8, top_
     inputs.stream_sse = stream_sse
     inputs.grammar = grammar.encode("UTF-8")
     inputs.grammar_retain_state = grammar_retain_state
+    inputs.n_probs = n_probs if logprobs_out is not None else 0
+    inputs.beam_width = beam_width
     inputs.unban_tokens_rt = not use_default_badwordsids
     if args.usemirostat and args.usemirostat[0]>0:
         inputs.mirostat = int(args.usemirostat[0])
@@ -336,10 +367,38 @@ def generate(prompt,max_length=20, max_context_length=512, temperature=0.8, top_
             inputs.stop_sequence[n] = stop_sequence[n].encode("UTF-8")
     currentusergenkey = genkey
     totalgens += 1
-    ret = handle.generate(inputs,outputs)
-    if(ret.status==1):
-        return ret.text.decode("UTF-8","ignore")
-    return ""
+    status = handle.generate_buffered(inputs)
+    if status!=1:
+        return ""
+    # read the result straight out of the core buffer, no size limit and no intermediate struct
+    view = generation_output_view()
+    if not handle.get_output_view(ctypes.byref(view)):
+        return ""
+    try:
+        if logprobs_out is not None and view.n_probs > 0:
+            read_logprobs(view, logprobs_out)
+        return ctypes.string_at(view.text, view.text_len).decode("UTF-8","ignore") if view.text_len > 0 else ""
+    finally:
+        handle.release_output(view.handle)
+
+def read_logprobs(view, logprobs_out):
+    # converts the binary per-token records into the openai completions logprobs layout
+    # the logprobs are those of the distribution each token was drawn from, so after the samplers and temperature
+    tokens, token_logprobs, top_logprobs, text_offset = [], [], [], []
+    def tokstr(id):
+        return ctypes.string_at(handle.token_to_text(id)).decode("UTF-8","ignore")
+    for i in range(view.token_meta_count):
+        meta = view.token_meta[i]
+        tokens.append(tokstr(meta.token_id))
+        token_logprobs.append(meta.logprob)
+        text_offset.append(meta.text_offset)
+        alts = {}
+        for n in range(view.n_probs):
+            alt = view.top_logprobs[i*view.n_probs + n]
+            if alt.token_id >= 0:
+                alts[tokstr(alt.token_id)] = alt.logprob
+        top_logprobs.append(alts)
+    logprobs_out.update({"tokens":tokens, "token_logprobs":token_logprobs, "top_logprobs":top_logprobs, "text_offset":text_offset})
 
 def utfprint(str):
     try:
@@ -406,6 +465,9 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                 scaled_rep_pen = genparams.get('presence_penalty', frqp) + 1
                 genparams["max_length"] = genparams.get('max_tokens', 50)
                 genparams["rep_pen"] = scaled_rep_pen
+                reqlogprobs = genparams.get('logprobs', None)
+                if reqlogprobs is not None and int(reqlogprobs) > 0:
+                    genparams["n_probs"] = int(reqlogprobs)
 
             return generate(
                 prompt=genparams.get('prompt', ""),
@@ -429,8 +491,12 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                 stream_sse=stream_flag,
                 grammar=genparams.get('grammar', ''),
                 grammar_retain_state = genparams.get('grammar_retain_state', False),
-                genkey=genparams.get('genkey', ''))
+                genkey=genparams.get('genkey', ''),
+                n_probs=genparams.get('n_probs', 0),
+                logprobs_out=(logprobs if genparams.get('n_probs', 0) > 0 else None),
+                beam_width=genparams.get('beam_width', 0))
 
+        logprobs = {}
         recvtxt = ""
         if stream_flag:
             loop = asyncio.get_event_loop()
@@ -446,9 +512,11 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
             res = {"data": {"seqs":[recvtxt]}}
         elif api_format==3:
             res = {"id": "cmpl-1", "object": "text_completion", "created": 1, "model": "koboldcpp",
-            "choices": [{"text": recvtxt, "index": 0, "finish_reason": "length"}]}
+            "choices": [{"text": recvtxt, "index": 0, "finish_reason": "length", "logprobs": (logprobs if logprobs else None)}]}
         else:
             res = {"results": [{"text": recvtxt}]}
+            if logprobs:
+                res["results"][0]["logprobs"] = logprobs
 
         try:
             return res
@@ -469,7 +537,6 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
 
         current_token = 0
 
-        incomplete_token_buffer = bytearray()
         while True:
             streamDone = handle.has_finished() #exit next loop on done
             tokenStr = ""
@@ -481,12 +548,7 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                     break
 
                 current_token += 1
-                newbyte = ctypes.string_at(token)
-                incomplete_token_buffer += bytearray(newbyte)
-                tokenSeg = incomplete_token_buffer.decode("UTF-8","ignore")
-                if tokenSeg!="":
-                    incomplete_token_buffer.clear()
-                    tokenStr += tokenSeg
+                tokenStr += ctypes.string_at(token).decode("UTF-8","ignore") #spans are whole codepoints and never part of a stopper
 
             if tokenStr!="":
                 event_data = {"token": tokenStr}
@@ -1788,6 +1850,9 @@ def unload_libs():
         dll_close(handle._handle)
         del handle.load_model
         del handle.generate
+        del handle.generate_buffered
+        del handle.get_output_view
+        del handle.release_output
         del handle.new_token
         del handle.get_stream_count
         del handle.has_finished
@@ -1796,6 +1861,7 @@ def unload_libs():
         del handle.get_last_token_count
         del handle.get_last_stop_reason
         del handle.abort_generate
+        del handle.set_log_level
         del handle.token_count
         del handle.get_pending_output
         del handle
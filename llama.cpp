@@ -31,6 +31,7 @@
 #ifdef __has_include
     #if __has_include(<unistd.h>)
         #include <unistd.h>
+        #include <fcntl.h>
         #if defined(_POSIX_MAPPED_FILES)
             #include <sys/mman.h>
         #endif
@@ -52,6 +53,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <climits>
@@ -60,6 +62,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <condition_variable>
 #include <ctime>
 #include <fstream>
 #include <initializer_list>
@@ -75,6 +78,10 @@
 #include <unordered_map>
 #include <set>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -128,13 +135,6 @@ static void replace_all(std::string & s, const std::string & search, const std::
 #include <hbwmalloc.h>
 #endif
 
-static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
-    }
-}
-
 LLAMA_ATTRIBUTE_FORMAT(1, 2)
 static std::string format(const char * fmt, ...) {
     va_list ap;
@@ -353,12 +353,30 @@ static std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NAMES =
         LLM_ARCH_GPT2,
         {
             { LLM_TENSOR_TOKEN_EMBD,      "token_embd" },
+            { LLM_TENSOR_POS_EMBD,        "position_embd" },
+            { LLM_TENSOR_OUTPUT_NORM,     "output_norm" },
+            { LLM_TENSOR_OUTPUT,          "output" },
+            { LLM_TENSOR_ATTN_NORM,       "blk.%d.attn_norm" },
+            { LLM_TENSOR_ATTN_QKV,        "blk.%d.attn_qkv" },
+            { LLM_TENSOR_ATTN_OUT,        "blk.%d.attn_output" },
+            { LLM_TENSOR_FFN_NORM,        "blk.%d.ffn_norm" },
+            { LLM_TENSOR_FFN_UP,          "blk.%d.ffn_up" },
+            { LLM_TENSOR_FFN_DOWN,        "blk.%d.ffn_down" },
         },
     },
     {
         LLM_ARCH_GPTJ,
         {
             { LLM_TENSOR_TOKEN_EMBD,      "token_embd" },
+            { LLM_TENSOR_OUTPUT_NORM,     "output_norm" },
+            { LLM_TENSOR_OUTPUT,          "output" },
+            { LLM_TENSOR_ATTN_NORM,       "blk.%d.attn_norm" },
+            { LLM_TENSOR_ATTN_Q,          "blk.%d.attn_q" },
+            { LLM_TENSOR_ATTN_K,          "blk.%d.attn_k" },
+            { LLM_TENSOR_ATTN_V,          "blk.%d.attn_v" },
+            { LLM_TENSOR_ATTN_OUT,        "blk.%d.attn_output" },
+            { LLM_TENSOR_FFN_DOWN,        "blk.%d.ffn_down" },
+            { LLM_TENSOR_FFN_UP,          "blk.%d.ffn_up" },
         },
     },
     {
@@ -379,6 +397,14 @@ static std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NAMES =
         LLM_ARCH_MPT,
         {
             { LLM_TENSOR_TOKEN_EMBD,      "token_embd" },
+            { LLM_TENSOR_OUTPUT_NORM,     "output_norm" },
+            { LLM_TENSOR_OUTPUT,          "output" },
+            { LLM_TENSOR_ATTN_NORM,       "blk.%d.attn_norm" },
+            { LLM_TENSOR_ATTN_QKV,        "blk.%d.attn_qkv" },
+            { LLM_TENSOR_ATTN_OUT,        "blk.%d.attn_output" },
+            { LLM_TENSOR_FFN_NORM,        "blk.%d.ffn_norm" },
+            { LLM_TENSOR_FFN_DOWN,        "blk.%d.ffn_down" },
+            { LLM_TENSOR_FFN_UP,          "blk.%d.ffn_up" },
         },
     },
     {
@@ -468,7 +494,7 @@ do { \
 // ggml helpers
 //
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads, const std::vector<int> & parse_seq = {}) {
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
 
     if (plan.work_size > 0) {
@@ -476,6 +502,11 @@ static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph *
         plan.work_data = buf.data();
     }
 
+    if (!parse_seq.empty()) {
+        plan.parse_seq     = parse_seq.data();
+        plan.parse_seq_len = parse_seq.size();
+    }
+
     ggml_graph_compute(graph, &plan);
 }
 
@@ -595,6 +626,39 @@ struct llama_file {
         }
     }
 
+    // positional read, does not use the file position so several threads can read at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        uint8_t * dst = (uint8_t *) ptr;
+#if defined(_WIN32)
+        HANDLE handle = (HANDLE) _get_osfhandle(_fileno(fp));
+        while (len > 0) {
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) (offset & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD n = 0;
+            if (!ReadFile(handle, dst, (DWORD) std::min(len, (size_t) 1 << 30), &n, &ov)) {
+                throw std::runtime_error(format("read error: %s", llama_format_win_err(GetLastError()).c_str()));
+            }
+#else
+        const int fd = fileno(fp);
+        while (len > 0) {
+            const ssize_t n = pread(fd, dst, std::min(len, (size_t) 1 << 30), (off_t) offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+#endif
+            if (n == 0) {
+                throw std::runtime_error(std::string("unexpectedly reached end of file"));
+            }
+            dst    += n;
+            len    -= n;
+            offset += n;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -623,6 +687,229 @@ struct llama_file {
     }
 };
 
+// Sequential file writer that keeps the disk busy while the caller produces the next data.
+// Writes are staged in two aligned buffers, the caller fills one while a background thread
+// writes the other. Where supported the file is opened with O_DIRECT so that large outputs
+// do not push everything else out of the page cache.
+struct llama_stream_writer {
+    static constexpr size_t ALIGNMENT = 4096;
+
+    llama_stream_writer(const char * fname, size_t buf_size = 16u*1024*1024) : buf_size(GGML_PAD(buf_size, ALIGNMENT)) {
+#if defined(_WIN32)
+        fp = std::fopen(fname, "wb");
+        if (fp == NULL) {
+            throw std::runtime_error(format("failed to open %s: %s", fname, strerror(errno)));
+        }
+#else
+#ifdef O_DIRECT
+        fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        direct = fd >= 0;
+        if (fd < 0)
+#endif
+        fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error(format("failed to open %s: %s", fname, strerror(errno)));
+        }
+#ifdef F_NOCACHE
+        fcntl(fd, F_NOCACHE, 1);
+#endif
+#endif
+        for (int i = 0; i < 2; ++i) {
+            storage[i].resize(this->buf_size + ALIGNMENT);
+            bufs[i] = (uint8_t *) GGML_PAD((uintptr_t) storage[i].data(), ALIGNMENT);
+        }
+        thread = std::thread([this]() { worker(); });
+    }
+
+    llama_stream_writer(const llama_stream_writer &) = delete;
+
+    ~llama_stream_writer() {
+        stop_worker();
+#if defined(_WIN32)
+        if (fp) {
+            std::fclose(fp);
+        }
+#else
+        if (fd >= 0) {
+            ::close(fd);
+        }
+#endif
+    }
+
+    // bytes handed to the writer so far, i.e. the current offset in the output file
+    size_t tell() const {
+        return total;
+    }
+
+    void write_raw(const void * ptr, size_t len) {
+        const uint8_t * src = (const uint8_t *) ptr;
+        while (len > 0) {
+            const size_t n = std::min(len, buf_size - fill);
+            memcpy(bufs[cur] + fill, src, n);
+            fill += n; total += n;
+            src  += n; len   -= n;
+            if (fill == buf_size) {
+                submit(buf_size);
+            }
+        }
+    }
+
+    void write_zeros(size_t len) {
+        while (len > 0) {
+            const size_t n = std::min(len, buf_size - fill);
+            memset(bufs[cur] + fill, 0, n);
+            fill += n; total += n;
+            len  -= n;
+            if (fill == buf_size) {
+                submit(buf_size);
+            }
+        }
+    }
+
+    // writes out what is left and closes the file, throws if any write failed
+    void close() {
+        wait_idle();
+        if (fill > 0) {
+            // direct writes have to be whole blocks, the padding is truncated away below
+            const size_t len = direct ? GGML_PAD(fill, ALIGNMENT) : fill;
+            memset(bufs[cur] + fill, 0, len - fill);
+            submit(len);
+            wait_idle();
+        }
+        stop_worker();
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+#if defined(_WIN32)
+        const int ret = std::fclose(fp);
+        fp = NULL;
+        if (ret != 0) {
+            throw std::runtime_error(format("write error: %s", strerror(errno)));
+        }
+#else
+        const bool failed = ftruncate(fd, (off_t) total) != 0;
+        const int err = errno;
+        ::close(fd);
+        fd = -1;
+        if (failed) {
+            throw std::runtime_error(format("write error: %s", strerror(err)));
+        }
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    FILE * fp = NULL;
+#else
+    int fd = -1;
+#endif
+    bool direct = false;
+
+    size_t buf_size;
+    std::vector<uint8_t> storage[2];
+    uint8_t * bufs[2];
+    int    cur   = 0; // buffer being filled by the caller
+    size_t fill  = 0;
+    size_t total = 0;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    int    pending     = -1; // buffer handed to the writer thread
+    size_t pending_len = 0;
+    bool   stop        = false;
+    std::string error;
+
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return pending < 0; });
+    }
+
+    void submit(size_t len) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return pending < 0; });
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+        pending     = cur;
+        pending_len = len;
+        cv.notify_all();
+        cur ^= 1;
+        fill = 0;
+    }
+
+    void stop_worker() {
+        if (!thread.joinable()) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return pending < 0; });
+            stop = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    void worker() {
+        while (true) {
+            int idx;
+            size_t len;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return pending >= 0 || stop; });
+                if (pending < 0) {
+                    return;
+                }
+                idx = pending;
+                len = pending_len;
+            }
+            std::string err;
+            try {
+                write_block(bufs[idx], len);
+            } catch (const std::exception & e) {
+                err = e.what();
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (error.empty()) {
+                    error = err;
+                }
+                pending = -1;
+            }
+            cv.notify_all();
+        }
+    }
+
+    void write_block(const uint8_t * data, size_t len) {
+#if defined(_WIN32)
+        if (std::fwrite(data, len, 1, fp) != 1) {
+            throw std::runtime_error(format("write error: %s", strerror(errno)));
+        }
+#else
+        while (len > 0) {
+            const ssize_t ret = ::write(fd, data, len);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+#ifdef O_DIRECT
+                // some filesystems accept O_DIRECT on open and only refuse the writes
+                if (errno == EINVAL && direct) {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                    direct = false;
+                    continue;
+                }
+#endif
+                throw std::runtime_error(format("write error: %s", strerror(errno)));
+            }
+            data += ret;
+            len  -= (size_t) ret;
+        }
+#endif
+    }
+};
+
 struct llama_mmap {
     void * addr;
     size_t size;
@@ -890,6 +1177,29 @@ static void llama_nop(struct ggml_tensor * tensor) { // don't offload by default
     (void) tensor;
 }
 
+// scale, mask and soft_max of the attention scores in a single op (ggml_soft_max_ext), which only has a CPU kernel
+static bool llama_use_fused_soft_max(offload_func_t offload_func_kq, offload_func_t offload_func_v) {
+#ifdef GGML_USE_METAL
+    (void) offload_func_kq;
+    (void) offload_func_v;
+    return false;
+#else
+    return offload_func_kq == llama_nop && offload_func_v == llama_nop;
+#endif
+}
+
+// the CPU kernels read the strided Q, K and V views of a fused QKV output directly,
+// the GPU kernels need contiguous copies of them
+static bool llama_use_qkv_views(offload_func_t offload_func_kq, offload_func_t offload_func_v) {
+#ifdef GGML_USE_METAL
+    (void) offload_func_kq;
+    (void) offload_func_v;
+    return false;
+#else
+    return offload_func_kq == llama_nop && offload_func_v == llama_nop;
+#endif
+}
+
 static std::string llama_token_to_str(const struct llama_context * ctx, llama_token token) {
     std::vector<char> result(8, 0);
     const int n_tokens = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
@@ -921,9 +1231,11 @@ enum e_model {
     MODEL_UNKNOWN,
     MODEL_1B,
     MODEL_3B,
+    MODEL_6B,
     MODEL_7B,
     MODEL_13B,
     MODEL_15B,
+    MODEL_20B,
     MODEL_30B,
     MODEL_34B,
     MODEL_40B,
@@ -949,6 +1261,11 @@ struct llama_hparams {
     float f_norm_eps;
     float f_norm_rms_eps;
 
+    float f_clamp_kqv;
+    float f_max_alibi_bias;
+
+    bool use_par_res;
+
     float rope_freq_base_train;
     float rope_freq_scale_train;
 
@@ -1034,8 +1351,16 @@ struct llama_kv_cache {
     // computed before each graph build
     uint32_t n = 0;
 
+    // V is stored transposed (one row of n_ctx per embedding dim) or one row per cell like K
+    bool v_trans = true;
+
     std::vector<llama_kv_cell> cells;
 
+    // kept in sync with cells for building the KQ mask without touching the seq_id sets:
+    // the cell positions, contiguous, and per sequence a bitmap of the cells that hold it
+    std::vector<llama_pos> cell_pos;
+    std::map<llama_seq_id, std::vector<uint64_t>> seq_cells;
+
     struct ggml_tensor * k = NULL;
     struct ggml_tensor * v = NULL;
 
@@ -1113,9 +1438,13 @@ struct llama_model {
     struct ggml_tensor * output_norm;
     struct ggml_tensor * output_norm_b;
     struct ggml_tensor * output;
+    struct ggml_tensor * output_b;
 
     std::vector<llama_layer> layers;
 
+    // ALiBi slope per head, empty for models that do not use ALiBi
+    std::vector<float> alibi_slopes;
+
     int n_gpu_layers;
 
     // context
@@ -1193,6 +1522,9 @@ struct llama_context {
     std::vector<float> logits;
     bool logits_all = false;
 
+    // batch positions of the rows passed through the output projection, empty = all of them
+    std::vector<int32_t> output_rows;
+
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
@@ -1205,6 +1537,9 @@ struct llama_context {
     llama_buffer buf_alloc;
     ggml_allocr * alloc = NULL;
 
+    // order in which the nodes of the graph are allocated and computed, see llama_alloc_graph
+    std::vector<int> alloc_seq;
+
 #ifdef GGML_USE_METAL
     ggml_metal_context * ctx_metal = NULL;
 #endif
@@ -1237,6 +1572,8 @@ static bool llama_kv_cache_init(
 
     cache.cells.clear();
     cache.cells.resize(n_ctx);
+    cache.cell_pos.assign(n_ctx, -1);
+    cache.seq_cells.clear();
 
     cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*MB);
 
@@ -1279,6 +1616,39 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// cell updates go through these so that cell_pos and seq_cells stay in sync with cells
+static void llama_kv_cell_set_pos(struct llama_kv_cache & cache, uint32_t i, llama_pos pos) {
+    cache.cells[i].pos = pos;
+    cache.cell_pos[i]  = pos;
+}
+
+static void llama_kv_cell_add_seq(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    cache.cells[i].seq_id.insert(seq_id);
+
+    std::vector<uint64_t> & bits = cache.seq_cells[seq_id];
+    if (bits.empty()) {
+        bits.resize((cache.size + 63)/64, 0);
+    }
+    bits[i/64] |= 1ull << (i%64);
+}
+
+static void llama_kv_cell_rm_seq(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    cache.cells[i].seq_id.erase(seq_id);
+
+    auto it = cache.seq_cells.find(seq_id);
+    if (it != cache.seq_cells.end()) {
+        it->second[i/64] &= ~(1ull << (i%64));
+    }
+}
+
+static void llama_kv_cell_clear(struct llama_kv_cache & cache, uint32_t i) {
+    for (const llama_seq_id seq_id : cache.cells[i].seq_id) {
+        cache.seq_cells[seq_id][i/64] &= ~(1ull << (i%64));
+    }
+    cache.cells[i].seq_id.clear();
+    llama_kv_cell_set_pos(cache, i, -1);
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 static bool llama_kv_cache_find_slot(
@@ -1322,8 +1692,8 @@ static bool llama_kv_cache_find_slot(
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
-        cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i]);
+        llama_kv_cell_set_pos(cache, cache.head + i, batch.pos[i]);
+        llama_kv_cell_add_seq(cache, cache.head + i, batch.seq_id[i]);
     }
 
     return true;
@@ -1345,8 +1715,7 @@ static void llama_kv_cache_tokens_rm(struct llama_kv_cache & cache, int32_t c0,
     if (c1 < 0) c1 = cache.size;
 
     for (int32_t i = c0; i < c1; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        llama_kv_cell_clear(cache, i);
     }
 }
 
@@ -1357,9 +1726,9 @@ static void llama_kv_cache_seq_rm(
                          llama_pos   p1) {
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.erase(seq_id);
+            llama_kv_cell_rm_seq(cache, i, seq_id);
             if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
+                llama_kv_cell_set_pos(cache, i, -1);
             }
         }
     }
@@ -1373,7 +1742,7 @@ static void llama_kv_cache_seq_cp(
                          llama_pos   p1) {
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            llama_kv_cell_add_seq(cache, i, seq_id_dst);
         }
     }
 }
@@ -1381,8 +1750,7 @@ static void llama_kv_cache_seq_cp(
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (!cache.cells[i].has_seq_id(seq_id)) {
-            cache.cells[i].pos = -1;
-            cache.cells[i].seq_id.clear();
+            llama_kv_cell_clear(cache, i);
         }
     }
 }
@@ -1395,10 +1763,9 @@ static void llama_kv_cache_seq_shift(
                          llama_pos   delta) {
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].pos += delta;
+            llama_kv_cell_set_pos(cache, i, cache.cells[i].pos + delta);
             if (cache.cells[i].pos < 0) {
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                llama_kv_cell_clear(cache, i);
             } else {
                 cache.has_shift = true;
                 cache.cells[i].delta = delta;
@@ -1407,6 +1774,89 @@ static void llama_kv_cache_seq_shift(
     }
 }
 
+// one row of the KQ mask: 0 for the cells in the bitmap whose position is <= pos, -INFINITY for the rest
+static void llama_kv_cache_fill_kq_mask_row(const uint64_t * bits, const llama_pos * cell_pos, llama_pos pos, int32_t n_kv, float * row) {
+    if (bits == nullptr) {
+        std::fill(row, row + n_kv, -INFINITY);
+        return;
+    }
+
+#if defined(__AVX2__)
+    const __m256i sel     = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256i pos_v   = _mm256_set1_epi32(pos);
+    const __m256  neg_inf = _mm256_set1_ps(-INFINITY);
+#endif
+
+    for (int32_t i0 = 0; i0 < n_kv; i0 += 64) {
+        const int32_t  n = std::min(64, n_kv - i0);
+        const uint64_t w = bits[i0/64];
+
+        if (w == 0) {
+            std::fill(row + i0, row + i0 + n, -INFINITY);
+            continue;
+        }
+
+        int32_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 8 <= n; i += 8) {
+            const __m256i in_seq = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int) ((w >> i) & 0xff)), sel), sel);
+            const __m256i future = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *) (cell_pos + i0 + i)), pos_v);
+            const __m256i keep   = _mm256_andnot_si256(future, in_seq);
+            _mm256_storeu_ps(row + i0 + i, _mm256_andnot_ps(_mm256_castsi256_ps(keep), neg_inf));
+        }
+#endif
+        for (; i < n; ++i) {
+            row[i0 + i] = ((w >> i) & 1) && cell_pos[i0 + i] <= pos ? 0.0f : -INFINITY;
+        }
+    }
+}
+
+// build the KQ mask of a batch (n_kv x n_tokens), rows are split across threads when the mask is large
+static void llama_kv_cache_fill_kq_mask(
+       const struct llama_kv_cache & cache,
+          const struct llama_batch & batch,
+                             int32_t n_kv,
+                               float * data,
+                                 int n_threads) {
+    const int32_t n_tokens = batch.n_tokens;
+
+    auto fill_rows = [&](int32_t j0, int32_t j1) {
+        llama_seq_id     last_seq = -1;
+        const uint64_t * bits     = nullptr;
+        for (int32_t j = j0; j < j1; ++j) {
+            if (j == j0 || batch.seq_id[j] != last_seq) {
+                last_seq = batch.seq_id[j];
+                auto it  = cache.seq_cells.find(last_seq);
+                bits     = it == cache.seq_cells.end() ? nullptr : it->second.data();
+            }
+            llama_kv_cache_fill_kq_mask_row(bits, cache.cell_pos.data(), batch.pos[j], n_kv, data + (int64_t) j*n_kv);
+        }
+    };
+
+    // below this the thread start-up costs more than the fill
+    const int64_t min_per_thread = 256*1024;
+
+    n_threads = (int) std::min<int64_t>(n_threads, (int64_t) n_tokens*n_kv/min_per_thread);
+    if (n_threads <= 1) {
+        fill_rows(0, n_tokens);
+        return;
+    }
+
+    const int32_t rows_per_thread = (n_tokens + n_threads - 1)/n_threads;
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int t = 1; t < n_threads; ++t) {
+        const int32_t j0 = std::min(n_tokens, t*rows_per_thread);
+        const int32_t j1 = std::min(n_tokens, j0 + rows_per_thread);
+        workers.emplace_back(fill_rows, j0, j1);
+    }
+    fill_rows(0, std::min(n_tokens, rows_per_thread));
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
 //
 // model loading and saving
 //
@@ -1444,6 +1894,12 @@ static std::string llama_format_tensor_shape(const struct ggml_tensor * t) {
 }
 
 struct llama_model_loader {
+    // without mmap the tensor data is read by several threads, in requests of up to READ_CHUNK bytes
+    static constexpr int    READ_THREADS = 8;
+    static constexpr size_t READ_CHUNK   = 8u*1024*1024;
+    // host memory for tensors that are only staged for upload to the GPU, bounds the size of one batch of reads
+    static constexpr size_t READ_STAGING = 1024u*1024*1024;
+
     int n_kv      = 0;
     int n_tensors = 0;
     int n_created = 0;
@@ -1681,6 +2137,113 @@ struct llama_model_loader {
         }
     }
 
+    // reads the data of the given tensors with READ_THREADS threads
+    // large tensors are split into chunks, runs of small tensors that are adjacent in the file are merged into a
+    // single read through a staging buffer
+    void load_data_parallel(
+            const std::vector<struct ggml_tensor *> & tensors,
+            llama_progress_callback progress_callback, void * progress_callback_user_data,
+            size_t done_size, size_t size_data) const {
+        struct tensor_offs {
+            struct ggml_tensor * tensor;
+            size_t offs;
+        };
+
+        std::vector<tensor_offs> order;
+        order.reserve(tensors.size());
+        for (struct ggml_tensor * cur : tensors) {
+            order.push_back({cur, file_offset(ggml_get_name(cur))});
+        }
+        std::sort(order.begin(), order.end(), [](const tensor_offs & a, const tensor_offs & b) { return a.offs < b.offs; });
+
+        struct read_req {
+            size_t offs;  // in the file
+            size_t size;  // bytes to read from the file
+            size_t bytes; // tensor bytes covered, for progress
+            size_t first; // index into order
+            size_t count; // > 1: merged small tensors
+            size_t toffs; // offset into the tensor data, for chunks of a large tensor
+        };
+
+        std::vector<read_req> reqs;
+        for (size_t i = 0; i < order.size(); ) {
+            const size_t offs = order[i].offs;
+            const size_t size = ggml_nbytes(order[i].tensor);
+            if (size >= READ_CHUNK) {
+                for (size_t k = 0; k < size; k += READ_CHUNK) {
+                    const size_t n = std::min(READ_CHUNK, size - k);
+                    reqs.push_back({offs + k, n, n, i, 1, k});
+                }
+                i++;
+                continue;
+            }
+            size_t end   = offs + size;
+            size_t bytes = size;
+            size_t j = i + 1;
+            for (; j < order.size(); j++) {
+                const size_t o = order[j].offs;
+                const size_t n = ggml_nbytes(order[j].tensor);
+                // only merge across the alignment padding between tensors
+                if (o < end || o - end > GGUF_DEFAULT_ALIGNMENT || o + n - offs > READ_CHUNK) {
+                    break;
+                }
+                end    = o + n;
+                bytes += n;
+            }
+            reqs.push_back({offs, end - offs, bytes, i, j - i, 0});
+            i = j;
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<size_t> done(0);
+        std::mutex error_mutex;
+        std::string error;
+
+        auto worker = [&](bool report) {
+            std::vector<uint8_t> staging;
+            for (size_t r = next++; r < reqs.size(); r = next++) {
+                const read_req & req = reqs[r];
+                try {
+                    if (req.count == 1) {
+                        file.read_raw_at((uint8_t *) order[req.first].tensor->data + req.toffs, req.size, req.offs);
+                    } else {
+                        staging.resize(req.size);
+                        file.read_raw_at(staging.data(), req.size, req.offs);
+                        for (size_t k = req.first; k < req.first + req.count; k++) {
+                            memcpy(order[k].tensor->data, staging.data() + (order[k].offs - req.offs), ggml_nbytes(order[k].tensor));
+                        }
+                    }
+                } catch (const std::exception & err) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (error.empty()) {
+                        error = err.what();
+                    }
+                    next = reqs.size();
+                    break;
+                }
+                done += req.bytes;
+                if (report && progress_callback) {
+                    progress_callback((float) (done_size + done) / size_data, progress_callback_user_data);
+                }
+            }
+        };
+
+        // the calling thread reads as well and reports the progress
+        const int n_threads = (int) std::min(reqs.size(), (size_t) READ_THREADS);
+        std::vector<std::thread> workers;
+        for (int i = 1; i < n_threads; i++) {
+            workers.emplace_back(worker, false);
+        }
+        worker(true);
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
     void load_all_data(struct ggml_context * ctx, llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock) {
         size_t size_data = 0;
         size_t size_lock = 0;
@@ -1701,26 +2264,45 @@ struct llama_model_loader {
             }
         }
 
+        const int n_tensors_ctx = gguf_get_n_tensors(ctx_gguf);
+
         size_t done_size = 0;
-        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
+        int batch_end = 0;
+        for (int i = 0; i < n_tensors_ctx; i++) {
             struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
             GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
 
-            if (progress_callback) {
-                progress_callback((float) done_size / size_data, progress_callback_user_data);
-            }
+            if (use_mmap) {
+                if (progress_callback) {
+                    progress_callback((float) done_size / size_data, progress_callback_user_data);
+                }
 
-            // allocate temp buffer if not using mmap
-            if (!use_mmap && cur->data == NULL) {
-                GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
-                #ifdef GGML_USE_CPU_HBM
-                cur->data = (uint8_t*)hbw_malloc(ggml_nbytes(cur));
-                #else
-                cur->data = (uint8_t*)malloc(ggml_nbytes(cur));
-                #endif
-            }
+                load_data_for(cur);
+            } else if (i == batch_end) {
+                // read the next batch of tensors in parallel, then upload them in order below
+                // tensors not kept on the CPU get a temp buffer, which bounds the batch size
+                std::vector<struct ggml_tensor *> batch;
+                size_t size_staging = 0;
+                for (; batch_end < n_tensors_ctx; batch_end++) {
+                    struct ggml_tensor * t = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, batch_end));
+                    GGML_ASSERT(t);
+                    if (t->data == NULL) {
+                        GGML_ASSERT(t->backend != GGML_BACKEND_CPU);
+                        if (!batch.empty() && size_staging + ggml_nbytes(t) > READ_STAGING) {
+                            break;
+                        }
+                        size_staging += ggml_nbytes(t);
+                        #ifdef GGML_USE_CPU_HBM
+                        t->data = (uint8_t*)hbw_malloc(ggml_nbytes(t));
+                        #else
+                        t->data = (uint8_t*)malloc(ggml_nbytes(t));
+                        #endif
+                    }
+                    batch.push_back(t);
+                }
 
-            load_data_for(cur);
+                load_data_parallel(batch, progress_callback, progress_callback_user_data, done_size, size_data);
+            }
 
             switch (cur->backend) {
                 case GGML_BACKEND_CPU:
@@ -1805,9 +2387,11 @@ static const char * llama_model_type_name(e_model type) {
     switch (type) {
         case MODEL_1B:  return "1B";
         case MODEL_3B:  return "3B";
+        case MODEL_6B:  return "6B";
         case MODEL_7B:  return "7B";
         case MODEL_13B: return "13B";
         case MODEL_15B: return "15B";
+        case MODEL_20B: return "20B";
         case MODEL_30B: return "30B";
         case MODEL_34B: return "34B";
         case MODEL_40B: return "40B";
@@ -1906,6 +2490,12 @@ static void llm_load_hparams(
                     case 40: model.type = e_model::MODEL_13B; break;
                     default: model.type = e_model::MODEL_UNKNOWN;
                 }
+
+                // the 13B model uses ALiBi instead of RoPE
+                if (model.type == e_model::MODEL_13B) {
+                    model.alibi_slopes.resize(hparams.n_head);
+                    ggml_alibi_slopes(hparams.n_head, 8.0f, model.alibi_slopes.data());
+                }
             } break;
         case LLM_ARCH_STARCODER:
             {
@@ -1918,18 +2508,66 @@ static void llm_load_hparams(
                     default: model.type = e_model::MODEL_UNKNOWN;
                 }
             } break;
-        default: (void)0;
-    }
-
-    model.ftype = ml.ftype;
-}
+        case LLM_ARCH_GPT2:
+            {
+                GGUF_GET_KEY(ctx, hparams.f_norm_eps, gguf_get_val_f32, GGUF_TYPE_FLOAT32, true, kv(LLM_KV_ATTENTION_LAYERNORM_EPS));
+                switch (hparams.n_layer) {
+                    case 48: model.type = e_model::MODEL_1B; break;
+                    default: model.type = e_model::MODEL_UNKNOWN;
+                }
+            } break;
+        case LLM_ARCH_GPTJ:
+            {
+                GGUF_GET_KEY(ctx, hparams.f_norm_eps, gguf_get_val_f32, GGUF_TYPE_FLOAT32, true, kv(LLM_KV_ATTENTION_LAYERNORM_EPS));
+                switch (hparams.n_layer) {
+                    case 28: model.type = e_model::MODEL_6B; break;
+                    default: model.type = e_model::MODEL_UNKNOWN;
+                }
+            } break;
+        case LLM_ARCH_GPTNEOX:
+            {
+                GGUF_GET_KEY(ctx, hparams.f_norm_eps, gguf_get_val_f32, GGUF_TYPE_FLOAT32, true, kv(LLM_KV_ATTENTION_LAYERNORM_EPS));
 
-// TODO: This should probably be in llama.h
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos);
-static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
+                // the parallel residual is the default for gpt-neox, pythia and redpajama
+                hparams.use_par_res = true;
+                GGUF_GET_KEY(ctx, hparams.use_par_res, gguf_get_val_bool, GGUF_TYPE_BOOL, false, kv(LLM_KV_USE_PARALLEL_RESIDUAL));
 
-static void llm_load_vocab(
-        llama_model_loader & ml,
+                switch (hparams.n_layer) {
+                    case 32: model.type = e_model::MODEL_7B; break;
+                    case 44: model.type = e_model::MODEL_20B; break;
+                    default: model.type = e_model::MODEL_UNKNOWN;
+                }
+            } break;
+        case LLM_ARCH_MPT:
+            {
+                GGUF_GET_KEY(ctx, hparams.f_norm_eps,       gguf_get_val_f32, GGUF_TYPE_FLOAT32, true,  kv(LLM_KV_ATTENTION_LAYERNORM_EPS));
+                GGUF_GET_KEY(ctx, hparams.f_max_alibi_bias, gguf_get_val_f32, GGUF_TYPE_FLOAT32, true,  kv(LLM_KV_ATTENTION_MAX_ALIBI_BIAS));
+
+                // clamping of the qkv projection is optional, 0 disables it
+                hparams.f_clamp_kqv = 0.0f;
+                GGUF_GET_KEY(ctx, hparams.f_clamp_kqv,      gguf_get_val_f32, GGUF_TYPE_FLOAT32, false, kv(LLM_KV_ATTENTION_CLAMP_KQV));
+
+                switch (hparams.n_layer) {
+                    case 32: model.type = e_model::MODEL_7B; break;
+                    case 48: model.type = e_model::MODEL_30B; break;
+                    default: model.type = e_model::MODEL_UNKNOWN;
+                }
+
+                model.alibi_slopes.resize(hparams.n_head);
+                ggml_alibi_slopes(hparams.n_head, hparams.f_max_alibi_bias, model.alibi_slopes.data());
+            } break;
+        default: (void)0;
+    }
+
+    model.ftype = ml.ftype;
+}
+
+// TODO: This should probably be in llama.h
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos);
+static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
+
+static void llm_load_vocab(
+        llama_model_loader & ml,
         llama_model & model) {
     auto & vocab = model.vocab;
 
@@ -2363,6 +3001,7 @@ static void llm_load_tensors(
                         }
                     }
                 } break;
+            case LLM_ARCH_GPT2:
             case LLM_ARCH_STARCODER:
                 {
                     model.tok_embeddings = ml.create_tensor(ctx, tn(LLM_TENSOR_TOKEN_EMBD, "weight"), {n_embd, n_vocab}, GGML_BACKEND_CPU);
@@ -2417,19 +3056,173 @@ static void llm_load_tensors(
                         layer.attn_norm_b = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_NORM,   "bias", i),   {n_embd}, backend);
 
                         layer.wqkv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_QKV, "weight", i), {n_embd, n_embd + 2*n_embd_gqa}, backend_split);
-                        layer.bqkv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_QKV, "bias", i),   {n_embd + 2*n_embd_gqa},         backend_split);
+                        layer.bqkv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_QKV, "bias", i),   {n_embd + 2*n_embd_gqa},         backend);
+
+                        layer.wo   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd, n_embd},   backend_split);
+                        layer.bo   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "bias", i),   {n_embd},           backend);
+
+                        layer.ffn_norm   = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, backend);
+                        layer.ffn_norm_b = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_NORM, "bias", i),   {n_embd}, backend);
+
+                        layer.w2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {n_ff, n_embd}, backend_split);
+                        layer.b2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "bias", i),   {n_embd},       backend);
+
+                        layer.w3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, backend_split);
+                        layer.b3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "bias", i),   {n_ff},           backend);
+
+                        if (backend == GGML_BACKEND_GPU) {
+                            vram_weights +=
+                                ggml_nbytes(layer.attn_norm) + ggml_nbytes(layer.attn_norm_b) +
+                                ggml_nbytes(layer.wqkv)      + ggml_nbytes(layer.bqkv)        +
+                                ggml_nbytes(layer.wo)        + ggml_nbytes(layer.bo)          +
+                                ggml_nbytes(layer.ffn_norm)  + ggml_nbytes(layer.ffn_norm_b)  +
+                                ggml_nbytes(layer.w2)        + ggml_nbytes(layer.b2)          +
+                                ggml_nbytes(layer.w3)        + ggml_nbytes(layer.b3);
+                        }
+                    }
+                } break;
+            case LLM_ARCH_GPTJ:
+                {
+                    model.tok_embeddings = ml.create_tensor(ctx, tn(LLM_TENSOR_TOKEN_EMBD, "weight"), {n_embd, n_vocab}, GGML_BACKEND_CPU);
+
+                    // output
+                    {
+                        ggml_backend backend_norm;
+                        ggml_backend backend_output;
+
+                        if (n_gpu_layers > int(n_layer)) {
+                            // norm is not performance relevant on its own but keeping it in VRAM reduces data copying
+                            // on Windows however this is detrimental unless everything is on the GPU
+#ifndef _WIN32
+                            backend_norm = LLAMA_BACKEND_OFFLOAD;
+#else
+                            backend_norm = n_gpu_layers <= (int) n_layer + 2 ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD;
+#endif // _WIN32
+
+                            backend_output = LLAMA_BACKEND_OFFLOAD_SPLIT;
+                        } else {
+                            backend_norm   = GGML_BACKEND_CPU;
+                            backend_output = GGML_BACKEND_CPU;
+                        }
+
+                        model.output_norm   = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT_NORM, "weight"), {n_embd},          backend_norm);
+                        model.output_norm_b = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT_NORM, "bias"),   {n_embd},          backend_norm);
+                        model.output        = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT,      "weight"), {n_embd, n_vocab}, backend_output);
+                        model.output_b      = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT,      "bias"),   {n_vocab},         backend_norm);
+
+                        if (backend_norm == GGML_BACKEND_GPU) {
+                            vram_weights += ggml_nbytes(model.output_norm);
+                            vram_weights += ggml_nbytes(model.output_norm_b);
+                            vram_weights += ggml_nbytes(model.output_b);
+                        }
+                        if (backend_output == GGML_BACKEND_GPU_SPLIT) {
+                            vram_weights += ggml_nbytes(model.output);
+                        }
+                    }
+
+                    const uint32_t n_ff = hparams.n_ff;
+
+                    const int i_gpu_start = n_layer - n_gpu_layers;
+
+                    model.layers.resize(n_layer);
+
+                    for (uint32_t i = 0; i < n_layer; ++i) {
+                        const ggml_backend backend       = int(i) < i_gpu_start ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD; // NOLINT
+                        const ggml_backend backend_split = int(i) < i_gpu_start ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD_SPLIT; // NOLINT
+
+                        auto & layer = model.layers[i];
+
+                        // attention and feed forward share the input norm
+                        layer.attn_norm   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd}, backend);
+                        layer.attn_norm_b = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_NORM, "bias", i),   {n_embd}, backend);
+
+                        layer.wq = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd},     backend_split);
+                        layer.wk = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_gqa}, backend_split);
+                        layer.wv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_gqa}, backend_split);
+                        layer.wo = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd, n_embd},     backend_split);
+
+                        layer.w2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {n_ff, n_embd}, backend_split);
+                        layer.b2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "bias", i),   {n_embd},       backend);
+
+                        layer.w3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, backend_split);
+                        layer.b3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "bias", i),   {n_ff},           backend);
+
+                        if (backend == GGML_BACKEND_GPU) {
+                            vram_weights +=
+                                ggml_nbytes(layer.attn_norm) + ggml_nbytes(layer.attn_norm_b) +
+                                ggml_nbytes(layer.wq)        + ggml_nbytes(layer.wk)          +
+                                ggml_nbytes(layer.wv)        + ggml_nbytes(layer.wo)          +
+                                ggml_nbytes(layer.w2)        + ggml_nbytes(layer.b2)          +
+                                ggml_nbytes(layer.w3)        + ggml_nbytes(layer.b3);
+                        }
+                    }
+                } break;
+            case LLM_ARCH_GPTNEOX:
+                {
+                    model.tok_embeddings = ml.create_tensor(ctx, tn(LLM_TENSOR_TOKEN_EMBD, "weight"), {n_embd, n_vocab}, GGML_BACKEND_CPU);
+
+                    // output
+                    {
+                        ggml_backend backend_norm;
+                        ggml_backend backend_output;
+
+                        if (n_gpu_layers > int(n_layer)) {
+                            // norm is not performance relevant on its own but keeping it in VRAM reduces data copying
+                            // on Windows however this is detrimental unless everything is on the GPU
+#ifndef _WIN32
+                            backend_norm = LLAMA_BACKEND_OFFLOAD;
+#else
+                            backend_norm = n_gpu_layers <= (int) n_layer + 2 ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD;
+#endif // _WIN32
+
+                            backend_output = LLAMA_BACKEND_OFFLOAD_SPLIT;
+                        } else {
+                            backend_norm   = GGML_BACKEND_CPU;
+                            backend_output = GGML_BACKEND_CPU;
+                        }
+
+                        model.output_norm   = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT_NORM, "weight"), {n_embd},          backend_norm);
+                        model.output_norm_b = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT_NORM, "bias"),   {n_embd},          backend_norm);
+                        model.output        = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT,      "weight"), {n_embd, n_vocab}, backend_output);
+
+                        if (backend_norm == GGML_BACKEND_GPU) {
+                            vram_weights += ggml_nbytes(model.output_norm);
+                            vram_weights += ggml_nbytes(model.output_norm_b);
+                        }
+                        if (backend_output == GGML_BACKEND_GPU_SPLIT) {
+                            vram_weights += ggml_nbytes(model.output);
+                        }
+                    }
+
+                    const uint32_t n_ff = hparams.n_ff;
+
+                    const int i_gpu_start = n_layer - n_gpu_layers;
+
+                    model.layers.resize(n_layer);
+
+                    for (uint32_t i = 0; i < n_layer; ++i) {
+                        const ggml_backend backend       = int(i) < i_gpu_start ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD; // NOLINT
+                        const ggml_backend backend_split = int(i) < i_gpu_start ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD_SPLIT; // NOLINT
+
+                        auto & layer = model.layers[i];
+
+                        layer.attn_norm   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_NORM,   "weight", i), {n_embd}, backend);
+                        layer.attn_norm_b = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_NORM,   "bias", i),   {n_embd}, backend);
+
+                        layer.wqkv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_QKV, "weight", i), {n_embd, n_embd + 2*n_embd_gqa}, backend_split);
+                        layer.bqkv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_QKV, "bias", i),   {n_embd + 2*n_embd_gqa},         backend);
 
                         layer.wo   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd, n_embd},   backend_split);
-                        layer.bo   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "bias", i),   {n_embd},           backend_split);
+                        layer.bo   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "bias", i),   {n_embd},           backend);
 
                         layer.ffn_norm   = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, backend);
                         layer.ffn_norm_b = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_NORM, "bias", i),   {n_embd}, backend);
 
                         layer.w2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {n_ff, n_embd}, backend_split);
-                        layer.b2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "bias", i),   {n_embd},       backend_split);
+                        layer.b2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "bias", i),   {n_embd},       backend);
 
                         layer.w3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, backend_split);
-                        layer.b3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "bias", i),   {n_ff},           backend_split);
+                        layer.b3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "bias", i),   {n_ff},           backend);
 
                         if (backend == GGML_BACKEND_GPU) {
                             vram_weights +=
@@ -2442,6 +3235,78 @@ static void llm_load_tensors(
                         }
                     }
                 } break;
+            case LLM_ARCH_MPT:
+                {
+                    model.tok_embeddings = ml.create_tensor(ctx, tn(LLM_TENSOR_TOKEN_EMBD, "weight"), {n_embd, n_vocab}, GGML_BACKEND_CPU);
+
+                    // output
+                    {
+                        ggml_backend backend_norm;
+                        ggml_backend backend_output;
+
+                        if (n_gpu_layers > int(n_layer)) {
+                            // norm is not performance relevant on its own but keeping it in VRAM reduces data copying
+                            // on Windows however this is detrimental unless everything is on the GPU
+#ifndef _WIN32
+                            backend_norm = LLAMA_BACKEND_OFFLOAD;
+#else
+                            backend_norm = n_gpu_layers <= (int) n_layer + 2 ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD;
+#endif // _WIN32
+
+                            backend_output = LLAMA_BACKEND_OFFLOAD_SPLIT;
+                        } else {
+                            backend_norm   = GGML_BACKEND_CPU;
+                            backend_output = GGML_BACKEND_CPU;
+                        }
+
+                        model.output_norm = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT_NORM, "weight"), {n_embd}, backend_norm);
+
+                        // mpt ties the output projection to the token embeddings, a separate one is only used when present
+                        if (gguf_find_tensor(ml.ctx_gguf, tn(LLM_TENSOR_OUTPUT, "weight").c_str()) >= 0) {
+                            model.output = ml.create_tensor(ctx, tn(LLM_TENSOR_OUTPUT, "weight"), {n_embd, n_vocab}, backend_output);
+
+                            if (backend_output == GGML_BACKEND_GPU_SPLIT) {
+                                vram_weights += ggml_nbytes(model.output);
+                            }
+                        } else {
+                            model.output = model.tok_embeddings;
+                        }
+
+                        if (backend_norm == GGML_BACKEND_GPU) {
+                            vram_weights += ggml_nbytes(model.output_norm);
+                        }
+                    }
+
+                    const uint32_t n_ff = hparams.n_ff;
+
+                    const int i_gpu_start = n_layer - n_gpu_layers;
+
+                    model.layers.resize(n_layer);
+
+                    for (uint32_t i = 0; i < n_layer; ++i) {
+                        const ggml_backend backend       = int(i) < i_gpu_start ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD; // NOLINT
+                        const ggml_backend backend_split = int(i) < i_gpu_start ? GGML_BACKEND_CPU : LLAMA_BACKEND_OFFLOAD_SPLIT; // NOLINT
+
+                        auto & layer = model.layers[i];
+
+                        layer.attn_norm = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd}, backend);
+
+                        layer.wqkv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_QKV, "weight", i), {n_embd, n_embd + 2*n_embd_gqa}, backend_split);
+                        layer.wo   = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd, n_embd},                backend_split);
+
+                        layer.ffn_norm = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, backend);
+
+                        layer.w2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, backend_split);
+                        layer.w3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, backend_split);
+
+                        if (backend == GGML_BACKEND_GPU) {
+                            vram_weights +=
+                                ggml_nbytes(layer.attn_norm) + ggml_nbytes(layer.wqkv)     +
+                                ggml_nbytes(layer.wo)        + ggml_nbytes(layer.ffn_norm) +
+                                ggml_nbytes(layer.w2)        + ggml_nbytes(layer.w3);
+                        }
+                    }
+                } break;
             default:
                 throw std::runtime_error("unknown architecture");
         }
@@ -2550,6 +3415,117 @@ static bool llama_model_load(
     return true;
 }
 
+// the output projection is the largest matmul for big vocabularies, so only the rows whose logits are read
+// back go through it: the flagged ones, or only the last one without flags and without logits_all
+static std::vector<int32_t> llama_output_rows(const llama_context & lctx, const llama_batch & batch) {
+    std::vector<int32_t> rows;
+
+    const int32_t n_tokens = batch.n_tokens;
+
+    if (batch.logits) {
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            if (batch.logits[i] != 0) {
+                rows.push_back(i);
+            }
+        }
+        // the embeddings are taken from the last token
+        if (!lctx.embedding.empty() && (rows.empty() || rows.back() != n_tokens - 1)) {
+            rows.push_back(n_tokens - 1);
+        }
+        if (rows.empty()) {
+            rows.push_back(n_tokens - 1);
+        }
+    } else if (!lctx.logits_all) {
+        rows.push_back(n_tokens - 1);
+    }
+
+    if ((int32_t) rows.size() == n_tokens) {
+        rows.clear();
+    }
+
+    return rows;
+}
+
+// selects lctx.output_rows from the normalized hidden state, the result replaces it as "result_norm"
+static struct ggml_tensor * llm_build_output_rows(
+        struct ggml_context * ctx0,
+              llama_context & lctx,
+        struct ggml_tensor  * cur) {
+    // the measure pass has to size the buffers for all rows
+    if (ggml_allocr_is_measure(lctx.alloc) || lctx.output_rows.empty()) {
+        return cur;
+    }
+
+    ggml_set_name(cur, "result_norm_all");
+
+    struct ggml_tensor * inp_rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, lctx.output_rows.size());
+    ggml_allocr_alloc(lctx.alloc, inp_rows);
+    memcpy(inp_rows->data, lctx.output_rows.data(), ggml_nbytes(inp_rows));
+    ggml_set_name(inp_rows, "inp_output_rows");
+
+    cur = ggml_get_rows(ctx0, cur, inp_rows);
+    ggml_set_name(cur, "result_norm");
+
+    return cur;
+}
+
+// copies Vcur into the cells [kv_head, kv_head + n_tokens) of the V cache of layer il
+// Vcur is [n_tokens, n_embd_gqa] when the cache is transposed and [n_embd_gqa, n_tokens] when it stores rows
+static struct ggml_tensor * llm_build_kv_store_v(
+        struct ggml_context * ctx0,
+       const llama_kv_cache & kv_self,
+        struct ggml_tensor  * Vcur,
+                    int64_t   n_embd_gqa,
+                    int64_t   n_ctx,
+                    int32_t   n_tokens,
+                    int32_t   kv_head,
+                        int   il,
+             offload_func_t   offload_func_v) {
+    struct ggml_tensor * v = kv_self.v_trans
+        ? ggml_view_2d(ctx0, kv_self.v, n_tokens, n_embd_gqa,
+                (   n_ctx)*ggml_element_size(kv_self.v),
+                (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v))
+        : ggml_view_1d(ctx0, kv_self.v, n_tokens*n_embd_gqa, (ggml_element_size(kv_self.v)*n_embd_gqa)*(il*n_ctx + kv_head));
+    offload_func_v(v);
+    ggml_set_name(v, "v");
+
+    return ggml_cpy(ctx0, Vcur, v);
+}
+
+// KQV = V * KQ_soft_max over the first n_kv cells of the V cache of layer il, split into n_head_kv heads
+// with V stored one row per cell the weighted rows are accumulated by ggml_attn_v instead of transposing V
+static struct ggml_tensor * llm_build_kqv(
+        struct ggml_context * ctx0,
+       const llama_kv_cache & kv_self,
+        struct ggml_tensor  * KQ_soft_max,
+                    int64_t   n_embd_head,
+                    int64_t   n_embd_gqa,
+                    int64_t   n_head_kv,
+                    int64_t   n_ctx,
+                    int32_t   n_kv,
+                        int   il,
+             offload_func_t   offload_func_v) {
+    struct ggml_tensor * V = kv_self.v_trans
+        ? ggml_view_3d(ctx0, kv_self.v,
+                n_kv, n_embd_head, n_head_kv,
+                ggml_element_size(kv_self.v)*n_ctx,
+                ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il)
+        : ggml_view_3d(ctx0, kv_self.v,
+                n_embd_head, n_kv, n_head_kv,
+                ggml_element_size(kv_self.v)*n_embd_gqa,
+                ggml_element_size(kv_self.v)*n_embd_head,
+                ggml_element_size(kv_self.v)*n_embd_gqa*n_ctx*il);
+    offload_func_v(V);
+    ggml_set_name(V, "V");
+
+    struct ggml_tensor * KQV = kv_self.v_trans ? ggml_mul_mat(ctx0, V, KQ_soft_max) : ggml_attn_v(ctx0, V, KQ_soft_max);
+    offload_func_v(KQV);
+    ggml_set_name(KQV, "KQV");
+
+    return KQV;
+}
+
 static struct ggml_cgraph * llm_build_llama(
          llama_context & lctx,
      const llama_batch & batch) {
@@ -2660,21 +3636,7 @@ static struct ggml_cgraph * llm_build_llama(
     ggml_set_name(KQ_mask, "KQ_mask");
     ggml_allocr_alloc(lctx.alloc, KQ_mask);
     if (!ggml_allocr_is_measure(lctx.alloc)) {
-        float * data = (float *) KQ_mask->data;
-        memset(data, 0, ggml_nbytes(KQ_mask));
-
-        for (int h = 0; h < 1; ++h) {
-            for (int j = 0; j < n_tokens; ++j) {
-                const llama_pos    pos    = batch.pos[j];
-                const llama_seq_id seq_id = batch.seq_id[j];
-
-                for (int i = 0; i < n_kv; ++i) {
-                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                    }
-                }
-            }
-        }
+        llama_kv_cache_fill_kq_mask(kv_self, batch, n_kv, (float *) KQ_mask->data, n_tokens > 1 ? lctx.cparams.n_threads_batch : 1);
     }
 
     // KQ_pos - contains the positions
@@ -2716,6 +3678,8 @@ static struct ggml_cgraph * llm_build_llama(
         }
     }
 
+    const bool fused_soft_max = llama_use_fused_soft_max(offload_func_kq, offload_func_v);
+
     for (int il = 0; il < n_layer; ++il) {
         ggml_format_name(inpL, "layer_inp_%d", il);
 
@@ -2762,13 +3726,16 @@ static struct ggml_cgraph * llm_build_llama(
 
             // store key and value to memory
             {
-                // compute the transposed [n_tokens, n_embd] V matrix
+                // compute the V matrix, transposed to [n_tokens, n_embd] when the cache stores it that way
 
                 struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
                 offload_func_v(tmpv);
                 ggml_set_name(tmpv, "tmpv");
 
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, n_tokens));
+                struct ggml_tensor * Vcur = ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, n_tokens);
+                if (kv_self.v_trans) {
+                    Vcur = ggml_transpose(ctx0, Vcur);
+                }
                 offload_func_v(Vcur);
                 ggml_set_name(Vcur, "Vcur");
 
@@ -2776,15 +3743,9 @@ static struct ggml_cgraph * llm_build_llama(
                 offload_func_kq(k);
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_embd_gqa,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
-                offload_func_v(v);
-                ggml_set_name(v, "v");
-
                 // important: storing RoPE-ed version of K in the KV cache!
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                ggml_build_forward_expand(gf, llm_build_kv_store_v(ctx0, kv_self, Vcur, n_embd_gqa, n_ctx, n_tokens, kv_head, il, offload_func_v));
             }
 
             struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
@@ -2805,43 +3766,30 @@ static struct ggml_cgraph * llm_build_llama(
             offload_func_kq(KQ);
             ggml_set_name(KQ, "KQ");
 
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_kv, n_tokens, n_head, 1]
-            struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
+            struct ggml_tensor * KQ_soft_max;
 
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
-            offload_func_kq(KQ_masked);
-            ggml_set_name(KQ_masked, "KQ_masked");
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
+            if (fused_soft_max) {
+                // KQ = soft_max(KQ / sqrt(n_embd_head) + KQ_mask)
+                KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, NULL, NULL, 1.0f/sqrtf(float(n_embd_head)), -1);
+            } else {
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_kv, n_tokens, n_head, 1]
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+            }
             ggml_set_name(KQ_soft_max, "KQ_soft_max");
 
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            ggml_set_name(V, "V");
-
-#if 1
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            ggml_set_name(KQV, "KQV");
-#else
-            // make V contiguous in memory to speed up the matmul, however we waste time on the copy
-            // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
-            // is there a better way?
-            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_ctx, n_embd_head, n_head));
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
-#endif
+            struct ggml_tensor * KQV = llm_build_kqv(ctx0, kv_self, KQ_soft_max, n_embd_head, n_embd_gqa, n_head_kv, n_ctx, n_kv, il, offload_func_v);
 
             // KQV_merged = KQV.permute(0, 2, 1, 3)
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
@@ -2929,6 +3877,8 @@ static struct ggml_cgraph * llm_build_llama(
         ggml_set_name(cur, "result_norm");
     }
 
+    cur = llm_build_output_rows(ctx0, lctx, cur);
+
     // lm_head
     cur = ggml_mul_mat(ctx0, model.output, cur);
     ggml_set_name(cur, "result_output");
@@ -3048,20 +3998,19 @@ static struct ggml_cgraph * llm_build_baichaun(
     ggml_set_name(KQ_mask, "KQ_mask");
     ggml_allocr_alloc(lctx.alloc, KQ_mask);
     if (!ggml_allocr_is_measure(lctx.alloc)) {
-        float * data = (float *) KQ_mask->data;
-        memset(data, 0, ggml_nbytes(KQ_mask));
+        llama_kv_cache_fill_kq_mask(kv_self, batch, n_kv, (float *) KQ_mask->data, n_tokens > 1 ? lctx.cparams.n_threads_batch : 1);
+    }
 
-        for (int h = 0; h < 1; ++h) {
-            for (int j = 0; j < n_tokens; ++j) {
-                const llama_pos    pos    = batch.pos[j];
-                const llama_seq_id seq_id = batch.seq_id[j];
+    const bool fused_soft_max = llama_use_fused_soft_max(offload_func_kq, offload_func_v);
 
-                for (int i = 0; i < n_kv; ++i) {
-                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                    }
-                }
-            }
+    // ALiBi slopes for the fused soft_max
+    struct ggml_tensor * KQ_slopes = NULL;
+    if (!model.alibi_slopes.empty() && fused_soft_max) {
+        KQ_slopes = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_head);
+        ggml_set_name(KQ_slopes, "KQ_slopes");
+        ggml_allocr_alloc(lctx.alloc, KQ_slopes);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(KQ_slopes->data, model.alibi_slopes.data(), n_head*ggml_element_size(KQ_slopes));
         }
     }
 
@@ -3163,13 +4112,16 @@ static struct ggml_cgraph * llm_build_baichaun(
 
             // store key and value to memory
             {
-                // compute the transposed [n_tokens, n_embd] V matrix
+                // compute the V matrix, transposed to [n_tokens, n_embd] when the cache stores it that way
 
                 struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
                 offload_func_v(tmpv);
                 ggml_set_name(tmpv, "tmpv");
 
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, n_tokens));
+                struct ggml_tensor * Vcur = ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, n_tokens);
+                if (kv_self.v_trans) {
+                    Vcur = ggml_transpose(ctx0, Vcur);
+                }
                 offload_func_v(Vcur);
                 ggml_set_name(Vcur, "Vcur");
 
@@ -3177,15 +4129,9 @@ static struct ggml_cgraph * llm_build_baichaun(
                 offload_func_kq(k);
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_embd_gqa,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
-                offload_func_v(v);
-                ggml_set_name(v, "v");
-
                 // important: storing RoPE-ed version of K in the KV cache!
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                ggml_build_forward_expand(gf, llm_build_kv_store_v(ctx0, kv_self, Vcur, n_embd_gqa, n_ctx, n_tokens, kv_head, il, offload_func_v));
             }
 
             struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
@@ -3206,47 +4152,42 @@ static struct ggml_cgraph * llm_build_baichaun(
             offload_func_kq(KQ);
             ggml_set_name(KQ, "KQ");
 
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + n_tokens, n_tokens, n_head, 1]
-            struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
+            struct ggml_tensor * KQ_soft_max;
 
-            struct ggml_tensor * KQ_masked;
-            struct ggml_tensor * KQ_scaled_alibi;
+            if (fused_soft_max) {
+                // scale, mask, ALiBi bias (13B) and soft_max in a single pass over the scores
+                KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, KQ_slopes, NULL, 1.0f/sqrtf(float(n_embd)/n_head), -1);
+            } else {
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_past + n_tokens, n_tokens, n_head, 1]
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct ggml_tensor * KQ_masked;
+                struct ggml_tensor * KQ_scaled_alibi;
+
+                switch (model.type) {
+                    case MODEL_7B:
+                        KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                        break;
+                    case MODEL_13B:
+                        // TODO: replace with ggml_add()
+                        KQ_scaled_alibi = ggml_alibi(ctx0, KQ_scaled, /*n_past*/ 0, n_head, 8);
+                        ggml_set_name(KQ_scaled_alibi, "KQ_scaled_alibi");
+                        KQ_masked = ggml_add(ctx0, KQ_scaled_alibi, KQ_mask);
+                        break;
+                    default:
+                        GGML_ASSERT(false);
+                }
 
-            switch (model.type) {
-                case MODEL_7B:
-                    KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
-                    break;
-                case MODEL_13B:
-                    // TODO: replace with ggml_add()
-                    KQ_scaled_alibi = ggml_alibi(ctx0, KQ_scaled, /*n_past*/ 0, n_head, 8);
-                    ggml_set_name(KQ_scaled_alibi, "KQ_scaled_alibi");
-                    KQ_masked = ggml_add(ctx0, KQ_scaled_alibi, KQ_mask);
-                    break;
-                default:
-                    GGML_ASSERT(false);
+                // KQ = soft_max(KQ_masked)
+                KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
             }
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
             ggml_set_name(KQ_soft_max, "KQ_soft_max");
 
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            ggml_set_name(V, "V");
-
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            ggml_set_name(KQV, "KQV");
+            struct ggml_tensor * KQV = llm_build_kqv(ctx0, kv_self, KQ_soft_max, n_embd_head, n_embd_gqa, n_head_kv, n_ctx, n_kv, il, offload_func_v);
 
             // KQV_merged = KQV.permute(0, 2, 1, 3)
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
@@ -3334,6 +4275,8 @@ static struct ggml_cgraph * llm_build_baichaun(
         ggml_set_name(cur, "result_norm");
     }
 
+    cur = llm_build_output_rows(ctx0, lctx, cur);
+
     // lm_head
     cur = ggml_mul_mat(ctx0, model.output, cur);
     ggml_set_name(cur, "result_output");
@@ -3456,21 +4399,7 @@ static struct ggml_cgraph * llm_build_falcon(
     ggml_set_name(KQ_mask, "KQ_mask");
     ggml_allocr_alloc(lctx.alloc, KQ_mask);
     if (!ggml_allocr_is_measure(lctx.alloc)) {
-        float * data = (float *) KQ_mask->data;
-        memset(data, 0, ggml_nbytes(KQ_mask));
-
-        for (int h = 0; h < 1; ++h) {
-            for (int j = 0; j < n_tokens; ++j) {
-                const llama_pos    pos    = batch.pos[j];
-                const llama_seq_id seq_id = batch.seq_id[j];
-
-                for (int i = 0; i < n_kv; ++i) {
-                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                    }
-                }
-            }
-        }
+        llama_kv_cache_fill_kq_mask(kv_self, batch, n_kv, (float *) KQ_mask->data, n_tokens > 1 ? lctx.cparams.n_threads_batch : 1);
     }
 
     // KQ_pos - contains the positions
@@ -3512,6 +4441,10 @@ static struct ggml_cgraph * llm_build_falcon(
         }
     }
 
+    const bool qkv_views = llama_use_qkv_views(offload_func_kq, offload_func_v);
+
+    const bool fused_soft_max = llama_use_fused_soft_max(offload_func_kq, offload_func_v);
+
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * attn_norm;
 
@@ -3564,22 +4497,28 @@ static struct ggml_cgraph * llm_build_falcon(
 
             const size_t wsize = ggml_type_size(cur->type);
 
-            // TODO: these 2 ggml_conts are technically not needed, but we add them until CUDA support for
-            //       non-contiguous views is added for the rope operator
-            struct ggml_tensor * tmpq = ggml_cont(ctx0, ggml_view_3d(
+            struct ggml_tensor * tmpq = ggml_view_3d(
                 ctx0, cur, n_embd_head, n_head, n_tokens,
                 wsize * n_embd_head,
                 wsize * n_embd_head * (n_head + 2 * n_head_kv),
-                0));
+                0);
             offload_func_kq(tmpq);
 
-            struct ggml_tensor * tmpk = ggml_cont(ctx0, ggml_view_3d(
+            struct ggml_tensor * tmpk = ggml_view_3d(
                 ctx0, cur, n_embd_head, n_head_kv, n_tokens,
                 wsize * n_embd_head,
                 wsize * n_embd_head * (n_head + 2 * n_head_kv),
-                wsize * n_embd_head *  n_head));
+                wsize * n_embd_head *  n_head);
             offload_func_kq(tmpk);
 
+            if (!qkv_views) {
+                tmpq = ggml_cont(ctx0, tmpq);
+                offload_func_kq(tmpq);
+
+                tmpk = ggml_cont(ctx0, tmpk);
+                offload_func_kq(tmpk);
+            }
+
             struct ggml_tensor * tmpv = ggml_view_3d(
                 ctx0, cur, n_embd_head, n_head_kv, n_tokens,
                 wsize * n_embd_head,
@@ -3594,22 +4533,23 @@ static struct ggml_cgraph * llm_build_falcon(
             offload_func_kq(Kcur);
 
             {
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, n_tokens));
+                struct ggml_tensor * Vcur = tmpv;
+                if (kv_self.v_trans && !qkv_views) {
+                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, n_tokens));
+                    offload_func_v(Vcur->src[0]->src[0]);
+                } else if (kv_self.v_trans) {
+                    // the heads of V are adjacent in each row of the QKV output, so it can be viewed as one 2d tensor
+                    Vcur = ggml_transpose(ctx0, ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], wsize * n_embd_head * (n_head + n_head_kv)));
+                }
                 offload_func_v(Vcur);
-                offload_func_v(Vcur->src[0]->src[0]);
                 ggml_set_name(Vcur, "Vcur");
 
                 struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + kv_head));
                 offload_func_kq(k);
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_embd_gqa,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
-                offload_func_v(v);
-
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                ggml_build_forward_expand(gf, llm_build_kv_store_v(ctx0, kv_self, Vcur, n_embd_gqa, n_ctx, n_tokens, kv_head, il, offload_func_v));
             }
 
             struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
@@ -3629,30 +4569,25 @@ static struct ggml_cgraph * llm_build_falcon(
             offload_func_kq(KQ);
             ggml_set_name(KQ, "KQ");
 
-            struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
+            struct ggml_tensor * KQ_soft_max;
 
-            struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
-            offload_func_kq(KQ_masked);
-            ggml_set_name(KQ_masked, "KQ_masked");
+            if (fused_soft_max) {
+                KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, NULL, NULL, 1.0f/sqrtf(float(n_embd)/n_head), -1);
+            } else {
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            ggml_set_name(V, "V");
+                KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+            }
+            ggml_set_name(KQ_soft_max, "KQ_soft_max");
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            ggml_set_name(KQV, "KQV");
+            struct ggml_tensor * KQV = llm_build_kqv(ctx0, kv_self, KQ_soft_max, n_embd_head, n_embd_gqa, n_head_kv, n_ctx, n_kv, il, offload_func_v);
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
             offload_func_v(KQV_merged);
@@ -3676,17 +4611,991 @@ static struct ggml_cgraph * llm_build_falcon(
             cur = ggml_mul_mat(ctx0, model.layers[il].w3, inpFF);
             offload_func(cur);
 
-            cur = ggml_gelu(ctx0, cur);
+            cur = ggml_gelu(ctx0, cur);
+            offload_func(cur);
+            cur = ggml_mul_mat(ctx0, model.layers[il].w2, cur);
+            offload_func(cur);
+        }
+
+        cur = ggml_add(ctx0, cur, attn_out);
+        offload_func(cur);
+        cur = ggml_add(ctx0, cur, inpL);
+        offload_func(cur);
+
+        // input for next layer
+        inpL = cur;
+    }
+
+    cur = inpL;
+
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, norm_eps);
+        offload_func_nr(cur);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0, cur, model.output_norm),
+                model.output_norm_b);
+        ggml_set_name(cur, "result_norm");
+    }
+
+    cur = llm_build_output_rows(ctx0, lctx, cur);
+
+    cur = ggml_mul_mat(ctx0, model.output, cur);
+    ggml_set_name(cur, "result_output");
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static struct ggml_cgraph * llm_build_starcoder(
+         llama_context & lctx,
+     const llama_batch & batch) {
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    const auto & kv_self = lctx.kv_self;
+
+    GGML_ASSERT(!!kv_self.ctx);
+
+    const int64_t n_embd      = hparams.n_embd;
+    const int64_t n_layer     = hparams.n_layer;
+    const int64_t n_ctx       = cparams.n_ctx;
+    const int64_t n_head      = hparams.n_head;
+    const int64_t n_head_kv   = hparams.n_head_kv;
+    const int64_t n_embd_head = hparams.n_embd_head();
+    const int64_t n_embd_gqa  = hparams.n_embd_gqa();
+
+    GGML_ASSERT(n_embd_head == hparams.n_rot);
+
+    const float norm_eps = hparams.f_norm_eps;
+
+    const int n_gpu_layers = model.n_gpu_layers;
+
+    const int32_t n_tokens = batch.n_tokens;
+    const int32_t n_kv     = ggml_allocr_is_measure(lctx.alloc) ? n_ctx            : kv_self.n;
+    const int32_t kv_head  = ggml_allocr_is_measure(lctx.alloc) ? n_ctx - n_tokens : kv_self.head;
+
+    auto & buf_compute = lctx.buf_compute;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ buf_compute.size,
+        /*.mem_buffer =*/ buf_compute.data,
+        /*.no_alloc   =*/ false,
+    };
+
+    params.no_alloc = true;
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur;
+    struct ggml_tensor * token;
+    struct ggml_tensor * position;
+    struct ggml_tensor * inpL;
+
+    if (batch.token) {
+        struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+
+        ggml_allocr_alloc(lctx.alloc, inp_tokens);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(inp_tokens->data, batch.token, n_tokens*ggml_element_size(inp_tokens));
+        }
+        ggml_set_name(inp_tokens, "inp_tokens");
+
+        token = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
+    } else {
+#ifdef GGML_USE_MPI
+        GGML_ASSERT(false && "not implemented");
+#endif
+
+        token = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens);
+
+        ggml_allocr_alloc(lctx.alloc, token);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(token->data, batch.embd, n_tokens * n_embd * ggml_element_size(token));
+        }
+    }
+
+    {
+        // Compute position embeddings.
+        struct ggml_tensor * inp_positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        ggml_allocr_alloc(lctx.alloc, inp_positions);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            for (int i = 0; i < n_tokens; ++i) {
+                ((int32_t *) inp_positions->data)[i] = batch.pos[i];
+            }
+        }
+        ggml_set_name(inp_positions, "inp_positions");
+
+        position = ggml_get_rows(ctx0, model.pos_embeddings, inp_positions);
+    }
+
+    const int i_gpu_start = n_layer - n_gpu_layers;
+    (void) i_gpu_start;
+
+    // offload functions set the tensor output backend to GPU
+    // tensors are GPU-accelerated if any input or the output has been offloaded
+    offload_func_t offload_func_nr = llama_nop; // nr = non-repeating
+    offload_func_t offload_func_kq = llama_nop;
+    offload_func_t offload_func_v  = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+    if (n_gpu_layers > n_layer) {
+        offload_func_nr = ggml_cuda_assign_buffers_no_alloc;
+    }
+    if (n_gpu_layers > n_layer + 1) {
+        offload_func_v  = ggml_cuda_assign_buffers_no_alloc;
+    }
+    if (n_gpu_layers > n_layer + 2) {
+        offload_func_kq = ggml_cuda_assign_buffers_no_alloc;
+    }
+#endif // GGML_USE_CUBLAS
+
+    // KQ_scale
+    struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+    ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+    ggml_allocr_alloc(lctx.alloc, KQ_scale);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd)/n_head));
+    }
+
+    // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
+    offload_func_kq(KQ_mask);
+    ggml_set_name(KQ_mask, "KQ_mask");
+    ggml_allocr_alloc(lctx.alloc, KQ_mask);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        llama_kv_cache_fill_kq_mask(kv_self, batch, n_kv, (float *) KQ_mask->data, n_tokens > 1 ? lctx.cparams.n_threads_batch : 1);
+    }
+
+    const bool fused_soft_max = llama_use_fused_soft_max(offload_func_kq, offload_func_v);
+
+    inpL = ggml_add(ctx0, token, position);
+    ggml_set_name(inpL, "inpL");
+
+    for (int il = 0; il < n_layer; ++il) {
+        offload_func_t offload_func = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+        if (il >= i_gpu_start) {
+            offload_func = ggml_cuda_assign_buffers_no_alloc;
+        }
+#endif // GGML_USE_CUBLAS
+
+        {
+            // Norm
+            cur = ggml_norm(ctx0, inpL, norm_eps);
+            offload_func(cur);
+
+            cur = ggml_add(ctx0, ggml_mul(ctx0, cur, model.layers[il].attn_norm), model.layers[il].attn_norm_b);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+        }
+
+        {
+            // Self Attention
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wqkv, cur), model.layers[il].bqkv);
+            offload_func_kq(cur->src[0]);
+            offload_func_kq(cur);
+
+            struct ggml_tensor * tmpq = ggml_view_2d(ctx0, cur, n_embd, n_tokens, cur->nb[1], 0*sizeof(float)*n_embd);
+            offload_func_kq(tmpq);
+
+            struct ggml_tensor * tmpk = ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], sizeof(float)*n_embd);
+            offload_func_kq(tmpk);
+
+            struct ggml_tensor * tmpv = ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], sizeof(float)*(n_embd + n_embd_gqa));
+            offload_func_v(tmpv);
+
+            struct ggml_tensor * Qcur = tmpq;
+            struct ggml_tensor * Kcur = tmpk;
+
+            {
+                struct ggml_tensor * Vcur = tmpv;
+                if (kv_self.v_trans) {
+                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, n_tokens));
+                    offload_func_v(Vcur->src[0]->src[0]);
+                }
+                offload_func_v(Vcur);
+                ggml_set_name(Vcur, "Vcur");
+
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + kv_head));
+                offload_func_kq(k);
+                ggml_set_name(k, "k");
+
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+                ggml_build_forward_expand(gf, llm_build_kv_store_v(ctx0, kv_self, Vcur, n_embd_gqa, n_ctx, n_tokens, kv_head, il, offload_func_v));
+            }
+
+            struct ggml_tensor * Q = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd_head, n_head, n_tokens);
+            offload_func_kq(Q);
+
+            Q = ggml_cpy(ctx0, Qcur, Q);
+            offload_func_kq(Q);
+
+            Q = ggml_permute(ctx0, Q, 0, 2, 1, 3);
+            offload_func_kq(Q);
+            ggml_set_name(Q, "Q");
+
+            struct ggml_tensor * K =
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_embd_head, n_kv, n_head_kv,
+                        ggml_element_size(kv_self.k)*n_embd_gqa,
+                        ggml_element_size(kv_self.k)*n_embd_head,
+                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
+            offload_func_kq(K);
+            ggml_set_name(K, "K");
+
+            // K * Q
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            offload_func_kq(KQ);
+            ggml_set_name(KQ, "KQ");
+
+            struct ggml_tensor * KQ_soft_max;
+
+            if (fused_soft_max) {
+                // KQ = soft_max(KQ / sqrt(n_embd_head) + KQ_mask)
+                KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, NULL, NULL, 1.0f/sqrtf(float(n_embd)/n_head), -1);
+            } else {
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_kv, n_tokens, n_head, 1]
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+            }
+            ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+            struct ggml_tensor * KQV = llm_build_kqv(ctx0, kv_self, KQ_soft_max, n_embd_head, n_embd_gqa, n_head_kv, n_ctx, n_kv, il, offload_func_v);
+
+            // KQV_merged = KQV.permute(0, 2, 1, 3)
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+            offload_func_v(KQV_merged);
+            ggml_set_name(KQV_merged, "KQV_merged");
+
+            // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
+            cur = ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+            offload_func_v(cur);
+            ggml_set_name(cur, "KQV_merged_contiguous");
+        }
+
+        // Projection
+        cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wo, cur), model.layers[il].bo);
+        offload_func(cur->src[0]);
+        offload_func(cur);
+
+        // Add the input
+        cur = ggml_add(ctx0, cur, inpL);
+        offload_func(cur);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // FF
+        {
+            // Norm
+            {
+                cur = ggml_norm(ctx0, inpFF, norm_eps);
+                offload_func(cur);
+
+                cur = ggml_add(ctx0, ggml_mul(ctx0, cur, model.layers[il].ffn_norm), model.layers[il].ffn_norm_b);
+                offload_func(cur->src[0]);
+                offload_func(cur);
+            }
+
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w3, cur), model.layers[il].b3);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+            offload_func(cur);
+
+            // Projection
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w2, cur), model.layers[il].b2);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+        }
+
+        inpL = ggml_add(ctx0, cur, inpFF);
+        offload_func(inpL);
+    }
+
+    // Output Norm
+    {
+        cur = ggml_norm(ctx0, inpL, norm_eps);
+        offload_func_nr(cur);
+
+        cur = ggml_add(ctx0, ggml_mul(ctx0, cur, model.output_norm), model.output_norm_b);
+    }
+    ggml_set_name(cur, "result_norm");
+
+    cur = llm_build_output_rows(ctx0, lctx, cur);
+
+    cur = ggml_mul_mat(ctx0, model.output, cur);
+    ggml_set_name(cur, "result_output");
+
+    ggml_build_forward_expand(gf, cur);
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static struct ggml_cgraph * llm_build_gptj(
+         llama_context & lctx,
+     const llama_batch & batch) {
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    const auto & kv_self = lctx.kv_self;
+
+    GGML_ASSERT(!!kv_self.ctx);
+
+    const int64_t n_embd      = hparams.n_embd;
+    const int64_t n_layer     = hparams.n_layer;
+    const int64_t n_ctx       = cparams.n_ctx;
+    const int64_t n_head      = hparams.n_head;
+    const int64_t n_head_kv   = hparams.n_head_kv;
+    const int64_t n_embd_head = hparams.n_embd_head();
+    const int64_t n_embd_gqa  = hparams.n_embd_gqa();
+    const int64_t n_rot       = hparams.n_rot;
+
+    const float freq_base  = cparams.rope_freq_base;
+    const float freq_scale = cparams.rope_freq_scale;
+    const float norm_eps   = hparams.f_norm_eps;
+
+    const int n_gpu_layers = model.n_gpu_layers;
+
+    const int32_t n_tokens = batch.n_tokens;
+    const int32_t n_kv     = ggml_allocr_is_measure(lctx.alloc) ? n_ctx            : kv_self.n;
+    const int32_t kv_head  = ggml_allocr_is_measure(lctx.alloc) ? n_ctx - n_tokens : kv_self.head;
+
+    const bool do_rope_shift = ggml_allocr_is_measure(lctx.alloc) || kv_self.has_shift;
+
+    auto & buf_compute = lctx.buf_compute;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ buf_compute.size,
+        /*.mem_buffer =*/ buf_compute.data,
+        /*.no_alloc   =*/ false,
+    };
+
+    params.no_alloc = true;
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur;
+    struct ggml_tensor * inpL;
+
+    if (batch.token) {
+        struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+
+        ggml_allocr_alloc(lctx.alloc, inp_tokens);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(inp_tokens->data, batch.token, n_tokens*ggml_element_size(inp_tokens));
+        }
+        ggml_set_name(inp_tokens, "inp_tokens");
+
+        inpL = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
+    } else {
+#ifdef GGML_USE_MPI
+        GGML_ASSERT(false && "not implemented");
+#endif
+
+        inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens);
+
+        ggml_allocr_alloc(lctx.alloc, inpL);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(inpL->data, batch.embd, n_tokens * n_embd * ggml_element_size(inpL));
+        }
+    }
+
+    const int i_gpu_start = n_layer - n_gpu_layers;
+    (void) i_gpu_start;
+
+    // offload functions set the tensor output backend to GPU
+    // tensors are GPU-accelerated if any input or the output has been offloaded
+    offload_func_t offload_func_nr = llama_nop; // nr = non-repeating
+    offload_func_t offload_func_kq = llama_nop;
+    offload_func_t offload_func_v  = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+    if (n_gpu_layers > n_layer) {
+        offload_func_nr = ggml_cuda_assign_buffers_no_alloc;
+    }
+    if (n_gpu_layers > n_layer + 1) {
+        offload_func_v  = ggml_cuda_assign_buffers_no_alloc;
+    }
+    if (n_gpu_layers > n_layer + 2) {
+        offload_func_kq = ggml_cuda_assign_buffers_no_alloc;
+    }
+#endif // GGML_USE_CUBLAS
+
+    // KQ_scale
+    struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+    ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+    ggml_allocr_alloc(lctx.alloc, KQ_scale);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd_head)));
+    }
+
+    // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
+    offload_func_kq(KQ_mask);
+    ggml_set_name(KQ_mask, "KQ_mask");
+    ggml_allocr_alloc(lctx.alloc, KQ_mask);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        llama_kv_cache_fill_kq_mask(kv_self, batch, n_kv, (float *) KQ_mask->data, n_tokens > 1 ? lctx.cparams.n_threads_batch : 1);
+    }
+
+    // KQ_pos - contains the positions
+    struct ggml_tensor * KQ_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    offload_func_kq(KQ_pos);
+    ggml_set_name(KQ_pos, "KQ_pos");
+    ggml_allocr_alloc(lctx.alloc, KQ_pos);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        int * data = (int *) KQ_pos->data;
+        for (int i = 0; i < n_tokens; ++i) {
+            data[i] = batch.pos[i];
+        }
+    }
+
+    // shift the entire K-cache if needed
+    if (do_rope_shift) {
+        struct ggml_tensor * K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        offload_func_kq(K_shift);
+        ggml_set_name(K_shift, "K_shift");
+        ggml_allocr_alloc(lctx.alloc, K_shift);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            int * data = (int *) K_shift->data;
+            for (int i = 0; i < n_ctx; ++i) {
+                data[i] = kv_self.cells[i].delta;
+            }
+        }
+
+        for (int il = 0; il < n_layer; ++il) {
+            struct ggml_tensor * tmp =
+                    ggml_rope_custom_inplace(ctx0,
+                        ggml_view_3d(ctx0, kv_self.k,
+                            n_embd_head, n_head_kv, n_ctx,
+                            ggml_element_size(kv_self.k)*n_embd_head,
+                            ggml_element_size(kv_self.k)*n_embd_gqa,
+                            ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il),
+                        K_shift, n_rot, 0, 0, freq_base, freq_scale);
+            offload_func_kq(tmp);
+            ggml_build_forward_expand(gf, tmp);
+        }
+    }
+
+    const bool fused_soft_max = llama_use_fused_soft_max(offload_func_kq, offload_func_v);
+
+    for (int il = 0; il < n_layer; ++il) {
+        struct ggml_tensor * attn_norm;
+
+        offload_func_t offload_func = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+        if (il >= i_gpu_start) {
+            offload_func = ggml_cuda_assign_buffers_no_alloc;
+        }
+#endif // GGML_USE_CUBLAS
+
+        // attention and feed forward both read the output of the single input norm
+        {
+            attn_norm = ggml_norm(ctx0, inpL, norm_eps);
+            offload_func(attn_norm);
+
+            attn_norm = ggml_add(ctx0,
+                    ggml_mul(ctx0, attn_norm, model.layers[il].attn_norm),
+                    model.layers[il].attn_norm_b);
+            offload_func(attn_norm->src[0]);
+            offload_func(attn_norm);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * tmpq = ggml_mul_mat(ctx0, model.layers[il].wq, attn_norm);
+            offload_func_kq(tmpq);
+            ggml_set_name(tmpq, "tmpq");
+
+            struct ggml_tensor * tmpk = ggml_mul_mat(ctx0, model.layers[il].wk, attn_norm);
+            offload_func_kq(tmpk);
+            ggml_set_name(tmpk, "tmpk");
+
+            struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, attn_norm);
+            offload_func_v(tmpv);
+            ggml_set_name(tmpv, "tmpv");
+
+            // gpt-j rotates interleaved pairs of the first n_rot dimensions of each head
+            struct ggml_tensor * Qcur = ggml_rope_custom(ctx0, ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head,    n_tokens), KQ_pos, n_rot, 0, 0, freq_base, freq_scale);
+            offload_func_kq(Qcur);
+            ggml_set_name(Qcur, "Qcur");
+            struct ggml_tensor * Kcur = ggml_rope_custom(ctx0, ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, n_tokens), KQ_pos, n_rot, 0, 0, freq_base, freq_scale);
+            offload_func_kq(Kcur);
+            ggml_set_name(Kcur, "Kcur");
+
+            {
+                struct ggml_tensor * Vcur = ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, n_tokens);
+                if (kv_self.v_trans) {
+                    Vcur = ggml_transpose(ctx0, Vcur);
+                }
+                offload_func_v(Vcur);
+                ggml_set_name(Vcur, "Vcur");
+
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + kv_head));
+                offload_func_kq(k);
+                ggml_set_name(k, "k");
+
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+                ggml_build_forward_expand(gf, llm_build_kv_store_v(ctx0, kv_self, Vcur, n_embd_gqa, n_ctx, n_tokens, kv_head, il, offload_func_v));
+            }
+
+            struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
+            offload_func_kq(Q);
+            ggml_set_name(Q, "Q");
+
+            struct ggml_tensor * K =
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_embd_head, n_kv, n_head_kv,
+                        ggml_element_size(kv_self.k)*n_embd_gqa,
+                        ggml_element_size(kv_self.k)*n_embd_head,
+                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
+            offload_func_kq(K);
+            ggml_set_name(K, "K");
+
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            offload_func_kq(KQ);
+            ggml_set_name(KQ, "KQ");
+
+            struct ggml_tensor * KQ_soft_max;
+
+            if (fused_soft_max) {
+                KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, NULL, NULL, 1.0f/sqrtf(float(n_embd_head)), -1);
+            } else {
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+            }
+            ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+            struct ggml_tensor * KQV = llm_build_kqv(ctx0, kv_self, KQ_soft_max, n_embd_head, n_embd_gqa, n_head_kv, n_ctx, n_kv, il, offload_func_v);
+
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+            offload_func_v(KQV_merged);
+            ggml_set_name(KQV_merged, "KQV_merged");
+
+            cur = ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+            offload_func_v(cur);
+            ggml_set_name(cur, "KQV_merged_contiguous");
+
+            cur = ggml_mul_mat(ctx0, model.layers[il].wo, cur);
+            offload_func(cur);
+            ggml_set_name(cur, "result_wo");
+        }
+
+        struct ggml_tensor * attn_out = cur;
+
+        // feed forward
+        {
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w3, attn_norm), model.layers[il].b3);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+
+            cur = ggml_gelu(ctx0, cur);
+            offload_func(cur);
+
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w2, cur), model.layers[il].b2);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+        }
+
+        cur = ggml_add(ctx0, cur, attn_out);
+        offload_func(cur);
+        cur = ggml_add(ctx0, cur, inpL);
+        offload_func(cur);
+
+        // input for next layer
+        inpL = cur;
+    }
+
+    cur = inpL;
+
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, norm_eps);
+        offload_func_nr(cur);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0, cur, model.output_norm),
+                model.output_norm_b);
+        ggml_set_name(cur, "result_norm");
+    }
+
+    cur = llm_build_output_rows(ctx0, lctx, cur);
+
+    cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.output, cur), model.output_b);
+    ggml_set_name(cur, "result_output");
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static struct ggml_cgraph * llm_build_gptneox(
+         llama_context & lctx,
+     const llama_batch & batch) {
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    const auto & kv_self = lctx.kv_self;
+
+    GGML_ASSERT(!!kv_self.ctx);
+
+    const int64_t n_embd      = hparams.n_embd;
+    const int64_t n_layer     = hparams.n_layer;
+    const int64_t n_ctx       = cparams.n_ctx;
+    const int64_t n_head      = hparams.n_head;
+    const int64_t n_head_kv   = hparams.n_head_kv;
+    const int64_t n_embd_head = hparams.n_embd_head();
+    const int64_t n_embd_gqa  = hparams.n_embd_gqa();
+    const int64_t n_rot       = hparams.n_rot;
+
+    // the fused qkv projection is laid out per head, which only works without grouped kv heads
+    GGML_ASSERT(n_head == n_head_kv);
+
+    const float freq_base  = cparams.rope_freq_base;
+    const float freq_scale = cparams.rope_freq_scale;
+    const float norm_eps   = hparams.f_norm_eps;
+
+    const int n_gpu_layers = model.n_gpu_layers;
+
+    const int32_t n_tokens = batch.n_tokens;
+    const int32_t n_kv     = ggml_allocr_is_measure(lctx.alloc) ? n_ctx            : kv_self.n;
+    const int32_t kv_head  = ggml_allocr_is_measure(lctx.alloc) ? n_ctx - n_tokens : kv_self.head;
+
+    const bool do_rope_shift = ggml_allocr_is_measure(lctx.alloc) || kv_self.has_shift;
+
+    auto & buf_compute = lctx.buf_compute;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ buf_compute.size,
+        /*.mem_buffer =*/ buf_compute.data,
+        /*.no_alloc   =*/ false,
+    };
+
+    params.no_alloc = true;
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur;
+    struct ggml_tensor * inpL;
+
+    if (batch.token) {
+        struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+
+        ggml_allocr_alloc(lctx.alloc, inp_tokens);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(inp_tokens->data, batch.token, n_tokens*ggml_element_size(inp_tokens));
+        }
+        ggml_set_name(inp_tokens, "inp_tokens");
+
+        inpL = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
+    } else {
+#ifdef GGML_USE_MPI
+        GGML_ASSERT(false && "not implemented");
+#endif
+
+        inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens);
+
+        ggml_allocr_alloc(lctx.alloc, inpL);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(inpL->data, batch.embd, n_tokens * n_embd * ggml_element_size(inpL));
+        }
+    }
+
+    const int i_gpu_start = n_layer - n_gpu_layers;
+    (void) i_gpu_start;
+
+    // offload functions set the tensor output backend to GPU
+    // tensors are GPU-accelerated if any input or the output has been offloaded
+    offload_func_t offload_func_nr = llama_nop; // nr = non-repeating
+    offload_func_t offload_func_kq = llama_nop;
+    offload_func_t offload_func_v  = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+    if (n_gpu_layers > n_layer) {
+        offload_func_nr = ggml_cuda_assign_buffers_no_alloc;
+    }
+    if (n_gpu_layers > n_layer + 1) {
+        offload_func_v  = ggml_cuda_assign_buffers_no_alloc;
+    }
+    if (n_gpu_layers > n_layer + 2) {
+        offload_func_kq = ggml_cuda_assign_buffers_no_alloc;
+    }
+#endif // GGML_USE_CUBLAS
+
+    // KQ_scale
+    struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+    ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+    ggml_allocr_alloc(lctx.alloc, KQ_scale);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd_head)));
+    }
+
+    // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
+    offload_func_kq(KQ_mask);
+    ggml_set_name(KQ_mask, "KQ_mask");
+    ggml_allocr_alloc(lctx.alloc, KQ_mask);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        llama_kv_cache_fill_kq_mask(kv_self, batch, n_kv, (float *) KQ_mask->data, n_tokens > 1 ? lctx.cparams.n_threads_batch : 1);
+    }
+
+    // KQ_pos - contains the positions
+    struct ggml_tensor * KQ_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    offload_func_kq(KQ_pos);
+    ggml_set_name(KQ_pos, "KQ_pos");
+    ggml_allocr_alloc(lctx.alloc, KQ_pos);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        int * data = (int *) KQ_pos->data;
+        for (int i = 0; i < n_tokens; ++i) {
+            data[i] = batch.pos[i];
+        }
+    }
+
+    // shift the entire K-cache if needed
+    if (do_rope_shift) {
+        struct ggml_tensor * K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        offload_func_kq(K_shift);
+        ggml_set_name(K_shift, "K_shift");
+        ggml_allocr_alloc(lctx.alloc, K_shift);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            int * data = (int *) K_shift->data;
+            for (int i = 0; i < n_ctx; ++i) {
+                data[i] = kv_self.cells[i].delta;
+            }
+        }
+
+        for (int il = 0; il < n_layer; ++il) {
+            struct ggml_tensor * tmp =
+                    ggml_rope_custom_inplace(ctx0,
+                        ggml_view_3d(ctx0, kv_self.k,
+                            n_embd_head, n_head_kv, n_ctx,
+                            ggml_element_size(kv_self.k)*n_embd_head,
+                            ggml_element_size(kv_self.k)*n_embd_gqa,
+                            ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il),
+                        K_shift, n_rot, 2, 0, freq_base, freq_scale);
+            offload_func_kq(tmp);
+            ggml_build_forward_expand(gf, tmp);
+        }
+    }
+
+    const bool qkv_views = llama_use_qkv_views(offload_func_kq, offload_func_v);
+
+    const bool fused_soft_max = llama_use_fused_soft_max(offload_func_kq, offload_func_v);
+
+    for (int il = 0; il < n_layer; ++il) {
+        offload_func_t offload_func = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+        if (il >= i_gpu_start) {
+            offload_func = ggml_cuda_assign_buffers_no_alloc;
+        }
+#endif // GGML_USE_CUBLAS
+
+        // self-attention
+        {
+            cur = ggml_norm(ctx0, inpL, norm_eps);
+            offload_func(cur);
+
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, model.layers[il].attn_norm),
+                    model.layers[il].attn_norm_b);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wqkv, cur), model.layers[il].bqkv);
+            offload_func_kq(cur->src[0]);
+            offload_func_kq(cur);
+
+            // q, k and v are interleaved per head: [q_0 k_0 v_0 q_1 k_1 v_1 ...]
+            const size_t wsize = ggml_type_size(cur->type);
+
+            struct ggml_tensor * tmpq = ggml_view_3d(
+                ctx0, cur, n_embd_head, n_head, n_tokens,
+                wsize * n_embd_head * 3,
+                cur->nb[1],
+                0);
+            offload_func_kq(tmpq);
+
+            struct ggml_tensor * tmpk = ggml_view_3d(
+                ctx0, cur, n_embd_head, n_head_kv, n_tokens,
+                wsize * n_embd_head * 3,
+                cur->nb[1],
+                wsize * n_embd_head);
+            offload_func_kq(tmpk);
+
+            if (!qkv_views) {
+                tmpq = ggml_cont(ctx0, tmpq);
+                offload_func_kq(tmpq);
+
+                tmpk = ggml_cont(ctx0, tmpk);
+                offload_func_kq(tmpk);
+            }
+
+            struct ggml_tensor * tmpv = ggml_view_3d(
+                ctx0, cur, n_embd_head, n_head_kv, n_tokens,
+                wsize * n_embd_head * 3,
+                cur->nb[1],
+                wsize * n_embd_head * 2);
+            offload_func_v(tmpv);
+
+            // using mode = 2 for neox mode, only the first n_rot dimensions of each head are rotated
+            struct ggml_tensor * Qcur = ggml_rope_custom(ctx0, tmpq, KQ_pos, n_rot, 2, 0, freq_base, freq_scale);
+            offload_func_kq(Qcur);
+            ggml_set_name(Qcur, "Qcur");
+            struct ggml_tensor * Kcur = ggml_rope_custom(ctx0, tmpk, KQ_pos, n_rot, 2, 0, freq_base, freq_scale);
+            offload_func_kq(Kcur);
+            ggml_set_name(Kcur, "Kcur");
+
+            {
+                struct ggml_tensor * Vcur = tmpv;
+                if (kv_self.v_trans) {
+                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, n_tokens));
+                    offload_func_v(Vcur->src[0]->src[0]);
+                }
+                offload_func_v(Vcur);
+                ggml_set_name(Vcur, "Vcur");
+
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + kv_head));
+                offload_func_kq(k);
+                ggml_set_name(k, "k");
+
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+                ggml_build_forward_expand(gf, llm_build_kv_store_v(ctx0, kv_self, Vcur, n_embd_gqa, n_ctx, n_tokens, kv_head, il, offload_func_v));
+            }
+
+            struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
+            offload_func_kq(Q);
+            ggml_set_name(Q, "Q");
+
+            struct ggml_tensor * K =
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_embd_head, n_kv, n_head_kv,
+                        ggml_element_size(kv_self.k)*n_embd_gqa,
+                        ggml_element_size(kv_self.k)*n_embd_head,
+                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
+            offload_func_kq(K);
+            ggml_set_name(K, "K");
+
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            offload_func_kq(KQ);
+            ggml_set_name(KQ, "KQ");
+
+            struct ggml_tensor * KQ_soft_max;
+
+            if (fused_soft_max) {
+                KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, NULL, NULL, 1.0f/sqrtf(float(n_embd_head)), -1);
+            } else {
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+            }
+            ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+            struct ggml_tensor * KQV = llm_build_kqv(ctx0, kv_self, KQ_soft_max, n_embd_head, n_embd_gqa, n_head_kv, n_ctx, n_kv, il, offload_func_v);
+
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+            offload_func_v(KQV_merged);
+            ggml_set_name(KQV_merged, "KQV_merged");
+
+            cur = ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+            offload_func_v(cur);
+            ggml_set_name(cur, "KQV_merged_contiguous");
+
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wo, cur), model.layers[il].bo);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+            ggml_set_name(cur, "result_wo");
+        }
+
+        struct ggml_tensor * attn_out = cur;
+
+        // with the parallel residual the feed forward reads the layer input instead of the attention output
+        struct ggml_tensor * inpFF = inpL;
+        if (!hparams.use_par_res) {
+            inpFF = ggml_add(ctx0, attn_out, inpL);
+            offload_func(inpFF);
+        }
+
+        // feed forward
+        {
+            cur = ggml_norm(ctx0, inpFF, norm_eps);
+            offload_func(cur);
+
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, model.layers[il].ffn_norm),
+                    model.layers[il].ffn_norm_b);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w3, cur), model.layers[il].b3);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+
+            cur = ggml_gelu(ctx0, cur);
+            offload_func(cur);
+
+            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w2, cur), model.layers[il].b2);
+            offload_func(cur->src[0]);
+            offload_func(cur);
+        }
+
+        if (hparams.use_par_res) {
+            cur = ggml_add(ctx0, cur, attn_out);
             offload_func(cur);
-            cur = ggml_mul_mat(ctx0, model.layers[il].w2, cur);
+            cur = ggml_add(ctx0, cur, inpL);
+            offload_func(cur);
+        } else {
+            cur = ggml_add(ctx0, cur, inpFF);
             offload_func(cur);
         }
 
-        cur = ggml_add(ctx0, cur, attn_out);
-        offload_func(cur);
-        cur = ggml_add(ctx0, cur, inpL);
-        offload_func(cur);
-
         // input for next layer
         inpL = cur;
     }
@@ -3704,6 +5613,8 @@ static struct ggml_cgraph * llm_build_falcon(
         ggml_set_name(cur, "result_norm");
     }
 
+    cur = llm_build_output_rows(ctx0, lctx, cur);
+
     cur = ggml_mul_mat(ctx0, model.output, cur);
     ggml_set_name(cur, "result_output");
 
@@ -3714,7 +5625,7 @@ static struct ggml_cgraph * llm_build_falcon(
     return gf;
 }
 
-static struct ggml_cgraph * llm_build_starcoder(
+static struct ggml_cgraph * llm_build_mpt(
          llama_context & lctx,
      const llama_batch & batch) {
     const auto & model   = lctx.model;
@@ -3733,9 +5644,10 @@ static struct ggml_cgraph * llm_build_starcoder(
     const int64_t n_embd_head = hparams.n_embd_head();
     const int64_t n_embd_gqa  = hparams.n_embd_gqa();
 
-    GGML_ASSERT(n_embd_head == hparams.n_rot);
+    const float norm_eps  = hparams.f_norm_eps;
+    const float clamp_kqv = hparams.f_clamp_kqv;
 
-    const float norm_eps = hparams.f_norm_eps;
+    const int n_gpu_layers = model.n_gpu_layers;
 
     const int32_t n_tokens = batch.n_tokens;
     const int32_t n_kv     = ggml_allocr_is_measure(lctx.alloc) ? n_ctx            : kv_self.n;
@@ -3756,8 +5668,6 @@ static struct ggml_cgraph * llm_build_starcoder(
     ggml_cgraph * gf = ggml_new_graph(ctx0);
 
     struct ggml_tensor * cur;
-    struct ggml_tensor * token;
-    struct ggml_tensor * position;
     struct ggml_tensor * inpL;
 
     if (batch.token) {
@@ -3769,106 +5679,158 @@ static struct ggml_cgraph * llm_build_starcoder(
         }
         ggml_set_name(inp_tokens, "inp_tokens");
 
-        token = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
+        inpL = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
     } else {
 #ifdef GGML_USE_MPI
         GGML_ASSERT(false && "not implemented");
 #endif
 
-        token = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens);
+        inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tokens);
 
-        ggml_allocr_alloc(lctx.alloc, token);
+        ggml_allocr_alloc(lctx.alloc, inpL);
         if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(token->data, batch.embd, n_tokens * n_embd * ggml_element_size(token));
+            memcpy(inpL->data, batch.embd, n_tokens * n_embd * ggml_element_size(inpL));
         }
     }
 
-    {
-        // Compute position embeddings.
-        struct ggml_tensor * inp_positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-        ggml_allocr_alloc(lctx.alloc, inp_positions);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            for (int i = 0; i < n_tokens; ++i) {
-                ((int32_t *) inp_positions->data)[i] = batch.pos[i];
-            }
-        }
-        ggml_set_name(inp_positions, "inp_positions");
+    const int i_gpu_start = n_layer - n_gpu_layers;
+    (void) i_gpu_start;
 
-        position = ggml_get_rows(ctx0, model.pos_embeddings, inp_positions);
-    }
+    // offload functions set the tensor output backend to GPU
+    // tensors are GPU-accelerated if any input or the output has been offloaded
+    offload_func_t offload_func_nr = llama_nop; // nr = non-repeating
+    offload_func_t offload_func_kq = llama_nop;
+    offload_func_t offload_func_v  = llama_nop;
 
-    // KQ_scale
-    struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-    ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
-    ggml_allocr_alloc(lctx.alloc, KQ_scale);
-    if (!ggml_allocr_is_measure(lctx.alloc)) {
-        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd)/n_head));
+#ifdef GGML_USE_CUBLAS
+    if (n_gpu_layers > n_layer) {
+        offload_func_nr = ggml_cuda_assign_buffers_no_alloc;
+    }
+    if (n_gpu_layers > n_layer + 1) {
+        offload_func_v  = ggml_cuda_assign_buffers_no_alloc;
     }
+    if (n_gpu_layers > n_layer + 2) {
+        offload_func_kq = ggml_cuda_assign_buffers_no_alloc;
+    }
+#endif // GGML_USE_CUBLAS
+
+    const bool fused_soft_max = llama_use_fused_soft_max(offload_func_kq, offload_func_v);
 
     // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
     struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
+    offload_func_kq(KQ_mask);
     ggml_set_name(KQ_mask, "KQ_mask");
     ggml_allocr_alloc(lctx.alloc, KQ_mask);
     if (!ggml_allocr_is_measure(lctx.alloc)) {
-        float * data = (float *) KQ_mask->data;
-        memset(data, 0, ggml_nbytes(KQ_mask));
+        llama_kv_cache_fill_kq_mask(kv_self, batch, n_kv, (float *) KQ_mask->data, n_tokens > 1 ? lctx.cparams.n_threads_batch : 1);
+    }
+
+    struct ggml_tensor * KQ_scale  = nullptr;
+    struct ggml_tensor * KQ_alibi  = nullptr;
+    struct ggml_tensor * KQ_slopes = nullptr;
+    struct ggml_tensor * KQ_pos    = nullptr;
 
-        for (int h = 0; h < 1; ++h) {
-            for (int j = 0; j < n_tokens; ++j) {
-                const llama_pos    pos    = batch.pos[j];
-                const llama_seq_id seq_id = batch.seq_id[j];
+    // the bias grows with the position of the cached token rather than with its cell index, so it stays correct
+    // when sequences share the cache or have been shifted; the offset this adds per query row cancels in the soft_max
+    if (fused_soft_max) {
+        // ALiBi slopes and the positions of the cached tokens, consumed by ggml_soft_max_ext
+        KQ_slopes = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_head);
+        ggml_set_name(KQ_slopes, "KQ_slopes");
+        ggml_allocr_alloc(lctx.alloc, KQ_slopes);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(KQ_slopes->data, model.alibi_slopes.data(), n_head*ggml_element_size(KQ_slopes));
+        }
+
+        KQ_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+        ggml_set_name(KQ_pos, "KQ_pos");
+        ggml_allocr_alloc(lctx.alloc, KQ_pos);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(KQ_pos->data, kv_self.cell_pos.data(), n_kv*ggml_element_size(KQ_pos));
+        }
+    } else {
+        // KQ_scale
+        KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+        ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+        ggml_allocr_alloc(lctx.alloc, KQ_scale);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd_head)));
+        }
 
+        // KQ_alibi (bias for 1 token, it will be broadcasted to all tokens)
+        KQ_alibi = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, 1, n_head);
+        offload_func_kq(KQ_alibi);
+        ggml_set_name(KQ_alibi, "KQ_alibi");
+        ggml_allocr_alloc(lctx.alloc, KQ_alibi);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            float * data = (float *) KQ_alibi->data;
+
+            for (int h = 0; h < n_head; ++h) {
                 for (int i = 0; i < n_kv; ++i) {
-                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                    }
+                    data[h*n_kv + i] = model.alibi_slopes[h]*kv_self.cells[i].pos;
                 }
             }
         }
     }
 
-    inpL = ggml_add(ctx0, token, position);
-    ggml_set_name(inpL, "inpL");
-
     for (int il = 0; il < n_layer; ++il) {
-        {
-            // Norm
-            cur = ggml_norm(ctx0, inpL, norm_eps);
-            cur = ggml_add(ctx0, ggml_mul(ctx0, cur, model.layers[il].attn_norm), model.layers[il].attn_norm_b);
+        offload_func_t offload_func = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+        if (il >= i_gpu_start) {
+            offload_func = ggml_cuda_assign_buffers_no_alloc;
         }
+#endif // GGML_USE_CUBLAS
 
+        // self-attention
         {
-            // Self Attention
-            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wqkv, cur), model.layers[il].bqkv);
+            cur = ggml_norm(ctx0, inpL, norm_eps);
+            offload_func(cur);
+
+            cur = ggml_mul(ctx0, cur, model.layers[il].attn_norm);
+            offload_func(cur);
+
+            cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+            offload_func_kq(cur);
+
+            if (clamp_kqv > 0.0f) {
+                cur = ggml_clamp(ctx0, cur, -clamp_kqv, clamp_kqv);
+                offload_func_kq(cur);
+            }
+
+            struct ggml_tensor * tmpq = ggml_view_2d(ctx0, cur, n_embd,     n_tokens, cur->nb[1], 0*sizeof(float)*n_embd);
+            offload_func_kq(tmpq);
 
-            struct ggml_tensor * tmpq = ggml_view_2d(ctx0, cur, n_embd, n_tokens, cur->nb[1], 0*sizeof(float)*n_embd);
             struct ggml_tensor * tmpk = ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], sizeof(float)*n_embd);
-            struct ggml_tensor * tmpv = ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], sizeof(float)*(n_embd + n_embd_gqa));
+            offload_func_kq(tmpk);
 
-            struct ggml_tensor * Qcur = tmpq;
-            struct ggml_tensor * Kcur = tmpk;
+            struct ggml_tensor * tmpv = ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], sizeof(float)*(n_embd + n_embd_gqa));
+            offload_func_v(tmpv);
 
             {
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, n_tokens));
+                struct ggml_tensor * Vcur = tmpv;
+                if (kv_self.v_trans) {
+                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, n_tokens));
+                    offload_func_v(Vcur->src[0]->src[0]);
+                }
+                offload_func_v(Vcur);
                 ggml_set_name(Vcur, "Vcur");
 
                 struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + kv_head));
+                offload_func_kq(k);
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_embd_gqa,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
-
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, tmpk, k));
+                ggml_build_forward_expand(gf, llm_build_kv_store_v(ctx0, kv_self, Vcur, n_embd_gqa, n_ctx, n_tokens, kv_head, il, offload_func_v));
             }
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd_head, n_head, n_tokens)),
-                        0, 2, 1, 3);
+            struct ggml_tensor * Q = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd_head, n_head, n_tokens);
+            offload_func_kq(Q);
+
+            Q = ggml_cpy(ctx0, tmpq, Q);
+            offload_func_kq(Q);
+
+            Q = ggml_permute(ctx0, Q, 0, 2, 1, 3);
+            offload_func_kq(Q);
             ggml_set_name(Q, "Q");
 
             struct ggml_tensor * K =
@@ -3877,85 +5839,98 @@ static struct ggml_cgraph * llm_build_starcoder(
                         ggml_element_size(kv_self.k)*n_embd_gqa,
                         ggml_element_size(kv_self.k)*n_embd_head,
                         ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
+            offload_func_kq(K);
             ggml_set_name(K, "K");
 
-            // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            offload_func_kq(KQ);
             ggml_set_name(KQ, "KQ");
 
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + n_tokens, n_tokens, n_head, 1]
-            struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
+            struct ggml_tensor * KQ_soft_max;
 
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
-            ggml_set_name(KQ_masked, "KQ_masked");
+            if (fused_soft_max) {
+                // scale, mask, ALiBi bias and soft_max in a single pass over the scores
+                KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, KQ_slopes, KQ_pos, 1.0f/sqrtf(float(n_embd_head)), -1);
+            } else {
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
 
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
 
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            ggml_set_name(V, "V");
+                struct ggml_tensor * KQ_scaled_alibi = ggml_add(ctx0, KQ_masked, KQ_alibi);
+                offload_func_kq(KQ_scaled_alibi);
+                ggml_set_name(KQ_scaled_alibi, "KQ_scaled_alibi");
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            ggml_set_name(KQV, "KQV");
+                KQ_soft_max = ggml_soft_max(ctx0, KQ_scaled_alibi);
+                offload_func_v(KQ_soft_max);
+            }
+            ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+            struct ggml_tensor * KQV = llm_build_kqv(ctx0, kv_self, KQ_soft_max, n_embd_head, n_embd_gqa, n_head_kv, n_ctx, n_kv, il, offload_func_v);
 
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+            offload_func_v(KQV_merged);
             ggml_set_name(KQV_merged, "KQV_merged");
 
-            // cur = KQV_merged.contiguous().view(n_embd, n_tokens)
             cur = ggml_cont_2d(ctx0, KQV_merged, n_embd, n_tokens);
+            offload_func_v(cur);
             ggml_set_name(cur, "KQV_merged_contiguous");
-        }
 
-        // Projection
-        cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wo, cur), model.layers[il].bo);
+            cur = ggml_mul_mat(ctx0, model.layers[il].wo, cur);
+            offload_func(cur);
+            ggml_set_name(cur, "result_wo");
+        }
 
         // Add the input
         cur = ggml_add(ctx0, cur, inpL);
+        offload_func(cur);
 
         struct ggml_tensor * inpFF = cur;
 
-        // FF
+        // feed forward
         {
-            // Norm
-            {
-                cur = ggml_norm(ctx0, inpFF, norm_eps);
-                cur = ggml_add(ctx0, ggml_mul(ctx0, cur, model.layers[il].ffn_norm), model.layers[il].ffn_norm_b);
-            }
+            cur = ggml_norm(ctx0, inpFF, norm_eps);
+            offload_func(cur);
 
-            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w3, cur), model.layers[il].b3);
+            cur = ggml_mul(ctx0, cur, model.layers[il].ffn_norm);
+            offload_func(cur);
+
+            cur = ggml_mul_mat(ctx0, model.layers[il].w3, cur);
+            offload_func(cur);
 
-            // GELU activation
             cur = ggml_gelu(ctx0, cur);
+            offload_func(cur);
 
-            // Projection
-            cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].w2, cur), model.layers[il].b2);
+            cur = ggml_mul_mat(ctx0, model.layers[il].w2, cur);
+            offload_func(cur);
         }
 
+        // input for next layer
         inpL = ggml_add(ctx0, cur, inpFF);
+        offload_func(inpL);
     }
 
-    // Output Norm
+    cur = inpL;
+
+    // norm
     {
-        cur = ggml_norm(ctx0, inpL, norm_eps);
-        cur = ggml_add(ctx0, ggml_mul(ctx0, cur, model.output_norm), model.output_norm_b);
+        cur = ggml_norm(ctx0, cur, norm_eps);
+        offload_func_nr(cur);
+
+        cur = ggml_mul(ctx0, cur, model.output_norm);
+        ggml_set_name(cur, "result_norm");
     }
-    ggml_set_name(cur, "result_norm");
+
+    cur = llm_build_output_rows(ctx0, lctx, cur);
 
     cur = ggml_mul_mat(ctx0, model.output, cur);
     ggml_set_name(cur, "result_output");
 
     ggml_build_forward_expand(gf, cur);
+
     ggml_free(ctx0);
 
     return gf;
@@ -3981,10 +5956,23 @@ static struct ggml_cgraph * llama_build_graph(
             {
                 result = llm_build_falcon(lctx, batch);
             } break;
+        case LLM_ARCH_GPT2: // gpt-2 is starcoder without multi-query attention
         case LLM_ARCH_STARCODER:
             {
                 result = llm_build_starcoder(lctx, batch);
             } break;
+        case LLM_ARCH_GPTJ:
+            {
+                result = llm_build_gptj(lctx, batch);
+            } break;
+        case LLM_ARCH_GPTNEOX:
+            {
+                result = llm_build_gptneox(lctx, batch);
+            } break;
+        case LLM_ARCH_MPT:
+            {
+                result = llm_build_mpt(lctx, batch);
+            } break;
         default:
             GGML_ASSERT(false);
     }
@@ -3992,6 +5980,20 @@ static struct ggml_cgraph * llama_build_graph(
     return result;
 }
 
+// allocate the graph in steps of nodes that ggml_graph_compute can run at the same time
+// nodes of a step never share memory, the list is passed on to ggml_graph_compute to run them in this order
+static size_t llama_alloc_graph(llama_context & lctx, ggml_cgraph * gf) {
+#if !defined(GGML_USE_METAL) && !defined(GGML_USE_MPI)
+    // Metal computes the nodes in graph order, and MPI splits the graph after it has been allocated
+    lctx.alloc_seq.resize(GGML_MAX_CONCUR);
+    lctx.alloc_seq.resize(ggml_graph_find_concurrency(gf, GGML_MAX_CONCUR_NODES, lctx.alloc_seq.data()));
+
+    ggml_allocr_set_parse_seq(lctx.alloc, lctx.alloc_seq.data(), lctx.alloc_seq.size());
+#endif
+
+    return ggml_allocr_alloc_graph(lctx.alloc, gf);
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -4081,9 +6083,11 @@ static int llama_decode_internal(
 
     ggml_allocr_reset(lctx.alloc);
 
+    lctx.output_rows = llama_output_rows(lctx, batch);
+
     ggml_cgraph * gf = llama_build_graph(lctx, batch);
 
-    ggml_allocr_alloc_graph(lctx.alloc, gf);
+    llama_alloc_graph(lctx, gf);
 
 #ifdef GGML_USE_CUBLAS
     for (int i = 0; i < gf->n_leafs; i++) {
@@ -4124,11 +6128,12 @@ static int llama_decode_internal(
         n_threads = 1;
     }
 
+    // the output projection can end in a bias add, so the norm is looked up by name
     struct ggml_tensor * res        = gf->nodes[gf->n_nodes - 1];
-    struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 2];
+    struct ggml_tensor * embeddings = ggml_graph_get_tensor(gf, "result_norm");
 
     GGML_ASSERT(strcmp(res->name,        "result_output") == 0);
-    GGML_ASSERT(strcmp(embeddings->name, "result_norm")   == 0);
+    GGML_ASSERT(embeddings != nullptr);
 
 #if GGML_USE_MPI
     const int64_t n_layer = hparams.n_layer;
@@ -4140,10 +6145,10 @@ static int llama_decode_internal(
         ggml_metal_set_n_cb     (lctx.ctx_metal, n_threads);
         ggml_metal_graph_compute(lctx.ctx_metal, gf);
     } else {
-        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.alloc_seq);
     }
 #else
-    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.alloc_seq);
 #endif
 
 #if GGML_USE_MPI
@@ -4166,23 +6171,29 @@ static int llama_decode_internal(
     //}
 
     // extract logits
+    // res has one row per entry of lctx.output_rows, or one per token when that is empty
     {
         auto & logits_out = lctx.logits;
 
+        const auto & rows = lctx.output_rows;
+        const int64_t n_rows = res->ne[1];
+        GGML_ASSERT(rows.empty() ? n_rows == n_tokens : n_rows == (int64_t) rows.size());
+
         if (batch.logits) {
             logits_out.resize(n_vocab * n_tokens);
-            for (uint32_t i = 0; i < n_tokens; i++) {
+            for (int64_t k = 0; k < n_rows; k++) {
+                const int32_t i = rows.empty() ? k : rows[k];
                 if (batch.logits[i] == 0) {
                     continue;
                 }
-                memcpy(logits_out.data() + (n_vocab*i), (float *) ggml_get_data(res) + (n_vocab*i), sizeof(float)*n_vocab);
+                memcpy(logits_out.data() + (n_vocab*i), (float *) ggml_get_data(res) + (n_vocab*k), sizeof(float)*n_vocab);
             }
         } else if (lctx.logits_all) {
             logits_out.resize(n_vocab * n_tokens);
             memcpy(logits_out.data(), (float *) ggml_get_data(res), sizeof(float)*n_vocab*n_tokens);
         } else {
             logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) ggml_get_data(res) + (n_vocab*(n_tokens - 1)), sizeof(float)*n_vocab);
+            memcpy(logits_out.data(), (float *) ggml_get_data(res) + (n_vocab*(n_rows - 1)), sizeof(float)*n_vocab);
         }
     }
 
@@ -4191,7 +6202,7 @@ static int llama_decode_internal(
         auto & embedding_out = lctx.embedding;
 
         embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(n_tokens - 1)), sizeof(float)*n_embd);
+        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(embeddings->ne[1] - 1)), sizeof(float)*n_embd);
     }
 
     // measure the performance only for the single-token evals
@@ -6105,20 +8116,54 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     std::vector<no_init<uint8_t>> work;
     std::vector<no_init<float>> f32_conv_buf;
 
-    // populate the original tensors so we get an initial meta data
+    // decide the output type of every tensor up front, so that the final layout is known and the
+    // meta data can be written before any tensor data
+    std::vector<ggml_type> new_types(ml.n_tensors);
     for (int i = 0; i < ml.n_tensors; ++i) {
         struct ggml_tensor * meta = ml.get_tensor_meta(i);
+
+        const std::string name = ggml_get_name(meta);
+
+        // This used to be a regex, but <regex> has an extreme cost to compile times.
+        bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
+
+        // quantize only 2D tensors
+        quantize &= (meta->n_dims == 2);
+        quantize &= params->quantize_output_tensor || name != "output.weight";
+        quantize &= !params->only_copy;
+
+        enum ggml_type new_type = meta->type;
+        if (quantize) {
+            new_type = quantized_type;
+#ifdef GGML_USE_K_QUANTS
+            new_type = get_k_quant_type(
+                new_type, meta, model, ftype, &i_attention_wv, n_attention_wv, &i_feed_forward_w2, n_feed_forward_w2
+            );
+#endif
+        }
+        new_types[i] = new_type;
+
         gguf_add_tensor(ctx_out, meta);
+        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
+        gguf_set_tensor_data(ctx_out, name.c_str(), NULL, ggml_type_size(new_type)*(ggml_nelements(meta)/ggml_blck_size(new_type)));
     }
 
-    std::ofstream fout(fname_out, std::ios::binary);
+    llama_stream_writer fout(fname_out.c_str());
 
     const size_t meta_size = gguf_get_meta_size(ctx_out);
 
     LLAMA_LOG_INFO("%s: meta size = %zu bytes\n", __func__, meta_size);
 
-    // placeholder for the meta data
-    ::zeros(fout, meta_size);
+    {
+        std::vector<uint8_t> data(meta_size);
+        gguf_get_meta_data(ctx_out, data.data());
+        fout.write_raw(data.data(), data.size());
+    }
+
+    // tensors are converted and quantized a slab of rows at a time, so the scratch buffers stay
+    // small however large the tensor is, and the writer thread stores one slab while the next one
+    // is being quantized
+    static const size_t slab_elements = 1 << 22;
 
     for (int i = 0; i < ml.n_tensors; ++i) {
         struct ggml_tensor * tensor = ml.get_tensor_meta(i);
@@ -6139,91 +8184,93 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
                llama_format_tensor_shape(tensor).c_str(),
                ggml_type_name(tensor->type));
 
-        // This used to be a regex, but <regex> has an extreme cost to compile times.
-        bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
-
-        // quantize only 2D tensors
-        quantize &= (tensor->n_dims == 2);
-        quantize &= params->quantize_output_tensor || name != "output.weight";
-        quantize &= !params->only_copy;
+        const enum ggml_type new_type = new_types[i];
+        GGML_ASSERT(fout.tell() == meta_size + gguf_get_tensor_offset(ctx_out, i));
 
-        enum ggml_type new_type;
-        void * new_data;
         size_t new_size;
 
-        if (quantize) {
-            new_type = quantized_type;
-#ifdef GGML_USE_K_QUANTS
-            new_type = get_k_quant_type(
-                new_type, tensor, model, ftype, &i_attention_wv, n_attention_wv, &i_feed_forward_w2, n_feed_forward_w2
-            );
-#endif
-            // If we've decided to quantize to the same type the tensor is already
-            // in then there's nothing to do.
-            quantize = tensor->type != new_type;
-        }
-        if (!quantize) {
-            new_type = tensor->type;
-            new_data = tensor->data;
+        // If we've decided to quantize to the same type the tensor is already
+        // in then there's nothing to do.
+        if (new_type == tensor->type) {
             new_size = ggml_nbytes(tensor);
+            fout.write_raw(tensor->data, new_size);
             LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
         } else {
             const size_t nelements = ggml_nelements(tensor);
 
-            float * f32_data;
-
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+            if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
                 throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_convert_tensor_internal(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
             }
 
             LLAMA_LOG_INFO("quantizing to %s .. ", ggml_type_name(new_type));
             fflush(stdout);
 
-            if (work.size() < nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
-            }
-            new_data = work.data();
             std::array<int64_t, 1 << 4> hist_cur = {};
+            new_size = 0;
 
-            static const int chunk_size = 32 * 512;
-            const int nchunk = (nelements + chunk_size - 1)/chunk_size;
-            const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
-            if (nthread_use < 2) {
-                new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nelements, hist_cur.data());
-            } else {
-                size_t counter = 0;
-                new_size = 0;
-                auto compute = [&mutex, &counter, &hist_cur, &new_size, new_type, f32_data, new_data, nelements]() {
-                    std::array<int64_t, 1 << 4> local_hist = {};
-                    size_t local_size = 0;
-                    while (true) {
-                        std::unique_lock<std::mutex> lock(mutex);
-                        size_t first = counter; counter += chunk_size;
-                        if (first >= nelements) {
-                            if (local_size > 0) {
-                                for (int j=0; j<int(local_hist.size()); ++j) {
-                                    hist_cur[j] += local_hist[j];
+            const size_t row_elements  = tensor->ne[0];
+            const size_t slab_rows     = std::max<size_t>(1, slab_elements/row_elements);
+            const size_t nrows         = nelements/row_elements;
+            const size_t row_size_in   = ggml_type_size(tensor->type)*(row_elements/ggml_blck_size(tensor->type));
+
+            for (size_t row0 = 0; row0 < nrows; row0 += slab_rows) {
+                const size_t slab_nelements = std::min(slab_rows, nrows - row0)*row_elements;
+
+                float * f32_data;
+
+                if (tensor->type == GGML_TYPE_F32) {
+                    f32_data = (float *) tensor->data + row0*row_elements;
+                } else {
+                    struct ggml_tensor slab = *tensor;
+                    slab.data = (uint8_t *) tensor->data + row0*row_size_in;
+                    llama_convert_tensor_internal(&slab, f32_conv_buf, workers, slab_nelements, nthread);
+                    f32_data = (float *) f32_conv_buf.data();
+                }
+
+                if (work.size() < slab_nelements * 4) {
+                    work.resize(slab_nelements * 4); // upper bound on size
+                }
+                void * new_data = work.data();
+                size_t slab_size;
+
+                static const int chunk_size = 32 * 512;
+                const int nchunk = (slab_nelements + chunk_size - 1)/chunk_size;
+                const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
+                if (nthread_use < 2) {
+                    slab_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, slab_nelements, hist_cur.data());
+                } else {
+                    size_t counter = 0;
+                    slab_size = 0;
+                    auto compute = [&mutex, &counter, &hist_cur, &slab_size, new_type, f32_data, new_data, slab_nelements]() {
+                        std::array<int64_t, 1 << 4> local_hist = {};
+                        size_t local_size = 0;
+                        while (true) {
+                            std::unique_lock<std::mutex> lock(mutex);
+                            size_t first = counter; counter += chunk_size;
+                            if (first >= slab_nelements) {
+                                if (local_size > 0) {
+                                    for (int j=0; j<int(local_hist.size()); ++j) {
+                                        hist_cur[j] += local_hist[j];
+                                    }
+                                    slab_size += local_size;
                                 }
-                                new_size += local_size;
+                                break;
                             }
-                            break;
+                            lock.unlock();
+                            size_t last = std::min(slab_nelements, first + chunk_size);
+                            local_size += ggml_quantize_chunk(new_type, f32_data, new_data, first, last - first, local_hist.data());
                         }
-                        lock.unlock();
-                        size_t last = std::min(nelements, first + chunk_size);
-                        local_size += ggml_quantize_chunk(new_type, f32_data, new_data, first, last - first, local_hist.data());
+                    };
+                    for (int it = 0; it < nthread_use - 1; ++it) {
+                        workers.emplace_back(compute);
                     }
-                };
-                for (int it = 0; it < nthread_use - 1; ++it) {
-                    workers.emplace_back(compute);
+                    compute();
+                    for (auto & w : workers) { w.join(); }
+                    workers.clear();
                 }
-                compute();
-                for (auto & w : workers) { w.join(); }
-                workers.clear();
+
+                fout.write_raw(new_data, slab_size);
+                new_size += slab_size;
             }
 
             LLAMA_LOG_INFO("size = %8.2f MB -> %8.2f MB | hist: ", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
@@ -6243,21 +8290,8 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         total_size_org += ggml_nbytes(tensor);
         total_size_new += new_size;
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
-
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
-    }
-
-    // go back to beginning of file and write the updated meta data
-    {
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-        gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *) data.data(), data.size());
+        // padding up to the next tensor
+        fout.write_zeros(GGML_PAD(new_size, align) - new_size);
     }
 
     fout.close();
@@ -6590,6 +8624,8 @@ struct llama_context_params llama_context_default_params() {
         /*.n_threads_batch             =*/ GGML_DEFAULT_N_THREADS,
         /*.rope_freq_base              =*/ 0.0f,
         /*.rope_freq_scale             =*/ 0.0f,
+        /*.v_layout                    =*/ LLAMA_V_LAYOUT_ROWS_UNLESS_OFFLOADED,
+        /*.alloc_size                  =*/ 0,
         /*.mul_mat_q                   =*/ true,
         /*.f16_kv                      =*/ true,
         /*.logits_all                  =*/ false,
@@ -6725,6 +8761,24 @@ struct llama_context * llama_new_context_with_model(
 
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
+    switch (params.v_layout) {
+        case LLAMA_V_LAYOUT_TRANSPOSED: ctx->kv_self.v_trans = true;  break;
+        case LLAMA_V_LAYOUT_ROWS:       ctx->kv_self.v_trans = false; break;
+        default:                        ctx->kv_self.v_trans = false; break; // LLAMA_V_LAYOUT_ROWS_UNLESS_OFFLOADED
+    }
+
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL)
+    // ggml_attn_v only has a CPU implementation
+    if (!ctx->kv_self.v_trans && model->n_gpu_layers > 0) {
+        if (params.v_layout == LLAMA_V_LAYOUT_ROWS) {
+            LLAMA_LOG_WARN("%s: the row V layout is not supported with GPU offload, using the transposed one\n", __func__);
+        }
+        ctx->kv_self.v_trans = true;
+    }
+#endif
+
+    LLAMA_LOG_INFO("%s: v layout   = %s\n",    __func__, ctx->kv_self.v_trans ? "transposed" : "rows");
+
     // reserve memory for context buffers
     if (!hparams.vocab_only) {
         if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, cparams.n_ctx, model->n_gpu_layers)) {
@@ -6754,14 +8808,20 @@ struct llama_context * llama_new_context_with_model(
             // the compute buffer is used to store the tensor and graph structs, while the allocator buffer is used for the tensor data
             ctx->buf_compute.resize(ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead());
 
+            size_t alloc_size = params.alloc_size;
+
             // create measure allocator
             ctx->alloc = ggml_allocr_new_measure(tensor_alignment);
-
-            // build worst-case graph
-            int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_batch);
-            int n_past = cparams.n_ctx - n_tokens;
-            llama_token token = llama_token_bos(ctx); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-            ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0));
+            ggml_allocr_set_planner(ctx->alloc, true);
+
+            // build worst-case graph, unless the caller already knows its size
+            ggml_cgraph * gf = NULL;
+            if (alloc_size == 0) {
+                int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_batch);
+                int n_past = cparams.n_ctx - n_tokens;
+                llama_token token = llama_token_bos(ctx); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
+                gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0));
+            }
 
 #ifdef GGML_USE_METAL
             if (model->n_gpu_layers > 0) {
@@ -6777,15 +8837,23 @@ struct llama_context * llama_new_context_with_model(
             }
 #endif
             // measure memory requirements for the graph
-            size_t alloc_size = ggml_allocr_alloc_graph(ctx->alloc, gf) + tensor_alignment;
+            if (gf) {
+                alloc_size = llama_alloc_graph(*ctx, gf) + tensor_alignment;
+            }
 
             LLAMA_LOG_INFO("%s: compute buffer total size = %.2f MB\n", __func__, (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0);
+            if (gf) {
+                const size_t peak = ggml_allocr_plan_peak(ctx->alloc);
+                LLAMA_LOG_INFO("%s: compute buffer graph = %.2f MB, live tensors peak = %.2f MB (%.2fx)\n", __func__,
+                        (alloc_size - tensor_alignment) / 1024.0 / 1024.0, peak / 1024.0 / 1024.0, (double)(alloc_size - tensor_alignment) / std::max<size_t>(peak, 1));
+            }
 
             // recreate allocator with exact memory requirements
             ggml_allocr_free(ctx->alloc);
 
             ctx->buf_alloc.resize(alloc_size);
             ctx->alloc = ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, tensor_alignment);
+            ggml_allocr_set_planner(ctx->alloc, true);
 #ifdef GGML_USE_METAL
             if (ctx->ctx_metal) {
                 //ggml_allocr_set_parse_seq(ctx->alloc, ggml_metal_get_concur_list(ctx->ctx_metal), ggml_metal_if_optimized(ctx->ctx_metal));
@@ -6883,6 +8951,10 @@ int llama_n_ctx(const struct llama_context * ctx) {
     return ctx->cparams.n_ctx;
 }
 
+size_t llama_get_alloc_size(const struct llama_context * ctx) {
+    return ctx->buf_alloc.size;
+}
+
 enum llama_vocab_type llama_vocab_type(const struct llama_model * model) {
     return model->vocab.type;
 }
@@ -7156,9 +9228,14 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
                 n_embd, kv_ntok, n_layer,
                 elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
 
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+            // the state always holds V transposed, whatever the layout of the cache
+            ggml_tensor * v3d = kv_self.v_trans
+                ? ggml_view_3d(cpy_ctx, kv_self.v,
+                    kv_ntok, n_embd, n_layer,
+                    elt_size*n_ctx, elt_size*n_ctx*n_embd, 0)
+                : ggml_transpose(cpy_ctx, ggml_view_3d(cpy_ctx, kv_self.v,
+                    n_embd, kv_ntok, n_layer,
+                    elt_size*n_embd, elt_size*n_embd*n_ctx, 0));
 
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, k3d, kout3d));
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
@@ -7268,9 +9345,14 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
                 n_embd, kv_ntok, n_layer,
                 elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
 
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+            // the state always holds V transposed, whatever the layout of the cache
+            ggml_tensor * v3d = kv_self.v_trans
+                ? ggml_view_3d(cpy_ctx, kv_self.v,
+                    kv_ntok, n_embd, n_layer,
+                    elt_size*n_ctx, elt_size*n_ctx*n_embd, 0)
+                : ggml_transpose(cpy_ctx, ggml_view_3d(cpy_ctx, kv_self.v,
+                    n_embd, kv_ntok, n_layer,
+                    elt_size*n_embd, elt_size*n_embd*n_ctx, 0));
 
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, kin3d, k3d));
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
@@ -106,6 +106,13 @@ extern "C" {
         LLAMA_FTYPE_GUESSED = 1024, // not specified in the model file
     };
 
+    // how the V cache is stored, fixed for the lifetime of the context
+    enum llama_v_layout {
+        LLAMA_V_LAYOUT_ROWS_UNLESS_OFFLOADED = 0, // rows, or transposed when layers are offloaded to a GPU. the batch sizes are not considered
+        LLAMA_V_LAYOUT_TRANSPOSED            = 1, // one row per embedding dim, best for large prompt batches, required for GPU offload
+        LLAMA_V_LAYOUT_ROWS                  = 2, // one row per cell like K, sequential writes, best for token by token generation
+    };
+
     typedef struct llama_token_data {
         llama_token id; // token id
         float logit;    // log-odds of the token
@@ -176,6 +183,12 @@ extern "C" {
         float rope_freq_base;  // RoPE base frequency, 0 = from model
         float rope_freq_scale; // RoPE frequency scaling factor, 0 = from model
 
+        enum llama_v_layout v_layout;
+
+        // compute buffer size from an earlier llama_get_alloc_size() with the same model and params
+        // skips the measure pass when creating the context, 0 = measure
+        size_t alloc_size;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool mul_mat_q;  // if true, use experimental mul_mat_q kernels
         bool f16_kv;     // use fp16 for KV cache, fp32 otherwise
@@ -276,6 +289,9 @@ extern "C" {
 
     LLAMA_API int llama_n_ctx      (const struct llama_context * ctx);
 
+    // Size of the compute buffer of the context, can be passed as alloc_size to skip measuring it next time
+    LLAMA_API size_t llama_get_alloc_size(const struct llama_context * ctx);
+
     LLAMA_API enum llama_vocab_type llama_vocab_type(const struct llama_model * model);
 
     LLAMA_API int llama_n_vocab    (const struct llama_model * model);
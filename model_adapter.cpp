@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <regex>
@@ -13,6 +15,11 @@
 #include "ggml.h"
 
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdarg>
 
 static auto bench_timer = std::chrono::high_resolution_clock().now();
 
@@ -28,6 +35,285 @@ double timer_check()
     return time_taken;
 }
 
+//async logger: a bounded lock-free MPSC ring (vyukov style) drained by one background thread.
+//producers never wait, if the ring is full the message is dropped and counted instead.
+static const size_t kcpp_log_slots = 1024; //must be a power of 2
+static const size_t kcpp_log_inline = 240; //longer messages are heap allocated by the producer
+static const int kcpp_log_progress_interval_ms = 100;
+
+struct kcpp_log_slot
+{
+    std::atomic<size_t> seq;
+    bool to_stderr;
+    size_t len;
+    char * heap;
+    char text[kcpp_log_inline];
+};
+
+struct kcpp_log_state
+{
+    kcpp_log_slot slots[kcpp_log_slots];
+    std::atomic<size_t> enqueue_pos;
+    size_t dequeue_pos = 0; //only touched by the drain thread
+    std::atomic<size_t> written_pos;
+    std::atomic<size_t> dropped;
+    std::atomic<uint64_t> progress; //packed kind|current|total, see kcpp_pack_progress
+    std::atomic<size_t> flush_req;
+    std::atomic<size_t> flush_done;
+    uint64_t progress_printed = 0;
+    std::mutex wake_mtx;
+    std::condition_variable wake_cv;
+    std::condition_variable flushed_cv;
+};
+
+//never freed on purpose, the drain thread may still be running during static destruction
+static kcpp_log_state * kcpp_logger = nullptr;
+static std::once_flag kcpp_log_once;
+static std::atomic<int> kcpp_log_verbosity(0);
+
+static inline uint64_t kcpp_pack_progress(int kind, int current, int total)
+{
+    return ((uint64_t)(kind & 0xFF) << 56) | ((uint64_t)(current & 0xFFFFFFF) << 28) | (uint64_t)(total & 0xFFFFFFF);
+}
+
+static void kcpp_log_write_progress(kcpp_log_state * st, uint64_t packed)
+{
+    int kind = (int)(packed >> 56);
+    int current = (int)((packed >> 28) & 0xFFFFFFF);
+    int total = (int)(packed & 0xFFFFFFF);
+    if(kind==KCPP_PROGRESS_PROMPT || kind==KCPP_PROGRESS_PROMPT_BLAS)
+    {
+        printf("\rProcessing Prompt%s (%d / %d tokens)", (kind==KCPP_PROGRESS_PROMPT_BLAS ? " [BLAS]" : ""), current, total);
+    }
+    else if(kind==KCPP_PROGRESS_GENERATE)
+    {
+        printf("\rGenerating (%d / %d tokens)", current, total);
+    }
+    st->progress_printed = packed;
+}
+
+//returns true if anything was written
+static bool kcpp_log_drain(kcpp_log_state * st, bool progress_due)
+{
+    bool wrote = false;
+    while(true)
+    {
+        kcpp_log_slot & slot = st->slots[st->dequeue_pos & (kcpp_log_slots - 1)];
+        if(slot.seq.load(std::memory_order_acquire) != st->dequeue_pos + 1)
+        {
+            break;
+        }
+        //bring the progress line up to date first so text lands after it, like the old inline printf did
+        uint64_t prog = st->progress.load(std::memory_order_acquire);
+        if(prog != st->progress_printed)
+        {
+            kcpp_log_write_progress(st, prog);
+        }
+        FILE * out = slot.to_stderr ? stderr : stdout;
+        if(slot.to_stderr)
+        {
+            fflush(stdout);
+        }
+        fwrite(slot.heap ? slot.heap : slot.text, 1, slot.len, out);
+        if(slot.heap)
+        {
+            free(slot.heap);
+            slot.heap = nullptr;
+        }
+        slot.seq.store(st->dequeue_pos + kcpp_log_slots, std::memory_order_release);
+        ++st->dequeue_pos;
+        wrote = true;
+    }
+    size_t dropped = st->dropped.exchange(0);
+    if(dropped > 0)
+    {
+        printf("\n[Log queue full, %zu messages dropped]\n", dropped);
+        wrote = true;
+    }
+    uint64_t prog = st->progress.load(std::memory_order_acquire);
+    if(progress_due && prog != st->progress_printed)
+    {
+        kcpp_log_write_progress(st, prog);
+        wrote = true;
+    }
+    return wrote;
+}
+
+static void kcpp_log_thread(kcpp_log_state * st)
+{
+    auto last_progress = std::chrono::steady_clock::now();
+    size_t flush_seen = 0;
+    while(true)
+    {
+        size_t flush_req = st->flush_req.load(std::memory_order_acquire);
+        auto now = std::chrono::steady_clock::now();
+        bool progress_due = (flush_req != flush_seen) || (now - last_progress) >= std::chrono::milliseconds(kcpp_log_progress_interval_ms);
+        if(progress_due)
+        {
+            last_progress = now;
+        }
+        if(kcpp_log_drain(st, progress_due))
+        {
+            fflush(stdout);
+        }
+        flush_seen = flush_req;
+        {
+            std::unique_lock<std::mutex> lock(st->wake_mtx);
+            st->written_pos.store(st->dequeue_pos, std::memory_order_release);
+            st->flush_done.store(flush_seen, std::memory_order_release);
+            st->flushed_cv.notify_all();
+            //producers notify without taking the lock, a missed wakeup only costs one interval
+            st->wake_cv.wait_for(lock, std::chrono::milliseconds(kcpp_log_progress_interval_ms), [&]()
+            {
+                return st->flush_req.load() != flush_seen || st->enqueue_pos.load() != st->dequeue_pos;
+            });
+        }
+    }
+}
+
+static kcpp_log_state * kcpp_log_get()
+{
+    std::call_once(kcpp_log_once, []()
+    {
+        kcpp_log_state * st = new kcpp_log_state();
+        for(size_t i=0;i<kcpp_log_slots;++i)
+        {
+            st->slots[i].seq.store(i, std::memory_order_relaxed);
+            st->slots[i].heap = nullptr;
+        }
+        st->enqueue_pos.store(0);
+        st->written_pos.store(0);
+        st->dropped.store(0);
+        st->progress.store(0);
+        st->flush_req.store(0);
+        st->flush_done.store(0);
+        kcpp_logger = st;
+        std::thread(kcpp_log_thread, st).detach();
+    });
+    return kcpp_logger;
+}
+
+static void kcpp_log_push(bool to_stderr, const char * format, va_list args)
+{
+    kcpp_log_state * st = kcpp_log_get();
+
+    char local[kcpp_log_inline];
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int len = vsnprintf(local, sizeof(local), format, args);
+    char * heap = nullptr;
+    if(len < 0)
+    {
+        va_end(args_copy);
+        return;
+    }
+    if((size_t)len >= sizeof(local))
+    {
+        heap = (char *)malloc(len + 1);
+        if(heap == nullptr)
+        {
+            va_end(args_copy);
+            st->dropped.fetch_add(1);
+            return;
+        }
+        vsnprintf(heap, len + 1, format, args_copy);
+    }
+    va_end(args_copy);
+
+    size_t pos = st->enqueue_pos.load(std::memory_order_relaxed);
+    kcpp_log_slot * slot;
+    while(true)
+    {
+        slot = &st->slots[pos & (kcpp_log_slots - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0)
+        {
+            if(st->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            //full, drop rather than stall the caller
+            free(heap);
+            st->dropped.fetch_add(1);
+            return;
+        }
+        else
+        {
+            pos = st->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->to_stderr = to_stderr;
+    slot->len = len;
+    slot->heap = heap;
+    if(heap == nullptr)
+    {
+        memcpy(slot->text, local, len);
+    }
+    slot->seq.store(pos + 1, std::memory_order_release);
+    st->wake_cv.notify_one();
+}
+
+void kcpp_log_set_level(int level)
+{
+    kcpp_log_verbosity.store(level < KCPP_LOG_OFF ? KCPP_LOG_OFF : (level > KCPP_LOG_DEBUG ? KCPP_LOG_DEBUG : level));
+}
+int kcpp_log_get_level()
+{
+    return kcpp_log_verbosity.load();
+}
+bool kcpp_log_enabled(int level)
+{
+    return level <= kcpp_log_verbosity.load(std::memory_order_relaxed);
+}
+
+void kcpp_log(int level, const char * format, ...)
+{
+    if(!kcpp_log_enabled(level))
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    kcpp_log_push(false, format, args);
+    va_end(args);
+}
+
+void kcpp_log_err(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    kcpp_log_push(true, format, args);
+    va_end(args);
+}
+
+void kcpp_log_progress(kcpp_progress_kind kind, int current, int total)
+{
+    if(!kcpp_log_enabled(KCPP_LOG_INFO))
+    {
+        return;
+    }
+    kcpp_log_get()->progress.store(kcpp_pack_progress(kind, current, total), std::memory_order_release);
+}
+
+void kcpp_log_flush()
+{
+    kcpp_log_state * st = kcpp_log_get();
+    size_t target = st->enqueue_pos.load();
+    std::unique_lock<std::mutex> lock(st->wake_mtx);
+    size_t req = st->flush_req.fetch_add(1) + 1;
+    st->wake_cv.notify_one();
+    //bounded wait, a wedged console must not hang the caller forever
+    st->flushed_cv.wait_for(lock, std::chrono::seconds(2), [&]()
+    {
+        return st->written_pos.load(std::memory_order_acquire) >= target && st->flush_done.load(std::memory_order_acquire) >= req;
+    });
+}
+
 void print_vec(std::vector<std::string> &embd)
 {
     std::cout << "[";
@@ -79,6 +365,119 @@ void print_tok_vec(std::vector<float> &embd)
     std::cout << "]\n";
 }
 
+static uint64_t kcpp_fnv1a(uint64_t h, const char * data, size_t len)
+{
+    for(size_t i=0;i<len;++i)
+    {
+        h ^= (uint8_t)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+//the model is identified by its size and its first and last 64kb, which stays cheap for huge files.
+std::string kcpp_load_cache_key(const std::string & fname, const std::string & settings)
+{
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+        return "";
+    }
+    fin.seekg(0, std::ios::end);
+    const uint64_t fsize = (uint64_t)fin.tellg();
+    const uint64_t span = 64*1024;
+    std::vector<char> buf(span);
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    fin.seekg(0, std::ios::beg);
+    fin.read(buf.data(), std::min(span, fsize));
+    h = kcpp_fnv1a(h, buf.data(), fin.gcount());
+    if(fsize > span)
+    {
+        fin.clear();
+        fin.seekg(fsize - span, std::ios::beg);
+        fin.read(buf.data(), span);
+        h = kcpp_fnv1a(h, buf.data(), fin.gcount());
+    }
+    if(!fin)
+    {
+        return "";
+    }
+
+    const uint64_t hs = kcpp_fnv1a(0xcbf29ce484222325ULL, settings.data(), settings.size());
+
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx-%llu-%016llx", (unsigned long long)h, (unsigned long long)fsize, (unsigned long long)hs);
+    return key;
+}
+
+//the cache is a text file with one "key mem_per_token alloc_size" line per entry, newest last
+static std::vector<std::string> kcpp_load_cache_read(const std::string & cachefile)
+{
+    std::vector<std::string> lines;
+    std::ifstream fin(cachefile);
+    std::string line;
+    while(std::getline(fin, line))
+    {
+        if(line!="")
+        {
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+bool kcpp_load_cache_get(const std::string & cachefile, const std::string & key, kcpp_load_cache_entry & entry)
+{
+    for(const std::string & line : kcpp_load_cache_read(cachefile))
+    {
+        char lkey[64];
+        unsigned long long mem = 0, alloc = 0;
+        if(sscanf(line.c_str(), "%63s %llu %llu", lkey, &mem, &alloc)==3 && key==lkey)
+        {
+            entry.mem_per_token = mem;
+            entry.alloc_size = alloc;
+            return true;
+        }
+    }
+    return false;
+}
+
+void kcpp_load_cache_put(const std::string & cachefile, const std::string & key, const kcpp_load_cache_entry & entry)
+{
+    const size_t max_entries = 32;
+    std::vector<std::string> lines = kcpp_load_cache_read(cachefile);
+    lines.erase(std::remove_if(lines.begin(), lines.end(), [&](const std::string & line) {
+        return line.compare(0, key.size()+1, key+" ")==0;
+    }), lines.end());
+    if(lines.size() >= max_entries)
+    {
+        lines.erase(lines.begin(), lines.end() - (max_entries - 1));
+    }
+    lines.push_back(key + " " + std::to_string((unsigned long long)entry.mem_per_token) + " " + std::to_string((unsigned long long)entry.alloc_size));
+
+    //written to the side and renamed, so a crash or a second instance never leaves a torn file behind
+    const std::string tmpfile = cachefile + ".tmp";
+    {
+        std::ofstream fout(tmpfile, std::ios::trunc);
+        for(const std::string & line : lines)
+        {
+            fout << line << "\n";
+        }
+        if(!fout)
+        {
+            std::remove(tmpfile.c_str());
+            return;
+        }
+    }
+    #if defined(_WIN32)
+    std::remove(cachefile.c_str());
+    #endif
+    if(std::rename(tmpfile.c_str(), cachefile.c_str())!=0)
+    {
+        std::remove(tmpfile.c_str());
+    }
+}
+
 //return val: 0=fail, 1=(original ggml, alpaca), 2=(ggmf), 3=(ggjt)
  FileFormat check_file_format(const std::string & fname, FileFormatExtraMeta * fileformatmeta)
  {
@@ -87,7 +486,7 @@ void print_tok_vec(std::vector<float> &embd)
     auto fin = std::ifstream(fname, std::ios::binary);
     fin.rdbuf()->pubsetbuf(f_buf.data(), f_buf.size());
     if (!fin) {
-        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        kcpp_log_err("%s: failed to open '%s'\n", __func__, fname.c_str());
         return FileFormat::BADFORMAT;
     }
 
@@ -274,11 +673,16 @@ void print_tok_vec(std::vector<float> &embd)
         else if(modelarch=="falcon")
         {
             fileformat = FileFormat::GGUF_FALCON; //uses the same loader
-            printf("\nDetected GGUF FALCON format.\n");
+            kcpp_log(KCPP_LOG_ALWAYS, "\nDetected GGUF FALCON format.\n");
+        }
+        else if(modelarch=="gptj" || modelarch=="gptneox" || modelarch=="gpt2" || modelarch=="mpt")
+        {
+            fileformat = FileFormat::GGUF_GENERIC; //uses the same loader
+            kcpp_log(KCPP_LOG_ALWAYS, "\nDetected GGUF %s format.\n",modelarch.c_str());
         }
         else
         {
-            printf("\nERROR: Detected unimplemented GGUF Arch: %s\n",modelarch.c_str());
+            kcpp_log(KCPP_LOG_ALWAYS, "\nERROR: Detected unimplemented GGUF Arch: %s\n",modelarch.c_str());
         }
 
         if(modelarch!="" && fileformatmeta!=nullptr)
@@ -463,7 +867,7 @@ void print_tok_vec(std::vector<float> &embd)
                 auto trimmed = std::vector<int>(embd_inp.begin() + found, embd_inp.end());
                 embd_inp = trimmed;
                 embd_inp_len = embd_inp.size();
-                printf("\n[Reusing Smart Context: %d allowance remaining]", found);
+                kcpp_log(KCPP_LOG_ALWAYS, "\n[Reusing Smart Context: %d allowance remaining]", found);
 
                 int old_n_past = n_past;
                 int offset_fix = old_n_past;
@@ -514,7 +918,7 @@ void print_tok_vec(std::vector<float> &embd)
         //determine longest common substring after removing start part
         int shiftamt = embd_inp.size() * SCTruncationRatio;
         smartcontext = std::vector<int>(embd_inp.begin() + shiftamt, embd_inp.end());
-         printf("\n[New Smart Context Triggered! Buffered Token Allowance: %d]",shiftamt);
+         kcpp_log(KCPP_LOG_ALWAYS, "\n[New Smart Context Triggered! Buffered Token Allowance: %d]",shiftamt);
 
         embd_inp = smartcontext;
         //if max ctx length is exceeded, chop the prompt in half after the start part, and memorize it. The memorized part becomes LCS marker.
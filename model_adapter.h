@@ -10,6 +10,7 @@
 #include <string>
 #include <math.h>
 #include <vector>
+#include <atomic>
 
 #include "expose.h"
 
@@ -49,6 +50,8 @@ enum FileFormat
 
     GGUF_FALCON=600, //GGUF (falcon)
 
+    GGUF_GENERIC=700, //GGUF (gpt-j, gpt-neox, gpt-2, mpt) on the same loader as llama
+
 };
 
 struct FileFormatExtraMeta
@@ -63,14 +66,53 @@ enum ModelLoadResult
     RETRY_LOAD = 2, //used if it's suspected that the model is an older format
 };
 
+//growable output of the last generation, shared with readers through a refcount
+struct kcpp_output_buffer
+{
+    int status = -1;
+    std::string text;
+    std::vector<generation_token_meta> token_meta;
+    std::vector<generation_logprob> top_logprobs;
+    int n_probs = 0;
+    std::atomic<int> refs;
+    kcpp_output_buffer() : refs(1) {}
+};
+
 ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in_file_format, FileFormatExtraMeta file_format_meta);
 generation_outputs gpttype_generate(const generation_inputs inputs, generation_outputs &output);
+int gpttype_generate_buffered(const generation_inputs inputs);
+kcpp_output_buffer * gpttype_acquire_output(); //adds a reference, must be paired with gpttype_release_output. nullptr until the generation has finished
+void gpttype_release_output(kcpp_output_buffer * buf);
 bool gpttype_generate_abort();
 const std::string & gpttype_get_pending_output();
 int gpttype_token_count(const std::string & input);
+const std::string & gpttype_token_to_text(int id);
 
 void timer_start();
 double timer_check();
+
+//console logging is queued and written by a background thread so it never blocks generation
+enum kcpp_log_level
+{
+    KCPP_LOG_OFF=-2, //only as a verbosity for kcpp_log_set_level, silences everything but kcpp_log_err
+    KCPP_LOG_ALWAYS=-1, //shown unless the verbosity is KCPP_LOG_OFF
+    KCPP_LOG_INFO=0, //normal output, hidden with debugmode -1
+    KCPP_LOG_DEBUG=1, //only shown with debugmode 1
+};
+enum kcpp_progress_kind
+{
+    KCPP_PROGRESS_NONE=0,
+    KCPP_PROGRESS_PROMPT=1,
+    KCPP_PROGRESS_PROMPT_BLAS=2,
+    KCPP_PROGRESS_GENERATE=3,
+};
+void kcpp_log_set_level(int level);
+int kcpp_log_get_level();
+bool kcpp_log_enabled(int level);
+void kcpp_log(int level, const char * format, ...);
+void kcpp_log_err(const char * format, ...);
+void kcpp_log_progress(kcpp_progress_kind kind, int current, int total); //coalesced, printed at a fixed rate
+void kcpp_log_flush(); //waits until everything queued so far is written
 void print_tok_vec(std::vector<int> &embd);
 void print_tok_vec(std::vector<float> &embd);
 void print_vec(std::vector<std::string> &embd);
@@ -79,6 +121,16 @@ bool ArrStartWith(const std::vector<int> targetArray, const std::vector<int> sea
 int ArrFindIndexOf(const std::vector<int> targetArray, const std::vector<int> searchSeq);
 
 FileFormat check_file_format(const std::string & fname, FileFormatExtraMeta * fileformatmeta);
+
+//sizes found by the dry runs after loading a model, persisted so that a restart with the same model and settings can skip them
+struct kcpp_load_cache_entry
+{
+    size_t mem_per_token = 0; //otherarch eval buffer estimate
+    size_t alloc_size = 0; //gguf compute buffer
+};
+std::string kcpp_load_cache_key(const std::string & fname, const std::string & settings); //empty if the model cannot be read
+bool kcpp_load_cache_get(const std::string & cachefile, const std::string & key, kcpp_load_cache_entry & entry);
+void kcpp_load_cache_put(const std::string & cachefile, const std::string & key, const kcpp_load_cache_entry & entry);
 void ContextFastForward(std::vector<int> &current_context_tokens, std::vector<int> &embd_inp,
  int &n_past, std::vector<int> &last_n_tokens, const int nctx, std::vector<int> &smartcontext,
  const bool useSmartContext, const bool requireFullSubset);
\ No newline at end of file
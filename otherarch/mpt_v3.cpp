@@ -72,6 +72,9 @@ bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vo
         printf("%s: qntvr          = %d\n", __func__, qntvr);
 
         hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+
+        model.alibi_slopes.resize(hparams.n_heads);
+        ggml_alibi_slopes(hparams.n_heads, hparams.alibi_bias_max, model.alibi_slopes.data());
     }
 
     // load vocab
@@ -397,6 +400,9 @@ bool mpt_eval(const mpt_model & model, const int n_threads, const int n_past,
 
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte_weight, embd);
 
+    struct ggml_tensor * KQ_slopes = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_head);
+    memcpy(KQ_slopes->data, model.alibi_slopes.data(), n_head * sizeof(float));
+
     for (int il = 0; il < n_layer; ++il) {
 
         struct ggml_tensor * cur;
@@ -459,18 +465,9 @@ bool mpt_eval(const mpt_model & model, const int n_threads, const int n_past,
             // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0, KQ, ggml_new_f32(ctx0, 1.0f / sqrt(float(n_embd) / n_head)));
-
-            struct ggml_tensor * KQ_scaled_alibi =
-                ggml_alibi(ctx0, KQ_scaled, n_past, n_head, model.hparams.alibi_bias_max);
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_alibi, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+            // KQ = soft_max(mask_past(alibi(KQ / sqrt(n_embd/n_head)))), in one pass over the scores
+            struct ggml_tensor * KQ_soft_max =
+                ggml_soft_max_ext(ctx0, KQ, NULL, KQ_slopes, NULL, 1.0f / sqrt(float(n_embd) / n_head), n_past);
 
             // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1,
             // 2, 0, 3).contiguous() [n_past + N, 64, 12]
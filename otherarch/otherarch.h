@@ -454,6 +454,9 @@ struct mpt_model {
     struct ggml_tensor * memory_k;
     struct ggml_tensor * memory_v;
 
+    // alibi slope per head, computed once at load
+    std::vector<float> alibi_slopes;
+
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
 };
@@ -2,6 +2,12 @@
 
 #include <regex>
 #include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
 
 static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q4_0", GGML_FTYPE_MOSTLY_Q4_0},
@@ -9,6 +15,13 @@ static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q5_0", GGML_FTYPE_MOSTLY_Q5_0},
     {"q5_1", GGML_FTYPE_MOSTLY_Q5_1},
     {"q8_0", GGML_FTYPE_MOSTLY_Q8_0},
+#ifdef GGML_USE_K_QUANTS
+    {"q2_k", GGML_FTYPE_MOSTLY_Q2_K},
+    {"q3_k", GGML_FTYPE_MOSTLY_Q3_K},
+    {"q4_k", GGML_FTYPE_MOSTLY_Q4_K},
+    {"q5_k", GGML_FTYPE_MOSTLY_Q5_K},
+    {"q6_k", GGML_FTYPE_MOSTLY_Q6_K},
+#endif
 };
 
 void ggml_print_ftypes(FILE * fp) {
@@ -33,12 +46,92 @@ enum ggml_ftype ggml_parse_ftype(const char * str) {
     return ftype;
 }
 
+// one tensor travelling through the read -> quantize -> write pipeline
+struct quantize_job {
+    int32_t n_dims;
+    int32_t length;
+    int32_t ttype;
+    int32_t ne[4] = { 1, 1, 1, 1 };
+    int32_t nelements = 1;
+    int32_t ttype_src;
+    std::string name;
+
+    bool quantize = false;
+    size_t budget = 0; // bytes charged against the in-flight limit
+
+    std::vector<float>   data_f32; // input of tensors to quantize
+    std::vector<uint8_t> data_u8;  // passthrough tensors, and the quantized output
+    std::vector<int64_t> hist;
+};
+
+// hand-off between two pipeline stages, closing it wakes up the consumer once drained
+class quantize_queue {
+public:
+    void push(std::unique_ptr<quantize_job> job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+        cv.notify_one();
+    }
+
+    std::unique_ptr<quantize_job> pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !jobs.empty() || closed; });
+        if (jobs.empty()) {
+            return nullptr;
+        }
+        std::unique_ptr<quantize_job> job = std::move(jobs.front());
+        jobs.pop_front();
+        return job;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<quantize_job>> jobs;
+    bool closed = false;
+};
+
+// caps the bytes held by all jobs between reading and writing. a tensor bigger than the
+// whole budget is still let through once nothing else is in flight
+class quantize_budget {
+public:
+    explicit quantize_budget(size_t limit) : limit(limit) {}
+
+    bool acquire(size_t bytes, const std::atomic<bool> & failed) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return used == 0 || used + bytes <= limit || failed; });
+        used += bytes;
+        return !failed;
+    }
+
+    void release(size_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        used -= bytes;
+        cv.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t limit;
+    size_t used = 0;
+};
+
+static const size_t quantize_inflight_max = 1024ull*1024*1024;
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip) {
+        const std::vector<std::string> & to_skip,
+        int nthread) {
 
     ggml_type qtype = GGML_TYPE_F32;
 
@@ -48,10 +141,14 @@ bool ggml_common_quantize_0(
         case GGML_FTYPE_MOSTLY_Q5_0: qtype = GGML_TYPE_Q5_0; break;
         case GGML_FTYPE_MOSTLY_Q5_1: qtype = GGML_TYPE_Q5_1; break;
         case GGML_FTYPE_MOSTLY_Q8_0: qtype = GGML_TYPE_Q8_0; break;
-        case GGML_FTYPE_UNKNOWN:
-        case GGML_FTYPE_ALL_F32:
-        case GGML_FTYPE_MOSTLY_F16:
-        case GGML_FTYPE_MOSTLY_Q4_1_SOME_F16:
+#ifdef GGML_USE_K_QUANTS
+        case GGML_FTYPE_MOSTLY_Q2_K: qtype = GGML_TYPE_Q2_K; break;
+        case GGML_FTYPE_MOSTLY_Q3_K: qtype = GGML_TYPE_Q3_K; break;
+        case GGML_FTYPE_MOSTLY_Q4_K: qtype = GGML_TYPE_Q4_K; break;
+        case GGML_FTYPE_MOSTLY_Q5_K: qtype = GGML_TYPE_Q5_K; break;
+        case GGML_FTYPE_MOSTLY_Q6_K: qtype = GGML_TYPE_Q6_K; break;
+#endif
+        default:
                 {
                     fprintf(stderr, "%s: invalid model type %d\n", __func__, ftype);
                     return false;
@@ -63,156 +160,215 @@ bool ggml_common_quantize_0(
         return false;
     }
 
+    if (nthread <= 0) {
+        nthread = std::thread::hardware_concurrency();
+    }
+
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<float> work;
-
-    std::vector<uint8_t>     data_u8;
-    std::vector<ggml_fp16_t> data_f16;
-    std::vector<float>       data_f32;
-
     std::vector<int64_t> hist_all(1 << 4, 0);
 
-    while (true) {
-        int32_t n_dims;
-        int32_t length;
-        int32_t ttype;
+    std::atomic<bool> failed(false);
+    quantize_budget budget(quantize_inflight_max);
+    quantize_queue  to_quantize;
+    quantize_queue  to_write;
 
-        finp.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-        finp.read(reinterpret_cast<char *>(&length), sizeof(length));
-        finp.read(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
+    // stage 1: parse tensors off the input, f16 is widened to f32 here so the quantizer only sees f32
+    std::thread reader([&] {
+        while (!failed) {
+            std::unique_ptr<quantize_job> job(new quantize_job());
 
-        if (finp.eof()) {
-            break;
-        }
+            finp.read(reinterpret_cast<char *>(&job->n_dims), sizeof(job->n_dims));
+            finp.read(reinterpret_cast<char *>(&job->length), sizeof(job->length));
+            finp.read(reinterpret_cast<char *>(&job->ttype),  sizeof(job->ttype));
 
-        int32_t nelements = 1;
-        int32_t ne[4] = { 1, 1, 1, 1 };
-        for (int i = 0; i < n_dims; ++i) {
-            finp.read (reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
-            nelements *= ne[i];
-        }
-
-        std::string name(length, 0);
-        finp.read (&name[0], length);
+            if (finp.eof()) {
+                break;
+            }
 
-        printf("%64s - [%5d, %5d, %5d], type = %6s ", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype));
+            for (int i = 0; i < job->n_dims; ++i) {
+                finp.read (reinterpret_cast<char *>(&job->ne[i]), sizeof(job->ne[i]));
+                job->nelements *= job->ne[i];
+            }
 
-        bool quantize = false;
+            job->name.resize(job->length);
+            finp.read (&job->name[0], job->length);
+            job->ttype_src = job->ttype;
 
-        // check if we should quantize this tensor
-        for (const auto & s : to_quant) {
-            if (std::regex_match(name, std::regex(s))) {
-                quantize = true;
-                break;
+            // check if we should quantize this tensor
+            for (const auto & s : to_quant) {
+                if (std::regex_match(job->name, std::regex(s))) {
+                    job->quantize = true;
+                    break;
+                }
             }
-        }
 
-        // check if we should skip this tensor
-        for (const auto & s : to_skip) {
-            if (std::regex_match(name, std::regex(s))) {
-                quantize = false;
-                break;
+            // check if we should skip this tensor
+            for (const auto & s : to_skip) {
+                if (std::regex_match(job->name, std::regex(s))) {
+                    job->quantize = false;
+                    break;
+                }
             }
-        }
 
-        // quantize only 2D tensors
-        quantize &= (n_dims == 2);
+            // quantize only 2D tensors
+            job->quantize &= (job->n_dims == 2);
 
-        if (quantize) {
-            if (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16) {
-                fprintf(stderr, "%s: unsupported ttype %d (%s) for integer quantization\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
-                return false;
-            }
+            const int32_t nelements = job->nelements;
+
+            if (job->quantize) {
+                if (job->ttype != GGML_TYPE_F32 && job->ttype != GGML_TYPE_F16) {
+                    fprintf(stderr, "%s: unsupported ttype %d (%s) for integer quantization\n", __func__, job->ttype, ggml_type_name((ggml_type) job->ttype));
+                    failed = true;
+                    break;
+                }
+                if (job->ne[0] % ggml_blck_size(qtype) != 0) {
+                    fprintf(stderr, "%s: tensor '%s' has %d columns, not a multiple of the %s block size %d\n",
+                            __func__, job->name.c_str(), job->ne[0], ggml_type_name(qtype), ggml_blck_size(qtype));
+                    failed = true;
+                    break;
+                }
+
+                // f32 input plus an f32 sized upper bound for the quantized output
+                job->budget = 2 * nelements * sizeof(float);
+                if (!budget.acquire(job->budget, failed)) {
+                    break;
+                }
 
-            if (ttype == GGML_TYPE_F16) {
-                data_f16.resize(nelements);
-                finp.read(reinterpret_cast<char *>(data_f16.data()), nelements * sizeof(ggml_fp16_t));
-                data_f32.resize(nelements);
-                for (int i = 0; i < nelements; ++i) {
-                    data_f32[i] = ggml_fp16_to_fp32(data_f16[i]);
+                job->data_f32.resize(nelements);
+                if (job->ttype == GGML_TYPE_F16) {
+                    std::vector<ggml_fp16_t> data_f16(nelements);
+                    finp.read(reinterpret_cast<char *>(data_f16.data()), nelements * sizeof(ggml_fp16_t));
+                    for (int i = 0; i < nelements; ++i) {
+                        job->data_f32[i] = ggml_fp16_to_fp32(data_f16[i]);
+                    }
+                } else {
+                    finp.read(reinterpret_cast<char *>(job->data_f32.data()), nelements * sizeof(float));
                 }
+
+                job->ttype = qtype;
             } else {
-                data_f32.resize(nelements);
-                finp.read(reinterpret_cast<char *>(data_f32.data()), nelements * sizeof(float));
-            }
+                const int bpe = (job->ttype == 0) ? sizeof(float) : sizeof(uint16_t);
 
-            ttype = qtype;
-        } else {
-            const int bpe = (ttype == 0) ? sizeof(float) : sizeof(uint16_t);
+                job->budget = nelements * bpe;
+                if (!budget.acquire(job->budget, failed)) {
+                    break;
+                }
 
-            data_u8.resize(nelements*bpe);
-            finp.read(reinterpret_cast<char *>(data_u8.data()), nelements * bpe);
-        }
+                job->data_u8.resize(nelements * bpe);
+                finp.read(reinterpret_cast<char *>(job->data_u8.data()), nelements * bpe);
+            }
 
-        fout.write(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-        fout.write(reinterpret_cast<char *>(&length), sizeof(length));
-        fout.write(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
-        for (int i = 0; i < n_dims; ++i) {
-            fout.write(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+            to_quantize.push(std::move(job));
         }
-        fout.write(&name[0], length);
-
-        if (quantize) {
-            work.resize(nelements); // for quantization
-
-            size_t cur_size = 0;
-            std::vector<int64_t> hist_cur(1 << 4, 0);
-
-            switch ((ggml_type) ttype) {
-                case GGML_TYPE_Q4_0:
-                    {
-                        cur_size = ggml_quantize_q4_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q4_1:
-                    {
-                        cur_size = ggml_quantize_q4_1(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q5_0:
-                    {
-                        cur_size = ggml_quantize_q5_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q5_1:
-                    {
-                        cur_size = ggml_quantize_q5_1(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q8_0:
-                    {
-                        cur_size = ggml_quantize_q8_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_F32:
-                case GGML_TYPE_F16:
-                case GGML_TYPE_I8:
-                case GGML_TYPE_I16:
-                case GGML_TYPE_I32:
-                case GGML_TYPE_Q8_1:
-                case GGML_TYPE_COUNT:
-                    {
-                        fprintf(stderr, "%s: unsupported quantization type %d (%s)\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
-                        return false;
-                    }
+        to_quantize.close();
+    });
+
+    // stage 3: write tensors back in input order and report them
+    std::thread writer([&] {
+        while (std::unique_ptr<quantize_job> job = to_write.pop()) {
+            fout.write(reinterpret_cast<char *>(&job->n_dims), sizeof(job->n_dims));
+            fout.write(reinterpret_cast<char *>(&job->length), sizeof(job->length));
+            fout.write(reinterpret_cast<char *>(&job->ttype),  sizeof(job->ttype));
+            for (int i = 0; i < job->n_dims; ++i) {
+                fout.write(reinterpret_cast<char *>(&job->ne[i]), sizeof(job->ne[i]));
             }
+            fout.write(&job->name[0], job->length);
+            fout.write(reinterpret_cast<char *>(job->data_u8.data()), job->data_u8.size());
 
-            fout.write(reinterpret_cast<char *>(work.data()), cur_size);
-            total_size_new += cur_size;
+            printf("%64s - [%5d, %5d, %5d], type = %6s ", job->name.data(), job->ne[0], job->ne[1], job->ne[2], ggml_type_name((ggml_type) job->ttype_src));
 
-            printf("size = %8.2f MB -> %8.2f MB | hist: ", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0);
-            for (int i = 0; i < (int) hist_cur.size(); ++i) {
-                hist_all[i] += hist_cur[i];
+            if (job->quantize) {
+                printf("size = %8.2f MB -> %8.2f MB | hist: ", job->nelements * sizeof(float)/1024.0/1024.0, job->data_u8.size()/1024.0/1024.0);
+                int64_t tot_count = 0;
+                for (int i = 0; i < (int) job->hist.size(); ++i) {
+                    hist_all[i] += job->hist[i];
+                    tot_count += job->hist[i];
+                }
+
+                // k-quants do not report a histogram
+                if (tot_count > 0) {
+                    for (int i = 0; i < (int) job->hist.size(); ++i) {
+                        printf("%5.3f ", job->hist[i] / (float)job->nelements);
+                    }
+                }
+                printf("\n");
+            } else {
+                printf("size = %8.3f MB\n", job->data_u8.size()/1024.0/1024.0);
             }
 
-            for (int i = 0; i < (int) hist_cur.size(); ++i) {
-                printf("%5.3f ", hist_cur[i] / (float)nelements);
+            total_size_new += job->data_u8.size();
+            total_size_org += job->nelements * sizeof(float);
+
+            budget.release(job->budget);
+        }
+    });
+
+    // stage 2: quantize each tensor in chunks spread over nthread workers
+    std::vector<std::thread> workers;
+    workers.reserve(nthread);
+    std::mutex mutex;
+
+    while (std::unique_ptr<quantize_job> job = to_quantize.pop()) {
+        if (job->quantize) {
+            static const int chunk_size = 32 * 512;
+            const int nelements = job->nelements;
+            const int nchunk = (nelements + chunk_size - 1)/chunk_size;
+            const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
+            const float * f32_data = job->data_f32.data();
+
+            job->data_u8.resize(nelements * sizeof(float)); // upper bound on size
+            job->hist.assign(1 << 4, 0);
+
+            uint8_t * new_data = job->data_u8.data();
+            std::vector<int64_t> & hist_cur = job->hist;
+            size_t new_size = 0;
+
+            if (nthread_use < 2) {
+                new_size = ggml_quantize_chunk(qtype, f32_data, new_data, 0, nelements, hist_cur.data());
+            } else {
+                int counter = 0;
+                auto compute = [&mutex, &counter, &hist_cur, &new_size, qtype, f32_data, new_data, nelements]() {
+                    std::vector<int64_t> local_hist(1 << 4, 0);
+                    size_t local_size = 0;
+                    while (true) {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        int first = counter; counter += chunk_size;
+                        if (first >= nelements) {
+                            if (local_size > 0) {
+                                for (int j=0; j<int(local_hist.size()); ++j) {
+                                    hist_cur[j] += local_hist[j];
+                                }
+                                new_size += local_size;
+                            }
+                            break;
+                        }
+                        lock.unlock();
+                        int last = std::min(nelements, first + chunk_size);
+                        local_size += ggml_quantize_chunk(qtype, f32_data, new_data, first, last - first, local_hist.data());
+                    }
+                };
+                for (int it = 0; it < nthread_use - 1; ++it) {
+                    workers.emplace_back(compute);
+                }
+                compute();
+                for (auto & w : workers) { w.join(); }
+                workers.clear();
             }
-            printf("\n");
-        } else {
-            printf("size = %8.3f MB\n", data_u8.size()/1024.0/1024.0);
-            fout.write(reinterpret_cast<char *>(data_u8.data()), data_u8.size());
-            total_size_new += data_u8.size();
+
+            job->data_u8.resize(new_size);
+            std::vector<float>().swap(job->data_f32);
         }
+        to_write.push(std::move(job));
+    }
+    to_write.close();
 
-        total_size_org += nelements * sizeof(float);
+    reader.join();
+    writer.join();
+
+    if (failed) {
+        return false;
     }
 
     printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
@@ -223,6 +379,7 @@ bool ggml_common_quantize_0(
         for (int i = 0; i < (int) hist_all.size(); ++i) {
             sum_all += hist_all[i];
         }
+        sum_all = std::max<int64_t>(sum_all, 1);
 
         printf("%s: hist: ", __func__);
         for (int i = 0; i < (int) hist_all.size(); ++i) {
@@ -232,4 +389,4 @@ bool ggml_common_quantize_0(
     }
 
     return true;
-}
\ No newline at end of file
+}
@@ -15,4 +15,5 @@ bool ggml_common_quantize_0(
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip);
\ No newline at end of file
+        const std::vector<std::string> & to_skip,
+        int nthread = 0); // 0 = std::thread::hardware_concurrency()
\ No newline at end of file
@@ -24,7 +24,8 @@ struct mpt_hparams {
 
 // quantize a model
 bool mpt_model_quantize(const std::string & fname_inp,
-                        const std::string & fname_out, ggml_ftype ftype) {
+                        const std::string & fname_out, ggml_ftype ftype,
+                        int nthread) {
 
     printf("%s: loading model from '%s'\n", __func__, fname_inp.c_str());
 
@@ -116,7 +117,7 @@ bool mpt_model_quantize(const std::string & fname_inp,
         ".*weight",
     };
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, to_quant, {})) {
+    if (!ggml_common_quantize_0(finp, fout, ftype, to_quant, {}, nthread)) {
         fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__,
                 fname_inp.c_str());
         return false;
@@ -130,11 +131,11 @@ bool mpt_model_quantize(const std::string & fname_inp,
 
 // usage:
 //  ./mpt-quantize models/mpt/ggml-model.bin
-//  models/mpt/ggml-model-quant.bin type
+//  models/mpt/ggml-model-quant.bin type [nthreads]
 //
 int main(int argc, char ** argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type\n",
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type [nthreads]\n",
                 argv[0]);
         ggml_print_ftypes(stderr);
         return 1;
@@ -151,6 +152,7 @@ int main(int argc, char ** argv) {
     const std::string fname_out = argv[2];
 
     const ggml_ftype ftype = ggml_parse_ftype(argv[3]);
+    const int nthread = argc > 4 ? std::stoi(argv[4]) : 0;
 
     const int64_t t_main_start_us = ggml_time_us();
 
@@ -160,7 +162,7 @@ int main(int argc, char ** argv) {
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!mpt_model_quantize(fname_inp, fname_out, ggml_ftype(ftype))) {
+        if (!mpt_model_quantize(fname_inp, fname_out, ggml_ftype(ftype), nthread)) {
             fprintf(stderr, "%s: failed to quantize model from '%s'\n",
                     __func__, fname_inp.c_str());
             return 1;
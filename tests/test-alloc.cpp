@@ -0,0 +1,298 @@
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// graphs of matrix-vector products in which some results are used by later nodes, so that the buffers have
+// overlapping lifetimes. node i multiplies the result of node src[i] (or the input if -1) into a vector of out[i] floats
+#define N_NODES 12
+
+struct test_graph {
+    int src[N_NODES];
+    int out[N_NODES];
+};
+
+static const test_graph graph_large = {
+    { -1, -1, -1,  0, -1, -1,  5,  1, -1,  6,  9, -1 },
+    { 104, 32, 24, 48, 24, 56, 56, 64, 56, 48, 64,  8 },
+};
+
+// graph_large with a smaller node 7, best-fit-decreasing needs more memory for it than for graph_large
+static const test_graph graph_small = {
+    { -1, -1, -1,  0, -1, -1,  5,  1, -1,  6,  9, -1 },
+    { 104, 32, 24, 48, 24, 56, 56, 56, 56, 48, 64,  8 },
+};
+
+// best-fit-decreasing needs more memory for this graph than the greedy allocator
+static const test_graph graph_greedy = {
+    { -1, -1,  0, -1, -1, -1, -1,  2,  1, -1,   7, -1 },
+    { 128, 104, 96,  8, 16, 72, 48, 56, 16, 96, 112, 24 },
+};
+
+static const size_t alignment = 32;
+
+static float frand(void) {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute(graph, &plan);
+}
+
+// the inputs and weights of a test graph
+struct test_model {
+    const test_graph    * graph;
+    struct ggml_context * ctx;
+    struct ggml_tensor  * x;
+    struct ggml_tensor  * w[N_NODES];
+};
+
+static void test_model_init(test_model & model, const test_graph & graph) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 4*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    model.graph = &graph;
+    model.ctx   = ggml_init(params);
+
+    model.x = ggml_new_tensor_1d(model.ctx, GGML_TYPE_F32, 16);
+    for (int i = 0; i < 16; i++) {
+        ((float *) model.x->data)[i] = frand()*2.0f - 1.0f;
+    }
+
+    for (int i = 0; i < N_NODES; i++) {
+        const int64_t n_in = graph.src[i] < 0 ? 16 : graph.out[graph.src[i]];
+        model.w[i] = ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, n_in, graph.out[i]);
+        for (int64_t j = 0; j < ggml_nelements(model.w[i]); j++) {
+            ((float *) model.w[i]->data)[j] = (frand()*2.0f - 1.0f)/n_in;
+        }
+    }
+}
+
+static struct ggml_cgraph * build_graph(struct ggml_context * ctx, const test_model & model, struct ggml_tensor ** nodes) {
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    const int * src = model.graph->src;
+    for (int i = 0; i < N_NODES; i++) {
+        nodes[i] = ggml_mul_mat(ctx, model.w[i], src[i] < 0 ? model.x : nodes[src[i]]);
+    }
+    for (int i = 0; i < N_NODES; i++) {
+        ggml_build_forward_expand(gf, nodes[i]);
+    }
+
+    return gf;
+}
+
+static bool is_output(const test_graph & graph, int i) {
+    for (int j = 0; j < N_NODES; j++) {
+        if (graph.src[j] == i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct ggml_context * new_graph_context(void) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    return ggml_init(params);
+}
+
+// results of the graph with every node in its own memory
+static std::vector<std::vector<float>> compute_reference(const test_model & model, std::vector<uint8_t> & work_buffer) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * nodes[N_NODES];
+    struct ggml_cgraph * gf = build_graph(ctx, model, nodes);
+    ggml_graph_compute_helper(work_buffer, gf, 2);
+
+    std::vector<std::vector<float>> result(N_NODES);
+    for (int i = 0; i < N_NODES; i++) {
+        const float * data = (const float *) nodes[i]->data;
+        result[i].assign(data, data + ggml_nelements(nodes[i]));
+    }
+
+    ggml_free(ctx);
+
+    return result;
+}
+
+static size_t measure(const test_model & model, bool planner) {
+    struct ggml_context * ctx = new_graph_context();
+
+    struct ggml_tensor * nodes[N_NODES];
+    struct ggml_cgraph * gf = build_graph(ctx, model, nodes);
+
+    struct ggml_allocr * alloc = ggml_allocr_new_measure(alignment);
+    ggml_allocr_set_planner(alloc, planner);
+    const size_t size = ggml_allocr_alloc_graph(alloc, gf);
+    ggml_allocr_free(alloc);
+
+    ggml_free(ctx);
+
+    return size;
+}
+
+// allocates the graph with alloc, checks that it stays in the buffer and that its outputs match the reference,
+// returns the addresses of the nodes
+static std::vector<void *> run_graph(struct ggml_allocr * alloc, const std::vector<uint8_t> & buf, const test_model & model,
+        const std::vector<std::vector<float>> & ref, std::vector<uint8_t> & work_buffer) {
+    struct ggml_context * ctx = new_graph_context();
+
+    struct ggml_tensor * nodes[N_NODES];
+    struct ggml_cgraph * gf = build_graph(ctx, model, nodes);
+
+    ggml_allocr_reset(alloc);
+    ggml_allocr_alloc_graph(alloc, gf);
+
+    std::vector<void *> addrs(N_NODES);
+    for (int i = 0; i < N_NODES; i++) {
+        const uint8_t * data = (const uint8_t *) nodes[i]->data;
+        GGML_ASSERT(data >= buf.data() && data + ggml_nbytes(nodes[i]) <= buf.data() + buf.size());
+        addrs[i] = nodes[i]->data;
+    }
+
+    ggml_graph_compute_helper(work_buffer, gf, 2);
+
+    for (int i = 0; i < N_NODES; i++) {
+        if (!is_output(*model.graph, i)) {
+            continue;
+        }
+        const float * data = (const float *) nodes[i]->data;
+        for (int64_t j = 0; j < ggml_nelements(nodes[i]); j++) {
+            GGML_ASSERT(fabsf(data[j] - ref[i][j]) <= 1e-5f*(1.0f + fabsf(ref[i][j])));
+        }
+    }
+
+    ggml_free(ctx);
+
+    return addrs;
+}
+
+static struct ggml_allocr * new_planner(std::vector<uint8_t> & buf) {
+    struct ggml_allocr * alloc = ggml_allocr_new(buf.data(), buf.size(), alignment);
+    ggml_allocr_set_planner(alloc, true);
+    return alloc;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    std::vector<uint8_t> work_buffer;
+
+    test_model large;
+    test_model small;
+    test_model greedy;
+    test_model_init(large,  graph_large);
+    test_model_init(small,  graph_small);
+    test_model_init(greedy, graph_greedy);
+
+    const std::vector<std::vector<float>> ref_large  = compute_reference(large,  work_buffer);
+    const std::vector<std::vector<float>> ref_small  = compute_reference(small,  work_buffer);
+    const std::vector<std::vector<float>> ref_greedy = compute_reference(greedy, work_buffer);
+
+    // the measured size covers the greedy allocation, which is used when a graph does not fit its plan
+    {
+        const size_t size_greedy  = measure(large, false);
+        const size_t size_planned = measure(large, true);
+
+        printf("measure: greedy %zu bytes, with the planner %zu bytes\n", size_greedy, size_planned);
+
+        GGML_ASSERT(size_planned >= size_greedy);
+    }
+
+    // a buffer measured for the large graph must fit the small one, even though its plan is larger
+    {
+        std::vector<uint8_t> buf(measure(large, true) + alignment);
+
+        struct ggml_allocr * alloc = new_planner(buf);
+        run_graph(alloc, buf, small, ref_small, work_buffer);
+        ggml_allocr_free(alloc);
+
+        printf("smaller graph: ok\n");
+    }
+
+    // reuse: the plan of the large graph is kept for the small one, which fits in its slots
+    {
+        std::vector<uint8_t> buf(measure(large, true) + alignment);
+
+        struct ggml_allocr * alloc = new_planner(buf);
+
+        const std::vector<void *> a0 = run_graph(alloc, buf, large, ref_large, work_buffer);
+        const std::vector<void *> a1 = run_graph(alloc, buf, large, ref_large, work_buffer);
+        const std::vector<void *> a2 = run_graph(alloc, buf, small, ref_small, work_buffer);
+
+        GGML_ASSERT(a0 == a1);
+        GGML_ASSERT(a0 == a2);
+
+        ggml_allocr_free(alloc);
+
+        printf("reuse: ok\n");
+    }
+
+    // replan: the large graph does not fit in the plan of the small one and gets a new plan
+    {
+        // too small to round up the slots of the plans
+        std::vector<uint8_t> buf(measure(small, true) + alignment);
+
+        struct ggml_allocr * alloc = new_planner(buf);
+
+        const std::vector<void *> a0 = run_graph(alloc, buf, small, ref_small, work_buffer);
+        const std::vector<void *> a1 = run_graph(alloc, buf, large, ref_large, work_buffer);
+        const std::vector<void *> a2 = run_graph(alloc, buf, large, ref_large, work_buffer);
+
+        GGML_ASSERT(a0 != a1);
+        GGML_ASSERT(a1 == a2);
+
+        ggml_allocr_free(alloc);
+
+        printf("replan: ok\n");
+    }
+
+    // fallback: the plan does not fit in a buffer sized for the greedy allocator, which is used instead
+    {
+        GGML_ASSERT(measure(greedy, true) > measure(greedy, false));
+
+        std::vector<uint8_t> buf(measure(greedy, false) + alignment);
+
+        struct ggml_allocr * alloc_greedy = ggml_allocr_new(buf.data(), buf.size(), alignment);
+        struct ggml_allocr * alloc        = new_planner(buf);
+
+        const std::vector<void *> a0 = run_graph(alloc_greedy, buf, greedy, ref_greedy, work_buffer);
+        const std::vector<void *> a1 = run_graph(alloc,        buf, greedy, ref_greedy, work_buffer);
+
+        GGML_ASSERT(a0 == a1);
+
+        ggml_allocr_free(alloc_greedy);
+        ggml_allocr_free(alloc);
+
+        printf("fallback: ok\n");
+    }
+
+    ggml_free(large.ctx);
+    ggml_free(small.ctx);
+    ggml_free(greedy.ctx);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#endif
+
+static float frand(void) {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute(graph, &plan);
+}
+
+static void set_f(struct ggml_tensor * t, int64_t i, float v) {
+    if (t->type == GGML_TYPE_F16) {
+        ((ggml_fp16_t *) t->data)[i] = ggml_fp32_to_fp16(v);
+    } else {
+        ((float *) t->data)[i] = v;
+    }
+}
+
+// ggml_attn_v on the row V cache must match ggml_mul_mat on the transposed V cache,
+// with the caches and views laid out the way llama.cpp builds them
+static void test_attn_v(struct ggml_context * ctx0, std::vector<uint8_t> & work_buffer, ggml_type type,
+        int64_t n_embd_head, int64_t n_head, int64_t n_head_kv, int64_t n_ctx, int64_t n_kv, int64_t n_tokens, int n_threads) {
+    const int64_t n_embd_gqa = n_embd_head*n_head_kv;
+
+    // same cell contents in both layouts
+    struct ggml_tensor * v_rows  = ggml_new_tensor_2d(ctx0, type, n_embd_gqa, n_ctx);
+    struct ggml_tensor * v_trans = ggml_new_tensor_2d(ctx0, type, n_ctx, n_embd_gqa);
+
+    for (int64_t c = 0; c < n_ctx; ++c) {
+        for (int64_t e = 0; e < n_embd_gqa; ++e) {
+            const float v = frand()*2.0f - 1.0f;
+            set_f(v_rows,  c*n_embd_gqa + e, v);
+            set_f(v_trans, e*n_ctx + c, v);
+        }
+    }
+
+    struct ggml_tensor * kq = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, n_head);
+    for (int64_t i = 0; i < ggml_nelements(kq); ++i) {
+        ((float *) kq->data)[i] = frand()*8.0f - 4.0f;
+    }
+    struct ggml_tensor * kq_soft_max = ggml_soft_max(ctx0, kq);
+
+    const size_t es = ggml_element_size(v_rows);
+
+    struct ggml_tensor * V_rows = ggml_view_3d(ctx0, v_rows,
+            n_embd_head, n_kv, n_head_kv,
+            es*n_embd_gqa,
+            es*n_embd_head,
+            0);
+
+    struct ggml_tensor * V_trans = ggml_view_3d(ctx0, v_trans,
+            n_kv, n_embd_head, n_head_kv,
+            es*n_ctx,
+            es*n_ctx*n_embd_head,
+            0);
+
+    struct ggml_tensor * r0 = ggml_attn_v(ctx0, V_rows, kq_soft_max);
+    struct ggml_tensor * r1 = ggml_mul_mat(ctx0, V_trans, kq_soft_max);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    ggml_build_forward_expand(gf, r0);
+    ggml_build_forward_expand(gf, r1);
+
+    ggml_graph_compute_helper(work_buffer, gf, n_threads);
+
+    GGML_ASSERT(ggml_are_same_shape(r0, r1));
+
+    double sum  = 0.0;
+    double diff = 0.0;
+
+    const float * r0_data = (float *) r0->data;
+    const float * r1_data = (float *) r1->data;
+
+    for (int64_t i = 0; i < ggml_nelements(r0); ++i) {
+        sum  += fabs(r1_data[i]);
+        diff += fabs(r0_data[i] - r1_data[i]);
+    }
+
+    printf("type: %s, head: %3d, head_kv: %2d, n_kv: %3d, tokens: %3d, threads: %d, rel err: %f\n",
+            ggml_type_name(type), (int) n_head, (int) n_head_kv, (int) n_kv, (int) n_tokens, n_threads, diff / sum);
+
+    // mul_mat rounds kq to F16 for F16 V, attn_v does not
+    GGML_ASSERT(diff / sum < (type == GGML_TYPE_F16 ? 0.001f : 0.0001f));
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 256*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    std::vector<uint8_t> work_buffer;
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    const ggml_type types[] = { GGML_TYPE_F32, GGML_TYPE_F16 };
+
+    for (ggml_type type : types) {
+        // token by token generation, prompt batch, GQA and a cache that is barely in use
+        test_attn_v(ctx0, work_buffer, type, 64,  8,  8, 256, 128,   1, 4);
+        test_attn_v(ctx0, work_buffer, type, 64,  8,  8, 256, 160,  32, 4);
+        test_attn_v(ctx0, work_buffer, type, 64, 32,  4, 256,  96,   7, 3);
+        test_attn_v(ctx0, work_buffer, type, 80, 16, 16, 512,   1,   1, 1);
+    }
+
+    ggml_free(ctx0);
+
+    return 0;
+}
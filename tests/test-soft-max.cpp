@@ -0,0 +1,214 @@
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#endif
+
+static float frand(void) {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute(graph, &plan);
+}
+
+// soft_max exponentiates with ggml_v_expf where there is one, otherwise with the fp16 table
+static bool has_vec_expf(void) {
+#if defined(__aarch64__)
+    if (ggml_cpu_has_neon()) {
+        return true;
+    }
+#endif
+    return ggml_cpu_has_avx512() || (ggml_cpu_has_avx2() && ggml_cpu_has_fma());
+}
+
+// a score for the rows of the exp test: mostly in the range that matters, plus the values that take the other paths
+// of ggml_v_expf, -INFINITY (masked), |n| > 126 (two step scaling) and |n| > 192 (0), with n = round(x/ln2)
+static float exp_test_value(void) {
+    const int r = rand()%16;
+    switch (r) {
+        case 0:  return -INFINITY;
+        case 1:  return -88.0f - frand()*44.0f;
+        case 2:  return -134.0f - frand()*1000.0f;
+        case 3:  return -16.0f - frand()*1.5f; // around the 2^-24 flush to 0
+        default: return -frand()*20.0f;
+    }
+}
+
+// soft_max of rows of different lengths (vector bodies and scalar tails) against double exp
+static void test_soft_max_exp(struct ggml_context * ctx0, std::vector<uint8_t> & work_buffer, float tol, bool vec_expf) {
+    const int     lengths[] = { 1, 3, 8, 15, 16, 17, 33, 100, 4096 + 5 };
+    const float   offsets[] = { 0.0f, 50.0f, -70.0f };
+
+    const double flush = ldexp(1.0, -24);
+
+    for (int n : lengths) {
+        for (float offset : offsets) {
+            struct ggml_tensor * x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n, 4);
+            float * xd = (float *) x->data;
+            for (int r = 0; r < 4; r++) {
+                for (int i = 0; i < n; i++) {
+                    xd[r*n + i] = offset + exp_test_value();
+                }
+                // the row max, which is the one finite value for the last row
+                const int imax = rand()%n;
+                for (int i = 0; r == 3 && i < n; i++) {
+                    xd[r*n + i] = -INFINITY;
+                }
+                xd[r*n + imax] = offset;
+            }
+
+            struct ggml_tensor * y = ggml_soft_max(ctx0, x);
+
+            ggml_cgraph * gf = ggml_new_graph(ctx0);
+            ggml_build_forward_expand(gf, y);
+            ggml_graph_compute_helper(work_buffer, gf, 2);
+
+            const float * yd = (const float *) y->data;
+
+            double max_err = 0.0;
+
+            for (int r = 0; r < 4; r++) {
+                // the values below 2^-24 are flushed to 0 before they are summed
+                std::vector<double> e(n);
+                double sum = 0.0;
+                for (int i = 0; i < n; i++) {
+                    e[i] = exp((double) xd[r*n + i] - (double) offset);
+                    sum += e[i] < flush ? 0.0 : e[i];
+                }
+
+                for (int i = 0; i < n; i++) {
+                    const double ref = e[i]/sum;
+                    const double val = yd[r*n + i];
+
+                    GGML_ASSERT(std::isfinite(val));
+
+                    if (e[i] < flush*(1.0 - 1e-5)) {
+                        // the table flushes at the fp16 subnormals, which is close but not exactly 2^-24
+                        GGML_ASSERT(vec_expf ? val == 0.0 : val <= 2*flush);
+                    } else if (e[i] > flush*(1.0 + 1e-5)) {
+                        const double err = fabs(val - ref);
+                        GGML_ASSERT(err <= tol*ref + 1e-7);
+                        max_err = std::max(max_err, err/ref);
+                    }
+                }
+            }
+
+            printf("soft_max: n = %4d, offset = %6.1f, max rel err: %g\n", n, offset, max_err);
+        }
+    }
+}
+
+enum soft_max_ext_mask {
+    MASK_TENSOR,       // mask tensor, like the LLaMA graph
+    MASK_TENSOR_ALIBI, // mask tensor and ALiBi slopes, like the Baichuan 13B graph
+    MASK_CAUSAL,       // no mask tensor, causal mask from n_past like ggml_diag_mask_inf
+};
+
+// the fused soft_max_ext against the scale -> (alibi) -> mask -> soft_max chain it replaces
+static void test_soft_max_ext(struct ggml_context * ctx0, std::vector<uint8_t> & work_buffer, float tol,
+        enum soft_max_ext_mask mode, int n_kv, int n_tokens, int n_head) {
+    const int   n_past = n_kv - n_tokens;
+    const float scale  = 1.0f/sqrtf(64.0f);
+
+    struct ggml_tensor * kq = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, n_head);
+    for (int64_t i = 0; i < ggml_nelements(kq); i++) {
+        ((float *) kq->data)[i] = frand()*80.0f - 40.0f;
+    }
+
+    struct ggml_tensor * mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, n_tokens);
+    for (int t = 0; t < n_tokens; t++) {
+        for (int j = 0; j < n_kv; j++) {
+            ((float *) mask->data)[t*n_kv + j] = j > n_past + t ? -INFINITY : 0.0f;
+        }
+    }
+
+    struct ggml_tensor * slopes = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_head);
+    ggml_alibi_slopes(n_head, 8.0f, (float *) slopes->data);
+
+    struct ggml_tensor * r0 = NULL;
+    struct ggml_tensor * r1 = NULL;
+
+    struct ggml_tensor * kq_scaled = ggml_scale(ctx0, kq, ggml_new_f32(ctx0, scale));
+
+    switch (mode) {
+        case MASK_TENSOR:
+            r0 = ggml_soft_max_ext(ctx0, kq, mask, NULL, NULL, scale, -1);
+            r1 = ggml_soft_max(ctx0, ggml_add(ctx0, kq_scaled, mask));
+            break;
+        case MASK_TENSOR_ALIBI:
+            r0 = ggml_soft_max_ext(ctx0, kq, mask, slopes, NULL, scale, -1);
+            r1 = ggml_soft_max(ctx0, ggml_add(ctx0, ggml_alibi(ctx0, kq_scaled, n_past, n_head, 8.0f), mask));
+            break;
+        case MASK_CAUSAL:
+            r0 = ggml_soft_max_ext(ctx0, kq, NULL, NULL, NULL, scale, n_past);
+            r1 = ggml_soft_max(ctx0, ggml_diag_mask_inf(ctx0, kq_scaled, n_past));
+            break;
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+    ggml_build_forward_expand(gf, r0);
+    ggml_build_forward_expand(gf, r1);
+    ggml_graph_compute_helper(work_buffer, gf, 3);
+
+    GGML_ASSERT(ggml_are_same_shape(r0, r1));
+
+    const float * r0_data = (const float *) r0->data;
+    const float * r1_data = (const float *) r1->data;
+
+    double max_err = 0.0;
+    for (int64_t i = 0; i < ggml_nelements(r0); i++) {
+        const double err = fabs(r0_data[i] - r1_data[i]);
+        GGML_ASSERT(err <= tol*r1_data[i] + 1e-7);
+        max_err = std::max(max_err, err);
+    }
+
+    printf("soft_max_ext: mode %d, n_kv = %3d, n_tokens = %2d, n_head = %2d, max abs err: %g\n", mode, n_kv, n_tokens, n_head, max_err);
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 128*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    std::vector<uint8_t> work_buffer;
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    // ggml_v_expf is within 3e-7, the fp16 table within 2.5e-3, plus the rounding of the normalization
+    const float tol = has_vec_expf() ? 1e-6f : 5e-3f;
+
+    printf("exp: %s\n", has_vec_expf() ? "ggml_v_expf" : "fp16 table");
+
+    test_soft_max_exp(ctx0, work_buffer, tol, has_vec_expf());
+
+    const soft_max_ext_mask modes[] = { MASK_TENSOR, MASK_TENSOR_ALIBI, MASK_CAUSAL };
+    for (soft_max_ext_mask mode : modes) {
+        test_soft_max_ext(ctx0, work_buffer, tol, mode,  37,  5,  8);
+        test_soft_max_ext(ctx0, work_buffer, tol, mode, 256, 32, 12);
+        test_soft_max_ext(ctx0, work_buffer, tol, mode,  64,  1, 32);
+    }
+
+    ggml_free(ctx0);
+
+    return 0;
+}